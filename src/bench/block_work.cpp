@@ -0,0 +1,62 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+#include "chain/chainparams.h"
+#include "key/key.h"
+#include "misc/random.h"
+#include "script/standard.h"
+#include "transaction/coins.h"
+#include "validation/validation.h"
+
+// 在较长的链上计算PoS工作量，主要开销为取祖先和前100个区块的nNonce平均值
+static const int BLOCK_WORK_CHAIN_LENGTH = 5000;
+
+extern uint32_t GetBlockWork(const MCBlock& block, const MCOutPoint& out, uint256& block_hash);
+
+static void BlockWork(benchmark::State& state)
+{
+    SelectParams(MCBaseChainParams::MAIN);
+
+    std::vector<uint256> hashes(BLOCK_WORK_CHAIN_LENGTH);
+    std::vector<MCBlockIndex> blocks(BLOCK_WORK_CHAIN_LENGTH);
+    for (int i = 0; i < BLOCK_WORK_CHAIN_LENGTH; ++i) {
+        MCBlockIndex& index = blocks[i];
+        hashes[i] = GetRandHash();
+        index.phashBlock = &mapBlockIndex.insert(std::make_pair(hashes[i], &index)).first->first;
+        index.pprev = i > 0 ? &blocks[i - 1] : nullptr;
+        index.nHeight = i;
+        index.nNonce = GetRand(1000000);
+        index.nChainNonce = (index.pprev ? index.pprev->nChainNonce : 0) + index.nNonce;
+        index.BuildSkip();
+    }
+
+    // 抵押币不存在，工作量只取决于祖先
+    MCCoinsView coinsDummy;
+    MCCoinsViewCache coins(&coinsDummy);
+    MCCoinsViewCache* pOldCoinsTip = pcoinsTip;
+    pcoinsTip = &coins;
+
+    MCKey key;
+    key.MakeNewKey(true);
+    MCMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(1);
+    coinbase.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    MCBlock block;
+    block.hashPrevBlock = hashes.back();
+    block.vtx.push_back(MakeTransactionRef(std::move(coinbase)));
+    MCOutPoint outpoint(GetRandHash(), 0);
+
+    uint256 hash;
+    while (state.KeepRunning()) {
+        GetBlockWork(block, outpoint, hash);
+    }
+
+    pcoinsTip = pOldCoinsTip;
+    for (const uint256& blockHash : hashes)
+        mapBlockIndex.erase(blockHash);
+}
+
+BENCHMARK(BlockWork);
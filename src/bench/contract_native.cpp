@@ -0,0 +1,65 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+#include "smartcontract/contractnative.h"
+
+extern "C"
+{
+#include "lua/lstate.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+}
+
+#include <assert.h>
+
+// 同一组转账分别用lua实现和原生库执行
+static const char* benchTransferScript =
+    "local native = table.native\n"
+    "function luatransfer(b, from, to, amount)\n"
+    "  local balance = b[from] or 0\n"
+    "  if amount < 0 or balance < amount then error('insufficient balance') end\n"
+    "  b[from] = balance - amount\n"
+    "  b[to] = (b[to] or 0) + amount\n"
+    "  return true\n"
+    "end\n"
+    "function run(name)\n"
+    "  local f = (name == 'native') and native.transfer or luatransfer\n"
+    "  local b = {alice = 100000}\n"
+    "  for i = 1, 1000 do f(b, 'alice', 'bob', 7) f(b, 'bob', 'carol', 3) end\n"
+    "  return b.carol\n"
+    "end\n";
+
+static void RunContractTransfer(benchmark::State& state, const char* name)
+{
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+    OpenContractNativeLib(L);
+    int ret = luaL_dostring(L, benchTransferScript);
+    assert(ret == 0);
+    L->limit_on = 1;
+
+    while (state.KeepRunning()) {
+        L->limit_instruction = 100000000;
+        lua_settop(L, 0);
+        lua_getglobal(L, "run");
+        lua_pushstring(L, name);
+        ret = lua_pcall(L, 1, 1, 0);
+        assert(ret == 0);
+    }
+    lua_close(L);
+}
+
+static void ContractTransferLua(benchmark::State& state)
+{
+    RunContractTransfer(state, "lua");
+}
+
+static void ContractTransferNative(benchmark::State& state)
+{
+    RunContractTransfer(state, "native");
+}
+
+BENCHMARK(ContractTransferLua);
+BENCHMARK(ContractTransferNative);
@@ -0,0 +1,119 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+#include "chain/chainparams.h"
+#include "coding/base58.h"
+#include "key/key.h"
+#include "misc/random.h"
+#include "smartcontract/contractdb.h"
+#include "smartcontract/smartcontract.h"
+#include "transaction/coins.h"
+#include "utils/util.h"
+#include "validation/validation.h"
+
+// 区块只有一个分组，每4笔交易中有1笔调用同一个热点合约，其余调用各自的合约
+static const int CONTRACT_BLOCK_TXS = 64;
+static const int HOT_CONTRACT_INTERVAL = 4;
+
+static const char* benchContractCode =
+    "function init()\n"
+    "    PersistentData = {}\n"
+    "    PersistentData.calls = 0\n"
+    "    PersistentData.callers = {}\n"
+    "end\n"
+    "function work(n)\n"
+    "    local sum = 0\n"
+    "    for i = 1, n do\n"
+    "        sum = sum + i % 7\n"
+    "    end\n"
+    "    PersistentData.calls = PersistentData.calls + 1\n"
+    "    PersistentData.callers[msg.sender] = sum\n"
+    "end\n";
+
+static void RunContractGroup(benchmark::State& state, bool speculation)
+{
+    SelectParams(MCBaseChainParams::MAIN);
+    fs::path pathTemp = fs::temp_directory_path() / strprintf("bench_contract_%lu_%i", (unsigned long)GetTime(), (int)GetRand(100000));
+    fs::create_directories(pathTemp);
+    gArgs.ForceSetArg("-datadir", pathTemp.string());
+    ClearDatadirCache();
+    gArgs.ForceSetArg("-contractspeculation", speculation ? "1" : "0");
+
+    ContractDataDB* pOldContractDb = mpContractDb;
+    ContractDataDB* pContractDb = new ContractDataDB(pathTemp / "contract", 1 << 20, true, true);
+    mpContractDb = pContractDb;
+
+    uint256 prevHash = GetRandHash();
+    MCBlockIndex prevIndex;
+    prevIndex.nHeight = 1;
+    prevIndex.nTime = GetTime();
+    prevIndex.phashBlock = &mapBlockIndex.insert(std::make_pair(prevHash, &prevIndex)).first->first;
+
+    MCKey key;
+    key.MakeNewKey(true);
+    MCPubKey pubKey = key.GetPubKey();
+    MagnaChainAddress senderAddr(pubKey.GetID());
+
+    // 发布合约并存盘到prevIndex
+    std::vector<MCContractID> contractIds;
+    SmartLuaState sls;
+    for (int i = 0; i <= CONTRACT_BLOCK_TXS; ++i) {
+        MCContractID contractId(Hash160(ParseHex(GetRandHash().ToString())));
+        MagnaChainAddress contractAddr(contractId);
+        std::string code = benchContractCode;
+        UniValue ret(UniValue::VARR);
+        sls.Initialize(true, prevIndex.GetBlockTime(), prevIndex.nHeight, -1, senderAddr, nullptr, &prevIndex, SmartLuaState::SAVE_TYPE_DATA, nullptr);
+        bool success = PublishContract(&sls, contractAddr, code, ret, false);
+        assert(success);
+        contractIds.push_back(contractId);
+    }
+    pContractDb->WriteBlockContractInfoToDisk(&prevIndex, &pContractDb->contractContext);
+    pContractDb->contractContext.ClearAll();
+
+    MCBlock block;
+    block.hashPrevBlock = prevHash;
+    for (int i = 0; i < CONTRACT_BLOCK_TXS; ++i) {
+        MCMutableTransaction tx;
+        tx.nVersion = MCTransaction::CALL_CONTRACT_VERSION;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = 0;
+        tx.pContractData.reset(new ContractData);
+        tx.pContractData->address = contractIds[(i % HOT_CONTRACT_INTERVAL == 0) ? 0 : i + 1];
+        tx.pContractData->sender = pubKey;
+        tx.pContractData->codeOrFunc = "work";
+        tx.pContractData->args = "[1000]";
+        tx.pContractData->amountOut = 0;
+        block.vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+    block.groupSize.push_back(block.vtx.size());
+
+    CoinAmountTemp coinAmountTemp;
+    while (state.KeepRunning()) {
+        CoinAmountCache coinAmountCache(&coinAmountTemp);
+        ContractContext contractContext;
+        bool success = pContractDb->RunBlockContract(&block, &contractContext, &coinAmountCache);
+        assert(success);
+    }
+
+    delete pContractDb;
+    mpContractDb = pOldContractDb;
+    mapBlockIndex.erase(prevHash);
+    gArgs.ForceSetArg("-contractspeculation", DEFAULT_CONTRACT_SPECULATION ? "1" : "0");
+    fs::remove_all(pathTemp);
+}
+
+static void ContractGroupSerial(benchmark::State& state)
+{
+    RunContractGroup(state, false);
+}
+
+static void ContractGroupSpeculative(benchmark::State& state)
+{
+    RunContractGroup(state, true);
+}
+
+BENCHMARK(ContractGroupSerial);
+BENCHMARK(ContractGroupSpeculative);
@@ -0,0 +1,60 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+#include "chain/branchchain.h"
+#include "chain/provebuilder.h"
+#include "primitives/block.h"
+#include "primitives/transaction.h"
+
+// 为一个区块中每个交易构建证明，对应一个2000笔交易的区块的输入都来自同一区块
+static const int PROVE_BLOCK_TXS = 2000;
+
+static std::shared_ptr<MCBlock> MakeProveBlock()
+{
+    std::shared_ptr<MCBlock> block = std::make_shared<MCBlock>();
+    for (int i = 0; i < PROVE_BLOCK_TXS; ++i) {
+        MCMutableTransaction tx;
+        tx.nLockTime = i;
+        block->vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+    return block;
+}
+
+// 原来的做法：每个输入都扫描区块并重新计算整棵默克尔树
+static void ProveInputsPerInput(benchmark::State& state)
+{
+    std::shared_ptr<MCBlock> block = MakeProveBlock();
+    while (state.KeepRunning()) {
+        for (const MCTransactionRef& ptx : block->vtx) {
+            MCTransactionRef tmpTx;
+            for (size_t j = 0; j < block->vtx.size(); j++) {
+                if (block->vtx[j]->GetHash() == ptx->GetHash()) {
+                    tmpTx = block->vtx[j];
+                    break;
+                }
+            }
+            std::set<uint256> setTxids;
+            setTxids.insert(tmpTx->GetHash());
+            std::unique_ptr<MCSpvProof> pSpvPf(NewSpvProof(*block, setTxids));
+        }
+    }
+}
+
+// 区块解析一次，各层哈希共享
+static void ProveInputsSharedBlock(benchmark::State& state)
+{
+    std::shared_ptr<MCBlock> block = MakeProveBlock();
+    while (state.KeepRunning()) {
+        ProveSourceBlock source(block);
+        for (const MCTransactionRef& ptx : block->vtx) {
+            MCSpvProof proof;
+            source.GetTx(ptx->GetHash());
+            source.MakeSpvProof(ptx->GetHash(), proof);
+        }
+    }
+}
+
+BENCHMARK(ProveInputsPerInput);
+BENCHMARK(ProveInputsSharedBlock);
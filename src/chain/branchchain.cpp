@@ -18,11 +18,8 @@
 
 #include <stdio.h>
 
-#include <event2/buffer.h>
-#include <event2/keyvalq_struct.h>
-#include "support/events.h"
-
 #include <univalue.h>
+#include <boost/thread.hpp>
 #include "misc/tinyformat.h"
 #include "thread/sync.h"
 #include "primitives/block.h"
@@ -37,160 +34,24 @@
 #include "io/core_io.h"
 #include "rpc/server.h"
 #include "chain/branchdb.h"
+#include "chain/branchrpcclient.h"
+#include "chain/branchtransfer.h"
+#include "misc/cuckoocache.h"
+#include "script/sigcache.h"
+#include "validation/checkqueue.h"
 #include "misc/timedata.h"
 #include "smartcontract/smartcontract.h"
 #include "transaction/txmempool.h"
 
-static const int DEFAULT_HTTP_CLIENT_TIMEOUT = 900;
-
-//
-// Exception thrown on connection error.  This error is used to determine
-// when to wait if -rpcwait is given.
-//
-class MCConnectionFailed : public std::runtime_error
-{
-public:
-
-	explicit inline MCConnectionFailed(const std::string& msg) :
-		std::runtime_error(msg)
-	{}
-
-};
-
-/** Reply structure for request_done to fill in */
-struct HTTPReply
-{
-	HTTPReply() : status(0), error(-1) {}
-
-	int status;
-	int error;
-	std::string body;
-};
-
-const char *http_errorstring2(int code)
-{
-	switch (code) {
-#if LIBEVENT_VERSION_NUMBER >= 0x02010300
-	case EVREQ_HTTP_TIMEOUT:
-		return "timeout reached";
-	case EVREQ_HTTP_EOF:
-		return "EOF reached";
-	case EVREQ_HTTP_INVALID_HEADER:
-		return "error while reading header, or invalid header";
-	case EVREQ_HTTP_BUFFER_ERROR:
-		return "error encountered while reading or writing";
-	case EVREQ_HTTP_REQUEST_CANCEL:
-		return "request was canceled";
-	case EVREQ_HTTP_DATA_TOO_LONG:
-		return "response body is larger than allowed";
-#endif
-	default:
-		return "unknown";
-	}
-}
-
-static void http_request_done(struct evhttp_request *req, void *ctx)
-{
-	HTTPReply *reply = static_cast<HTTPReply*>(ctx);
-
-	if (req == nullptr) {
-		/* If req is nullptr, it means an error occurred while connecting: the
-		* error code will have been passed to http_error_cb.
-		*/
-		reply->status = 0;
-		return;
-	}
-
-	reply->status = evhttp_request_get_response_code(req);
-
-	struct evbuffer *buf = evhttp_request_get_input_buffer(req);
-	if (buf)
-	{
-		size_t size = evbuffer_get_length(buf);
-		const char *data = (const char*)evbuffer_pullup(buf, size);
-		if (data)
-			reply->body = std::string(data, size);
-		evbuffer_drain(buf, size);
-	}
-}
-
-#if LIBEVENT_VERSION_NUMBER >= 0x02010300
-static void http_error_cb(enum evhttp_request_error err, void *ctx)
-{
-	HTTPReply *reply = static_cast<HTTPReply*>(ctx);
-	reply->error = err;
-}
-#endif
-
 UniValue CallRPC(const std::string& host, const int port, const std::string& strMethod, const UniValue& params, 
 	const std::string& strRPCUserColonPass, const std::string& rpcwallet/*=""*/)
 {
-	// Obtain event base
-	raii_event_base base = obtain_event_base();
-
-	// Synchronously look up hostname
-	raii_evhttp_connection evcon = obtain_evhttp_connection_base(base.get(), host, port);
-	evhttp_connection_set_timeout(evcon.get(), DEFAULT_HTTP_CLIENT_TIMEOUT);
-
-	HTTPReply response;
-	raii_evhttp_request req = obtain_evhttp_request(http_request_done, (void*)&response);
-	if (req == nullptr)
-		throw std::runtime_error("create http request failed");
-#if LIBEVENT_VERSION_NUMBER >= 0x02010300
-	evhttp_request_set_error_cb(req.get(), http_error_cb);
-#endif
-    
-	struct evkeyvalq* output_headers = evhttp_request_get_output_headers(req.get());
-	assert(output_headers);
-	evhttp_add_header(output_headers, "Host", host.c_str());
-	evhttp_add_header(output_headers, "Connection", "close");
-	evhttp_add_header(output_headers, "Authorization", (std::string("Basic ") + EncodeBase64(strRPCUserColonPass)).c_str());
-
-	// Attach request data
-    std::string strRequest = JSONRPCRequestObj(strMethod, params, 1).write() + "\n";
-	struct evbuffer* output_buffer = evhttp_request_get_output_buffer(req.get());
-	assert(output_buffer);
-	evbuffer_add(output_buffer, strRequest.data(), strRequest.size());
-
-	// check if we should use a special wallet endpoint
-	std::string endpoint = "/";
-    std::string walletName = rpcwallet;
-	if (!walletName.empty()) {
-		char *encodedURI = evhttp_uriencode(walletName.c_str(), walletName.size(), false);
-		if (encodedURI) {
-			endpoint = "/wallet/" + std::string(encodedURI);
-			free(encodedURI);
-		}
-		else {
-			throw MCConnectionFailed("uri-encode failed");
-		}
-	}
-	int r = evhttp_make_request(evcon.get(), req.get(), EVHTTP_REQ_POST, endpoint.c_str());
-	req.release(); // ownership moved to evcon in above call
-	if (r != 0) {
-		throw MCConnectionFailed("send http request failed");
-	}
-
-	event_base_dispatch(base.get());
-
-	if (response.status == 0)
-		throw MCConnectionFailed(strprintf("couldn't connect to server: %s (code %d)\n(make sure server is running and you are connecting to the correct RPC port)", http_errorstring2(response.error), response.error));
-	else if (response.status == HTTP_UNAUTHORIZED)
-		throw std::runtime_error("incorrect rpcuser or rpcpassword (authorization failed)");
-	else if (response.status >= 400 && response.status != HTTP_BAD_REQUEST && response.status != HTTP_NOT_FOUND && response.status != HTTP_INTERNAL_SERVER_ERROR)
-		throw std::runtime_error(strprintf("server returned HTTP error %d", response.status));
-	else if (response.body.empty())
-		throw std::runtime_error("no response from server");
-
-	// Parse reply
-	UniValue valReply(UniValue::VSTR);
-	if (!valReply.read(response.body))
-		throw std::runtime_error("couldn't parse reply from server");
-	const UniValue& reply = valReply.get_obj();
-	if (reply.empty())
-		throw std::runtime_error("expected reply to have result, error and id properties");
-
-	return reply;
+    MCRPCConfig rpccfg;
+    rpccfg.strIp = host;
+    rpccfg.iPort = port;
+    rpccfg.strRPCUserColonPass = strRPCUserColonPass;
+    rpccfg.strWallet = rpcwallet;
+    return BranchRPCCall(rpccfg, strMethod, params);
 }
 
 UniValue CallRPC(MCRPCConfig& rpccfg, const std::string& strMethod, const UniValue& params)
@@ -200,10 +61,10 @@ UniValue CallRPC(MCRPCConfig& rpccfg, const std::string& strMethod, const UniVal
             rpccfg.InitUserColonPass(true);
         }
 
-        UniValue ret = CallRPC(rpccfg.strIp, rpccfg.iPort, strMethod, params, rpccfg.strRPCUserColonPass, rpccfg.strWallet);
+        UniValue ret = BranchRPCCall(rpccfg, strMethod, params);
         return ret;
     }
-    catch (const MCConnectionFailed& e)
+    catch (const BranchRPCConnectionFailed& e)
     {
         error("%s: CallRPC excetion , %s", __func__, e.what());
         return JSONRPCReplyObj(NullUniValue, e.what(), 1);
@@ -699,7 +560,7 @@ int CheckSpvProof(const uint256& merkleRoot, MCPartialMerkleTree& pmt, const uin
 }
 
 // 跨链交易从发起链广播到目标链 
-bool BranchChainTransStep2(const MCTransactionRef& tx, const MCBlock &block, std::string* pStrErrorMsg)
+bool MakeBranchTransStep2Request(const MCTransactionRef& tx, const MCBlock &block, BranchRPCRequest& request, std::string* pStrErrorMsg)
 {
 	if (!tx->IsPregnantTx())
 	{
@@ -711,12 +572,6 @@ bool BranchChainTransStep2(const MCTransactionRef& tx, const MCBlock &block, std
 	if (strToChainId == Params().GetBranchId())
 		return error_ex1(pStrErrorMsg, "%s: can not to this chain!", __func__);
 
-	MCRPCConfig chainrpccfg;
-	if (g_branchChainMan->GetRpcConfig(strToChainId, chainrpccfg) == false || chainrpccfg.IsValid() == false)
-	{
-		return error_ex1(pStrErrorMsg, "%s: can not found branch rpc config for %s\n", __func__, strToChainId);
-	}
-
     std::string strTxHexData;
     if (strToChainId == MCBaseChainParams::MAIN && tx->IsBranchChainTransStep1())
     {//添加 部分默克尔树(spv证明)
@@ -734,54 +589,72 @@ bool BranchChainTransStep2(const MCTransactionRef& tx, const MCBlock &block, std
     }
 
 	// rpc to branch chain to create an branchtranstraction.
-	std::string strMethod = "makebranchtransaction";
-	UniValue params(UniValue::VARR);
-	params.push_back(strTxHexData);
-
-	UniValue reply = CallRPC(chainrpccfg, strMethod, params);
+	request.strMethod = "makebranchtransaction";
+	request.params = UniValue(UniValue::VARR);
+	request.params.push_back(strTxHexData);
+	return true;
+}
 
+bool CheckBranchTransStep2Reply(const UniValue& reply, const uint256& txid, std::string* pStrErrorMsg)
+{
 	const UniValue& result = find_value(reply, "result");
 	const UniValue& errorVal = find_value(reply, "error");
 	if (!errorVal.isNull())
 	{
 		//throw JSONRPCError(RPC_WALLET_ERROR, strError);
-		return error_ex1(pStrErrorMsg, "%s: RPC call makebranchtransaction fail: %s, txid %s\n", __func__, errorVal.write(), tx->GetHash().GetHex());
+		return error_ex1(pStrErrorMsg, "%s: RPC call makebranchtransaction fail: %s, txid %s\n", __func__, errorVal.write(), txid.GetHex());
 	}
 
-	if (result.isNull() || result.get_str() != "ok")
+	if (result.isNull() || !result.isStr() || result.get_str() != "ok")
 	{
 		return error_ex1(pStrErrorMsg, "%s RPC call not return ok", __func__);
 	}
 	return true;
 }
 
-//OP:移动独立的线程中去?或者满足高度后,相应的拥有者自己调用相关逻辑,但是这样跨链转账变得更麻烦
-void ProcessBlockBranchChain()
+bool BranchChainTransStep2(const MCTransactionRef& tx, const MCBlock &block, std::string* pStrErrorMsg)
 {
+	BranchRPCRequest request;
+	if (!MakeBranchTransStep2Request(tx, block, request, pStrErrorMsg))
+		return false;
+
+	MCRPCConfig chainrpccfg;
+	if (g_branchChainMan->GetRpcConfig(tx->sendToBranchid, chainrpccfg) == false || chainrpccfg.IsValid() == false)
 	{
-		uint32_t nBlockHeight = BRANCH_CHAIN_MATURITY + CUSHION_HEIGHT;
-		MCBlockIndex *pbi = chainActive[chainActive.Tip()->nHeight - nBlockHeight];
-		if (pbi != nullptr)
-		{
-			std::shared_ptr<MCBlock> pblock = std::make_shared<MCBlock>();
-			MCBlock& block = *pblock;
-			if (ReadBlockFromDisk(block, pbi, Params().GetConsensus()))
-			{
-				for (int i = 1; i < block.vtx.size(); i++)
-				{
-					const MCTransactionRef& tx = block.vtx[i];
-					if (tx->IsBranchChainTransStep1() || tx->IsMortgage())
-					{
-						BranchChainTransStep2(tx, block, nullptr);
-					}
-                    if (tx->IsRedeemMortgageStatement())
-                    {
-                        ReqMainChainRedeemMortgage(tx, block);
-                    }
-				}
-			}
-		}
+		return error_ex1(pStrErrorMsg, "%s: can not found branch rpc config for %s\n", __func__, tx->sendToBranchid);
 	}
+
+	UniValue reply = CallRPC(chainrpccfg, request.strMethod, request.params);
+	return CheckBranchTransStep2Reply(reply, tx->GetHash(), pStrErrorMsg);
+}
+
+// 异步调用，连接或cookie失败也以错误回复交给回调
+void CallRPCBatchAsync(MCRPCConfig& rpccfg, const std::vector<BranchRPCRequest>& requests, const BranchRPCCallback& callback)
+{
+    try {
+        if (rpccfg.strRPCUserColonPass.empty() && rpccfg.getcookiefail > 0) {
+            rpccfg.InitUserColonPass(true);
+        }
+    }
+    catch (const std::exception& e) {
+        error("%s: CallRPC excetion , %s", __func__, e.what());
+        std::vector<UniValue> replies;
+        for (size_t i = 0; i < requests.size(); ++i)
+            replies.push_back(JSONRPCReplyObj(NullUniValue, e.what(), (int)i));
+        callback(replies);
+        return;
+    }
+    BranchRPCCallBatchAsync(rpccfg, requests, callback);
+}
+
+//OP:移动独立的线程中去?或者满足高度后,相应的拥有者自己调用相关逻辑,但是这样跨链转账变得更麻烦
+// 只记录成熟的区块，读区块和发送请求都在跨链转账队列的线程中进行
+void ProcessBlockBranchChain()
+{
+	uint32_t nBlockHeight = BRANCH_CHAIN_MATURITY + CUSHION_HEIGHT;
+	MCBlockIndex *pbi = chainActive[chainActive.Tip()->nHeight - nBlockHeight];
+	if (pbi != nullptr && pBranchTransferQueue != nullptr)
+		pBranchTransferQueue->PushBlock(pbi->GetBlockHash(), pbi->nHeight);
 }
 
 //chain transaction step 2 Check.
@@ -938,7 +811,7 @@ bool CheckBranchTransaction(const MCTransaction& txBranchChainStep2, MCValidatio
 #define SetStrErr(strMsg) {if (pStrErr) *pStrErr = (strMsg);}
 //提交侧链区块头
 //call in branch chain
-bool SendBranchBlockHeader(const std::shared_ptr<const MCBlock> pBlock, std::string *pStrErr)
+static bool MakeBranchBlockHeaderRequest(const std::shared_ptr<const MCBlock> pBlock, MCRPCConfig& branchrpccfg, BranchRPCRequest& request, std::string *pStrErr)
 {
     SetStrErr("Unknow error\n");
     if (Params().IsMainChain() || pBlock == nullptr) {
@@ -973,19 +846,20 @@ bool SendBranchBlockHeader(const std::shared_ptr<const MCBlock> pBlock, std::str
     MCVectorWriter cvw{ SER_NETWORK, INIT_PROTO_VERSION, pBlockInfo->vchStakeTxData, 0, pBlock->vtx[1]};
     
     //call rpc
-    MCRPCConfig branchrpccfg;
     if (g_branchChainMan->GetRpcConfig(MCBaseChainParams::MAIN, branchrpccfg) == false || branchrpccfg.IsValid() == false){
         SetStrErr("can not found main chain rpc connnect info\n");
         return false;
     }
 
-    const std::string strMethod = "submitbranchblockinfo";
-    UniValue params(UniValue::VARR);
+    request.strMethod = "submitbranchblockinfo";
+    request.params = UniValue(UniValue::VARR);
     MCTransactionRef tx = MakeTransactionRef(std::move(mtx));
-    params.push_back(EncodeHexTx(*tx, RPCSerializationFlags()));
-
-    UniValue reply = CallRPC(branchrpccfg, strMethod, params);
+    request.params.push_back(EncodeHexTx(*tx, RPCSerializationFlags()));
+    return true;
+}
 
+static bool CheckBranchBlockHeaderReply(const UniValue& reply, std::string *pStrErr)
+{
     const UniValue& result = find_value(reply, "result");
     const UniValue& errorVal = find_value(reply, "error");
     if (!errorVal.isNull()){
@@ -1009,8 +883,37 @@ bool SendBranchBlockHeader(const std::shared_ptr<const MCBlock> pBlock, std::str
     return true;
 }
 
-extern bool CheckBlockHeaderWork(const MCBranchBlockInfo& block, MCValidationState& state, const MCChainParams &params, BranchData& branchdata, BranchCache* pBranchCache);
-extern bool BranchContextualCheckBlockHeader(const MCBlockHeader& block, MCValidationState& state, const MCChainParams& params, BranchData &branchdata, 
+bool SendBranchBlockHeader(const std::shared_ptr<const MCBlock> pBlock, std::string *pStrErr)
+{
+    MCRPCConfig branchrpccfg;
+    BranchRPCRequest request;
+    if (!MakeBranchBlockHeaderRequest(pBlock, branchrpccfg, request, pStrErr))
+        return false;
+
+    UniValue reply = CallRPC(branchrpccfg, request.strMethod, request.params);
+    return CheckBranchBlockHeaderReply(reply, pStrErr);
+}
+
+// 同一目标链的异步请求按顺序发送，父区块头总是先到
+void SendBranchBlockHeaderAsync(const std::shared_ptr<const MCBlock> pBlock)
+{
+    MCRPCConfig branchrpccfg;
+    BranchRPCRequest request;
+    std::string strErr;
+    if (!MakeBranchBlockHeaderRequest(pBlock, branchrpccfg, request, &strErr)) {
+        LogPrint(BCLog::BRANCH, "SendBranchBlockHeader fail when ProcessNewBlock: %s", strErr.c_str());
+        return;
+    }
+
+    CallRPCBatchAsync(branchrpccfg, std::vector<BranchRPCRequest>(1, request), [](const std::vector<UniValue>& replies) {
+        std::string strErr;
+        if (replies.size() != 1 || !CheckBranchBlockHeaderReply(replies[0], &strErr))
+            LogPrint(BCLog::BRANCH, "SendBranchBlockHeader fail when ProcessNewBlock: %s", strErr.c_str());
+    });
+}
+
+extern bool CheckBlockHeaderWork(const MCBranchBlockInfo& block, MCValidationState& state, const MCChainParams &params, const BranchData& branchdata, BranchCache* pBranchCache);
+extern bool BranchContextualCheckBlockHeader(const MCBlockHeader& block, MCValidationState& state, const MCChainParams& params, const BranchData &branchdata, 
     int64_t nAdjustedTime, BranchCache* pBranchCache);
 
 bool CheckBranchBlockInfoTx(const MCTransaction& tx, MCValidationState& state, BranchCache* pBranchCache)
@@ -1038,7 +941,7 @@ bool CheckBranchBlockInfoTx(const MCTransaction& tx, MCValidationState& state, B
         return state.DoS(100, false, REJECT_DUPLICATE, "branch block info duplicate");
     }
 
-    BranchData branchdata = pBranchCache->GetBranchData(tx.pBranchBlockData->branchID);
+    const BranchData& branchdata = pBranchCache->GetBranchData(tx.pBranchBlockData->branchID);
     //ContextualCheckBlockHeader
     const MCChainParams& bparams = BranchParams(tx.pBranchBlockData->branchID);
     if (!BranchContextualCheckBlockHeader(blockheader, state, bparams, branchdata, GetAdjustedTime(), pBranchCache)) {
@@ -1054,7 +957,7 @@ bool CheckBranchBlockInfoTx(const MCTransaction& tx, MCValidationState& state, B
 }
 
 // 如果是自己的交易则,向自己的主链发起赎回请求,把抵押币解锁
-bool ReqMainChainRedeemMortgage(const MCTransactionRef& tx, const MCBlock& block, std::string *pStrErr)
+bool MakeRedeemMortgageRequest(const MCTransactionRef& tx, const MCBlock& block, BranchRPCRequest& request, std::string *pStrErr)
 {
     SetStrErr("Unknow error");
     if (tx->IsRedeemMortgageStatement() == false) {
@@ -1073,23 +976,18 @@ bool ReqMainChainRedeemMortgage(const MCTransactionRef& tx, const MCBlock& block
     txids.emplace(tx->GetHash());
     std::shared_ptr<MCSpvProof> spvProof(NewSpvProof(block, txids));
 
-    const std::string strMethod = "redeemmortgagecoin";
-    UniValue params(UniValue::VARR);
-    params.push_back(coinfromtxid.ToString());
-    params.push_back(UniValue(int(0)));
-    params.push_back(EncodeHexTx(*tx));
-    params.push_back(Params().GetBranchId());
-    params.push_back(EncodeHexSpvProof(*spvProof));
-
-    //call rpc
-    MCRPCConfig branchrpccfg;
-    if (g_branchChainMan->GetRpcConfig(MCBaseChainParams::MAIN, branchrpccfg) == false || branchrpccfg.IsValid() == false) {
-        SetStrErr("Can not found main chain rpc connnect config");
-        return false;
-    }
-
-    UniValue reply = CallRPC(branchrpccfg, strMethod, params);
+    request.strMethod = "redeemmortgagecoin";
+    request.params = UniValue(UniValue::VARR);
+    request.params.push_back(coinfromtxid.ToString());
+    request.params.push_back(UniValue(int(0)));
+    request.params.push_back(EncodeHexTx(*tx));
+    request.params.push_back(Params().GetBranchId());
+    request.params.push_back(EncodeHexSpvProof(*spvProof));
+    return true;
+}
 
+bool CheckRedeemMortgageReply(const UniValue& reply, std::string *pStrErr)
+{
     const UniValue& result = find_value(reply, "result");
     const UniValue& errorVal = find_value(reply, "error");
     if (!errorVal.isNull()) {
@@ -1105,6 +1003,23 @@ bool ReqMainChainRedeemMortgage(const MCTransactionRef& tx, const MCBlock& block
     return true;
 }
 
+bool ReqMainChainRedeemMortgage(const MCTransactionRef& tx, const MCBlock& block, std::string *pStrErr)
+{
+    BranchRPCRequest request;
+    if (!MakeRedeemMortgageRequest(tx, block, request, pStrErr))
+        return false;
+
+    //call rpc
+    MCRPCConfig branchrpccfg;
+    if (g_branchChainMan->GetRpcConfig(MCBaseChainParams::MAIN, branchrpccfg) == false || branchrpccfg.IsValid() == false) {
+        SetStrErr("Can not found main chain rpc connnect config");
+        return false;
+    }
+
+    UniValue reply = CallRPC(branchrpccfg, request.strMethod, request.params);
+    return CheckRedeemMortgageReply(reply, pStrErr);
+}
+
 //GetReportTxHashKey 和 GetProveTxHashKey 需要计算出同样的值
 uint256 GetReportTxHashKey(const MCTransaction& tx)
 {
@@ -1148,7 +1063,7 @@ bool CheckBranchDuplicateTx(const MCTransaction& tx, MCValidationState& state, B
         if (pBranchCache && pBranchCache->HasInCache(tx))
             return state.DoS(0, false, REJECT_DUPLICATE, "branch block info duplicate");
 
-        BranchData branchdata = g_pBranchDb->GetBranchData(tx.pBranchBlockData->branchID);
+        const BranchData& branchdata = g_pBranchDb->GetBranchData(tx.pBranchBlockData->branchID);
         MCBlockHeader blockheader;
         tx.pBranchBlockData->GetBlockHeader(blockheader);
         if (branchdata.mapHeads.count(blockheader.GetHash())) {
@@ -1191,9 +1106,9 @@ bool CheckBranchDuplicateTx(const MCTransaction& tx, MCValidationState& state, B
     return true;
 }
 
-bool CheckReportTxCommonly(const MCTransaction& tx, MCValidationState& state, BranchData& branchdata)
+bool CheckReportTxCommonly(const MCTransaction& tx, MCValidationState& state, const BranchData& branchdata)
 {
-    BranchBlockData* pBlockData = branchdata.GetBranchBlockData(tx.pReportData->reportedBlockHash);
+    const BranchBlockData* pBlockData = branchdata.GetBranchBlockData(tx.pReportData->reportedBlockHash);
     if (pBlockData == nullptr)
         return state.DoS(0, false, REJECT_INVALID, "CheckReportCheatTx Can not found block data in mapHeads");
     if (branchdata.Height() < pBlockData->nHeight)
@@ -1210,12 +1125,12 @@ bool CheckReportCheatTx(const MCTransaction& tx, MCValidationState& state, Branc
         const uint256 reportedBranchId = tx.pReportData->reportedBranchId;
         if (!pBranchCache->HasBranchData(reportedBranchId))
             return state.DoS(100, false, REJECT_INVALID, "CheckReportCheatTx branchid error");
-        BranchData branchdata = pBranchCache->GetBranchData(reportedBranchId);
+        const BranchData& branchdata = pBranchCache->GetBranchData(reportedBranchId);
 
         if (tx.pReportData->reporttype == ReportType::REPORT_TX || tx.pReportData->reporttype == ReportType::REPORT_COINBASE)
         {
             MCSpvProof spvProof(*tx.pPMT);
-            BranchBlockData* pBlockData = branchdata.GetBranchBlockData(spvProof.blockhash);
+            const BranchBlockData* pBlockData = branchdata.GetBranchBlockData(spvProof.blockhash);
             if (pBlockData == nullptr)
                 return state.DoS(100, false, REJECT_INVALID, "pBlockData == nullptr");
             if (CheckSpvProof(pBlockData->header.hashMerkleRoot, spvProof.pmt, tx.pReportData->reportedTxHash) < 0)
@@ -1239,8 +1154,72 @@ bool CheckReportCheatTx(const MCTransaction& tx, MCValidationState& state, Branc
     return true;
 }
 
+static CuckooCache::cache<uint256, SignatureCacheHasher> proveCheckCache;
+static uint256 proveCheckCacheNonce(GetRandHash());
+static boost::shared_mutex cs_proveCheckCache;
+
+void InitProveCheckCache()
+{
+    size_t nMaxCacheSize = (size_t)DEFAULT_PROVE_CHECK_CACHE_SIZE << 20;
+    size_t nElems = proveCheckCache.setup_bytes(nMaxCacheSize);
+    LogPrintf("Using %zu MiB for prove check cache, able to store %zu elements\n",
+            (nElems*sizeof(uint256)) >>20, nElems);
+}
+
+static MCCheckQueue<ProveInputCheck> proveCheckQueue(128);
+
+void ThreadProveCheck()
+{
+    RenameThread("magnachain-provech");
+    proveCheckQueue.Thread();
+}
+
+bool ProveInputCheck::operator()()
+{
+    // 缓存键包含证明、所证明的交易和要验证的输入，以及是否要求脚本检查通过(合约转币只要求地址一致)
+    MCHashWriter ss(SER_GETHASH, 0);
+    ss << proveCheckCacheNonce << merkleRoot << pmt << prevTxHash << scriptPubKey << amount << ptxTo->GetWitnessHash() << nIn << nFlags << strContractError.empty();
+    uint256 hashCacheEntry = ss.GetHash();
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_proveCheckCache);
+        if (proveCheckCache.contains(hashCacheEntry, false))
+            return true;
+    }
+
+    if (CheckSpvProof(merkleRoot, pmt, prevTxHash) < 0) {
+        strError = "Check Prove ReportTx spv check fail";
+        return false;
+    }
+
+    CScriptCheck check(scriptPubKey, amount, *ptxTo, nIn, nFlags, false, txdata.get());
+    if (!check() && !strContractError.empty()) {
+        strError = strContractError;
+        return false;
+    }
+
+    boost::unique_lock<boost::shared_mutex> lock(cs_proveCheckCache);
+    proveCheckCache.insert(hashCacheEntry);
+    return true;
+}
+
+void ProveInputCheck::swap(ProveInputCheck& check)
+{
+    std::swap(merkleRoot, check.merkleRoot);
+    std::swap(pmt, check.pmt);
+    std::swap(prevTxHash, check.prevTxHash);
+    scriptPubKey.swap(check.scriptPubKey);
+    std::swap(amount, check.amount);
+    std::swap(ptxTo, check.ptxTo);
+    std::swap(nIn, check.nIn);
+    std::swap(nFlags, check.nFlags);
+    std::swap(strContractError, check.strContractError);
+    std::swap(txdata, check.txdata);
+    std::swap(strError, check.strError);
+}
+
+// pvChecks 为空时在当前线程中执行各输入的证明和脚本检查，否则加入 pvChecks
 bool CheckTransactionProveWithProveData(const MCTransactionRef &pProveTx, MCValidationState& state, 
-    const std::vector<ProveDataItem>& vectProveData, BranchData& branchData, MCAmount& fee, bool jumpFrist)
+    const std::vector<ProveDataItem>& vectProveData, const BranchData& branchData, MCAmount& fee, bool jumpFrist, std::vector<ProveInputCheck>* pvChecks)
 {
     if (pProveTx->IsCoinBase()) {
         return state.DoS(0, false, REJECT_INVALID, "CheckProveReportTx Prove tx can not a coinbase transaction");
@@ -1254,6 +1233,8 @@ bool CheckTransactionProveWithProveData(const MCTransactionRef &pProveTx, MCVali
     MCAmount nInAmount = 0;
     MCAmount nContractIn = 0;
     MCScript contractScript = GetScriptForDestination(pProveTx->pContractData->address);
+    const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY | SCRIPT_VERIFY_CHECKSEQUENCEVERIFY | SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_NULLDUMMY;
+    std::shared_ptr<PrecomputedTransactionData> txdata = std::make_shared<PrecomputedTransactionData>(*pProveTx);
     for (size_t i = 0; i < pProveTx->vin.size(); ++i)
     {
         const ProveDataItem& provDataItem = vectProveData[i + baseIndex];
@@ -1264,12 +1245,10 @@ bool CheckTransactionProveWithProveData(const MCTransactionRef &pProveTx, MCVali
         MCDataStream cds(provDataItem.tx, SER_NETWORK, INIT_PROTO_VERSION);
         cds >> (pTx);
 
-        MCSpvProof spvProof(provDataItem.pCSP);
-        BranchBlockData* pBlockData = branchData.GetBranchBlockData(spvProof.blockhash);
+        const MCSpvProof& spvProof = provDataItem.pCSP;
+        const BranchBlockData* pBlockData = branchData.GetBranchBlockData(spvProof.blockhash);
         if (pBlockData == nullptr)
             return state.DoS(0, false, REJECT_INVALID, "pBlockData == nullptr");
-        if (CheckSpvProof(pBlockData->header.hashMerkleRoot, spvProof.pmt, pTx->GetHash()) < 0)
-            return state.DoS(0, false, REJECT_INVALID, "Check Prove ReportTx spv check fail");
 
         const MCOutPoint& outpoint = pProveTx->vin[i].prevout;
         if (pTx->GetHash() != outpoint.hash)
@@ -1289,25 +1268,24 @@ bool CheckTransactionProveWithProveData(const MCTransactionRef &pProveTx, MCVali
             nContractIn += amount;
         }
 
-        bool fCacheResults = false;
-        unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY | SCRIPT_VERIFY_CHECKSEQUENCEVERIFY | SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_NULLDUMMY;
-
-        PrecomputedTransactionData txdata(*pProveTx);
-        CScriptCheck check(scriptPubKey, amount, *pProveTx, i, flags, fCacheResults, &txdata);
-        if (!check()) {
-            bool checkok = true;
-            if (pProveTx->IsCallContract()){//智能合约转币不用签名的
-                checkok = false;
-                MCContractID kDestKey;
-                if (!scriptPubKey.GetContractAddr(kDestKey)) {
-                    return state.DoS(0, false, REJECT_NONSTANDARD, "check smartcontract sign fail, contract addr fail");
-                }
-                if (kDestKey != pProveTx->pContractData->address)
-                    return state.DoS(0, false, REJECT_INVALID, "check smartcontract sign fail, contract addr error");
-                checkok = true;
-            }
-            if (!checkok)
-                return state.DoS(0, false, REJECT_INVALID, "CheckProveReportTx scriptcheck fail");
+        std::string strContractError = "CheckProveReportTx scriptcheck fail";
+        if (pProveTx->IsCallContract()){//智能合约转币不用签名的
+            MCContractID kDestKey;
+            if (!scriptPubKey.GetContractAddr(kDestKey))
+                strContractError = "check smartcontract sign fail, contract addr fail";
+            else if (kDestKey != pProveTx->pContractData->address)
+                strContractError = "check smartcontract sign fail, contract addr error";
+            else
+                strContractError.clear();
+        }
+
+        ProveInputCheck check(pBlockData->header.hashMerkleRoot, spvProof.pmt, pTx->GetHash(), scriptPubKey, amount, pProveTx, i, flags, strContractError, txdata);
+        if (pvChecks) {
+            pvChecks->push_back(ProveInputCheck());
+            check.swap(pvChecks->back());
+        }
+        else if (!check()) {
+            return state.DoS(0, false, REJECT_INVALID, check.GetError());
         }
     }
 
@@ -1402,9 +1380,9 @@ bool CheckProveReportTx(const MCTransaction& tx, MCValidationState& state, Branc
         return state.DoS(0, false, REJECT_INVALID, "Prove tx data error, first tx's hasdid is not eq proved txid");
 
     // spv check
-    BranchData branchData = pBranchCache->GetBranchData(branchId);
+    const BranchData& branchData = pBranchCache->GetBranchData(branchId);
     MCSpvProof spvProof(vectProveData[0].pCSP);
-    BranchBlockData* pBlockData = branchData.GetBranchBlockData(spvProof.blockhash);
+    const BranchBlockData* pBlockData = branchData.GetBranchBlockData(spvProof.blockhash);
     if (pBlockData == nullptr)
         return state.DoS(0, false, REJECT_INVALID, "pBlockData == nullptr");
     if (CheckSpvProof(pBlockData->header.hashMerkleRoot, spvProof.pmt, pProveTx->GetHash()) < 0)
@@ -1412,11 +1390,16 @@ bool CheckProveReportTx(const MCTransaction& tx, MCValidationState& state, Branc
 
     //check input/output/sign
     MCAmount fee;
-    if (!CheckTransactionProveWithProveData(pProveTx, state, vectProveData, branchData, fee, true))
+    std::vector<ProveInputCheck> vChecks;
+    MCCheckQueueControl<ProveInputCheck> control(nScriptCheckThreads ? &proveCheckQueue : nullptr);
+    if (!CheckTransactionProveWithProveData(pProveTx, state, vectProveData, branchData, fee, true, nScriptCheckThreads ? &vChecks : nullptr))
         return false;
+    control.Add(vChecks);
+    if (!control.Wait())
+        return state.DoS(0, false, REJECT_INVALID, "Check Prove ReportTx input prove check fail");
 
     if (pProveTx->IsSmartContract()) {
-        BranchBlockData* pPrevBlockData = branchData.GetBranchBlockData(pBlockData->header.hashPrevBlock);
+        const BranchBlockData* pPrevBlockData = branchData.GetBranchBlockData(pBlockData->header.hashPrevBlock);
         if (!CheckProveSmartContract(tx.pProveData, pProveTx, pBlockData, pPrevBlockData)) {
             return state.DoS(0, false, REJECT_INVALID, "CheckProveSmartContract fail");
         }
@@ -1438,11 +1421,12 @@ bool CheckProveCoinbaseTx(const MCTransaction& tx, MCValidationState& state, Bra
         return state.DoS(0, false, REJECT_INVALID, "prove coinbase tx no branchid data");
     }
 
-    BranchData branchData = pBranchCache->GetBranchData(branchId);
-    if (branchData.mapHeads.count(tx.pProveData->blockHash) == 0){
+    const BranchData& branchData = pBranchCache->GetBranchData(branchId);
+    const BranchBlockData* pBranchBlockData = branchData.GetBranchBlockData(tx.pProveData->blockHash);
+    if (pBranchBlockData == nullptr){
         return state.DoS(0, false, REJECT_INVALID, "prove coinbase tx no block data");
     }
-    BranchBlockData& branchblockdata = branchData.mapHeads[tx.pProveData->blockHash];
+    const BranchBlockData& branchblockdata = *pBranchBlockData;
 
     std::vector<MCTransactionRef> vtx;
     MCDataStream cds(tx.pProveData->vtxData, SER_NETWORK, INIT_PROTO_VERSION);
@@ -1472,17 +1456,23 @@ bool CheckProveCoinbaseTx(const MCTransaction& tx, MCValidationState& state, Bra
     }
 
     // check tx and collect input/output, calc fees
+    // 各输入的证明和脚本检查交给检查线程，与后续交易的解析并行
     MCAmount totalFee = 0;
+    MCCheckQueueControl<ProveInputCheck> control(nScriptCheckThreads ? &proveCheckQueue : nullptr);
     for (int i = 2; i < vtx.size(); i++){
         const MCTransactionRef& toProveTx = vtx[i];
         const std::vector<ProveDataItem>& vectProveData = tx.pProveData->vecBlockTxProve[i - 2];
 
         MCAmount fee;
-        if (!CheckTransactionProveWithProveData(toProveTx, state, vectProveData, branchData, fee, false)) {
+        std::vector<ProveInputCheck> vChecks;
+        if (!CheckTransactionProveWithProveData(toProveTx, state, vectProveData, branchData, fee, false, nScriptCheckThreads ? &vChecks : nullptr)) {
             return false;
         }
+        control.Add(vChecks);
         totalFee += fee;
     }
+    if (!control.Wait())
+        return state.DoS(0, false, REJECT_INVALID, "Prove coinbase transaction input prove check fail");
 
     //目前设计支链是不产生块奖励，只有收取手续费
     if (vtx[0]->GetValueOut() != totalFee){
@@ -1500,10 +1490,10 @@ bool CheckProveContractData(const MCTransaction& tx, MCValidationState& state, B
     const uint256& branchId = tx.pReportData->reportedBranchId;
     if (!pBranchCache->HasBranchData(branchId))
         return state.DoS(0, false, REJECT_INVALID, "prove coinbase tx no branchid data");
-    BranchData branchData = pBranchCache->GetBranchData(branchId);
+    const BranchData& branchData = pBranchCache->GetBranchData(branchId);
 
     // 先验证被举报交易及对应合约数据属于指定区块
-    BranchBlockData* pReportedBlockData = branchData.GetBranchBlockData(tx.pReportData->reportedBlockHash);
+    const BranchBlockData* pReportedBlockData = branchData.GetBranchBlockData(tx.pReportData->reportedBlockHash);
     if (pReportedBlockData == nullptr)
         return state.DoS(0, false, REJECT_INVALID, "Get branch reported block data fail");
 
@@ -1513,7 +1503,7 @@ bool CheckProveContractData(const MCTransaction& tx, MCValidationState& state, B
         return false;
 
     // 再验证替换的交易数据是否属于指定区块
-    BranchBlockData* pProveBlockData = branchData.GetBranchBlockData(tx.pReportData->contractData->proveSpvProof.blockhash);
+    const BranchBlockData* pProveBlockData = branchData.GetBranchBlockData(tx.pReportData->contractData->proveSpvProof.blockhash);
     if (pProveBlockData == nullptr)
         return state.DoS(0, false, REJECT_INVALID, "prove coinbase tx no block data");
 
@@ -1532,7 +1522,10 @@ bool CheckProveContractData(const MCTransaction& tx, MCValidationState& state, B
     for (auto& item : tx.pReportData->contractData->proveContractData) {
         auto it = tx.pReportData->contractData->reportedContractPrevData.items.find(item.first);
         if (it != tx.pReportData->contractData->reportedContractPrevData.items.end()) {
-            BranchBlockData& targetBlockData = branchData.mapHeads[it->second.blockHash];
+            // 不存在时按默认数据处理，与原先mapHeads[]的结果相同
+            static const BranchBlockData emptyBlockData;
+            const BranchBlockData* pTargetBlockData = branchData.GetBranchBlockData(it->second.blockHash);
+            const BranchBlockData& targetBlockData = pTargetBlockData ? *pTargetBlockData : emptyBlockData;
             const BranchBlockData* subAncestorBlockData = branchData.GetAncestor(pReportedBlockData, targetBlockData.nHeight);
             if (subAncestorBlockData->mBlockHash != targetBlockData.mBlockHash)
                 return true;
@@ -1610,12 +1603,12 @@ bool CheckReportRewardTransaction(const MCTransaction& tx, MCValidationState& st
     if (!pBranchCache->HasBranchData(reportbranchid))
         return false;
 
-    BranchData branchdata = pBranchCache->GetBranchData(reportbranchid);
+    const BranchData& branchdata = pBranchCache->GetBranchData(reportbranchid);
     if (!branchdata.mapHeads.count(reportblockhash))// best chain check? 1. no, 作弊过，但是数据在分叉上，也可以举报。带来麻烦是，矿工需要监控自己挖出来的分叉有没有监控。  
         return false;
 
     // 从stake交易取出prevout(抵押币)
-    BranchBlockData blockdata = branchdata.mapHeads[reportblockhash];
+    BranchBlockData blockdata = branchdata.mapHeads.at(reportblockhash);
     //检查举报有没有被证明
     uint256 reportFlagHash = GetReportTxHashKey(*ptxReport);
     if (blockdata.mapReportStatus.count(reportFlagHash) == 0 || blockdata.mapReportStatus[reportFlagHash] == RP_FLAG_PROVED) {
@@ -9,6 +9,7 @@
 #include <map>
 #include <memory>
 
+#include "chain/branchrpcclient.h"
 #include "primitives/transaction.h"
 
 class MCBlockIndex;
@@ -68,6 +69,8 @@ UniValue CallRPC(const std::string& host, const int port, const std::string& str
 	const std::string& strRPCUserColonPass, const std::string& rpcwallet = "");
 
 UniValue CallRPC(MCRPCConfig& rpccfg, const std::string& strMethod, const UniValue& params);
+// 异步批量调用，连接或cookie失败也以错误回复交给回调
+void CallRPCBatchAsync(MCRPCConfig& rpccfg, const std::vector<BranchRPCRequest>& requests, const BranchRPCCallback& callback);
 
 void ProcessBlockBranchChain();
 
@@ -87,14 +90,66 @@ bool GetMortgageCoinData(const MCScript& scriptPubKey, uint256* pFromTxid = null
 bool GetRedeemSriptData(const MCScript& scriptPubKey, uint256* pFromTxid);
 
 bool BranchChainTransStep2(const MCTransactionRef& tx, const MCBlock &block, std::string* pStrErrorMsg);
+// 跨链请求的构造和回复检查，由跨链转账队列使用，RPC配置在发送时再查找
+bool MakeBranchTransStep2Request(const MCTransactionRef& tx, const MCBlock &block, BranchRPCRequest& request, std::string* pStrErrorMsg);
+bool CheckBranchTransStep2Reply(const UniValue& reply, const uint256& txid, std::string* pStrErrorMsg);
 
 bool SendBranchBlockHeader(const std::shared_ptr<const MCBlock> pBlockHeader, std::string *pStrErr=nullptr);
+// 在跨链RPC线程中提交，失败只记录日志
+void SendBranchBlockHeaderAsync(const std::shared_ptr<const MCBlock> pBlockHeader);
 bool CheckBranchBlockInfoTx(const MCTransaction& tx, MCValidationState& state, BranchCache* pBranchCache);
 bool CheckBranchDuplicateTx(const MCTransaction& tx, MCValidationState& state, BranchCache* pBranchCache);
 
 uint256 GetReportTxHashKey(const MCTransaction& tx);
 uint256 GetProveTxHashKey(const MCTransaction& tx);
 
+// 证明检查缓存的大小(MiB)
+static const unsigned int DEFAULT_PROVE_CHECK_CACHE_SIZE = 4;
+
+struct PrecomputedTransactionData;
+
+/**
+ * Check of one input of a transaction proved by ProveData: the spv proof of
+ * the previous transaction against the branch block's merkle root, then the
+ * input script. The checks of a prove transaction are run on the prove check
+ * queue, like the script checks of a block. Passed checks are kept in a
+ * salted cache, so a prove transaction checked when it entered the mempool,
+ * or by an earlier CheckBlock of the same block, is not verified again.
+ */
+class ProveInputCheck
+{
+private:
+    uint256 merkleRoot;
+    MCPartialMerkleTree pmt;
+    uint256 prevTxHash;
+    MCScript scriptPubKey;
+    MCAmount amount;
+    MCTransactionRef ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    // 合约转币不用签名，脚本失败时只要求地址与合约一致
+    std::string strContractError;
+    std::shared_ptr<PrecomputedTransactionData> txdata;
+    std::string strError;
+
+public:
+    ProveInputCheck() : amount(0), nIn(0), nFlags(0) {}
+    ProveInputCheck(const uint256& merkleRootIn, const MCPartialMerkleTree& pmtIn, const uint256& prevTxHashIn, const MCScript& scriptPubKeyIn, const MCAmount amountIn,
+        const MCTransactionRef& ptxToIn, unsigned int nInIn, unsigned int nFlagsIn, const std::string& strContractErrorIn, const std::shared_ptr<PrecomputedTransactionData>& txdataIn) :
+        merkleRoot(merkleRootIn), pmt(pmtIn), prevTxHash(prevTxHashIn), scriptPubKey(scriptPubKeyIn), amount(amountIn),
+        ptxTo(ptxToIn), nIn(nInIn), nFlags(nFlagsIn), strContractError(strContractErrorIn), txdata(txdataIn) {}
+
+    bool operator()();
+
+    void swap(ProveInputCheck& check);
+
+    const std::string& GetError() const { return strError; }
+};
+
+/** Initializes the cache of passed prove input checks */
+void InitProveCheckCache();
+void ThreadProveCheck();
+
 bool CheckReportCheatTx(const MCTransaction& tx, MCValidationState& state, BranchCache *pBranchCache);
 bool CheckProveTx(const MCTransaction& tx, MCValidationState& state, BranchCache *pBranchCache);
 bool CheckReportRewardTransaction(const MCTransaction& tx, MCValidationState& state, MCBlockIndex* pindex, BranchCache *pBranchCache);
@@ -103,4 +158,6 @@ bool CheckUnlockMortgageMineCoinTx(const MCTransaction& tx, MCValidationState& s
 bool CheckProveContractData(const MCTransaction& tx, MCValidationState& state, BranchCache *pBranchCache);
 
 bool ReqMainChainRedeemMortgage(const MCTransactionRef& tx, const MCBlock& block, std::string *pStrErr = nullptr);
+bool MakeRedeemMortgageRequest(const MCTransactionRef& tx, const MCBlock& block, BranchRPCRequest& request, std::string *pStrErr);
+bool CheckRedeemMortgageReply(const UniValue& reply, std::string *pStrErr);
 #endif //  BRANCHCHAIN_H
@@ -8,8 +8,11 @@
 #include "chainparams.h"
 #include "coding/hash.h"
 #include "init.h"
+#include "misc/core_memusage.h"
+#include "misc/memusage.h"
 #include "misc/pow.h"
 #include "misc/random.h"
+#include "transaction/txdb.h"
 #include "ui/ui_interface.h"
 #include "coding/uint256.h"
 #include "utils/util.h"
@@ -69,13 +72,16 @@ void BranchData::InitBranchGenesisBlockData(const uint256 &branchid)
     blockdata.nChainWork = GetBlockProof(genesisblock.nBits);
     //LogPrintf("bBlockData.deadstatus = %d InitBranchGenesisBlockData\n", blockdata.deadstatus);
     blockdata.deadstatus = BranchBlockData::eLive;
+    setDirtyHeads.insert(genesisblock.GetHash());
 
     vecChainActive.push_back(blockdata.header.GetHash());
+    UpdateChainNonce();
 }
 
 void BranchData::SnapshotBlockTip(const uint256& mainBlockHash)
 {
     mapSnapshotBlockTip[mainBlockHash] = vecChainActive.back();
+    setDirtySnapshots.insert(mainBlockHash);
 
     //prune snapshot data
     if (mapSnapshotBlockTip.size() > 200)
@@ -89,6 +95,7 @@ void BranchData::SnapshotBlockTip(const uint256& mainBlockHash)
                 oldest = mit;
             }
         }
+        setDirtySnapshots.insert(oldest->first);
         mapSnapshotBlockTip.erase(oldest);
     }
 }
@@ -112,7 +119,7 @@ void BranchData::RecoverTip(const uint256& mainBlockHash)
     }
 }
 
-uint256 BranchData::TipHash(void)
+uint256 BranchData::TipHash(void) const
 {
     if (vecChainActive.size() == 0)
     {
@@ -121,29 +128,36 @@ uint256 BranchData::TipHash(void)
     return vecChainActive.back();
 }
 
-int32_t BranchData::Height(void)
+int32_t BranchData::Height(void) const
 {
     return vecChainActive.size() - 1;
 }
 
-bool BranchData::IsBlockInBestChain(const uint256& blockhash)
+bool BranchData::IsBlockInBestChain(const uint256& blockhash) const
 {
-    if (!mapHeads.count(blockhash)){
+    auto mi = mapHeads.find(blockhash);
+    if (mi == mapHeads.end()){
         return false;
     }
-    uint32_t height = mapHeads[blockhash].nHeight;
+    uint32_t height = mi->second.nHeight;
     if (height >= vecChainActive.size()){
         return false;
     }
     return vecChainActive[height] == blockhash;
 }
 
-int BranchData::GetBlockMinedHeight(const uint256& blockhash)
+bool BranchData::IsDirty() const
+{
+    return !setDirtyHeads.empty() || !setDirtySnapshots.empty()
+        || nChainDirtyFrom < vecChainActive.size() || nChainStored != vecChainActive.size();
+}
+
+int BranchData::GetBlockMinedHeight(const uint256& blockhash) const
 {
     if (!IsBlockInBestChain(blockhash)){
         return 0;
     }
-    uint32_t height = mapHeads[blockhash].nHeight;
+    uint32_t height = mapHeads.find(blockhash)->second.nHeight;
     return Height() - height;
 }
 
@@ -155,6 +169,14 @@ BranchBlockData* BranchData::GetBranchBlockData(const uint256& blockHash)
     return &(it->second);
 }
 
+const BranchBlockData* BranchData::GetBranchBlockData(const uint256& blockHash) const
+{
+    auto it = mapHeads.find(blockHash);
+    if (it == mapHeads.end())
+        return nullptr;
+    return &(it->second);
+}
+
 void BranchData::AddNewBlockData(BranchBlockData& blockdata)
 {
     const uint256 newTipHash = blockdata.header.GetHash();
@@ -163,6 +185,7 @@ void BranchData::AddNewBlockData(BranchBlockData& blockdata)
     //update parent's son hashs
     if (mapHeads.count(hashPrevBlock)) {
         mapHeads[hashPrevBlock].vecSonHashs.push_back(newTipHash);
+        setDirtyHeads.insert(hashPrevBlock);
 
         //继承hashPrevBlock的死亡属性
         if (mapHeads[hashPrevBlock].deadstatus)
@@ -171,10 +194,14 @@ void BranchData::AddNewBlockData(BranchBlockData& blockdata)
 
     //add new block head data
     mapHeads[newTipHash] = blockdata;
+    setDirtyHeads.insert(newTipHash);
     if (!blockdata.deadstatus)
     {
         if (vecChainActive.back() == blockdata.header.hashPrevBlock)
+        {
             vecChainActive.push_back(newTipHash);
+            UpdateChainNonce();
+        }
         else
         {
             const BranchBlockData& tipBlock = mapHeads[vecChainActive.back()];
@@ -210,19 +237,66 @@ void BranchData::ActivateBestChain(const uint256 &bestTipHash)
         vecChainActive.pop_back();
     }
     vecChainActive.insert(vecChainActive.end(), forkChain.rbegin(), forkChain.rend());
+    UpdateChainNonce();
 }
 
 void BranchData::RemoveBlock(const uint256& blockhash)
 {
     mapHeads.erase(blockhash);
+    setDirtyHeads.insert(blockhash);
 
     if (vecChainActive.back() == blockhash)
     {
         vecChainActive.pop_back();
+        UpdateChainNonce();
     }
 }
 
-const BranchBlockData* BranchData::GetAncestor(BranchBlockData* pBlock, int height)
+void BranchData::UpdateChainNonce()
+{
+    // 某高度的hash相同则其下的区块也都相同，只需去掉末尾失效的部分
+    size_t n = std::min(vecChainNonce.size(), vecChainActive.size());
+    while (n > 0 && vecChainNonce[n - 1].first != vecChainActive[n - 1])
+        --n;
+    vecChainNonce.resize(n);
+    // vecChainActive每次修改后都会调用这里，n以下的高度没有变化
+    nChainDirtyFrom = std::min(nChainDirtyFrom, n);
+
+    for (; n < vecChainActive.size(); ++n)
+    {
+        auto it = mapHeads.find(vecChainActive[n]);
+        if (it == mapHeads.end())
+            break;
+        uint64_t sum = (n > 0 ? vecChainNonce[n - 1].second : 0) + it->second.header.nNonce;
+        vecChainNonce.emplace_back(vecChainActive[n], sum);
+    }
+}
+
+size_t BranchData::DynamicMemoryUsage() const
+{
+    size_t usage = memusage::DynamicUsage(mapHeads) + memusage::DynamicUsage(vecChainActive) + memusage::DynamicUsage(mapSnapshotBlockTip) +
+        memusage::DynamicUsage(vecChainNonce) + memusage::DynamicUsage(setDirtyHeads) + memusage::DynamicUsage(setDirtySnapshots);
+    for (const auto& mi : mapHeads) {
+        const BranchBlockData& data = mi.second;
+        usage += RecursiveDynamicUsage(data.header.vchBlockSig) + memusage::DynamicUsage(data.vecSonHashs) + memusage::DynamicUsage(data.mapReportStatus);
+        if (data.pStakeTx)
+            usage += memusage::DynamicUsage(data.pStakeTx) + RecursiveDynamicUsage(*data.pStakeTx);
+    }
+    return usage;
+}
+
+bool BranchData::GetChainNonceSum(const uint256& blockhash, int height, int count, uint64_t& sum) const
+{
+    if (height < 0 || count <= 0 || count > height + 1 || height >= (int)vecChainNonce.size())
+        return false;
+    if (vecChainNonce[height].first != blockhash)
+        return false;
+    const int low = height - count;
+    sum = vecChainNonce[height].second - (low >= 0 ? vecChainNonce[low].second : 0);
+    return true;
+}
+
+const BranchBlockData* BranchData::GetAncestor(const BranchBlockData* pBlock, int height) const
 {
     if (pBlock == nullptr)
         return nullptr;
@@ -231,7 +305,7 @@ const BranchBlockData* BranchData::GetAncestor(BranchBlockData* pBlock, int heig
     if (delta <= 0)
         return pBlock;
 
-    BranchBlockData* cur = pBlock;
+    const BranchBlockData* cur = pBlock;
     for (int i = 0; i < delta; ++i) {
         auto it = mapHeads.find(cur->header.hashPrevBlock);
         if (it != mapHeads.end())
@@ -251,6 +325,7 @@ void BranchData::UpdateDeadStatus(const uint256& blockId, bool &fStatusChange){
         return;//alread dead
     }
     mapHeads[blockId].deadstatus = mapHeads[blockId].deadstatus | BranchBlockData::eDeadSelf;
+    setDirtyHeads.insert(blockId);
     fStatusChange = true;
     // dead transmit
     for (const uint256 sonhash : mapHeads[blockId].vecSonHashs){
@@ -261,6 +336,7 @@ void BranchData::UpdateDeadStatus(const uint256& blockId, bool &fStatusChange){
 void BranchData::DeadTransmit(const uint256& blockId)
 {
     mapHeads[blockId].deadstatus = mapHeads[blockId].deadstatus | BranchBlockData::eDeadInherit;
+    setDirtyHeads.insert(blockId);
     // 
     if (mapHeads[blockId].deadstatus & BranchBlockData::eDeadSelf){
         return;// 如何子block中有被举报死掉的块，它下面的应该不用递归了，没bug的话它的后代应该是dead的。
@@ -276,6 +352,7 @@ void BranchData::UpdateRebornStatus(const uint256& blockId, bool &fStatusChange)
     {
         //移除dead self的状态
         mapHeads[blockId].deadstatus = mapHeads[blockId].deadstatus & (~BranchBlockData::eDeadSelf);
+        setDirtyHeads.insert(blockId);
         fStatusChange = true;
     }
     if (!mapHeads[blockId].deadstatus){
@@ -289,6 +366,7 @@ void BranchData::RebornTransmit(const uint256& blockId)
 {
     //移除dead inherit状态
     mapHeads[blockId].deadstatus = mapHeads[blockId].deadstatus & (~BranchBlockData::eDeadInherit);
+    setDirtyHeads.insert(blockId);
     if (mapHeads[blockId].deadstatus) {
         return;
     }
@@ -337,9 +415,10 @@ uint32_t BrandchDataView::GetBranchHeight(const uint256& branchid)
 {
     return 0;
 }
-BranchData BrandchDataView::GetBranchData(const uint256& branchHash)
+const BranchData& BrandchDataView::GetBranchData(const uint256& branchHash)
 {
-    return BranchData();
+    static const BranchData emptyData;
+    return emptyData;
 }
 VBRANCH_CHAIN BrandchDataView::GetActiveChain(const uint256& branchHash)
 {
@@ -361,7 +440,7 @@ uint16_t BrandchDataView::GetTxReportState(const uint256& rpBranchId, const uint
 
 uint256 BranchDataProcesser::GetBranchTipHash(const uint256& branchid)
 {
-    if (!HasBranchData(branchid))
+    if (!FetchBranchData(branchid))
     {
         return uint256();
     }
@@ -371,7 +450,7 @@ uint256 BranchDataProcesser::GetBranchTipHash(const uint256& branchid)
 
 uint32_t BranchDataProcesser::GetBranchHeight(const uint256& branchid)
 {
-    if (!HasBranchData(branchid))
+    if (!FetchBranchData(branchid))
     {
         return 0;
     }
@@ -384,8 +463,14 @@ bool BranchDataProcesser::HasBranchData(const uint256& branchHash) const
     return mapBranchsData.count(branchHash) > 0;
 }
 
-BranchData BranchDataProcesser::GetBranchData(const uint256& branchHash)
+const BranchData& BranchDataProcesser::GetBranchData(const uint256& branchHash)
 {
+    // 不存在的branch只返回创世块数据，不放入mapBranchsData，避免留下无法换出的脏数据
+    if (!FetchBranchData(branchHash)) {
+        unknownBranchData = BranchData();
+        unknownBranchData.InitBranchGenesisBlockData(branchHash);
+        return unknownBranchData;
+    }
     BranchData& branchdata = mapBranchsData[branchHash];
     branchdata.InitBranchGenesisBlockData(branchHash);
     return branchdata;
@@ -393,7 +478,7 @@ BranchData BranchDataProcesser::GetBranchData(const uint256& branchHash)
 
 VBRANCH_CHAIN BranchDataProcesser::GetActiveChain(const uint256& branchHash)
 {
-    if (!HasBranchData(branchHash))
+    if (!FetchBranchData(branchHash))
     {
         VBRANCH_CHAIN vect;
         return vect;
@@ -403,7 +488,7 @@ VBRANCH_CHAIN BranchDataProcesser::GetActiveChain(const uint256& branchHash)
 
 bool BranchDataProcesser::IsBlockInActiveChain(const uint256& branchHash, const uint256& blockHash)
 {
-    if (!HasBranchData(branchHash))
+    if (!FetchBranchData(branchHash))
         return false;
 
     BranchData& branchdata = mapBranchsData[branchHash];
@@ -412,7 +497,7 @@ bool BranchDataProcesser::IsBlockInActiveChain(const uint256& branchHash, const
 
 int BranchDataProcesser::GetBranchBlockMinedHeight(const uint256& branchHash, const uint256& blockHash)
 {
-    if (!HasBranchData(branchHash))
+    if (!FetchBranchData(branchHash))
         return 0;
 
     BranchData& branchdata = mapBranchsData[branchHash];
@@ -420,7 +505,7 @@ int BranchDataProcesser::GetBranchBlockMinedHeight(const uint256& branchHash, co
 }
 uint16_t BranchDataProcesser::GetTxReportState(const uint256& rpBranchId, const uint256& rpBlockId, const uint256& flagHash)
 {
-    if (!HasBranchData(rpBranchId))
+    if (!FetchBranchData(rpBranchId))
         return RP_INVALID;
 
     BranchData& branchdata = mapBranchsData[rpBranchId];
@@ -526,6 +611,7 @@ void BranchDataProcesser::AddBlockInfoTxData(MCTransactionRef &transaction, cons
     //bBlockData.deadstatus = BranchBlockData::eLive;
 
     uint256 branchHash = transaction->pBranchBlockData->branchID;
+    FetchBranchData(branchHash);
     BranchData& bData = mapBranchsData[branchHash];
     bData.InitBranchGenesisBlockData(branchHash);
 
@@ -549,6 +635,7 @@ void BranchDataProcesser::DelBlockInfoTxData(MCTransactionRef &transaction, cons
 
     uint256 bBlockHash = bBlockData.header.GetHash();
     uint256 branchHash = transaction->pBranchBlockData->branchID;
+    FetchBranchData(branchHash);
     BranchData& bData = mapBranchsData[branchHash];
 
     bData.RemoveBlock(bBlockHash);
@@ -563,10 +650,11 @@ bool BranchDataProcesser::AddReportTxData(MCTransactionRef &tx, std::set<uint256
     //-----------
     const uint256& rpBranchId = tx->pReportData->reportedBranchId;
     const uint256& rpBlockId = tx->pReportData->reportedBlockHash;
-    if (mapBranchsData.count(rpBranchId)) {// ok, we must assert(mapBranchsData.count(rpBranchId));
+    if (FetchBranchData(rpBranchId)) {// ok, we must assert(mapBranchsData.count(rpBranchId));
         BranchData& branchdata = mapBranchsData[rpBranchId];
         if (branchdata.mapHeads.count(rpBlockId)) {
             branchdata.mapHeads[rpBlockId].mapReportStatus[reportFlagHash] = RP_FLAG_REPORTED;
+            branchdata.setDirtyHeads.insert(rpBlockId);
             //update dead status, dead transmit
             bool deadchanged = false;
             branchdata.UpdateDeadStatus(rpBlockId, deadchanged);
@@ -588,11 +676,12 @@ bool BranchDataProcesser::AddProveTxData(MCTransactionRef &tx, std::set<uint256>
     //-----------
     const uint256& rpBranchId = tx->pProveData->branchId;
     const uint256& rpBlockId = tx->pProveData->blockHash;
-    if (mapBranchsData.count(rpBranchId)) {// ok, we must assert(mapBranchsData.count(rpBranchId));
+    if (FetchBranchData(rpBranchId)) {// ok, we must assert(mapBranchsData.count(rpBranchId));
         BranchData& branchdata = mapBranchsData[rpBranchId];
         if (branchdata.mapHeads.count(rpBlockId)) {
             //assert branchdata.mapHeads[rpBlockId].mapReportStatus[proveFlagHash] == RP_FLAG_REPORTED
             branchdata.mapHeads[rpBlockId].mapReportStatus[proveFlagHash] = RP_FLAG_PROVED;
+            branchdata.setDirtyHeads.insert(rpBlockId);
             //update dead status, reborn transmit
             bool deadchanged = false;
             branchdata.UpdateRebornStatus(rpBlockId, deadchanged);
@@ -614,10 +703,11 @@ bool BranchDataProcesser::DelReportTxData(MCTransactionRef &tx, std::set<uint256
     //-----------
     const uint256& rpBranchId = tx->pReportData->reportedBranchId;
     const uint256& rpBlockId = tx->pReportData->reportedBlockHash;
-    if (mapBranchsData.count(rpBranchId)) {// ok, we must assert(mapBranchsData.count(rpBranchId));
+    if (FetchBranchData(rpBranchId)) {// ok, we must assert(mapBranchsData.count(rpBranchId));
         BranchData& branchdata = mapBranchsData[rpBranchId];
         if (branchdata.mapHeads.count(rpBlockId)) {
             branchdata.mapHeads[rpBlockId].mapReportStatus.erase(reportFlagHash);
+            branchdata.setDirtyHeads.insert(rpBlockId);
             //update dead status, 检查是否可以移除死亡状态
             bool deadchanged = false;
             branchdata.UpdateRebornStatus(rpBlockId, deadchanged);
@@ -642,10 +732,11 @@ bool BranchDataProcesser::DelProveTxData(MCTransactionRef &tx, std::set<uint256>
     //-----------
     const uint256& rpBranchId = tx->pProveData->branchId;
     const uint256& rpBlockId = tx->pProveData->blockHash;
-    if (mapBranchsData.count(rpBranchId)) {// ok, we must assert(mapBranchsData.count(rpBranchId));
+    if (FetchBranchData(rpBranchId)) {// ok, we must assert(mapBranchsData.count(rpBranchId));
         BranchData& branchdata = mapBranchsData[rpBranchId];
         if (branchdata.mapHeads.count(rpBlockId)) {
             branchdata.mapHeads[rpBlockId].mapReportStatus[proveFlagHash] = RP_FLAG_REPORTED;
+            branchdata.setDirtyHeads.insert(rpBlockId);
             //update dead status, 检查是否需要reborn to dead.
             bool deadchanged = false;
             branchdata.UpdateDeadStatus(rpBlockId, deadchanged);
@@ -664,6 +755,11 @@ bool BranchDataProcesser::DelProveTxData(MCTransactionRef &tx, std::set<uint256>
     return true;
 }
 
+bool BranchDataProcesser::FetchBranchData(const uint256& branchHash)
+{
+    return mapBranchsData.count(branchHash) > 0;
+}
+
 bool BranchDataProcesser::WriteModifyToDB(const std::set<uint256>& modifyBranch)
 {
     (void*)(&modifyBranch);
@@ -755,7 +851,7 @@ bool BranchCache::HasBranchData(const uint256& branchHash) const
         || (readonly_db && readonly_db->HasBranchData(branchHash));
 }
 
-BranchData BranchCache::GetBranchData(const uint256& branchHash)
+const BranchData& BranchCache::GetBranchData(const uint256& branchHash)
 {
     // try get local data
     if (mapBranchsData.count(branchHash))
@@ -869,6 +965,7 @@ void BranchCache::RemoveFromBlock(const std::vector<MCTransactionRef>& vtx)
         {
             // update activechain
             mapBranchsData[branchHash].vecChainActive = readonly_db->GetActiveChain(branchHash);
+            mapBranchsData[branchHash].UpdateChainNonce();
             // don't update mapHeads
         }
     }
@@ -891,10 +988,10 @@ std::vector<uint256> BranchCache::GetAncestorsBlocksHash(const MCTransaction& tx
     
     if (mapBranchsData.count(branchHash))
     {
-        std::shared_ptr<BranchData> pReadOnlyDbData = nullptr;
+        const BranchData* pReadOnlyDbData = nullptr;
         if (readonly_db && readonly_db->HasBranchData(branchHash))
         {
-            pReadOnlyDbData = std::make_shared<BranchData>(readonly_db->GetBranchData(branchHash));
+            pReadOnlyDbData = &readonly_db->GetBranchData(branchHash);
         }
 
         BranchData& branchdata = mapBranchsData[branchHash];
@@ -994,31 +1091,193 @@ bool BranchCache::DelProveTxData(MCTransactionRef &tx, std::set<uint256> &broken
     return ret;
 }
 
+// 分支数据按记录存储，旧版本每个branch一条记录，key为32字节的branch id
+static const char DB_BRANCH_VERSION = 'V';
+static const char DB_BRANCH_INFO = 'b';     // branch id -> 主链长度
+static const char DB_BRANCH_HEAD = 'h';     // (branch id, block hash) -> BranchBlockData
+static const char DB_BRANCH_ACTIVE = 'a';   // (branch id, height) -> block hash
+static const char DB_BRANCH_SNAPSHOT = 's'; // (branch id, main block hash) -> branch tip
+
+static const int BRANCHDB_VERSION = 1;
+static const unsigned int LEGACY_BRANCH_KEY_SIZE = 32;
+
 BranchDb::BranchDb(const fs::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
-    : db(path, nCacheSize, fMemory, fWipe, true)
+    : db(path, nCacheSize, fMemory, fWipe, true), nCacheUsage(0), nCacheLimit(DEFAULT_BRANCHDB_CACHE_SIZE)
 {
 }
 
-void BranchDb::LoadData()
+bool BranchDb::Upgrade()
 {
-    //LogPrintf("===== 1-branch db load data: %s \n", Params().GetBranchId()); 
-    if (!Params().IsMainChain()) {
-        //LogPrintf("===== 2-branch db load data: %s \n", Params().GetBranchId());  
-        return;
-    }
+    if (!Params().IsMainChain())
+        return true;
+
+    int nVersion = 0;
+    if (db.Read(DB_BRANCH_VERSION, nVersion) && nVersion >= BRANCHDB_VERSION)
+        return true;
+
+    int64_t count = 0;
+    LogPrintf("Upgrading branch chain database...\n");
+    size_t batch_size = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    MCDBBatch batch(db);
     std::unique_ptr<MCDBIterator> it(db.NewIterator());
     for (it->SeekToFirst(); it->Valid(); it->Next()) {
-        uint256 keyHash;
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        uint256 branchHash;
+        if (it->GetKeySize() != LEGACY_BRANCH_KEY_SIZE || !it->GetKey(branchHash))
+            continue;
+
+        BranchData data;
+        if (!it->GetValue(data))
+            return error("%s: cannot parse BranchData record %s", __func__, branchHash.ToString());
+        for (const auto& mi : data.mapHeads)
+            data.setDirtyHeads.insert(mi.first);
+        for (const auto& mi : data.mapSnapshotBlockTip)
+            data.setDirtySnapshots.insert(mi.first);
+        WriteBranchData(batch, branchHash, data);
+        batch.Erase(branchHash);
+        ++count;
+
+        if (batch.SizeEstimate() > batch_size) {
+            db.WriteBatch(batch);
+            batch.Clear();
+        }
+    }
+    if (!ShutdownRequested())
+        batch.Write(DB_BRANCH_VERSION, BRANCHDB_VERSION);
+    db.WriteBatch(batch, true);
+    LogPrintf("Upgraded %d branchs [%s].\n", count, ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
 
-        if (it->GetKey(keyHash))
-        {
-            BranchData data;
-            if (it->GetValue(data))
-            {
-                mapBranchsData[keyHash] = data;
-                //LogPrintf("===== 3-branch db load data: %s \n", branchHash.GetHex());
-            }
+bool BranchDb::HasBranchData(const uint256& branchHash) const
+{
+    return mapBranchsData.count(branchHash) > 0 || db.Exists(std::make_pair(DB_BRANCH_INFO, branchHash));
+}
+
+bool BranchDb::FetchBranchData(const uint256& branchHash)
+{
+    if (mapBranchsData.count(branchHash)) {
+        TouchBranch(branchHash);
+        return true;
+    }
+
+    BranchData data;
+    if (!ReadBranchData(branchHash, data))
+        return false;
+    mapBranchsData[branchHash] = std::move(data);
+    TouchBranch(branchHash);
+    UpdateBranchUsage(branchHash);
+    return true;
+}
+
+bool BranchDb::ReadBranchData(const uint256& branchHash, BranchData& data)
+{
+    uint32_t nLength = 0;
+    if (!db.Read(std::make_pair(DB_BRANCH_INFO, branchHash), nLength))
+        return false;
+
+    data.vecChainActive.resize(nLength);
+    for (uint32_t height = 0; height < nLength; ++height) {
+        if (!db.Read(std::make_pair(DB_BRANCH_ACTIVE, std::make_pair(branchHash, height)), data.vecChainActive[height]))
+            return error("%s: missing active chain height %d of branch %s", __func__, height, branchHash.ToString());
+    }
+
+    std::unique_ptr<MCDBIterator> it(db.NewIterator());
+    std::pair<char, std::pair<uint256, uint256>> key;
+    for (it->Seek(std::make_pair(DB_BRANCH_HEAD, std::make_pair(branchHash, uint256()))); it->Valid(); it->Next()) {
+        if (!it->GetKey(key) || key.first != DB_BRANCH_HEAD || key.second.first != branchHash)
+            break;
+        if (!it->GetValue(data.mapHeads[key.second.second]))
+            return error("%s: cannot parse BranchBlockData %s of branch %s", __func__, key.second.second.ToString(), branchHash.ToString());
+    }
+    for (it->Seek(std::make_pair(DB_BRANCH_SNAPSHOT, std::make_pair(branchHash, uint256()))); it->Valid(); it->Next()) {
+        if (!it->GetKey(key) || key.first != DB_BRANCH_SNAPSHOT || key.second.first != branchHash)
+            break;
+        if (!it->GetValue(data.mapSnapshotBlockTip[key.second.second]))
+            return error("%s: cannot parse snapshot %s of branch %s", __func__, key.second.second.ToString(), branchHash.ToString());
+    }
+
+    data.UpdateChainNonce();
+    data.nChainDirtyFrom = data.nChainStored = nLength;
+    return true;
+}
+
+void BranchDb::WriteBranchData(MCDBBatch& batch, const uint256& branchHash, BranchData& data)
+{
+    for (const uint256& blockHash : data.setDirtyHeads) {
+        auto mi = data.mapHeads.find(blockHash);
+        if (mi != data.mapHeads.end())
+            batch.Write(std::make_pair(DB_BRANCH_HEAD, std::make_pair(branchHash, blockHash)), mi->second);
+        else
+            batch.Erase(std::make_pair(DB_BRANCH_HEAD, std::make_pair(branchHash, blockHash)));
+    }
+
+    // 只写有变化的高度，链变短时删除多出的部分
+    const uint32_t nLength = data.vecChainActive.size();
+    for (uint32_t height = data.nChainDirtyFrom; height < nLength; ++height)
+        batch.Write(std::make_pair(DB_BRANCH_ACTIVE, std::make_pair(branchHash, height)), data.vecChainActive[height]);
+    for (uint32_t height = nLength; height < data.nChainStored; ++height)
+        batch.Erase(std::make_pair(DB_BRANCH_ACTIVE, std::make_pair(branchHash, height)));
+    batch.Write(std::make_pair(DB_BRANCH_INFO, branchHash), nLength);
+
+    for (const uint256& mainBlockHash : data.setDirtySnapshots) {
+        auto mi = data.mapSnapshotBlockTip.find(mainBlockHash);
+        if (mi != data.mapSnapshotBlockTip.end())
+            batch.Write(std::make_pair(DB_BRANCH_SNAPSHOT, std::make_pair(branchHash, mainBlockHash)), mi->second);
+        else
+            batch.Erase(std::make_pair(DB_BRANCH_SNAPSHOT, std::make_pair(branchHash, mainBlockHash)));
+    }
+
+    data.setDirtyHeads.clear();
+    data.setDirtySnapshots.clear();
+    data.nChainDirtyFrom = data.nChainStored = nLength;
+}
+
+void BranchDb::TouchBranch(const uint256& branchHash)
+{
+    auto mi = mapBranchLru.find(branchHash);
+    if (mi != mapBranchLru.end())
+        branchLru.erase(mi->second);
+    branchLru.push_front(branchHash);
+    mapBranchLru[branchHash] = branchLru.begin();
+}
+
+void BranchDb::UpdateBranchUsage(const uint256& branchHash)
+{
+    auto mi = mapBranchsData.find(branchHash);
+    size_t& usage = mapBranchUsage[branchHash];
+    nCacheUsage -= usage;
+    usage = mi != mapBranchsData.end() ? mi->second.DynamicMemoryUsage() : 0;
+    nCacheUsage += usage;
+}
+
+void BranchDb::SetCacheLimit(size_t nLimit)
+{
+    AssertLockHeld(cs_main);
+    nCacheLimit = nLimit;
+    TrimCache();
+}
+
+void BranchDb::TrimCache()
+{
+    // 未写盘的branch不能换出
+    auto it = branchLru.end();
+    while (nCacheUsage > nCacheLimit && it != branchLru.begin()) {
+        --it;
+        auto mi = mapBranchsData.find(*it);
+        if (mi != mapBranchsData.end() && mi->second.IsDirty())
+            continue;
+        if (mi != mapBranchsData.end())
+            mapBranchsData.erase(mi);
+        auto ui = mapBranchUsage.find(*it);
+        if (ui != mapBranchUsage.end()) {
+            nCacheUsage -= ui->second;
+            mapBranchUsage.erase(ui);
         }
+        mapBranchLru.erase(*it);
+        it = branchLru.erase(it);
     }
 }
 
@@ -1027,10 +1286,14 @@ bool BranchDb::WriteModifyToDB(const std::set<uint256>& modifyBranch)
     MCDBBatch batch(db);
     for (const uint256& branchHash : modifyBranch)
     {
-        BranchData& bData = mapBranchsData[branchHash];
-        batch.Write(branchHash, bData);
+        auto mi = mapBranchsData.find(branchHash);
+        if (mi == mapBranchsData.end())
+            continue;
+        WriteBranchData(batch, branchHash, mi->second);
+        TouchBranch(branchHash);
+        UpdateBranchUsage(branchHash);
     }
     bool retdb = db.WriteBatch(batch);
+    TrimCache();
     return retdb;
 }
-
@@ -8,7 +8,9 @@
 #include "chain.h"
 #include "io/dbwrapper.h"
 
+#include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -85,13 +87,29 @@ public:
     MAPBRANCH_HEADERS mapHeads;
     VBRANCH_CHAIN vecChainActive;
     MAP_MAINBLOCK_BRANCHTIP mapSnapshotBlockTip; // record connected main block, each branch tip
+    // memory only, 主链各高度的(区块hash, 累计nNonce)，hash与vecChainActive不同的项已失效
+    std::vector<std::pair<uint256, uint64_t>> vecChainNonce;
+    // memory only, 上次写盘后修改过的区块头和快照，vecChainActive从nChainDirtyFrom起有修改，盘上长度为nChainStored
+    std::set<uint256> setDirtyHeads;
+    std::set<uint256> setDirtySnapshots;
+    size_t nChainDirtyFrom;
+    size_t nChainStored;
+
+    BranchData() : nChainDirtyFrom(0), nChainStored(0) {}
 
     BranchBlockData* GetBranchBlockData(const uint256& blockHash);
+    const BranchBlockData* GetBranchBlockData(const uint256& blockHash) const;
     void AddNewBlockData(BranchBlockData& blockdata);
     void ActivateBestChain(const uint256 &bestTipHash);
     void RemoveBlock(const uint256& blockhash);
 
-    const BranchBlockData* GetAncestor(BranchBlockData* pBlock, int height);
+    const BranchBlockData* GetAncestor(const BranchBlockData* pBlock, int height) const;
+
+    void UpdateChainNonce();
+    // 内存用量估算
+    size_t DynamicMemoryUsage() const;
+    // 主链上高度为[height - count + 1, height]的区块nNonce之和，要求height处为blockhash
+    bool GetChainNonceSum(const uint256& blockhash, int height, int count, uint64_t& sum) const;
 
     //
     void UpdateDeadStatus(const uint256& blockId, bool &fStatusChange);
@@ -110,16 +128,19 @@ public:
         READWRITE(mapHeads);
         READWRITE(vecChainActive);
         READWRITE(mapSnapshotBlockTip);
+        if (ser_action.ForRead())
+            UpdateChainNonce();
     }
 
     void InitBranchGenesisBlockData(const uint256 &branchid);
     void SnapshotBlockTip(const uint256& mainBlockHash);
     void RecoverTip(const uint256& mainBlockHash);
 
-    uint256 TipHash(void);
-    int32_t Height(void);
-    bool IsBlockInBestChain(const uint256& blockhash);
-    int GetBlockMinedHeight(const uint256& blockhash);
+    uint256 TipHash(void) const;
+    int32_t Height(void) const;
+    bool IsBlockInBestChain(const uint256& blockhash) const;
+    int GetBlockMinedHeight(const uint256& blockhash) const;
+    bool IsDirty() const;
 
     enum {
         eADD,
@@ -142,7 +163,8 @@ public:
     virtual bool HasBranchData(const uint256& branchHash) const;
     virtual uint256 GetBranchTipHash(const uint256& branchid);
     virtual uint32_t GetBranchHeight(const uint256& branchid);
-    virtual BranchData GetBranchData(const uint256& branchHash);
+    // 返回引用不复制，在下次修改该branch或写盘前有效；对BranchDb调用者需持有cs_main，释放后不可再用
+    virtual const BranchData& GetBranchData(const uint256& branchHash);
     virtual VBRANCH_CHAIN GetActiveChain(const uint256& branchHash);
     virtual bool IsBlockInActiveChain(const uint256& branchHash, const uint256& blockHash);
     virtual int GetBranchBlockMinedHeight(const uint256& branchHash, const uint256& blockHash);
@@ -158,7 +180,7 @@ public:
     uint256 GetBranchTipHash(const uint256& branchid) override;
     uint32_t GetBranchHeight(const uint256& branchid) override;
     bool HasBranchData(const uint256& branchHash) const override;
-    BranchData GetBranchData(const uint256& branchHash) override;
+    const BranchData& GetBranchData(const uint256& branchHash) override;
     VBRANCH_CHAIN GetActiveChain(const uint256& branchHash) override;
     bool IsBlockInActiveChain(const uint256& branchHash, const uint256& blockHash) override;
     int GetBranchBlockMinedHeight(const uint256& branchHash, const uint256& blockHash) override;
@@ -178,9 +200,13 @@ protected:
     virtual bool DelReportTxData(MCTransactionRef &tx, std::set<uint256> &brokenChainBranch, std::set<uint256> &modifyBranch);
     virtual bool DelProveTxData(MCTransactionRef &tx, std::set<uint256> &brokenChainBranch, std::set<uint256> &modifyBranch);
 
+    // 确保branch数据在mapBranchsData中，不存在时返回false
+    virtual bool FetchBranchData(const uint256& branchHash);
     virtual bool WriteModifyToDB(const std::set<uint256>& modifyBranch);
 protected:
     MAPBRANCHS_DATA mapBranchsData;
+    // GetBranchData查询不存在的branch时返回，下次查询前有效
+    BranchData unknownBranchData;
 };
 
 // 1、内存池的记录 2、verifydb时的那种临时db
@@ -212,7 +238,7 @@ public:
     uint256 GetBranchTipHash(const uint256& branchid) override;
     uint32_t GetBranchHeight(const uint256& branchid) override;
     bool HasBranchData(const uint256& branchHash) const override;
-    BranchData GetBranchData(const uint256& branchHash) override;
+    const BranchData& GetBranchData(const uint256& branchHash) override;
     bool IsBlockInActiveChain(const uint256& branchHash, const uint256& blockHash) override;
     int GetBranchBlockMinedHeight(const uint256& branchHash, const uint256& blockHash) override;
 
@@ -232,11 +258,26 @@ private:
     void RemoveFromCache(const MCTransaction& tx, std::set<uint256> &modifyBranch);
 };
 
+// 内存中保留的branch数据大小上限(字节)，超出时换出最久未用且已写盘的branch
+static const size_t DEFAULT_BRANCHDB_CACHE_SIZE = 64 << 20;
+
 /*
  1、保证每个BranchData的mapHeads的BranchBlockData的preblock数据是存在的。
     也就是每个数据都有完整的到达创世块的链路径
  */
-// 持久化
+/**
+ * Persistent branch chain data.
+ *
+ * Every branch header, every height of the active chain and every tip
+ * snapshot is its own record, so connecting a main block only writes what
+ * that block changed. A branch is read from disk the first time it is used
+ * and dropped again, least recently used first, once the estimated memory
+ * of the loaded branches exceeds the cache limit, which the memory governor
+ * sets from -dbcache. Branches are dropped after a write and whenever the
+ * governor lowers the limit, both under cs_main, so a reference returned by
+ * GetBranchData is only valid while the caller keeps holding cs_main.
+ * Databases written with one record per branch are converted by Upgrade().
+ */
 class BranchDb : public BranchDataProcesser
 {
 public:
@@ -244,8 +285,15 @@ public:
     BranchDb(const BranchDb&) = delete;
     BranchDb(const fs::path& path, size_t nCacheSize, bool fMemory, bool fWipe);
     BranchDb& operator=(const BranchDb&) = delete;
-    
-    void LoadData();
+
+    bool Upgrade();
+    bool HasBranchData(const uint256& branchHash) const override;
+
+    MCDBWrapper* GetDb() { return &db; }
+    // 已加载branch数据的估算内存，调用者需持有cs_main
+    size_t DynamicMemoryUsage() const { return nCacheUsage; }
+    // 设置上限并换出超出部分，调用者需持有cs_main
+    void SetCacheLimit(size_t nLimit);
 // <override
     //uint256 GetBranchTipHash(const uint256& branchid) override;
     //uint32_t GetBranchHeight(const uint256& branchid) override;
@@ -267,9 +315,23 @@ protected:
     //bool DelReportTxData(MCTransactionRef &tx, std::set<uint256> &brokenChainBranch, std::set<uint256> &modifyBranch);
     //bool DelProveTxData(MCTransactionRef &tx, std::set<uint256> &brokenChainBranch, std::set<uint256> &modifyBranch);
 
+    bool FetchBranchData(const uint256& branchHash) override;
     bool WriteModifyToDB(const std::set<uint256>& modifyBranch) override;
 protected:
     MCDBWrapper db;
+private:
+    bool ReadBranchData(const uint256& branchHash, BranchData& data);
+    void WriteBranchData(MCDBBatch& batch, const uint256& branchHash, BranchData& data);
+    void TouchBranch(const uint256& branchHash);
+    void UpdateBranchUsage(const uint256& branchHash);
+    void TrimCache();
+
+    std::list<uint256> branchLru;
+    std::map<uint256, std::list<uint256>::iterator> mapBranchLru;
+    // 各branch的估算内存，在加载和写盘时更新
+    std::map<uint256, size_t> mapBranchUsage;
+    size_t nCacheUsage;
+    size_t nCacheLimit;
 };
 
 extern BranchDb* g_pBranchDb;
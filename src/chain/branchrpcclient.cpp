@@ -0,0 +1,528 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "chain/branchrpcclient.h"
+
+#include "chain/branchchain.h"
+#include "rpc/protocol.h"
+#include "support/events.h"
+#include "utils/util.h"
+#include "utils/utilstrencodings.h"
+#include "utils/utiltime.h"
+
+#include <event2/buffer.h>
+#include <event2/keyvalq_struct.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/** Reply structure for request_done to fill in */
+struct HTTPReply
+{
+    HTTPReply() : status(0), error(-1), done(false), base(nullptr) {}
+
+    int status;
+    int error;
+    bool done;
+    struct event_base* base;
+    std::string body;
+};
+
+static const char *http_errorstring2(int code)
+{
+    switch (code) {
+#if LIBEVENT_VERSION_NUMBER >= 0x02010300
+    case EVREQ_HTTP_TIMEOUT:
+        return "timeout reached";
+    case EVREQ_HTTP_EOF:
+        return "EOF reached";
+    case EVREQ_HTTP_INVALID_HEADER:
+        return "error while reading header, or invalid header";
+    case EVREQ_HTTP_BUFFER_ERROR:
+        return "error encountered while reading or writing";
+    case EVREQ_HTTP_REQUEST_CANCEL:
+        return "request was canceled";
+    case EVREQ_HTTP_DATA_TOO_LONG:
+        return "response body is larger than allowed";
+#endif
+    default:
+        return "unknown";
+    }
+}
+
+static void http_request_done(struct evhttp_request *req, void *ctx)
+{
+    HTTPReply *reply = static_cast<HTTPReply*>(ctx);
+
+    // 连接保持打开，dispatch 不会自己返回
+    reply->done = true;
+    event_base_loopbreak(reply->base);
+
+    if (req == nullptr) {
+        /* If req is nullptr, it means an error occurred while connecting: the
+        * error code will have been passed to http_error_cb.
+        */
+        reply->status = 0;
+        return;
+    }
+
+    reply->status = evhttp_request_get_response_code(req);
+
+    struct evbuffer *buf = evhttp_request_get_input_buffer(req);
+    if (buf)
+    {
+        size_t size = evbuffer_get_length(buf);
+        const char *data = (const char*)evbuffer_pullup(buf, size);
+        if (data)
+            reply->body = std::string(data, size);
+        evbuffer_drain(buf, size);
+    }
+}
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010300
+static void http_error_cb(enum evhttp_request_error err, void *ctx)
+{
+    HTTPReply *reply = static_cast<HTTPReply*>(ctx);
+    reply->error = err;
+}
+#endif
+
+// 一个保持打开的连接，每个连接有自己的 event_base，base 最后释放
+struct BranchRPCConnection
+{
+    BranchRPCConnection() : nLastUsed(0) {}
+
+    raii_event_base base;
+    raii_evhttp_connection evcon;
+    int64_t nLastUsed;
+};
+
+struct BranchRPCTask
+{
+    std::string strUserColonPass;
+    std::vector<BranchRPCRequest> requests;
+    BranchRPCCallback callback;
+};
+
+/** Connection pool, async queue and statistics of one target. */
+class BranchRPCEndpoint
+{
+public:
+    BranchRPCEndpoint(const std::string& host, int port, const std::string& wallet);
+
+    const std::string strHost;
+    const int iPort;
+    const std::string strWallet;
+
+    std::mutex cs;
+    std::condition_variable cond;
+    std::string strBranchId;
+    std::vector<std::unique_ptr<BranchRPCConnection>> vIdle;
+    int nConnections;
+
+    uint64_t nCalls;
+    uint64_t nRequests;
+    uint64_t nFailures;
+    uint64_t nRetries;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    int64_t nLastMicros;
+
+    // 异步请求队列，由 csAsync 保护
+    std::deque<BranchRPCTask> vQueue;
+    bool fScheduled;
+
+    // 发送一次 HTTP 请求，返回解析后的回复
+    UniValue Post(const std::string& strUserColonPass, const std::string& strRequest, size_t nRequestCount);
+
+private:
+    std::unique_ptr<BranchRPCConnection> Acquire();
+    void Release(std::unique_ptr<BranchRPCConnection> conn, bool fKeep);
+    void Send(BranchRPCConnection& conn, const std::string& strPath, const std::string& strUserColonPass, const std::string& strRequest, HTTPReply& response);
+};
+
+BranchRPCEndpoint::BranchRPCEndpoint(const std::string& host, int port, const std::string& wallet) :
+    strHost(host), iPort(port), strWallet(wallet), nConnections(0), nCalls(0), nRequests(0), nFailures(0), nRetries(0),
+    nTotalMicros(0), nMaxMicros(0), nLastMicros(0), fScheduled(false)
+{
+}
+
+std::unique_ptr<BranchRPCConnection> BranchRPCEndpoint::Acquire()
+{
+    {
+        std::unique_lock<std::mutex> lock(cs);
+        while (true) {
+            int64_t nNow = GetTime();
+            while (!vIdle.empty()) {
+                std::unique_ptr<BranchRPCConnection> conn = std::move(vIdle.back());
+                vIdle.pop_back();
+                if (nNow - conn->nLastUsed < BRANCH_RPC_IDLE_TIMEOUT)
+                    return conn;
+                --nConnections;// 空闲太久，对方可能已经关闭
+            }
+            if (nConnections < BRANCH_RPC_MAX_CONNECTIONS)
+                break;
+            cond.wait(lock);
+        }
+        ++nConnections;
+    }
+
+    try {
+        std::unique_ptr<BranchRPCConnection> conn(new BranchRPCConnection());
+        conn->base = obtain_event_base();
+        conn->evcon = obtain_evhttp_connection_base(conn->base.get(), strHost, iPort);
+        evhttp_connection_set_timeout(conn->evcon.get(), BRANCH_RPC_TIMEOUT);
+        return conn;
+    }
+    catch (...) {
+        Release(nullptr, false);
+        throw;
+    }
+}
+
+void BranchRPCEndpoint::Release(std::unique_ptr<BranchRPCConnection> conn, bool fKeep)
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        if (conn && fKeep) {
+            conn->nLastUsed = GetTime();
+            vIdle.push_back(std::move(conn));
+        }
+        else
+            --nConnections;
+    }
+    cond.notify_one();
+}
+
+void BranchRPCEndpoint::Send(BranchRPCConnection& conn, const std::string& strPath, const std::string& strUserColonPass, const std::string& strRequest, HTTPReply& response)
+{
+    // 先处理空闲期间积压的事件，对方关闭的连接会在发送时重新连接
+    event_base_loop(conn.base.get(), EVLOOP_NONBLOCK);
+
+    response.base = conn.base.get();
+    raii_evhttp_request req = obtain_evhttp_request(http_request_done, (void*)&response);
+    if (req == nullptr)
+        throw std::runtime_error("create http request failed");
+#if LIBEVENT_VERSION_NUMBER >= 0x02010300
+    evhttp_request_set_error_cb(req.get(), http_error_cb);
+#endif
+
+    struct evkeyvalq* output_headers = evhttp_request_get_output_headers(req.get());
+    assert(output_headers);
+    evhttp_add_header(output_headers, "Host", strHost.c_str());
+    evhttp_add_header(output_headers, "Authorization", (std::string("Basic ") + EncodeBase64(strUserColonPass)).c_str());
+
+    struct evbuffer* output_buffer = evhttp_request_get_output_buffer(req.get());
+    assert(output_buffer);
+    evbuffer_add(output_buffer, strRequest.data(), strRequest.size());
+
+    int r = evhttp_make_request(conn.evcon.get(), req.get(), EVHTTP_REQ_POST, strPath.c_str());
+    req.release(); // ownership moved to evcon in above call
+    if (r != 0)
+        return;
+
+    event_base_dispatch(conn.base.get());
+}
+
+UniValue BranchRPCEndpoint::Post(const std::string& strUserColonPass, const std::string& strRequest, size_t nRequestCount)
+{
+    // check if we should use a special wallet endpoint
+    std::string strPath = "/";
+    if (!strWallet.empty()) {
+        char *encodedURI = evhttp_uriencode(strWallet.c_str(), strWallet.size(), false);
+        if (encodedURI) {
+            strPath = "/wallet/" + std::string(encodedURI);
+            free(encodedURI);
+        }
+        else {
+            throw BranchRPCConnectionFailed("uri-encode failed");
+        }
+    }
+
+    const int64_t nStart = GetTimeMicros();
+    HTTPReply response;
+    for (int nTry = 0; ; ++nTry) {
+        std::unique_ptr<BranchRPCConnection> conn = Acquire();
+        const int64_t nTryStart = GetTime();
+        response = HTTPReply();
+        try {
+            Send(*conn, strPath, strUserColonPass, strRequest, response);
+        }
+        catch (...) {
+            Release(std::move(conn), false);
+            throw;
+        }
+        // 没有收到 HTTP 回复的连接不再使用
+        bool fKeep = response.done && response.status != 0;
+        Release(std::move(conn), fKeep);
+        if (fKeep || nTry >= BRANCH_RPC_RETRIES || GetTime() - nTryStart >= BRANCH_RPC_RETRY_WINDOW)
+            break;
+
+        LogPrint(BCLog::BRANCH, "%s: retry request to %s:%d, %s (code %d)\n", __func__, strHost, iPort, http_errorstring2(response.error), response.error);
+        std::lock_guard<std::mutex> lock(cs);
+        ++nRetries;
+    }
+    const int64_t nElapsed = GetTimeMicros() - nStart;
+
+    std::string strError;
+    if (response.status == 0)
+        strError = strprintf("couldn't connect to server: %s (code %d)\n(make sure server is running and you are connecting to the correct RPC port)", http_errorstring2(response.error), response.error);
+    else if (response.status == HTTP_UNAUTHORIZED)
+        strError = "incorrect rpcuser or rpcpassword (authorization failed)";
+    else if (response.status >= 400 && response.status != HTTP_BAD_REQUEST && response.status != HTTP_NOT_FOUND && response.status != HTTP_INTERNAL_SERVER_ERROR)
+        strError = strprintf("server returned HTTP error %d", response.status);
+    else if (response.body.empty())
+        strError = "no response from server";
+
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        ++nCalls;
+        nRequests += nRequestCount;
+        nTotalMicros += nElapsed;
+        nMaxMicros = std::max(nMaxMicros, nElapsed);
+        nLastMicros = nElapsed;
+        if (!strError.empty())
+            ++nFailures;
+    }
+
+    if (response.status == 0)
+        throw BranchRPCConnectionFailed(strError);
+    if (!strError.empty())
+        throw std::runtime_error(strError);
+
+    // Parse reply
+    UniValue valReply(UniValue::VSTR);
+    if (!valReply.read(response.body))
+        throw std::runtime_error("couldn't parse reply from server");
+    return valReply;
+}
+
+static std::mutex csEndpoints;
+static std::map<std::string, std::shared_ptr<BranchRPCEndpoint>> mapEndpoints;
+
+static std::mutex csAsync;
+static std::condition_variable condAsync;
+static std::deque<std::shared_ptr<BranchRPCEndpoint>> vReadyEndpoints;
+static std::vector<std::thread> vAsyncThreads;
+static bool fAsyncStop = false;
+
+static std::shared_ptr<BranchRPCEndpoint> GetEndpoint(const MCRPCConfig& rpccfg)
+{
+    std::shared_ptr<BranchRPCEndpoint> endpoint;
+    {
+        std::lock_guard<std::mutex> lock(csEndpoints);
+        std::shared_ptr<BranchRPCEndpoint>& entry = mapEndpoints[strprintf("%s:%d/%s", rpccfg.strIp, rpccfg.iPort, rpccfg.strWallet)];
+        if (!entry)
+            entry = std::make_shared<BranchRPCEndpoint>(rpccfg.strIp, rpccfg.iPort, rpccfg.strWallet);
+        endpoint = entry;
+    }
+    if (!rpccfg.strBranchId.empty()) {
+        std::lock_guard<std::mutex> lock(endpoint->cs);
+        endpoint->strBranchId = rpccfg.strBranchId;
+    }
+    return endpoint;
+}
+
+static std::vector<UniValue> CallBatch(BranchRPCEndpoint& endpoint, const std::string& strUserColonPass, const std::vector<BranchRPCRequest>& requests)
+{
+    std::vector<UniValue> replies(requests.size());
+    if (requests.empty())
+        return replies;
+
+    UniValue batch(UniValue::VARR);
+    for (size_t i = 0; i < requests.size(); ++i)
+        batch.push_back(JSONRPCRequestObj(requests[i].strMethod, requests[i].params, (int)i));
+    UniValue valReply = endpoint.Post(strUserColonPass, batch.write() + "\n", requests.size());
+
+    // 按 id 对应回请求，整批被拒绝时服务端只回一个错误对象
+    if (valReply.isArray()) {
+        for (size_t i = 0; i < valReply.size(); ++i) {
+            const UniValue& id = find_value(valReply[i], "id");
+            if (id.isNum() && id.get_int() >= 0 && id.get_int() < (int)replies.size())
+                replies[id.get_int()] = valReply[i];
+        }
+    }
+    else if (valReply.isObject()) {
+        for (size_t i = 0; i < replies.size(); ++i)
+            replies[i] = valReply;
+    }
+    for (size_t i = 0; i < replies.size(); ++i) {
+        if (replies[i].isNull())
+            replies[i] = JSONRPCReplyObj(NullUniValue, "no reply for request in batch", (int)i);
+    }
+    return replies;
+}
+
+static void RunTask(BranchRPCEndpoint& endpoint, const BranchRPCTask& task)
+{
+    std::vector<UniValue> replies;
+    try {
+        replies = CallBatch(endpoint, task.strUserColonPass, task.requests);
+    }
+    catch (const std::exception& e) {
+        error("%s: branch rpc to %s:%d fail, %s", __func__, endpoint.strHost, endpoint.iPort, e.what());
+        replies.clear();
+        for (size_t i = 0; i < task.requests.size(); ++i)
+            replies.push_back(JSONRPCReplyObj(NullUniValue, e.what(), (int)i));
+    }
+
+    if (task.callback) {
+        try {
+            task.callback(replies);
+        }
+        catch (const std::exception& e) {
+            error("%s: branch rpc callback exception, %s", __func__, e.what());
+        }
+    }
+}
+
+UniValue BranchRPCCall(const MCRPCConfig& rpccfg, const std::string& strMethod, const UniValue& params)
+{
+    std::shared_ptr<BranchRPCEndpoint> endpoint = GetEndpoint(rpccfg);
+    std::string strRequest = JSONRPCRequestObj(strMethod, params, 1).write() + "\n";
+    UniValue valReply = endpoint->Post(rpccfg.strRPCUserColonPass, strRequest, 1);
+
+    const UniValue& reply = valReply.get_obj();
+    if (reply.empty())
+        throw std::runtime_error("expected reply to have result, error and id properties");
+    return reply;
+}
+
+std::vector<UniValue> BranchRPCCallBatch(const MCRPCConfig& rpccfg, const std::vector<BranchRPCRequest>& requests)
+{
+    std::shared_ptr<BranchRPCEndpoint> endpoint = GetEndpoint(rpccfg);
+    return CallBatch(*endpoint, rpccfg.strRPCUserColonPass, requests);
+}
+
+void BranchRPCCallBatchAsync(const MCRPCConfig& rpccfg, const std::vector<BranchRPCRequest>& requests, const BranchRPCCallback& callback)
+{
+    std::shared_ptr<BranchRPCEndpoint> endpoint = GetEndpoint(rpccfg);
+    BranchRPCTask task;
+    task.strUserColonPass = rpccfg.strRPCUserColonPass;
+    task.requests = requests;
+    task.callback = callback;
+
+    {
+        std::lock_guard<std::mutex> lock(csAsync);
+        if (!vAsyncThreads.empty() && !fAsyncStop) {
+            endpoint->vQueue.push_back(std::move(task));
+            if (!endpoint->fScheduled) {
+                endpoint->fScheduled = true;
+                vReadyEndpoints.push_back(endpoint);
+                condAsync.notify_one();
+            }
+            return;
+        }
+    }
+    // 没有启动线程时同步执行
+    RunTask(*endpoint, task);
+}
+
+// 每次取一个目标的队首请求执行，同一目标同时只有一个线程在处理
+static void BranchRPCThread()
+{
+    std::unique_lock<std::mutex> lock(csAsync);
+    while (true) {
+        condAsync.wait(lock, [] { return fAsyncStop || !vReadyEndpoints.empty(); });
+        if (fAsyncStop)
+            break;
+
+        std::shared_ptr<BranchRPCEndpoint> endpoint = vReadyEndpoints.front();
+        vReadyEndpoints.pop_front();
+        BranchRPCTask task = std::move(endpoint->vQueue.front());
+        endpoint->vQueue.pop_front();
+
+        lock.unlock();
+        RunTask(*endpoint, task);
+        lock.lock();
+
+        if (endpoint->vQueue.empty())
+            endpoint->fScheduled = false;
+        else {
+            vReadyEndpoints.push_back(endpoint);
+            condAsync.notify_one();
+        }
+    }
+}
+
+UniValue GetBranchRPCInfo()
+{
+    std::vector<std::shared_ptr<BranchRPCEndpoint>> endpoints;
+    {
+        std::lock_guard<std::mutex> lock(csEndpoints);
+        for (const auto& entry : mapEndpoints)
+            endpoints.push_back(entry.second);
+    }
+
+    UniValue ret(UniValue::VARR);
+    for (const std::shared_ptr<BranchRPCEndpoint>& endpoint : endpoints) {
+        size_t nQueued = 0;
+        {
+            std::lock_guard<std::mutex> lock(csAsync);
+            nQueued = endpoint->vQueue.size();
+        }
+
+        std::lock_guard<std::mutex> lock(endpoint->cs);
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("branchid", endpoint->strBranchId));
+        obj.push_back(Pair("host", endpoint->strHost));
+        obj.push_back(Pair("port", endpoint->iPort));
+        obj.push_back(Pair("wallet", endpoint->strWallet));
+        obj.push_back(Pair("connections", endpoint->nConnections));
+        obj.push_back(Pair("idle", (int)endpoint->vIdle.size()));
+        obj.push_back(Pair("queued", (int)nQueued));
+        obj.push_back(Pair("calls", (uint64_t)endpoint->nCalls));
+        obj.push_back(Pair("requests", (uint64_t)endpoint->nRequests));
+        obj.push_back(Pair("failures", (uint64_t)endpoint->nFailures));
+        obj.push_back(Pair("retries", (uint64_t)endpoint->nRetries));
+        obj.push_back(Pair("avglatency", endpoint->nCalls ? endpoint->nTotalMicros * 0.001 / endpoint->nCalls : 0.0));
+        obj.push_back(Pair("maxlatency", endpoint->nMaxMicros * 0.001));
+        obj.push_back(Pair("lastlatency", endpoint->nLastMicros * 0.001));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
+// To be called once in AppInitMain to start the async threads.
+void StartBranchRPCClient()
+{
+    int threads = std::min(std::max(0, (int)gArgs.GetArg("-branchrpcthreads", DEFAULT_BRANCH_RPC_THREADS)), MAX_BRANCH_RPC_THREADS);
+    std::lock_guard<std::mutex> lock(csAsync);
+    fAsyncStop = false;
+    for (int i = 0; i < threads; ++i)
+        vAsyncThreads.emplace_back(&TraceThread<std::function<void()> >, "branchrpc", std::function<void()>(BranchRPCThread));
+    LogPrintf("Using %d threads for branch chain rpc calls\n", threads);
+}
+
+void StopBranchRPCClient()
+{
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(csAsync);
+        fAsyncStop = true;
+        threads.swap(vAsyncThreads);
+    }
+    condAsync.notify_all();
+    for (std::thread& thread : threads)
+        thread.join();
+
+    // 未发送的异步请求直接丢弃
+    size_t nDropped = 0;
+    std::lock_guard<std::mutex> lock(csEndpoints);
+    {
+        std::lock_guard<std::mutex> lockAsync(csAsync);
+        for (const auto& entry : mapEndpoints) {
+            nDropped += entry.second->vQueue.size();
+            entry.second->vQueue.clear();
+            entry.second->fScheduled = false;
+        }
+        vReadyEndpoints.clear();
+    }
+    mapEndpoints.clear();
+    if (nDropped > 0)
+        LogPrintf("%s: dropped %u queued branch chain rpc calls\n", __func__, nDropped);
+}
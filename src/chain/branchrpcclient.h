@@ -0,0 +1,79 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef MAGNACHAIN_BRANCHRPCCLIENT_H
+#define MAGNACHAIN_BRANCHRPCCLIENT_H
+
+#include <univalue.h>
+
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class MCRPCConfig;
+
+// 跨链异步调用的线程数，0表示在调用线程中同步执行
+static const int DEFAULT_BRANCH_RPC_THREADS = 4;
+static const int MAX_BRANCH_RPC_THREADS = 16;
+// 每个目标链保持的最大连接数
+static const int BRANCH_RPC_MAX_CONNECTIONS = 4;
+// 连接失败时的重试次数
+static const int BRANCH_RPC_RETRIES = 2;
+static const int BRANCH_RPC_TIMEOUT = 900;
+// 只重试在这段时间(秒)内就失败的请求，如对方已关闭的空闲连接或拒绝连接，超时的请求不再重试
+static const int BRANCH_RPC_RETRY_WINDOW = 10;
+// 空闲连接的最长保留时间(秒)，要小于对方的 -rpcservertimeout
+static const int BRANCH_RPC_IDLE_TIMEOUT = 20;
+
+//
+// Exception thrown on connection error.  This error is used to determine
+// when to wait if -rpcwait is given.
+//
+class BranchRPCConnectionFailed : public std::runtime_error
+{
+public:
+
+    explicit inline BranchRPCConnectionFailed(const std::string& msg) :
+        std::runtime_error(msg)
+    {}
+
+};
+
+struct BranchRPCRequest
+{
+    BranchRPCRequest() {}
+    BranchRPCRequest(const std::string& method, const UniValue& p) : strMethod(method), params(p) {}
+
+    std::string strMethod;
+    UniValue params;
+};
+
+// 异步调用完成后的回调，replies 与请求一一对应
+typedef std::function<void(const std::vector<UniValue>& replies)> BranchRPCCallback;
+
+/**
+ * Client for the RPC calls between the main chain and the branch chains.
+ *
+ * Each target (host, port and wallet) keeps a small pool of keep-alive HTTP
+ * connections, at most BRANCH_RPC_MAX_CONNECTIONS of them, and callers wait
+ * for a free one. A request that fails within BRANCH_RPC_RETRY_WINDOW
+ * seconds without an HTTP reply is retried on a new connection; a timed out
+ * request is not, so one call blocks for about BRANCH_RPC_TIMEOUT at most.
+ * Several requests to one target can be sent as a single JSON-RPC batch.
+ *
+ * The async calls are queued per target and run in order on the client
+ * threads, one batch per target at a time, so a branch header is never sent
+ * before its parent. Their transport errors are turned into error replies.
+ */
+UniValue BranchRPCCall(const MCRPCConfig& rpccfg, const std::string& strMethod, const UniValue& params);
+std::vector<UniValue> BranchRPCCallBatch(const MCRPCConfig& rpccfg, const std::vector<BranchRPCRequest>& requests);
+void BranchRPCCallBatchAsync(const MCRPCConfig& rpccfg, const std::vector<BranchRPCRequest>& requests, const BranchRPCCallback& callback);
+
+// 各目标链的连接和延迟统计
+UniValue GetBranchRPCInfo();
+
+void StartBranchRPCClient();
+void StopBranchRPCClient();
+
+#endif // MAGNACHAIN_BRANCHRPCCLIENT_H
@@ -0,0 +1,375 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "chain/branchtransfer.h"
+
+#include "chain/branchchain.h"
+#include "chainparams.h"
+#include "primitives/block.h"
+#include "rpc/protocol.h"
+#include "utils/util.h"
+#include "utils/utiltime.h"
+#include "validation/validation.h"
+
+#include <algorithm>
+
+BranchTransferQueue* pBranchTransferQueue = nullptr;
+
+BranchTransferQueue::BranchTransferQueue(const fs::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+    : m_db(path, nCacheSize, fMemory, fWipe, true), fStop(false), fWake(false)
+{
+    // 重启后恢复未展开的区块和所有请求
+    std::unique_ptr<MCDBIterator> it(m_db.NewIterator());
+    std::pair<char, uint256> blockKey;
+    for (it->Seek(std::make_pair(DB_TRANSFER_BLOCK, uint256())); it->Valid(); it->Next()) {
+        if (!it->GetKey(blockKey) || blockKey.first != DB_TRANSFER_BLOCK)
+            break;
+        int nHeight = 0;
+        if (it->GetValue(nHeight))
+            mapBlocks[blockKey.second] = nHeight;
+    }
+    std::pair<char, EntryKey> entryKey;
+    for (it->Seek(std::make_pair(DB_TRANSFER_ENTRY, EntryKey())); it->Valid(); it->Next()) {
+        if (!it->GetKey(entryKey) || entryKey.first != DB_TRANSFER_ENTRY)
+            break;
+        BranchTransferEntry entry;
+        if (it->GetValue(entry))
+            mapEntries[entryKey.second] = entry;
+    }
+    LogPrintf("Loaded %u matured blocks and %u branch transfer requests\n", mapBlocks.size(), mapEntries.size());
+}
+
+BranchTransferQueue::~BranchTransferQueue()
+{
+    Stop();
+}
+
+void BranchTransferQueue::PushBlock(const uint256& blockHash, int nHeight)
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        if (blockHash == lastPushedBlock || mapBlocks.count(blockHash))
+            return;
+        lastPushedBlock = blockHash;
+        mapBlocks[blockHash] = nHeight;
+        m_db.Write(std::make_pair(DB_TRANSFER_BLOCK, blockHash), nHeight);
+        fWake = true;
+    }
+    cond.notify_one();
+}
+
+bool BranchTransferQueue::AddEntry(const BranchTransferEntry& entry)
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        if (!mapEntries.insert(std::make_pair(entry.GetKey(), entry)).second)
+            return false;
+        WriteEntry(entry);
+        fWake = true;
+    }
+    cond.notify_one();
+    return true;
+}
+
+bool BranchTransferQueue::GetEntry(uint8_t nType, const uint256& txid, BranchTransferEntry& entry) const
+{
+    std::lock_guard<std::mutex> lock(cs);
+    auto mi = mapEntries.find(std::make_pair(nType, txid));
+    if (mi == mapEntries.end())
+        return false;
+    entry = mi->second;
+    return true;
+}
+
+void BranchTransferQueue::WriteEntry(const BranchTransferEntry& entry)
+{
+    m_db.Write(std::make_pair(DB_TRANSFER_ENTRY, entry.GetKey()), entry);
+}
+
+bool BranchTransferQueue::ExpandBlock(const uint256& blockHash)
+{
+    MCBlockIndex* pindex = nullptr;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(blockHash);
+        if (mi != mapBlockIndex.end() && chainActive.Contains(mi->second))
+            pindex = mi->second;
+    }
+
+    // 未知或已被重组出主链的区块直接丢弃，新主链上的区块成熟时会再加入
+    if (pindex == nullptr) {
+        LogPrintf("%s: drop matured block %s which is not in the active chain\n", __func__, blockHash.ToString());
+        EraseBlock(blockHash);
+        return true;
+    }
+
+    // 读不到区块时保留记录，由调用者稍后重试
+    MCBlock block;
+    if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus()))
+        return error("%s: cannot read matured block %s", __func__, blockHash.ToString());
+
+    // 请求中不含RPC配置，发送时再查找，目标链尚未配置的请求同样保存下来
+    const int64_t nNow = GetTime();
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        const MCTransactionRef& tx = block.vtx[i];
+        BranchRPCRequest request;
+        BranchTransferEntry entry, existing;
+        entry.txid = tx->GetHash();
+        entry.blockHash = blockHash;
+        entry.nTime = nNow;
+
+        if ((tx->IsBranchChainTransStep1() || tx->IsMortgage()) && !GetEntry(BranchTransferEntry::TRANS_STEP2, entry.txid, existing)
+            && MakeBranchTransStep2Request(tx, block, request, nullptr)) {
+            entry.nType = BranchTransferEntry::TRANS_STEP2;
+            entry.strToChainId = tx->sendToBranchid;
+            entry.strMethod = request.strMethod;
+            entry.strParams = request.params.write();
+            AddEntry(entry);
+        }
+        if (tx->IsRedeemMortgageStatement() && !GetEntry(BranchTransferEntry::REDEEM_MORTGAGE, entry.txid, existing)
+            && MakeRedeemMortgageRequest(tx, block, request, nullptr)) {
+            entry.nType = BranchTransferEntry::REDEEM_MORTGAGE;
+            entry.strToChainId = MCBaseChainParams::MAIN;
+            entry.strMethod = request.strMethod;
+            entry.strParams = request.params.write();
+            AddEntry(entry);
+        }
+    }
+
+    // 请求都写入后才删除区块记录
+    EraseBlock(blockHash);
+    return true;
+}
+
+void BranchTransferQueue::EraseBlock(const uint256& blockHash)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    mapBlocks.erase(blockHash);
+    mapBlockRetry.erase(blockHash);
+    m_db.Erase(std::make_pair(DB_TRANSFER_BLOCK, blockHash));
+}
+
+void BranchTransferQueue::Retry(BranchTransferEntry& entry, const std::string& strError, int64_t nNow)
+{
+    ++entry.nTries;
+    entry.nLastTry = nNow;
+    entry.strLastError = strError;
+    if (entry.nTries >= BRANCH_TRANSFER_MAX_TRIES) {
+        entry.nStatus = BranchTransferEntry::FAILED;
+        LogPrintf("%s: give up %s of %s after %d tries, %s\n", __func__, entry.strMethod, entry.txid.ToString(), entry.nTries, strError);
+    }
+    else {
+        int64_t nDelay = BRANCH_TRANSFER_RETRY_INTERVAL << std::min(entry.nTries - 1, 20);
+        entry.nNextTry = nNow + std::min(nDelay, BRANCH_TRANSFER_MAX_RETRY_INTERVAL);
+    }
+    WriteEntry(entry);
+}
+
+void BranchTransferQueue::SendDue(int64_t nNow)
+{
+    std::map<std::string, std::vector<EntryKey>> mapDue;
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        for (const auto& mi : mapEntries) {
+            const BranchTransferEntry& entry = mi.second;
+            if (entry.nStatus != BranchTransferEntry::PENDING || entry.nNextTry > nNow || setInFlight.count(mi.first))
+                continue;
+            std::vector<EntryKey>& keys = mapDue[entry.strToChainId];
+            if (keys.size() < BRANCH_TRANSFER_BATCH_SIZE)
+                keys.push_back(mi.first);
+        }
+    }
+
+    for (const auto& due : mapDue) {
+        const std::vector<EntryKey>& keys = due.second;
+        MCRPCConfig rpccfg;
+        if (g_branchChainMan == nullptr || !g_branchChainMan->GetRpcConfig(due.first, rpccfg) || !rpccfg.IsValid()) {
+            std::lock_guard<std::mutex> lock(cs);
+            for (const EntryKey& key : keys)
+                Retry(mapEntries[key], strprintf("can not found branch rpc config for %s", due.first), nNow);
+            continue;
+        }
+
+        std::vector<BranchRPCRequest> requests;
+        {
+            std::lock_guard<std::mutex> lock(cs);
+            for (const EntryKey& key : keys) {
+                const BranchTransferEntry& entry = mapEntries[key];
+                UniValue params(UniValue::VARR);
+                params.read(entry.strParams);
+                requests.push_back(BranchRPCRequest(entry.strMethod, params));
+                setInFlight.insert(key);
+            }
+        }
+        CallRPCBatchAsync(rpccfg, requests, [this, keys](const std::vector<UniValue>& replies) {
+            OnReplies(keys, replies);
+        });
+    }
+}
+
+void BranchTransferQueue::OnReplies(const std::vector<EntryKey>& keys, const std::vector<UniValue>& replies)
+{
+    const int64_t nNow = GetTime();
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            setInFlight.erase(keys[i]);
+            auto mi = mapEntries.find(keys[i]);
+            if (mi == mapEntries.end())
+                continue;
+            BranchTransferEntry& entry = mi->second;
+            const UniValue& reply = i < replies.size() ? replies[i] : NullUniValue;
+
+            std::string strError;
+            bool fOk = entry.nType == BranchTransferEntry::TRANS_STEP2 ? CheckBranchTransStep2Reply(reply, entry.txid, &strError) : CheckRedeemMortgageReply(reply, &strError);
+            if (fOk) {
+                ++entry.nTries;
+                entry.nLastTry = nNow;
+                entry.nStatus = BranchTransferEntry::DONE;
+                entry.strLastError.clear();
+                WriteEntry(entry);
+                continue;
+            }
+
+            // 目标链处理后拒绝的不再重试，连接失败和目标链启动中的稍后重试
+            const UniValue& errorVal = find_value(reply, "error");
+            const UniValue& code = find_value(errorVal, "code");
+            if (errorVal.isObject() && !(code.isNum() && code.get_int() == RPC_IN_WARMUP)) {
+                ++entry.nTries;
+                entry.nLastTry = nNow;
+                entry.nStatus = BranchTransferEntry::FAILED;
+                entry.strLastError = strError;
+                WriteEntry(entry);
+                LogPrint(BCLog::BRANCH, "%s: %s of %s rejected, %s\n", __func__, entry.strMethod, entry.txid.ToString(), strError);
+            }
+            else
+                Retry(entry, strError, nNow);
+        }
+        fWake = true;
+    }
+    cond.notify_one();
+}
+
+void BranchTransferQueue::Prune(int64_t nNow)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    MCDBBatch batch(m_db);
+    for (auto mi = mapEntries.begin(); mi != mapEntries.end();) {
+        const BranchTransferEntry& entry = mi->second;
+        if (entry.nStatus != BranchTransferEntry::PENDING && nNow - entry.nLastTry > BRANCH_TRANSFER_KEEP_TIME) {
+            batch.Erase(std::make_pair(DB_TRANSFER_ENTRY, mi->first));
+            mi = mapEntries.erase(mi);
+        }
+        else
+            ++mi;
+    }
+    if (batch.SizeEstimate() > 0)
+        m_db.WriteBatch(batch);
+}
+
+void BranchTransferQueue::ProcessOnce(int64_t nNow)
+{
+    // 按高度展开记录的区块，读取失败的按间隔加倍重试，超过次数后放弃
+    std::vector<std::pair<int, uint256>> vBlocks;
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        for (const auto& mi : mapBlocks) {
+            auto ri = mapBlockRetry.find(mi.first);
+            if (ri == mapBlockRetry.end() || ri->second.second <= nNow)
+                vBlocks.push_back(std::make_pair(mi.second, mi.first));
+        }
+    }
+    std::sort(vBlocks.begin(), vBlocks.end());
+    for (const auto& block : vBlocks) {
+        if (ExpandBlock(block.second))
+            continue;
+        {
+            std::lock_guard<std::mutex> lock(cs);
+            std::pair<int, int64_t>& retry = mapBlockRetry[block.second];
+            if (++retry.first < BRANCH_TRANSFER_MAX_TRIES) {
+                int64_t nDelay = BRANCH_TRANSFER_RETRY_INTERVAL << std::min(retry.first - 1, 20);
+                retry.second = nNow + std::min(nDelay, BRANCH_TRANSFER_MAX_RETRY_INTERVAL);
+                continue;
+            }
+        }
+        LogPrintf("%s: give up matured block %s after %d tries\n", __func__, block.second.ToString(), BRANCH_TRANSFER_MAX_TRIES);
+        EraseBlock(block.second);
+    }
+
+    SendDue(nNow);
+    Prune(nNow);
+}
+
+void BranchTransferQueue::ThreadMain()
+{
+    std::unique_lock<std::mutex> lock(cs);
+    while (!fStop) {
+        fWake = false;
+        lock.unlock();
+        ProcessOnce(GetTime());
+        lock.lock();
+        cond.wait_for(lock, std::chrono::seconds(1), [this] { return fStop || fWake; });
+    }
+}
+
+void BranchTransferQueue::Start()
+{
+    std::lock_guard<std::mutex> lock(cs);
+    if (thread.joinable())
+        return;
+    fStop = false;
+    thread = std::thread(&TraceThread<std::function<void()> >, "branchxfer", std::function<void()>(std::bind(&BranchTransferQueue::ThreadMain, this)));
+}
+
+void BranchTransferQueue::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        fStop = true;
+    }
+    cond.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+UniValue BranchTransferQueue::GetInfo(bool fVerbose) const
+{
+    std::lock_guard<std::mutex> lock(cs);
+    int nPending = 0, nDone = 0, nFailed = 0;
+    UniValue entries(UniValue::VARR);
+    for (const auto& mi : mapEntries) {
+        const BranchTransferEntry& entry = mi.second;
+        if (entry.nStatus == BranchTransferEntry::DONE) {
+            ++nDone;
+            continue;
+        }
+        if (entry.nStatus == BranchTransferEntry::FAILED)
+            ++nFailed;
+        else
+            ++nPending;
+        if (!fVerbose)
+            continue;
+
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("txid", entry.txid.GetHex()));
+        obj.push_back(Pair("blockhash", entry.blockHash.GetHex()));
+        obj.push_back(Pair("method", entry.strMethod));
+        obj.push_back(Pair("tochain", entry.strToChainId));
+        obj.push_back(Pair("status", entry.nStatus == BranchTransferEntry::FAILED ? "failed" : (setInFlight.count(mi.first) ? "sending" : "pending")));
+        obj.push_back(Pair("tries", entry.nTries));
+        obj.push_back(Pair("time", entry.nTime));
+        obj.push_back(Pair("nexttry", entry.nNextTry));
+        obj.push_back(Pair("lasterror", entry.strLastError));
+        entries.push_back(obj);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("blocks", (int)mapBlocks.size()));
+    ret.push_back(Pair("pending", nPending));
+    ret.push_back(Pair("sending", (int)setInFlight.size()));
+    ret.push_back(Pair("done", nDone));
+    ret.push_back(Pair("failed", nFailed));
+    if (fVerbose)
+        ret.push_back(Pair("entries", entries));
+    return ret;
+}
@@ -0,0 +1,154 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BRANCH_TRANSFER_H
+#define BRANCH_TRANSFER_H
+
+#include "io/dbwrapper.h"
+#include "io/fs.h"
+#include "io/serialize.h"
+#include "coding/uint256.h"
+
+#include <univalue.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+static const char DB_TRANSFER_BLOCK = 'B';
+static const char DB_TRANSFER_ENTRY = 'T';
+
+// 失败后的重试间隔(秒)，每次失败加倍
+static const int64_t BRANCH_TRANSFER_RETRY_INTERVAL = 10;
+static const int64_t BRANCH_TRANSFER_MAX_RETRY_INTERVAL = 3600;
+static const int BRANCH_TRANSFER_MAX_TRIES = 20;
+// 完成和失败的记录保留时间(秒)，期间同一交易不会再次发送
+static const int64_t BRANCH_TRANSFER_KEEP_TIME = 7 * 24 * 60 * 60;
+// 发往一条链的一批请求的最大数量
+static const unsigned int BRANCH_TRANSFER_BATCH_SIZE = 100;
+static const size_t BRANCH_TRANSFER_DB_CACHE = 2 << 20;
+
+// 一个要发往其他链的跨链请求
+class BranchTransferEntry
+{
+public:
+    enum {
+        TRANS_STEP2 = 1,        // makebranchtransaction
+        REDEEM_MORTGAGE = 2,    // redeemmortgagecoin
+    };
+    enum {
+        PENDING = 0,
+        DONE = 1,
+        FAILED = 2,
+    };
+
+    uint8_t nType;
+    uint8_t nStatus;
+    uint256 txid;
+    uint256 blockHash;
+    std::string strToChainId;
+    std::string strMethod;
+    std::string strParams;
+    int32_t nTries;
+    int64_t nTime;
+    int64_t nLastTry;
+    int64_t nNextTry;
+    std::string strLastError;
+
+    BranchTransferEntry() : nType(0), nStatus(PENDING), nTries(0), nTime(0), nLastTry(0), nNextTry(0) {}
+
+    std::pair<uint8_t, uint256> GetKey() const { return std::make_pair(nType, txid); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nType);
+        READWRITE(nStatus);
+        READWRITE(txid);
+        READWRITE(blockHash);
+        READWRITE(strToChainId);
+        READWRITE(strMethod);
+        READWRITE(strParams);
+        READWRITE(nTries);
+        READWRITE(nTime);
+        READWRITE(nLastTry);
+        READWRITE(nNextTry);
+        READWRITE(strLastError);
+    }
+};
+
+/**
+ * Durable queue of the cross-chain requests triggered by matured blocks.
+ *
+ * ProcessBlockBranchChain only records the hash of the matured block. The
+ * queue thread reads the block and stores one entry per request before the
+ * block record is erased, so nothing is lost on restart. A block which is no
+ * longer in the active chain is dropped; one which cannot be read keeps its
+ * record and is retried up to BRANCH_TRANSFER_MAX_TRIES times in this run.
+ * The rpc config of the target chain is only looked up when an entry is sent. Due entries are sent
+ * as one batch per target chain through the branch rpc client without
+ * blocking the queue thread. A transport error or an unfinished target is
+ * retried with doubling delays; a request the target rejects is marked
+ * failed. Finished entries are kept for BRANCH_TRANSFER_KEEP_TIME so the same
+ * transaction is never sent twice.
+ */
+class BranchTransferQueue
+{
+public:
+    BranchTransferQueue() = delete;
+    BranchTransferQueue(const BranchTransferQueue&) = delete;
+
+    BranchTransferQueue(const fs::path& path, size_t nCacheSize, bool fMemory, bool fWipe);
+    ~BranchTransferQueue();
+
+    // 记录一个成熟的区块，重复的区块忽略
+    void PushBlock(const uint256& blockHash, int nHeight);
+    // 加入一个请求，已存在的返回false
+    bool AddEntry(const BranchTransferEntry& entry);
+    bool GetEntry(uint8_t nType, const uint256& txid, BranchTransferEntry& entry) const;
+
+    // 展开记录的区块、发送到期的请求并清理过期记录
+    void ProcessOnce(int64_t nNow);
+
+    void Start();
+    void Stop();
+
+    UniValue GetInfo(bool fVerbose) const;
+
+    MCDBWrapper* GetDb() { return &m_db; }
+
+private:
+    typedef std::pair<uint8_t, uint256> EntryKey;
+
+    MCDBWrapper m_db;
+
+    mutable std::mutex cs;
+    std::condition_variable cond;
+    std::map<uint256, int> mapBlocks;
+    // 读取失败的区块: 失败次数和下次展开时间
+    std::map<uint256, std::pair<int, int64_t>> mapBlockRetry;
+    std::map<EntryKey, BranchTransferEntry> mapEntries;
+    std::set<EntryKey> setInFlight;
+    uint256 lastPushedBlock;
+
+    std::thread thread;
+    bool fStop;
+    bool fWake;
+
+    bool ExpandBlock(const uint256& blockHash);
+    void EraseBlock(const uint256& blockHash);
+    void SendDue(int64_t nNow);
+    void Prune(int64_t nNow);
+    void OnReplies(const std::vector<EntryKey>& keys, const std::vector<UniValue>& replies);
+    void Retry(BranchTransferEntry& entry, const std::string& strError, int64_t nNow);
+    void WriteEntry(const BranchTransferEntry& entry);
+    void ThreadMain();
+};
+
+extern BranchTransferQueue* pBranchTransferQueue;
+
+#endif
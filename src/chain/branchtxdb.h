@@ -187,6 +187,8 @@ public:
     bool IsBranchCreated(const uint256 &branchid) const;
 
     bool IsMineCoinLock(const uint256& coinhash) const;
+
+    MCDBWrapper* GetDb() { return &m_db; }
 private:
     MCDBWrapper m_db;
     CREATE_BRANCH_TX_CONTAINER m_vCreatedBranchTxs;
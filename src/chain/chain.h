@@ -195,6 +195,9 @@ public:
     //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
     arith_uint256 nChainWork;
 
+    //! (memory only) Sum of nNonce in the chain up to and including this block, used by GetBlockWork
+    uint64_t nChainNonce;
+
     //! Number of transactions in this block.
     //! Note: in a potential headers-first mode, this number cannot be relied upon
     unsigned int nTx;
@@ -234,6 +237,7 @@ public:
         nDataPos = 0;
         nUndoPos = 0;
         nChainWork = arith_uint256();
+        nChainNonce = 0;
         nTx = 0;
         nChainTx = 0;
         nStatus = 0;
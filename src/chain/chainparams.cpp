@@ -12,6 +12,7 @@
 #include "utils/utilstrencodings.h"
 
 #include <assert.h>
+#include <limits>
 
 #include "chain/chainparamsseeds.h"
 #include "key/keystore.h"
@@ -190,6 +191,9 @@ public:
         consensus.BIP34Hash = uint256();
         consensus.BIP65Height = 0; // 000000000000000004c2b624ed5d7756c508d90fd0da2c7c679febfa6c4735f0
         consensus.BIP66Height = 0; // 00000000000000000379eaa19dce8c9b722d46ae6a57c2f1a988119488b50931
+        consensus.ContractLazyStorageHeight = std::numeric_limits<int>::max(); // 尚未确定激活高度
+        consensus.ContractNativeLibHeight = std::numeric_limits<int>::max(); // 尚未确定激活高度
+        consensus.ContractSandboxSetfenvHeight = std::numeric_limits<int>::max(); // 尚未确定激活高度
 		consensus.powLimit = uint256S("0xefffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff");
         consensus.nPowTargetTimespan = 14 * 24 * 60 * 60; // two weeks
         consensus.nPowTargetSpacing = gArgs.GetArg("-powtargetspacing", MAIN_CHAIN_POW_TARGET_SPACING);
@@ -288,6 +292,9 @@ public:
         consensus.BIP34Hash = uint256();
         consensus.BIP65Height = 0; // 00000000007f6655f22f98e72ed80d8b06dc761d5da09df0fa1dc4be4f861eb6
         consensus.BIP66Height = 0; // 000000002104c8c45e99a8853285a3b592602a3ccde2b832481da85e9e4ba182
+        consensus.ContractLazyStorageHeight = std::numeric_limits<int>::max(); // 尚未确定激活高度
+        consensus.ContractNativeLibHeight = std::numeric_limits<int>::max(); // 尚未确定激活高度
+        consensus.ContractSandboxSetfenvHeight = std::numeric_limits<int>::max(); // 尚未确定激活高度
         consensus.powLimit = uint256S("0xefffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff");
         consensus.nPowTargetTimespan = 14 * 24 * 60 * 60; // two weeks
 		consensus.nPowTargetSpacing = gArgs.GetArg("-powtargetspacing", TEST_CHAIN_POW_TARGET_SPACING);
@@ -373,6 +380,9 @@ public:
         consensus.BIP34Hash = uint256();
         consensus.BIP65Height = 0; // BIP65 activated on regtest (Used in rpc activation tests)
         consensus.BIP66Height = 0; // BIP66 activated on regtest (Used in rpc activation tests)
+        consensus.ContractLazyStorageHeight = 0;
+        consensus.ContractNativeLibHeight = 0;
+        consensus.ContractSandboxSetfenvHeight = 0;
         consensus.powLimit = uint256S("0xefffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff");
         consensus.nPowTargetTimespan = 14 * 24 * 60 * 60; // two weeks
 		consensus.nPowTargetSpacing = gArgs.GetArg("-powtargetspacing", TEST_CHAIN_POW_TARGET_SPACING);
@@ -442,6 +452,9 @@ public:
 		consensus.BIP34Hash = uint256();
 		consensus.BIP65Height = 0; // 000000000000000004c2b624ed5d7756c508d90fd0da2c7c679febfa6c4735f0
 		consensus.BIP66Height = 0; // 00000000000000000379eaa19dce8c9b722d46ae6a57c2f1a988119488b50931
+		consensus.ContractLazyStorageHeight = std::numeric_limits<int>::max(); // 尚未确定激活高度
+		consensus.ContractNativeLibHeight = std::numeric_limits<int>::max(); // 尚未确定激活高度
+		consensus.ContractSandboxSetfenvHeight = std::numeric_limits<int>::max(); // 尚未确定激活高度
 		consensus.powLimit = uint256S("0xefffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff");
 		consensus.nPowTargetTimespan = 14 * 24 * 60 * 60; // two weeks
 		consensus.nPowTargetSpacing = gArgs.GetArg("-powtargetspacing", BRANCH_CHAIN_POW_TARGET_SPACING);
@@ -0,0 +1,220 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "chain/provebuilder.h"
+#include "chain/chain.h"
+#include "chain/chainparams.h"
+#include "io/streams.h"
+#include "misc/version.h"
+#include "utils/util.h"
+#include "validation/validation.h"
+
+#include <functional>
+
+ProveBuilder* pProveBuilder = nullptr;
+
+ProveSourceBlock::ProveSourceBlock(const std::shared_ptr<const MCBlock>& block) : pblock(block), hash(block->GetHash())
+{
+    std::vector<uint256> vTxid;
+    vTxid.reserve(pblock->vtx.size());
+    for (uint32_t i = 0; i < pblock->vtx.size(); i++) {
+        vTxid.push_back(pblock->vtx[i]->GetHash());
+        mapTxIndex.insert(std::make_pair(vTxid.back(), i));
+    }
+    if (!vTxid.empty())
+        MCPartialMerkleTree::BuildLevels(vTxid, vLevels);
+}
+
+MCTransactionRef ProveSourceBlock::GetTx(const uint256& txid) const
+{
+    std::map<uint256, uint32_t>::const_iterator it = mapTxIndex.find(txid);
+    if (it == mapTxIndex.end())
+        return MCTransactionRef();
+    return pblock->vtx[it->second];
+}
+
+bool ProveSourceBlock::MakeSpvProof(const uint256& txid, MCSpvProof& proof) const
+{
+    std::map<uint256, uint32_t>::const_iterator it = mapTxIndex.find(txid);
+    if (it == mapTxIndex.end())
+        return false;
+
+    std::vector<bool> vMatch(vLevels[0].size(), false);
+    vMatch[it->second] = true;
+    proof.blockhash = hash;
+    proof.pmt = MCPartialMerkleTree(vLevels, vMatch);
+    return true;
+}
+
+// 一次请求的任务，由构建线程和调用线程共同执行
+struct ProveBuilder::Batch
+{
+    std::vector<std::function<void()>> tasks;
+    std::atomic<size_t> next;
+    size_t done;
+
+    Batch() : next(0), done(0) {}
+
+    // 取出下一个任务，没有时返回false
+    bool Take(size_t& n)
+    {
+        n = next++;
+        return n < tasks.size();
+    }
+};
+
+ProveBuilder::ProveBuilder(size_t nMaxBlocksIn, int nThreads) : nMaxBlocks(std::max<size_t>(1, nMaxBlocksIn)), nHits(0), nMisses(0), fShutdown(false)
+{
+    for (int i = 0; i < nThreads; i++)
+        threads.emplace_back(&TraceThread<std::function<void()> >, "prove", std::function<void()>(std::bind(&ProveBuilder::ThreadMain, this)));
+}
+
+ProveBuilder::~ProveBuilder()
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        fShutdown = true;
+    }
+    cond.notify_all();
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+std::shared_ptr<const ProveSourceBlock> ProveBuilder::GetSourceBlock(const MCBlockIndex* pindex)
+{
+    const uint256 blockHash = pindex->GetBlockHash();
+    {
+        std::lock_guard<std::mutex> lock(csCache);
+        auto it = mapBlocks.find(blockHash);
+        if (it != mapBlocks.end()) {
+            lruBlocks.splice(lruBlocks.begin(), lruBlocks, it->second);
+            ++nHits;
+            return *it->second;
+        }
+    }
+    ++nMisses;
+
+    // 读取和解析在锁外进行，同时读取同一区块时只保留一份
+    std::shared_ptr<MCBlock> pblock = std::make_shared<MCBlock>();
+    if (!ReadBlockFromDisk(*pblock, pindex, Params().GetConsensus()))
+        return nullptr;
+    std::shared_ptr<const ProveSourceBlock> source = std::make_shared<ProveSourceBlock>(pblock);
+
+    std::lock_guard<std::mutex> lock(csCache);
+    auto it = mapBlocks.find(blockHash);
+    if (it != mapBlocks.end())
+        return *it->second;
+    lruBlocks.push_front(source);
+    mapBlocks[blockHash] = lruBlocks.begin();
+    while (lruBlocks.size() > nMaxBlocks) {
+        mapBlocks.erase(lruBlocks.back()->GetHash());
+        lruBlocks.pop_back();
+    }
+    return source;
+}
+
+bool ProveBuilder::BuildGroup(const std::vector<InputRef>& inputs, const std::vector<size_t>& group, const uint256& proveBlockHash, std::vector<std::vector<ProveDataItem>>& results)
+{
+    std::shared_ptr<const ProveSourceBlock> source = GetSourceBlock(inputs[group[0]].pindex);
+    if (!source)
+        return error("%s: read block %s failed", __func__, inputs[group[0]].pindex->GetBlockHash().ToString());
+
+    // 同一交易的多个输出被花费时只构建一次证明
+    std::map<uint256, const ProveDataItem*> mapDone;
+    for (size_t n : group) {
+        const InputRef& input = inputs[n];
+        ProveDataItem& item = results[input.nTx][input.nVin];
+        auto it = mapDone.find(input.prevTxid);
+        if (it != mapDone.end()) {
+            item = *it->second;
+            continue;
+        }
+
+        MCTransactionRef ptx = source->GetTx(input.prevTxid);
+        if (!ptx || !source->MakeSpvProof(input.prevTxid, item.pCSP))
+            return error("%s: tx %s not found in block %s", __func__, input.prevTxid.ToString(), source->GetHash().ToString());
+        item.tx.clear();
+        MCVectorWriter cvw{ SER_NETWORK, INIT_PROTO_VERSION, item.tx, 0, *ptx };
+        item.blockHash = proveBlockHash;
+        mapDone[input.prevTxid] = &item;
+    }
+    return true;
+}
+
+bool ProveBuilder::BuildInputProves(const std::vector<InputRef>& inputs, const uint256& proveBlockHash, std::vector<std::vector<ProveDataItem>>& results)
+{
+    // 按输入所在的区块分组，每组一个任务
+    std::map<const MCBlockIndex*, std::vector<size_t>> mapGroups;
+    for (size_t n = 0; n < inputs.size(); n++)
+        mapGroups[inputs[n].pindex].push_back(n);
+    if (mapGroups.empty())
+        return true;
+
+    std::atomic<bool> fOk(true);
+    std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+    for (const auto& group : mapGroups) {
+        const std::vector<size_t>* pgroup = &group.second;
+        batch->tasks.emplace_back([this, &inputs, pgroup, &proveBlockHash, &results, &fOk]() {
+            if (fOk && !BuildGroup(inputs, *pgroup, proveBlockHash, results))
+                fOk = false;
+        });
+    }
+
+    if (batch->tasks.size() > 1 && !threads.empty()) {
+        {
+            std::lock_guard<std::mutex> lock(cs);
+            queue.push_back(batch);
+        }
+        cond.notify_all();
+    }
+
+    size_t n;
+    size_t nRun = 0;
+    while (batch->Take(n)) {
+        batch->tasks[n]();
+        nRun++;
+    }
+
+    std::unique_lock<std::mutex> lock(cs);
+    batch->done += nRun;
+    if (batch->done < batch->tasks.size())
+        condDone.wait(lock, [&] { return batch->done == batch->tasks.size(); });
+    return fOk;
+}
+
+void ProveBuilder::ThreadMain()
+{
+    std::unique_lock<std::mutex> lock(cs);
+    while (true) {
+        cond.wait(lock, [this] { return fShutdown || !queue.empty(); });
+        if (fShutdown)
+            return;
+
+        std::shared_ptr<Batch> batch = queue.front();
+        size_t n;
+        if (!batch->Take(n)) {
+            // 任务都已被取走，剩下的在其他线程执行中
+            queue.pop_front();
+            continue;
+        }
+        lock.unlock();
+        batch->tasks[n]();
+        lock.lock();
+        if (++batch->done == batch->tasks.size())
+            condDone.notify_all();
+    }
+}
+
+// To be called once in AppInitMain to start the prove threads.
+void InitProveBuilder()
+{
+    int threads = std::min(std::max(0, (int)gArgs.GetArg("-provethreads", DEFAULT_PROVE_THREADS)), MAX_PROVE_THREADS);
+    pProveBuilder = new ProveBuilder(DEFAULT_PROVE_BLOCK_CACHE, threads);
+    LogPrintf("Using %d threads for building branch proves\n", threads);
+}
+
+void StopProveBuilder()
+{
+    delete pProveBuilder;
+    pProveBuilder = nullptr;
+}
@@ -0,0 +1,110 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef MAGNACHAIN_PROVEBUILDER_H
+#define MAGNACHAIN_PROVEBUILDER_H
+
+#include "coding/uint256.h"
+#include "primitives/block.h"
+#include "primitives/transaction.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class MCBlockIndex;
+
+// 缓存的输入所在区块数
+static const unsigned int DEFAULT_PROVE_BLOCK_CACHE = 32;
+// 构建证明的线程数，0表示在调用线程中依次执行
+static const int DEFAULT_PROVE_THREADS = 4;
+static const int MAX_PROVE_THREADS = 16;
+
+// 一个被引用的区块，交易索引和默克尔树各层只计算一次
+class ProveSourceBlock
+{
+public:
+    explicit ProveSourceBlock(const std::shared_ptr<const MCBlock>& block);
+
+    const MCBlock& GetBlock() const { return *pblock; }
+    const uint256& GetHash() const { return hash; }
+
+    MCTransactionRef GetTx(const uint256& txid) const;
+    // 与NewSpvProof(block, {txid})的结果相同
+    bool MakeSpvProof(const uint256& txid, MCSpvProof& proof) const;
+
+private:
+    std::shared_ptr<const MCBlock> pblock;
+    uint256 hash;
+    std::map<uint256, uint32_t> mapTxIndex;
+    std::vector<std::vector<uint256>> vLevels;
+};
+
+/**
+ * Builds the prove data of transaction inputs, as used by the branch
+ * transactions and the coinbase proofs.
+ *
+ * The inputs of a request are grouped by the block holding their previous
+ * transaction and every group runs as one task: the block is read once, kept
+ * in an LRU of parsed blocks shared by all requests, and the hashes of all
+ * levels of its merkle tree are computed once, so each proof only copies its
+ * branch. An input spending an output of a transaction already proved in the
+ * same request reuses that proof. The tasks run on the builder's threads and
+ * on the calling thread.
+ */
+class ProveBuilder
+{
+public:
+    // 一个要证明的输入，结果放在 results[nTx][nVin]
+    struct InputRef
+    {
+        size_t nTx;
+        size_t nVin;
+        const MCBlockIndex* pindex;
+        uint256 prevTxid;
+    };
+
+    ProveBuilder(size_t nMaxBlocks, int nThreads);
+    ~ProveBuilder();
+
+    std::shared_ptr<const ProveSourceBlock> GetSourceBlock(const MCBlockIndex* pindex);
+
+    // results 需已按交易和输入数分配好，失败时内容不完整
+    bool BuildInputProves(const std::vector<InputRef>& inputs, const uint256& proveBlockHash, std::vector<std::vector<ProveDataItem>>& results);
+
+    uint64_t GetCacheHits() const { return nHits; }
+    uint64_t GetCacheMisses() const { return nMisses; }
+
+private:
+    struct Batch;
+
+    size_t nMaxBlocks;
+    std::mutex csCache;
+    std::list<std::shared_ptr<const ProveSourceBlock>> lruBlocks;
+    std::map<uint256, std::list<std::shared_ptr<const ProveSourceBlock>>::iterator> mapBlocks;
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nMisses;
+
+    std::mutex cs;
+    std::condition_variable cond;
+    std::condition_variable condDone;
+    std::deque<std::shared_ptr<Batch>> queue;
+    std::vector<std::thread> threads;
+    bool fShutdown;
+
+    bool BuildGroup(const std::vector<InputRef>& inputs, const std::vector<size_t>& group, const uint256& proveBlockHash, std::vector<std::vector<ProveDataItem>>& results);
+    void ThreadMain();
+};
+
+extern ProveBuilder* pProveBuilder;
+
+void InitProveBuilder();
+void StopProveBuilder();
+
+#endif // MAGNACHAIN_PROVEBUILDER_H
@@ -47,6 +47,12 @@ struct Params {
     int BIP65Height;
     /** Block height at which BIP66 becomes active */
     int BIP66Height;
+    /** Block height at which contract storage is decoded per key instead of unpacked eagerly */
+    int ContractLazyStorageHeight;
+    /** Block height from which contracts can use the table.native library */
+    int ContractNativeLibHeight;
+    /** Block height from which setfenv in contracts can only change the environment of lua functions */
+    int ContractSandboxSetfenvHeight;
     /**
      * Minimum blocks including miner confirmation of the total of 2016 blocks in a retargeting period,
      * (nPowTargetTimespan / nPowTargetSpacing) which is also used for BIP9 deployments.
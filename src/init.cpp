@@ -70,7 +70,15 @@
 
 #include "chain/branchchain.h"
 #include "chain/branchdb.h"
+#include "chain/branchrpcclient.h"
+#include "chain/branchtransfer.h"
+#include "chain/provebuilder.h"
+#include "misc/memorygovernor.h"
 #include "smartcontract/contractdb.h"
+#include "smartcontract/contractcache.h"
+#include "smartcontract/contractprofiler.h"
+#include "smartcontract/contractquery.h"
+#include "smartcontract/smartcontract.h"
 
 bool fFeeEstimatesInitialized = false;
 
@@ -171,6 +179,11 @@ void Shutdown()
     StopREST();
     StopRPC();
     StopHTTPServer();
+    StopContractQuery();
+    StopProveBuilder();
+    if (pBranchTransferQueue)
+        pBranchTransferQueue->Stop();
+    StopBranchRPCClient();
 #ifdef ENABLE_WALLET
     for (CWalletRef pwallet : vpwallets) {
         pwallet->Flush(false);
@@ -216,6 +229,9 @@ void Shutdown()
     // up with our current chain to avoid any strange pruning edge cases and make
     // next startup faster by avoiding rescan.
 
+    // 组件的用量函数引用下面删除的对象
+    g_memoryGovernor.Clear();
+
     {
         LOCK(cs_main);
         if (pcoinsTip != nullptr) {
@@ -229,6 +245,8 @@ void Shutdown()
         mpContractDb = nullptr;
         delete pBranchChainTxRecordsDb;
         pBranchChainTxRecordsDb = nullptr;
+        delete pBranchTransferQueue;
+        pBranchTransferQueue = nullptr;
         delete pcoinscatcher;
         pcoinscatcher = nullptr;
         delete pcoinsdbview;
@@ -275,6 +293,9 @@ void Shutdown()
 #endif
     globalVerifyHandle.reset();
     ECC_Stop();
+#ifdef DEBUG_LOCKCONTENTION
+    LogLockContentionStats();
+#endif
     LogPrintf("%s: done\n", __func__);
 }
 
@@ -345,6 +366,12 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
     strUsage += HelpMessageOpt("-assumevalid=<hex>", strprintf(_("If this block is in the chain assume that it and its ancestors are valid and potentially skip their script verification (0 to verify all, default: %s, testnet: %s)"), defaultChainParams->GetConsensus().defaultAssumeValid.GetHex(), testnetChainParams->GetConsensus().defaultAssumeValid.GetHex()));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), MAGNACHAIN_CONF_FILENAME));
+    strUsage += HelpMessageOpt("-contractprofile=<n>", strprintf("Profile smart contract execution per contract and function, sampling the running lua function every <n> instructions (0 = off, minimum: %d, default: %d)", MIN_CONTRACT_PROFILE_INTERVAL, DEFAULT_CONTRACT_PROFILE_INTERVAL));
+    if (showDebug)
+        strUsage += HelpMessageOpt("-contractspeculation", strprintf("Execute the contract transactions of a block group speculatively in parallel and re-execute conflicting ones in block order (default: %u)", DEFAULT_CONTRACT_SPECULATION));
+    strUsage += HelpMessageOpt("-restcontractquerybudget=<n>", strprintf("Lua instructions shared by all calls of one REST contract query (minimum: 1, default: %d)", DEFAULT_REST_CONTRACT_QUERY_BUDGET));
+    strUsage += HelpMessageOpt("-contractquerythreads=<n>", strprintf("Number of threads running read-only contract queries of querycontracts and REST (0 to %d, default: %d)", MAX_CONTRACT_QUERY_THREADS, DEFAULT_CONTRACT_QUERY_THREADS));
+    strUsage += HelpMessageOpt("-contractstatepool=<n>", strprintf(_("Keep <n> initialised lua states for smart contract execution (0 to %d, default: %d)"), MAX_CONTRACT_STATE_POOL_SIZE, DEFAULT_CONTRACT_STATE_POOL_SIZE));
     if (mode == HMM_MAGNACHAIND)
     {
 #if HAVE_DECL_DAEMON
@@ -465,6 +492,7 @@ std::string HelpMessage(HelpMessageMode mode)
     if (showDebug) {
         strUsage += HelpMessageOpt("-logtimemicros", strprintf("Add microsecond precision to debug timestamps (default: %u)", DEFAULT_LOGTIMEMICROS));
         strUsage += HelpMessageOpt("-mocktime=<n>", "Replace actual time with <n> seconds since epoch (default: 0)");
+        strUsage += HelpMessageOpt("-maxcontractcodecache=<n>", strprintf("Limit the shared cache of decompressed contract code to <n> MiB (default: %u)", DEFAULT_MAX_CONTRACT_CODE_CACHE_SIZE));
         strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit sum of signature cache and script execution cache sizes to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
         strUsage += HelpMessageOpt("-maxtipage=<n>", strprintf("Maximum tip age in seconds to consider node in initial block download (default: %u)", DEFAULT_MAX_TIP_AGE));
     }
@@ -520,6 +548,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageGroup(_("Branch chain options:"));
     strUsage += HelpMessageOpt("-branchcfg=<{\"branchid\":\"5fb9a9eaa705de2b5a76cd47230e651a7361353fb044de60290181bd053d1dd8\",\"ip\":\"127.0.0.1\",\"port\":9201,\"usrname\":\"user\",\"password\":\"pwd\"}>", _("config your local branch program for branch chain,this field for main chain's config, This option can be specified multiple times"));
     strUsage += HelpMessageOpt("-branchid=<branchid>", _("Config branchid of current program, this field for branch chain's config."));
+    strUsage += HelpMessageOpt("-branchrpcthreads=<n>", strprintf("Number of threads sending block triggered rpc calls to the other chains (0 to %d, default: %d)", MAX_BRANCH_RPC_THREADS, DEFAULT_BRANCH_RPC_THREADS));
+    strUsage += HelpMessageOpt("-provethreads=<n>", strprintf("Number of threads building the input proves of branch and coinbase transactions (0 to %d, default: %d)", MAX_PROVE_THREADS, DEFAULT_PROVE_THREADS));
     strUsage += HelpMessageOpt("-mainchaincfg=<{\"ip\":\"127.0.0.1\",\"port\":9201,\"usrname\":\"user\",\"password\":\"pwd\"}>", _("Config branchid of current program, this field for branch chain's config."));
     strUsage += HelpMessageOpt("-vseeds=<vseeds>", _("Branch chain's vseeds, this can get from create branch transaction data, this field for branch chain's config."));
     strUsage += HelpMessageOpt("-seedspec6=<seedspec6>", _("Branch chain's seedspec6, this can get from create branch transaction data, this field for branch chain's config."));
@@ -1167,6 +1197,38 @@ bool AppInitParameterInteraction()
     return true;
 }
 
+// 把数据库和内存缓存登记到内存管理，数据库的缓存大小在打开时已固定，只统计用量
+static void RegisterMemoryComponents(int64_t nBlockTreeDBCache, int64_t nCoinDBCache, int64_t nContractDBCache, int64_t nContractDataCache,
+    int64_t nBranchTxDBCache, int64_t nBranchDBCache, int64_t nBranchDataCache, int64_t nMempoolSizeMax)
+{
+    g_memoryGovernor.Register("blocktree_db", nBlockTreeDBCache, [] { return pblocktree->DynamicMemoryUsage(); });
+    g_memoryGovernor.Register("chainstate_db", nCoinDBCache, [] { return pcoinsdbview->GetDb()->DynamicMemoryUsage(); });
+    g_memoryGovernor.Register("coinscache", nCoinCacheUsage, [] {
+        LOCK(cs_main);
+        return pcoinsTip->DynamicMemoryUsage();
+    });
+    g_memoryGovernor.Register("contract_db", nContractDBCache, [] { return mpContractDb->GetDb()->DynamicMemoryUsage(); });
+    g_memoryGovernor.Register("contract_data", nContractDataCache, [] { return mpContractDb->DynamicMemoryUsage(); },
+        [](size_t nTarget) { mpContractDb->EvictContractData(nTarget); });
+    g_memoryGovernor.Register("branchchaintx_db", nBranchTxDBCache, [] { return pBranchChainTxRecordsDb->GetDb()->DynamicMemoryUsage(); });
+    // 侧链数据库只在主链上打开
+    if (g_pBranchDb != nullptr) {
+        g_memoryGovernor.Register("branchchain_db", nBranchDBCache, [] { return g_pBranchDb->GetDb()->DynamicMemoryUsage(); });
+        g_memoryGovernor.Register("branch_data", nBranchDataCache, [] {
+            LOCK(cs_main);
+            return g_pBranchDb->DynamicMemoryUsage();
+        }, [nBranchDataCache](size_t nTarget) {
+            // 换出到目标大小后恢复原上限
+            LOCK(cs_main);
+            g_pBranchDb->SetCacheLimit(nTarget);
+            g_pBranchDb->SetCacheLimit(nBranchDataCache);
+        });
+    }
+    g_memoryGovernor.Register("branchtransfer_db", BRANCH_TRANSFER_DB_CACHE, [] { return pBranchTransferQueue->GetDb()->DynamicMemoryUsage(); });
+    // 交易池有自己的-maxmempool上限，不计入-dbcache
+    g_memoryGovernor.Register("mempool", nMempoolSizeMax, [] { return mempool.DynamicMemoryUsage(); }, MemoryGovernor::EvictFunc(), false);
+}
+
 static bool LockDataDirectory(bool probeOnly)
 {
     std::string strDataDir = GetDataDir().string();
@@ -1249,11 +1311,19 @@ bool AppInitMain(boost::thread_group& threadGroup, MCScheduler& scheduler)
 
     InitSignatureCache();
     InitScriptExecutionCache();
+    InitProveCheckCache();
+    InitContractCodeCache();
+    InitLuaStatePool();
+    InitContractProfiler();
+    InitContractQuery();
+    InitProveBuilder();
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadProveCheck);
+        }
     }
 
     // Start the lightweight task scheduler thread
@@ -1294,6 +1364,7 @@ bool AppInitMain(boost::thread_group& threadGroup, MCScheduler& scheduler)
 	assert(!g_branchChainMan);
 	g_branchChainMan = std::unique_ptr<MCBranchChainMan>(new MCBranchChainMan());
 	g_branchChainMan->Init();
+	StartBranchRPCClient();
 
     LogPrintf("Init branch chain %s\n", chainparams.GetBranchId());
 
@@ -1411,7 +1482,15 @@ bool AppInitMain(boost::thread_group& threadGroup, MCScheduler& scheduler)
     nTotalCache = std::min(nTotalCache, nMaxDbCache << 20); // total cache cannot be greater than nMaxDbcache
     int64_t nBlockTreeDBCache = nTotalCache / 8;
     nBlockTreeDBCache = std::min(nBlockTreeDBCache, (gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX) ? nMaxBlockDBAndTxIndexCache : nMaxBlockDBCache) << 20);
+    g_memoryGovernor.SetBudget(nTotalCache);
     nTotalCache -= nBlockTreeDBCache;
+    // 合约和branch的数据库及内存缓存从同一预算中分出
+    int64_t nContractDBCache = std::min(nTotalCache / 16, nMaxCoinsDBCache << 20);
+    int64_t nContractDataCache = nTotalCache / 16;
+    int64_t nBranchTxDBCache = std::min(nTotalCache / 32, nMaxCoinsDBCache << 20);
+    int64_t nBranchDBCache = std::min(nTotalCache / 32, nMaxCoinsDBCache << 20);
+    int64_t nBranchDataCache = nTotalCache / 32;
+    nTotalCache -= nContractDBCache + nContractDataCache + nBranchTxDBCache + nBranchDBCache + nBranchDataCache + BRANCH_TRANSFER_DB_CACHE;
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nCoinDBCache = std::min(nCoinDBCache, nMaxCoinsDBCache << 20); // cap total coins db cache
     nTotalCache -= nCoinDBCache;
@@ -1420,6 +1499,9 @@ bool AppInitMain(boost::thread_group& threadGroup, MCScheduler& scheduler)
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for contract database (plus %.1fMiB for contract data)\n", nContractDBCache * (1.0 / 1024 / 1024), nContractDataCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for branch chain database (plus %.1fMiB for branch data)\n", nBranchDBCache * (1.0 / 1024 / 1024), nBranchDataCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for branch transaction database\n", nBranchTxDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set (plus up to %.1fMiB of unused mempool space)\n", nCoinCacheUsage * (1.0 / 1024 / 1024), nMempoolSizeMax * (1.0 / 1024 / 1024));
 
     bool fLoaded = false;
@@ -1496,8 +1578,9 @@ bool AppInitMain(boost::thread_group& threadGroup, MCScheduler& scheduler)
 
                 pcoinsdbview = new MCCoinsViewDB(nCoinDBCache, false, fReset || fReindexChainState);
                 pcoinscatcher = new MCCoinsViewErrorCatcher(pcoinsdbview);
-                mpContractDb = new ContractDataDB(GetDataDir() / "contract", nCoinDBCache, false, fReset || fReindexChainState);
-                pBranchChainTxRecordsDb = new BranchChainTxRecordsDb(GetDataDir() / "branchchaintx", nCoinDBCache, false, fReset || fReindexChainState);
+                mpContractDb = new ContractDataDB(GetDataDir() / "contract", nContractDBCache, false, fReset || fReindexChainState);
+                mpContractDb->SetCacheLimit(nContractDataCache);
+                pBranchChainTxRecordsDb = new BranchChainTxRecordsDb(GetDataDir() / "branchchaintx", nBranchTxDBCache, false, fReset || fReindexChainState);
                 
                 // If necessary, upgrade from older database format.
                 // This is a no-op if we cleared the coinsviewdb with -reindex or -reindex-chainstate
@@ -1508,6 +1591,10 @@ bool AppInitMain(boost::thread_group& threadGroup, MCScheduler& scheduler)
 
                 pcoinsTip = new MCCoinsViewCache(pcoinscatcher);
                 pcoinListDb = new CoinListDB(pcoinsdbview->GetDb());
+                if (!pcoinListDb->Upgrade()) {
+                    strLoadError = _("Error upgrading coin list database");
+                    break;
+                }
 
                 // ReplayBlocks is a no-op if we cleared the coinsviewdb with -reindex or -reindex-chainstate
                 if (!ReplayBlocks(chainparams, pcoinsdbview)) {
@@ -1521,17 +1608,14 @@ bool AppInitMain(boost::thread_group& threadGroup, MCScheduler& scheduler)
                 
                 if (Params().IsMainChain()) //only in main chain
                 {
-                    if (g_pBranchDb == nullptr) { // cache size calculations
-                        int64_t nTotalCache = (gArgs.GetArg("-dbcache", nDefaultDbCache) << 20);
-                        nTotalCache = std::max(nTotalCache, nMinDbCache << 20); // total cache cannot be less than nMinDbCache
-                        nTotalCache = std::min(nTotalCache, nMaxDbCache << 20); // total cache cannot be greater than nMaxDbcache
-                        int64_t nBlockTreeDBCache = nTotalCache / 8;
-                        nBlockTreeDBCache = std::min(nBlockTreeDBCache, (gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX) ? nMaxBlockDBAndTxIndexCache : nMaxBlockDBCache) << 20);
-                        nTotalCache -= nBlockTreeDBCache;
-                        int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
-                        nCoinDBCache = std::min(nCoinDBCache, nMaxCoinsDBCache << 20);                   // cap total coins db cache
-                        g_pBranchDb = new BranchDb(GetDataDir() / "branchchain", nCoinDBCache, false, false);
-                        g_pBranchDb->LoadData();
+                    if (g_pBranchDb == nullptr) {
+                        g_pBranchDb = new BranchDb(GetDataDir() / "branchchain", nBranchDBCache, false, false);
+                        if (!g_pBranchDb->Upgrade()) {
+                            strLoadError = _("Error upgrading branch chain database");
+                            break;
+                        }
+                        LOCK(cs_main);
+                        g_pBranchDb->SetCacheLimit(nBranchDataCache);
                     }
                     if (g_pBranchDataMemCache == nullptr){
                         g_pBranchDataMemCache = new BranchCache(g_pBranchDb);
@@ -1632,6 +1716,13 @@ bool AppInitMain(boost::thread_group& threadGroup, MCScheduler& scheduler)
         ::feeEstimator.Read(est_filein);
     fFeeEstimatesInitialized = true;
 
+    // 成熟区块触发的跨链请求在后台发送，未完成的请求在重启后继续
+    pBranchTransferQueue = new BranchTransferQueue(GetDataDir() / "branchtransfer", BRANCH_TRANSFER_DB_CACHE, false, false);
+    pBranchTransferQueue->Start();
+
+    RegisterMemoryComponents(nBlockTreeDBCache, nCoinDBCache, nContractDBCache, nContractDataCache, nBranchTxDBCache, nBranchDBCache, nBranchDataCache, nMempoolSizeMax);
+    scheduler.scheduleEvery(std::bind(&MemoryGovernor::Check, &g_memoryGovernor), MEMORY_GOVERNOR_INTERVAL * 1000);
+
     // ********************************************************* Step 8: load wallet
 #ifdef ENABLE_WALLET
     if (!MCWallet::InitLoadWallet())
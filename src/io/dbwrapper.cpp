@@ -190,6 +190,16 @@ bool MCDBWrapper::IsEmpty()
     return !(it->Valid());
 }
 
+size_t MCDBWrapper::DynamicMemoryUsage() const
+{
+    std::string memory;
+    if (!pdb->GetProperty("leveldb.approximate-memory-usage", &memory)) {
+        LogPrint(BCLog::LEVELDB, "Failed to get approximate-memory-usage property\n");
+        return 0;
+    }
+    return stoul(memory);
+}
+
 MCDBIterator::~MCDBIterator() { delete piter; }
 bool MCDBIterator::Valid() { return piter->Valid(); }
 void MCDBIterator::SeekToFirst() { piter->SeekToFirst(); }
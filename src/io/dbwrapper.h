@@ -168,6 +168,10 @@ public:
         return true;
     }
 
+    unsigned int GetKeySize() {
+        return piter->key().size();
+    }
+
     unsigned int GetValueSize() {
         return piter->value().size();
     }
@@ -307,6 +311,11 @@ public:
      */
     bool IsEmpty();
 
+    /**
+     * Return the approximate memory used by the block cache and the memtables.
+     */
+    size_t DynamicMemoryUsage() const;
+
     template<typename K>
     size_t EstimateSize(const K& key_begin, const K& key_end) const
     {
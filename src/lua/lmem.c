@@ -81,7 +81,9 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
     luaD_throw(L, LUA_ERRMEM);
   lua_assert((nsize == 0) == (block == NULL));
   g->totalbytes = (g->totalbytes - osize) + nsize;
-  if (osize == 0 && nsize > 0 && g->totalbytes > MAX_LUA_ALLOC_SIZE)
+  if (nsize > osize)
+    g->allocbytes += nsize - osize;
+  if (osize == 0 && nsize > 0 && (l_mem)g->totalbytes - g->memoffset > (l_mem)MAX_LUA_ALLOC_SIZE)
     luaD_throw(L, LUA_ERRMEM);
   return block;
 }
@@ -99,6 +99,9 @@ static void preinit_state (lua_State *L, global_State *g) {
   L->savedpc = NULL;
   L->errfunc = 0;
   L->limit_instruction = 0;
+  L->profile_hook = NULL;
+  L->profile_interval = 0;
+  L->profile_countdown = 0;
   setnilvalue(gt(L));
 }
 
@@ -179,6 +182,8 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->weak = NULL;
   g->tmudata = NULL;
   g->totalbytes = sizeof(LG);
+  g->allocbytes = sizeof(LG);
+  g->memoffset = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
   g->gcdept = 0;
@@ -81,6 +81,8 @@ typedef struct global_State {
   Mbuffer buff;  /* temporary buffer for string concatentation */
   lu_mem GCthreshold;
   lu_mem totalbytes;  /* number of bytes currently allocated */
+  lu_mem allocbytes;  /* number of bytes ever allocated */
+  l_mem memoffset;  /* bytes not counted against MAX_LUA_ALLOC_SIZE */
   lu_mem estimate;  /* an estimate of number of bytes actually in use */
   lu_mem gcdept;  /* how much GC is `behind schedule' */
   int gcpause;  /* size of pause between successive GCs */
@@ -127,6 +129,9 @@ struct lua_State {
   void* userData;
   long limit_instruction; /*limit instruction call */
   lu_byte limit_on;
+  void (*profile_hook) (lua_State *L);  /* sampling profiler, see luaD_limitinstruction */
+  long profile_interval;
+  long profile_countdown;
 };
 
 
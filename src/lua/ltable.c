@@ -330,6 +330,22 @@ void luaH_resizearray (lua_State *L, Table *t, int nasize) {
 }
 
 
+/*
+** drop every entry of `t', leaving it in the same state as a table
+** just created by luaH_new(L, 0, 0)
+*/
+void luaH_reset (lua_State *L, Table *t) {
+  int i;
+  for (i=0; i<t->sizearray; i++)
+    setnilvalue(&t->array[i]);
+  if (t->node != dummynode) {
+    for (i=0; i<sizenode(t); i++)
+      setnilvalue(gval(gnode(t, i)));
+  }
+  resize(L, t, 0, 0);
+}
+
+
 static void rehash (lua_State *L, Table *t, const TValue *ek) {
   int nasize, na;
   int nums[MAXBITS+1];  /* nums[i] = number of keys between 2^(i-1) and 2^i */
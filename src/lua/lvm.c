@@ -34,6 +34,11 @@
 void luaD_limitinstruction(lua_State *L, long instructions) {
   if (L->limit_on != 0) {
     long left = L->limit_instruction - instructions;
+    /* the hook only looks at the call stack, it does not run code or allocate */
+    if (L->profile_hook != NULL && (L->profile_countdown -= instructions) <= 0) {
+      L->profile_countdown = L->profile_interval;
+      L->profile_hook(L);
+    }
     if (left < 0) {
       L->limit_instruction = -1;
       luaG_runerror(L, "run out of limit instruction.");
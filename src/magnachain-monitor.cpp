@@ -11,6 +11,7 @@
 #include "init.h"
 #include "io/fs.h"
 #include "misc/clientversion.h"
+#include "monitor/database.h"
 #include "monitor/monitorinit.h"
 #include "net/compat.h"
 #include "net/http/httprpc.h"
@@ -173,6 +174,8 @@ bool AppInit(int argc, char* argv[])
         WaitForShutdown(&threadGroup);
     }
     Shutdown();
+    // 网络线程停止后才关闭写入线程
+    DBShutdown();
 
     return fRet;
 }
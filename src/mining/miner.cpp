@@ -5,6 +5,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "mining/miner.h"
+#include "mining/stakesearch.h"
 
 #include "misc/amount.h"
 #include "chain/chain.h"
@@ -48,6 +49,8 @@
 
 #include <assert.h>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <queue>
 #include <utility>
 #include "chain/branchchain.h"
@@ -80,6 +83,7 @@ uint64_t ReserveBranchTxBlockDataSize = 100;
 
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockWeight = 0;
+int64_t nLastBlockTemplateTime = 0;
 
 int64_t UpdateTime(MCBlockHeader* pblock, const Consensus::Params& consensusParams, const MCBlockIndex* pindexPrev)
 {
@@ -498,8 +502,18 @@ MCAmount MakeBranchTxUTXO::UseUTXO(uint160& key, MCAmount nAmount, std::vector<M
         CoinListPtr pcoinlist = pcoinListDb->GetList(key);
 
         BranchUTXOCache cache;
-        if (pcoinlist != nullptr)
+        if (pcoinlist != nullptr) {
             cache.coinlist = *pcoinlist;// copy
+            // 列表按outpoint排序，按高度重排以便优先使用较老的币
+            std::vector<MCOutPoint>& coins = cache.coinlist.coins;
+            std::vector<std::pair<int, MCOutPoint>> sorted;
+            sorted.reserve(coins.size());
+            for (const MCOutPoint& outpoint : coins)
+                sorted.emplace_back(pcoinsTip->AccessCoin(outpoint).nHeight, outpoint);
+            std::stable_sort(sorted.begin(), sorted.end(), [](const std::pair<int, MCOutPoint>& a, const std::pair<int, MCOutPoint>& b) { return a.first < b.first; });
+            for (size_t i = 0; i < sorted.size(); ++i)
+                coins[i] = sorted[i].second;
+        }
         mapBranchCoins.insert(std::make_pair(key, cache));
     }
     BranchUTXOCache& utxoCache = mapBranchCoins[key];
@@ -876,49 +890,171 @@ void static GenerateSleep()
 	boost::this_thread::interruption_point();
 }
 
+std::shared_ptr<StakeSnapshot> StakeSearch::GetSnapshot(MCWallet* pwallet)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    if (pSnapshot && !IsStale(*pSnapshot) &&
+        (pSnapshot->nNext < pSnapshot->vCandidates.size() || GetTimeMicros() - pSnapshot->nStartTime < STAKE_RETRY_MILLIS * 1000))
+        return pSnapshot;
+
+    std::shared_ptr<StakeSnapshot> snapshot = std::make_shared<StakeSnapshot>();
+    // 先取序号，扫描期间出现的新tip会使该快照失效
+    snapshot->nTipSequence = nTipSequence;
+    snapshot->nTipTime = (pSnapshot && pSnapshot->nTipSequence == snapshot->nTipSequence) ? pSnapshot->nTipTime : GetTimeMicros();
+    {
+        LOCK2(cs_main, pwallet->cs_wallet);
+        snapshot->pindexPrev = chainActive.Tip();
+        snapshot->fPrescreen = Params().IsMainChain() || snapshot->pindexPrev->nHeight > 0;
+
+        std::vector<MCOutput> vecOutputs;
+        if (Params().IsMainChain())
+            pwallet->AvailableCoins(vecOutputs, nullptr, false);
+        else
+            pwallet->AvailableMortgageCoins(vecOutputs, false);
+
+        // 与generateBlocks相同的过滤，组装区块时仍会重新检查
+        snapshot->vCandidates.reserve(vecOutputs.size());
+        for (const MCOutput& out : vecOutputs) {
+            StakeCandidate candidate(out);
+            candidate.scriptPubKey = out.tx->tx->vout[out.i].scriptPubKey;
+            if (!Params().IsMainChain()) {
+                MCKeyID keyid;
+                uint256 coinpreouthash;
+                if (!GetMortgageCoinData(candidate.scriptPubKey, &coinpreouthash, &keyid))
+                    continue;
+                if (pBranchChainTxRecordsDb->IsMineCoinLock(coinpreouthash))
+                    continue;
+                candidate.scriptPubKey = GetScriptForDestination(keyid);
+            }
+            if (candidate.scriptPubKey.IsPayToScriptHash())
+                continue;
+            candidate.outpoint = MCOutPoint(out.tx->tx->GetHash(), out.i);
+            pcoinsTip->GetCoin(candidate.outpoint, candidate.coin);
+            snapshot->vCandidates.push_back(std::move(candidate));
+        }
+    }
+    snapshot->nStartTime = GetTimeMicros();
+    snapshot->nLastEvalTime = snapshot->nStartTime;
+
+    if (pSnapshot)
+        FinishSnapshot(*pSnapshot);
+    pSnapshot = snapshot;
+    return snapshot;
+}
+
+bool StakeSearch::FindStake(StakeSnapshot& snapshot, size_t& nPos, size_t& nEnd, const StakeCandidate*& pFound)
+{
+    const Consensus::Params& consensus = Params().GetConsensus();
+    while (!IsStale(snapshot)) {
+        boost::this_thread::interruption_point();
+        if (nPos >= nEnd) {
+            nPos = snapshot.nNext.fetch_add(STAKE_CANDIDATE_CHUNK);
+            if (nPos >= snapshot.vCandidates.size())
+                return false;
+            nEnd = std::min(nPos + STAKE_CANDIDATE_CHUNK, snapshot.vCandidates.size());
+        }
+
+        size_t nBegin = nPos;
+        pFound = nullptr;
+        while (nPos < nEnd && pFound == nullptr) {
+            const StakeCandidate& candidate = snapshot.vCandidates[nPos++];
+            if (!snapshot.fPrescreen || StakeMeetsTarget(snapshot.pindexPrev, candidate.scriptPubKey, candidate.outpoint, candidate.coin, consensus))
+                pFound = &candidate;
+        }
+        snapshot.nEvaluated += nPos - nBegin;
+        snapshot.nLastEvalTime = GetTimeMicros();
+        if (pFound != nullptr)
+            return true;
+    }
+    return false;
+}
+
+void StakeSearch::BlockGenerated(const StakeSnapshot& snapshot)
+{
+    int64_t nTemplateTime;
+    {
+        LOCK(cs_main);
+        nTemplateTime = nLastBlockTemplateTime;
+    }
+    std::lock_guard<std::mutex> lock(csStats);
+    nTimeToTemplate = std::max<int64_t>(0, nTemplateTime - snapshot.nTipTime) / 1000;
+}
+
+void StakeSearch::FinishSnapshot(const StakeSnapshot& snapshot)
+{
+    std::lock_guard<std::mutex> lock(csStats);
+    nTotalEvaluated += snapshot.nEvaluated;
+    int64_t nElapsed = snapshot.nLastEvalTime - snapshot.nStartTime;
+    if (snapshot.nEvaluated > 0 && nElapsed > 0)
+        dCandidatesPerSec = snapshot.nEvaluated * 1000000.0 / nElapsed;
+}
+
+void StakeSearch::SetThreads(int n)
+{
+    std::lock_guard<std::mutex> lock(csStats);
+    nThreads = n;
+}
+
+StakeSearchStats StakeSearch::GetStats()
+{
+    std::shared_ptr<StakeSnapshot> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        snapshot = pSnapshot;
+    }
+
+    std::lock_guard<std::mutex> lock(csStats);
+    StakeSearchStats stats;
+    stats.nThreads = nThreads;
+    stats.nCandidates = snapshot ? snapshot->vCandidates.size() : 0;
+    stats.nEvaluated = nTotalEvaluated + (snapshot ? (uint64_t)snapshot->nEvaluated : 0);
+    stats.dCandidatesPerSec = dCandidatesPerSec;
+    stats.nTimeToTemplate = nTimeToTemplate;
+    return stats;
+}
+
+namespace {
+
+StakeSearch stakeSearch;
+
+} // namespace
+
+StakeSearchStats GetStakeSearchStats()
+{
+    return stakeSearch.GetStats();
+}
+
 void static MagnaChainMiner(const MCChainParams& chainparams)
 {
     LogPrintf("MagnaChainMiner started\n");
 	RenameThread("magnachain-miner");
 
-	unsigned int nExtraNonce = 0;
-
     MCWallet* const pwallet = ::vpwallets[0];
+    assert(pwallet != nullptr);
 
+    std::shared_ptr<StakeSnapshot> snapshot;
+    size_t nPos = 0;
+    size_t nEnd = 0;
 	while (!ShutdownRequested()) {
 		try {
-            std::set<MCTxDestination> setAddress;
-            std::vector<MCOutput> vecOutputs;
-			{
-				assert(pwallet != nullptr);
-
-				LOCK2(cs_main, pwallet->cs_wallet);
-
-                if (Params().IsMainChain())
-                    pwallet->AvailableCoins(vecOutputs, nullptr, false);
-                else
-                    pwallet->AvailableMortgageCoins(vecOutputs, false);
-				//for (const MCOutput& out : vecOutputs) {
-				//	MCTxDestination address;
-				//	const MCScript& scriptPubKey = out.tx->tx->vout[out.i].scriptPubKey;
-				//	bool fValidAddress = ExtractDestination(scriptPubKey, address);
-
-				//	if (setAddress.count(address))
-				//		continue;
-
-				//	if (fValidAddress) {
-				//		if (!scriptPubKey.IsPayToScriptHash()) {
-				//			setAddress.insert(address);
-				//		}
-				//	}
-				//}
+            std::shared_ptr<StakeSnapshot> current = stakeSearch.GetSnapshot(pwallet);
+            if (current != snapshot) {
+                snapshot = current;
+                nPos = nEnd = 0;
+            }
 
-			}
-            //std::vector< MCScript> vecScript;
-            //BOOST_FOREACH(const MCTxDestination& addr, setAddress) {
-			//	vecScript.push_back(GetScriptForDestination(addr));
-			//}
-			generateBlocks(pwallet, vecOutputs, vecOutputs.size(), vecOutputs.size(), true, GenerateSleep);
+            const StakeCandidate* pFound = nullptr;
+            if (stakeSearch.FindStake(*snapshot, nPos, nEnd, pFound)) {
+                std::vector<MCOutput> vecOutputs(1, pFound->output);
+                UniValue blockHashes = generateBlocks(pwallet, vecOutputs, 1, 1, true, GenerateSleep);
+                if (!blockHashes.empty())
+                    stakeSearch.BlockGenerated(*snapshot);
+            }
+            else if (!stakeSearch.IsStale(*snapshot)) {
+                // 快照已评估完，等待新区块，或过一段时间难度降低后重新评估
+                boost::unique_lock<boost::mutex> lock(csBestBlock);
+                cvBlockChange.timed_wait(lock, boost::get_system_time() + boost::posix_time::milliseconds(STAKE_RETRY_MILLIS));
+            }
 
 			// Check for stop or if block needs to be rebuilt
 			boost::this_thread::interruption_point();
@@ -931,7 +1067,7 @@ void static MagnaChainMiner(const MCChainParams& chainparams)
 		catch (const boost::thread_interrupted &e)
 		{
 			LogPrintf("MagnaChainMiner terminated for boost::thread_interrupted\n");
-            //throw;
+            return;
 		}
 		catch (const std::runtime_error &e)
 		{
@@ -959,10 +1095,19 @@ void GenerateMCs(bool fGenerate, int nThreads, const MCChainParams& chainparams)
 		delete minerThreads;
 		minerThreads = NULL;
 	}
+	stakeSearch.SetThreads(0);
 
 	if (nThreads == 0 || !fGenerate)
 		return;
 
+	// 新tip通知用于停止评估旧的快照
+	static bool fRegistered = false;
+	if (!fRegistered) {
+		RegisterValidationInterface(&stakeSearch);
+		fRegistered = true;
+	}
+
+	stakeSearch.SetThreads(nThreads);
 	minerThreads = new boost::thread_group();
 	for (int i = 0; i < nThreads; i++)
         minerThreads->create_thread(boost::bind(&MagnaChainMiner, boost::cref(chainparams)));
@@ -1040,18 +1185,27 @@ namespace BlockExplorer
 
         static MCAmount GetUnspent(const uint160& kAddr)
         {
-            CoinListPtr pList = pcoinListDb->GetList(kAddr);
-            if (pList == nullptr)
-                return 0;
-            return CountAmount(*pList, true);
+            // 分页读取，不把整个列表读入内存
+            const size_t nPageSize = 1000;
+            MCAmount total = 0;
+            CoinList kPage;
+            MCOutPoint last;
+            const MCOutPoint* pStart = nullptr;
+            do {
+                pcoinListDb->GetCoins(kAddr, pStart, nPageSize, kPage.coins);
+                total += CountAmount(kPage, true);
+                if (!kPage.coins.empty()) {
+                    last = kPage.coins.back();
+                    pStart = &last;
+                }
+            } while (kPage.coins.size() == nPageSize);
+            return total;
         }
 
         static MCAmount GetUnspent(const std::string& strAddr)
         {
-            CoinListPtr pList = GetCoinList(strAddr);
-            if (pList == nullptr)
-                return 0;
-            return CountAmount(*pList, true);
+            MagnaChainAddress kAddr(strAddr);
+            return GetUnspent(GetUint160(kAddr.Get()));
         }
     };
 }
@@ -1127,80 +1281,43 @@ bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params&
 
 static uint256 guMaxWork = uint256S("0xffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff");
 
-// 如有修改,同时也需修改 GetBlockHeaderWork
-uint32_t GetBlockWork(const MCBlock& block, const MCOutPoint& out, uint256& block_hash)
+// 抵押币按币龄计算的工作量基数，币已花费时为0
+static MCAmount GetStakeCoinAge(const Coin& coin, int iPrevHeight)
 {
-	block_hash  = guMaxWork;
-	BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
-	if (mi == mapBlockIndex.end())
-	{
+	if (coin.IsSpent())
 		return 0;
-	}
-    MCBlockIndex* pPreIndex = mi->second;
-	const int iPrevHeight = pPreIndex->nHeight;
-	//const int iTop = chainActive.Height();
-
-	const bool isBigBoom = iPrevHeight < Params().GetConsensus().BigBoomHeight;
 
 	const int iMatureDepth = COINBASE_MATURITY - 1;
-    MCAmount total = 0;
-
-	// 取得矿工当前可用的UTXO
-    MCTxDestination kDest;
-	ExtractDestination(block.vtx[0]->vout[0].scriptPubKey, kDest);
-
-	if ( isBigBoom )
-		total = 0;
-    else if (!Params().IsMainChain() && iPrevHeight == 0)//侧链第2个块,即传世块后的第1个块
-    {
-        if (block.vtx.size() <= 2)
-            return 0;
-        const MCTransaction& tx = *block.vtx[1];
-        std::vector<MCTransactionRef>::const_iterator itFound = std::find_if(block.vtx.begin(), block.vtx.end(), [&tx](const MCTransactionRef& ptx) { return ptx->GetHash() == tx.vin[0].prevout.hash; });
-        if (itFound != block.vtx.end()){
-            int iRun = 1;
-            total = ((*itFound)->vout[0].nValue / COIN) * iRun;
-        }
-        else
-            return 0;
-    }
-	else {
-		Coin coin;
-		if (pcoinsTip->GetCoin(out, coin)) {
-            MCAmount v = coin.out.nValue;
-			// 计算深度时从上一次挖矿的时候开始算，同时要减去一个成熟时间
-			int iHeight = coin.nHeight;
-			iHeight += iMatureDepth;
-            if (!Params().IsMainChain() && iPrevHeight < 2*COINBASE_MATURITY) {// 侧链前 2 COINBASE_MATURITY 块的高度处理
-                iHeight = -COINBASE_MATURITY;
-                iHeight = std::min(iHeight, COINBASE_MATURITY);
-            }
-			int iRun = iPrevHeight - iHeight;
-			if (iRun > 0) {
-				total += (v / COIN) * iRun;
-			}
-		}
+	MCAmount v = coin.out.nValue;
+	// 计算深度时从上一次挖矿的时候开始算，同时要减去一个成熟时间
+	int iHeight = coin.nHeight;
+	iHeight += iMatureDepth;
+	if (!Params().IsMainChain() && iPrevHeight < 2*COINBASE_MATURITY) {// 侧链前 2 COINBASE_MATURITY 块的高度处理
+		iHeight = -COINBASE_MATURITY;
+		iHeight = std::min(iHeight, COINBASE_MATURITY);
 	}
+	int iRun = iPrevHeight - iHeight;
+	if (iRun > 0)
+		return (v / COIN) * iRun;
+	return 0;
+}
+
+// 由币龄和前一区块计算工作量HASH，不访问mapBlockIndex和pcoinsTip，调用者无需持有cs_main
+static uint32_t GetStakeWork(const MCBlockIndex* pPreIndex, const MCTxDestination& kDest, const MCOutPoint& out, MCAmount total, uint256& block_hash)
+{
+	block_hash = guMaxWork;
+	const int iPrevHeight = pPreIndex->nHeight;
+	const bool isBigBoom = iPrevHeight < Params().GetConsensus().BigBoomHeight;
 
 	if (total >= std::numeric_limits<uint32_t>::max()) {
 		total = std::numeric_limits<uint32_t>::max();
 	}
 
-	// 计算前100个区块的平均值
+	// 计算前100个区块的平均值，由累计值相减得到
 	{
-		MCAmount iAvg = 0;
-		MCBlockIndex *ptest = pPreIndex;
-		int i = 0;
-		for ( ;i < 100; ++i)
-		{
-			if (ptest == NULL)
-			{
-				break;
-			}
-			iAvg += ptest->nNonce;
-
-			ptest = ptest->pprev;
-		}
+		int i = std::min(100, iPrevHeight + 1);
+		const MCBlockIndex* pFirst = pPreIndex->GetAncestor(iPrevHeight - i);
+		MCAmount iAvg = pPreIndex->nChainNonce - (pFirst ? pFirst->nChainNonce : 0);
 		iAvg /= i;
 		if ( iAvg > 100 && total > iAvg + iAvg /20 ) {
 			total = iAvg + iAvg / 20;
@@ -1215,28 +1332,11 @@ uint32_t GetBlockWork(const MCBlock& block, const MCOutPoint& out, uint256& bloc
     MCHashWriter sheader(nType, nVersion);
     MCHashWriter snum(nType, nVersion);
 
-	int iCheck2 = 2;
-	int iCheck3 = 3;
-    MCBlockIndex* pNextIndex = pPreIndex;
-	for (int i = 0; i < 1000; ++i)
-	{
-		if (pNextIndex == NULL)
-		{
-			break;
-		}
-		if (i == iCheck2)
-		{
-			iCheck2 *= 2;
-			sheader << pNextIndex->GetBlockHash();
-		}
-		if (i == iCheck3)
-		{
-			iCheck3 *= 3;
-			snum << pNextIndex->GetBlockHash();
-		}
-
-        pNextIndex = pNextIndex->pprev;
-	}
+	// 深度为2和3的各次幂(小于1000)的祖先，经pskip直接取得
+	for (int i = 2; i < 1000 && i <= iPrevHeight; i *= 2)
+		sheader << pPreIndex->GetAncestor(iPrevHeight - i)->GetBlockHash();
+	for (int i = 3; i < 1000 && i <= iPrevHeight; i *= 3)
+		snum << pPreIndex->GetAncestor(iPrevHeight - i)->GetBlockHash();
 
     if (kDest.type() != typeid(MCKeyID))
     {
@@ -1283,6 +1383,51 @@ uint32_t GetBlockWork(const MCBlock& block, const MCOutPoint& out, uint256& bloc
 	return total;
 }
 
+// 如有修改,同时也需修改 GetBlockHeaderWork
+uint32_t GetBlockWork(const MCBlock& block, const MCOutPoint& out, uint256& block_hash)
+{
+	block_hash  = guMaxWork;
+	BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+	if (mi == mapBlockIndex.end())
+	{
+		return 0;
+	}
+    MCBlockIndex* pPreIndex = mi->second;
+	const int iPrevHeight = pPreIndex->nHeight;
+	//const int iTop = chainActive.Height();
+
+	const bool isBigBoom = iPrevHeight < Params().GetConsensus().BigBoomHeight;
+
+    MCAmount total = 0;
+
+	// 取得矿工当前可用的UTXO
+    MCTxDestination kDest;
+	ExtractDestination(block.vtx[0]->vout[0].scriptPubKey, kDest);
+
+	if ( isBigBoom )
+		total = 0;
+    else if (!Params().IsMainChain() && iPrevHeight == 0)//侧链第2个块,即传世块后的第1个块
+    {
+        if (block.vtx.size() <= 2)
+            return 0;
+        const MCTransaction& tx = *block.vtx[1];
+        std::vector<MCTransactionRef>::const_iterator itFound = std::find_if(block.vtx.begin(), block.vtx.end(), [&tx](const MCTransactionRef& ptx) { return ptx->GetHash() == tx.vin[0].prevout.hash; });
+        if (itFound != block.vtx.end()){
+            int iRun = 1;
+            total = ((*itFound)->vout[0].nValue / COIN) * iRun;
+        }
+        else
+            return 0;
+    }
+	else {
+		Coin coin;
+		if (pcoinsTip->GetCoin(out, coin))
+			total = GetStakeCoinAge(coin, iPrevHeight);
+	}
+
+	return GetStakeWork(pPreIndex, kDest, out, total, block_hash);
+}
+
 bool CheckBlockWork(const MCBlock& block, MCValidationState& state, const Consensus::Params& consensusParams)
 {
 	uint256 hash;
@@ -1316,10 +1461,38 @@ bool CheckBlockWork(const MCBlock& block, MCValidationState& state, const Consen
 	return true;
 }
 
+bool StakeMeetsTarget(const MCBlockIndex* pindexPrev, const MCScript& scriptPubKey, const MCOutPoint& outpoint, const Coin& coin, const Consensus::Params& consensusParams)
+{
+    // 与CreateNewBlock相同的前一区块、时间和coinbase第一个输出，其他交易不影响工作量
+    MCBlockHeader header;
+    header.hashPrevBlock = pindexPrev->GetBlockHash();
+    UpdateTime(&header, consensusParams, pindexPrev);
+    MCTxDestination kDest;
+    ExtractDestination(scriptPubKey, kDest);
+
+    MCAmount total = 0;
+    if (pindexPrev->nHeight >= consensusParams.BigBoomHeight)
+        total = GetStakeCoinAge(coin, pindexPrev->nHeight);
+
+    uint256 hash;
+    GetStakeWork(pindexPrev, kDest, outpoint, total, hash);
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(GetNextWorkRequired(pindexPrev, &header, consensusParams));
+    return UintToArith256(hash) <= bnTarget;
+}
+
+bool StakeMeetsTarget(const MCBlockIndex* pindexPrev, const MCScript& scriptPubKey, const MCOutPoint& outpoint, const MCCoinsView& view, const Consensus::Params& consensusParams)
+{
+    Coin coin;
+    view.GetCoin(outpoint, coin);
+    return StakeMeetsTarget(pindexPrev, scriptPubKey, outpoint, coin, consensusParams);
+}
+
 ////---------------------------------------------------------
-inline const BranchBlockData* GetBranchBlockData(BranchData& branchdata, const uint256 &blockhash, const uint256 &branchhash, BranchCache *pBranchCache){
-    if (branchdata.mapHeads.count(blockhash))
-        return &branchdata.mapHeads[blockhash];
+inline const BranchBlockData* GetBranchBlockData(const BranchData& branchdata, const uint256 &blockhash, const uint256 &branchhash, BranchCache *pBranchCache){
+    const BranchBlockData* pBlockData = branchdata.GetBranchBlockData(blockhash);
+    if (pBlockData)
+        return pBlockData;
     if (pBranchCache)// is get data from mempool
         return pBranchCache->GetBranchBlockData(branchhash, blockhash);
     return nullptr;
@@ -1328,7 +1501,7 @@ inline const BranchBlockData* GetBranchBlockData(BranchData& branchdata, const u
 ////---------------------------------------------------------
 //主链获取侧链头工作量
 //核心算法需要和 GetBlockWork 一致
-uint32_t GetBlockHeaderWork(const MCBranchBlockInfo& block, uint256& block_hash, const MCChainParams &params, BranchData& branchdata, BranchCache *pBranchCache)
+uint32_t GetBlockHeaderWork(const MCBranchBlockInfo& block, uint256& block_hash, const MCChainParams &params, const BranchData& branchdata, BranchCache *pBranchCache)
 {
     ///// get and check data
     const MCOutPoint& out = block.prevoutStake;
@@ -1400,20 +1573,53 @@ uint32_t GetBlockHeaderWork(const MCBranchBlockInfo& block, uint256& block_hash,
         total = std::numeric_limits<uint32_t>::max();
     }
 
+    // 先沿hashPrevBlock走到branchdata主链上的区块，其更早的祖先直接按高度取
+    std::vector<const BranchBlockData*> vecOffChain;
+    uint256 joinHash = block.hashPrevBlock;
+    const BranchBlockData* pJoin = pPreIndex;
+    while (pJoin != nullptr && vecOffChain.size() < 1000)
+    {
+        if (pJoin->nHeight < branchdata.vecChainActive.size() && branchdata.vecChainActive[pJoin->nHeight] == joinHash)
+            break;
+        vecOffChain.push_back(pJoin);
+        joinHash = pJoin->header.hashPrevBlock;
+        pJoin = GetBranchBlockData(branchdata, joinHash, params.GetBranchHash(), pBranchCache);
+    }
+    const int iJoinHeight = pJoin ? (int)pJoin->nHeight : -1;
+    // 深度为depth的祖先hash，不存在时返回false
+    auto getAncestorHash = [&](int depth, uint256& hash) {
+        if (depth < (int)vecOffChain.size()) {
+            hash = depth == 0 ? block.hashPrevBlock : vecOffChain[depth - 1]->header.hashPrevBlock;
+            return true;
+        }
+        int height = iJoinHeight - (depth - (int)vecOffChain.size());
+        if (pJoin == nullptr || height < 0)
+            return false;
+        hash = branchdata.vecChainActive[height];
+        return true;
+    };
+
     // 计算前100个区块的平均值
     {
         MCAmount iAvg = 0;
-        const BranchBlockData* ptest = pPreIndex;
         int i = 0;
-        for (; i < 100; ++i)
+        for (; i < 100 && i < (int)vecOffChain.size(); ++i)
+            iAvg += vecOffChain[i]->header.nNonce;
+        const int iRest = std::min(100 - i, iJoinHeight + 1);
+        uint64_t sum = 0;
+        if (iRest > 0 && branchdata.GetChainNonceSum(joinHash, iJoinHeight, iRest, sum))
+        {
+            iAvg += sum;
+            i += iRest;
+        }
+        else
         {
-            if (ptest == NULL)
+            const BranchBlockData* ptest = pJoin;
+            for (; i < 100 && ptest != nullptr; ++i)
             {
-                break;
+                iAvg += ptest->header.nNonce;
+                ptest = GetBranchBlockData(branchdata, ptest->header.hashPrevBlock, params.GetBranchHash(), pBranchCache);
             }
-            iAvg += ptest->header.nNonce;
-
-            ptest = GetBranchBlockData(branchdata, ptest->header.hashPrevBlock, params.GetBranchHash(), pBranchCache);
         }
         iAvg /= i;
         if (iAvg > 100 && total > iAvg + iAvg / 20) {
@@ -1427,28 +1633,11 @@ uint32_t GetBlockHeaderWork(const MCBranchBlockInfo& block, uint256& block_hash,
     MCHashWriter sheader(nType, nVersion);
     MCHashWriter snum(nType, nVersion);
 
-    int iCheck2 = 2;
-    int iCheck3 = 3;
-    const BranchBlockData* pNextIndex = pPreIndex;
-    for (int i = 0; i < 1000; ++i)
-    {
-        if (pNextIndex == NULL)
-        {
-            break;
-        }
-        if (i == iCheck2)
-        {
-            iCheck2 *= 2;
-            sheader << pNextIndex->header.GetHash();
-        }
-        if (i == iCheck3)
-        {
-            iCheck3 *= 3;
-            snum << pNextIndex->header.GetHash();
-        }
-
-        pNextIndex = GetBranchBlockData(branchdata, pNextIndex->header.hashPrevBlock, params.GetBranchHash(), pBranchCache);
-    }
+    uint256 ancestorHash;
+    for (int i = 2; i < 1000 && getAncestorHash(i, ancestorHash); i *= 2)
+        sheader << ancestorHash;
+    for (int i = 3; i < 1000 && getAncestorHash(i, ancestorHash); i *= 3)
+        snum << ancestorHash;
 
     sheader << (uint160)kKey;
     sheader << out.hash;
@@ -1487,7 +1676,7 @@ uint32_t GetBlockHeaderWork(const MCBranchBlockInfo& block, uint256& block_hash,
 ////---------------------------------------------------------
 //主链检查侧链头工作量
 //核心和 CheckBlockWork 相同
-bool CheckBlockHeaderWork(const MCBranchBlockInfo& block, MCValidationState& state, const MCChainParams &params, BranchData& branchdata, BranchCache *pBranchCache)
+bool CheckBlockHeaderWork(const MCBranchBlockInfo& block, MCValidationState& state, const MCChainParams &params, const BranchData& branchdata, BranchCache *pBranchCache)
 {
     const Consensus::Params& consensusParams = params.GetConsensus();
 
@@ -1636,7 +1825,7 @@ unsigned int GetNextWorkRequired(const MCBlockIndex* pindexLast, const MCBlockHe
 }
 ////---------------------------------------------------------
 //主链上获取侧链的nextwork
-unsigned int GetBranchNextWorkRequired(const BranchBlockData* pindexLast, const MCBlockHeader* pblock, const MCChainParams& params, BranchData &branchdata, BranchCache *pBranchCache)
+unsigned int GetBranchNextWorkRequired(const BranchBlockData* pindexLast, const MCBlockHeader* pblock, const MCChainParams& params, const BranchData &branchdata, BranchCache *pBranchCache)
 {
     const Consensus::Params& consensusParams = params.GetConsensus();
     unsigned int nProofOfWorkLimit = UintToArith256(consensusParams.powLimit).GetCompact();
@@ -1696,7 +1885,7 @@ unsigned int GetBranchNextWorkRequired(const BranchBlockData* pindexLast, const
 }
 ////---------------------------------------------------------
 //主链上验证侧链
-bool BranchContextualCheckBlockHeader(const MCBlockHeader& block, MCValidationState& state, const MCChainParams& params, BranchData &branchdata, 
+bool BranchContextualCheckBlockHeader(const MCBlockHeader& block, MCValidationState& state, const MCChainParams& params, const BranchData &branchdata, 
     int64_t nAdjustedTime, BranchCache *pBranchCache)
 {
     const BranchBlockData* pindexPrev = GetBranchBlockData(branchdata, block.hashPrevBlock, params.GetBranchHash(), pBranchCache);
@@ -2066,6 +2255,7 @@ std::unique_ptr<MCBlockTemplate> BlockAssembler::CreateNewBlock(const MCScript&
     }
 
 	int64_t nTime2 = GetTimeMicros();
+	nLastBlockTemplateTime = nTime2;
 	LogPrint(BCLog::MINING, "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
 
 	return std::move(pblocktemplate);
@@ -2091,12 +2281,12 @@ void BlockAssembler::addReportProofTx(const MCTransactionRef &ptxReport, const M
     if (!g_pBranchDb->HasBranchData(reportbranchid))
         return;
 
-    BranchData branchdata = g_pBranchDb->GetBranchData(reportbranchid);
+    const BranchData& branchdata = g_pBranchDb->GetBranchData(reportbranchid);
     if (!branchdata.mapHeads.count(reportblockhash))// best chain check?
         return;
     
     // 从stake交易取出prevout(抵押币)
-    BranchBlockData blockdata = branchdata.mapHeads[reportblockhash];
+    BranchBlockData blockdata = branchdata.mapHeads.at(reportblockhash);
     uint256 coinfromtxid;
     if (!GetMortgageCoinData(blockdata.pStakeTx->vout[0].scriptPubKey, &coinfromtxid))
         return;
@@ -19,6 +19,7 @@ extern uint64_t ReservePubContractBlockDataSize;
 extern uint64_t ReserveCallContractBlockDataSize;
 extern uint64_t ReserveBranchTxBlockDataSize;
 
+class Coin;
 class MCBlockIndex;
 class MCChainParams;
 class MCScript;
@@ -246,5 +247,22 @@ private:
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(MCBlock* pblock, const MCBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(MCBlockHeader* pblock, const Consensus::Params& consensusParams, const MCBlockIndex* pindexPrev);
+/** Whether a block built on pindexPrev that pays scriptPubKey and stakes outpoint would pass CheckBlockWork.
+ *  The block work only depends on these, so this is checked before assembling a block for the stake.
+ *  The stake coin is read from view, which should be the view the block is assembled from. */
+bool StakeMeetsTarget(const MCBlockIndex* pindexPrev, const MCScript& scriptPubKey, const MCOutPoint& outpoint, const MCCoinsView& view, const Consensus::Params& consensusParams);
+/** Same as above with the stake coin already read; does not need cs_main as long as pindexPrev stays in the block index. */
+bool StakeMeetsTarget(const MCBlockIndex* pindexPrev, const MCScript& scriptPubKey, const MCOutPoint& outpoint, const Coin& coin, const Consensus::Params& consensusParams);
+
+/** Statistics of the stake search of the miner threads, for getmininginfo. */
+struct StakeSearchStats
+{
+    int nThreads;
+    size_t nCandidates;       // 当前快照的候选个数
+    uint64_t nEvaluated;      // 启动以来评估的候选个数
+    double dCandidatesPerSec; // 上一个快照的评估速度
+    int64_t nTimeToTemplate;  // 上次从新tip到区块模板生成的毫秒数，没有时为-1
+};
+StakeSearchStats GetStakeSearchStats();
 
 #endif // MAGNACHAIN_MINER_H
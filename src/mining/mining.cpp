@@ -232,6 +232,18 @@ UniValue generateBlocks(MCWallet* keystoreIn, std::vector<MCOutput>& vecOutput,
             outpoint.n = out.i;
         }
 
+        // 先只计算工作量，达不到难度的输出不必组装区块
+        // 侧链的第2个块要从区块中的交易取抵押币，仍然组装后再检查
+        {
+            LOCK(cs_main);
+            MCBlockIndex* pindexPrev = chainActive.Tip();
+            if ((Params().IsMainChain() || pindexPrev->nHeight > 0) &&
+                !StakeMeetsTarget(pindexPrev, scriptPubKey, outpoint, *pcoinsCache, Params().GetConsensus())) {
+                nTries++;
+                continue;
+            }
+        }
+
         ContractContext contractContext;
         BlockAssembler::Options options = BlockAssembler::DefaultOptions(Params());
         options.outpoint = outpoint;
@@ -582,6 +594,13 @@ UniValue getmininginfo(const JSONRPCRequest& request)
             "  \"networkhashps\": nnn,      (numeric) The network hashes per second\n"
             "  \"pooledtx\": n              (numeric) The size of the mempool\n"
             "  \"chain\": \"xxxx\",           (string) current network name as defined in BIP70 (main, test, regtest)\n"
+            "  \"staking\": {                (json object) stake search of the built-in miner\n"
+            "    \"threads\": n,             (numeric) number of miner threads\n"
+            "    \"candidates\": n,          (numeric) stake outputs in the snapshot of the current tip\n"
+            "    \"evaluated\": n,           (numeric) stake outputs evaluated since the node started\n"
+            "    \"candidatespersec\": x.x,  (numeric) stake outputs evaluated per second for the last tip\n"
+            "    \"timetotemplate\": n       (numeric) milliseconds from a new tip to the block template of the last found stake, -1 if none\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmininginfo", "")
@@ -589,6 +608,15 @@ UniValue getmininginfo(const JSONRPCRequest& request)
         );
 
 
+    // 在cs_main之外取得，建立快照时先持有其锁再加cs_main
+    StakeSearchStats stakeStats = GetStakeSearchStats();
+    UniValue staking(UniValue::VOBJ);
+    staking.push_back(Pair("threads", stakeStats.nThreads));
+    staking.push_back(Pair("candidates", (uint64_t)stakeStats.nCandidates));
+    staking.push_back(Pair("evaluated", stakeStats.nEvaluated));
+    staking.push_back(Pair("candidatespersec", stakeStats.dCandidatesPerSec));
+    staking.push_back(Pair("timetotemplate", stakeStats.nTimeToTemplate));
+
     LOCK(cs_main);
 
     UniValue obj(UniValue::VOBJ);
@@ -600,6 +628,7 @@ UniValue getmininginfo(const JSONRPCRequest& request)
     obj.push_back(Pair("networkhashps",    getnetworkhashps(request)));
     obj.push_back(Pair("pooledtx",         (uint64_t)mempool.Size()));
     obj.push_back(Pair("chain",            Params().NetworkIDString()));
+    obj.push_back(Pair("staking",          staking));
     return obj;
 }
 
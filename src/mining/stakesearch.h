@@ -0,0 +1,88 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef MAGNACHAIN_STAKESEARCH_H
+#define MAGNACHAIN_STAKESEARCH_H
+
+#include "mining/miner.h"
+#include "validation/validationinterface.h"
+#include "wallet/wallet.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// 每次从快照中取出评估的候选个数
+static const size_t STAKE_CANDIDATE_CHUNK = 64;
+// 快照中的候选都达不到难度时，间隔多久(毫秒)重新评估，难度会随时间降低
+static const int64_t STAKE_RETRY_MILLIS = 1000;
+
+/** A stake output prepared while holding cs_main and evaluated without it. */
+struct StakeCandidate
+{
+    MCOutput output;
+    MCScript scriptPubKey; // coinbase的第一个输出
+    MCOutPoint outpoint;
+    Coin coin;
+
+    explicit StakeCandidate(const MCOutput& outputIn) : output(outputIn) {}
+};
+
+struct StakeSnapshot
+{
+    const MCBlockIndex* pindexPrev;
+    uint64_t nTipSequence;
+    bool fPrescreen; // 侧链第2个块要从区块交易中取抵押币，只能组装后检查
+    int64_t nTipTime; // 发现该tip的时间(微秒)
+    int64_t nStartTime; // 建立快照的时间(微秒)
+    std::vector<StakeCandidate> vCandidates;
+    std::atomic<size_t> nNext;
+    std::atomic<uint64_t> nEvaluated;
+    std::atomic<int64_t> nLastEvalTime;
+
+    StakeSnapshot() : pindexPrev(nullptr), nTipSequence(0), fPrescreen(true), nTipTime(0), nStartTime(0), nNext(0), nEvaluated(0), nLastEvalTime(0) {}
+};
+
+/**
+ * Stake search shared by the miner threads.
+ *
+ * For each tip one thread takes a snapshot of the wallet's stake outputs and
+ * their coins while holding cs_main and cs_wallet. All miner threads then take
+ * chunks of the snapshot and evaluate the stake work in parallel without any
+ * lock, and only a thread that finds a stake meeting the target assembles a
+ * block. A new tip stops the evaluation of the old snapshot.
+ */
+class StakeSearch : public MCValidationInterface
+{
+public:
+    StakeSearch() : nThreads(0), nTipSequence(0), nTotalEvaluated(0), dCandidatesPerSec(0), nTimeToTemplate(-1) {}
+
+    std::shared_ptr<StakeSnapshot> GetSnapshot(MCWallet* pwallet);
+    // 从nPos继续评估，快照评估完或出现新tip时返回false
+    bool FindStake(StakeSnapshot& snapshot, size_t& nPos, size_t& nEnd, const StakeCandidate*& pFound);
+    void BlockGenerated(const StakeSnapshot& snapshot);
+    bool IsStale(const StakeSnapshot& snapshot) const { return snapshot.nTipSequence != nTipSequence; }
+
+    void SetThreads(int n);
+    StakeSearchStats GetStats();
+
+protected:
+    void UpdatedBlockTip(const MCBlockIndex* pindexNew, const MCBlockIndex* pindexFork, bool fInitialDownload) override { ++nTipSequence; }
+
+private:
+    std::mutex cs; // 只在建立快照时持有，在cs_main之前加锁
+    std::shared_ptr<StakeSnapshot> pSnapshot;
+    std::atomic<uint64_t> nTipSequence;
+
+    std::mutex csStats;
+    int nThreads;
+    uint64_t nTotalEvaluated; // 不含当前快照
+    double dCandidatesPerSec;
+    int64_t nTimeToTemplate;
+
+    void FinishSnapshot(const StakeSnapshot& snapshot);
+};
+
+#endif // MAGNACHAIN_STAKESEARCH_H
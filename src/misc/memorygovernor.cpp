@@ -0,0 +1,97 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "misc/memorygovernor.h"
+#include "utils/util.h"
+
+MemoryGovernor g_memoryGovernor;
+
+void MemoryGovernor::SetBudget(size_t nBudgetIn)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    nBudget = nBudgetIn;
+}
+
+size_t MemoryGovernor::GetBudget() const
+{
+    std::lock_guard<std::mutex> lock(cs);
+    return nBudget;
+}
+
+void MemoryGovernor::Register(const std::string& strName, size_t nLimit, const UsageFunc& usage, const EvictFunc& evict, bool fInBudget)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    Component component{ strName, nLimit, usage, evict, fInBudget, 0 };
+    for (Component& c : vComponents) {
+        if (c.strName == strName) {
+            c = component;
+            return;
+        }
+    }
+    vComponents.push_back(component);
+}
+
+void MemoryGovernor::Clear()
+{
+    std::lock_guard<std::mutex> lock(cs);
+    vComponents.clear();
+}
+
+void MemoryGovernor::CountEviction(const std::string& strName)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    for (Component& c : vComponents) {
+        if (c.strName == strName)
+            ++c.nEvictions;
+    }
+}
+
+void MemoryGovernor::Check()
+{
+    // 组件的用量和换出函数可能要取其他锁，在本锁外调用
+    std::vector<Component> components;
+    size_t nBudgetCopy;
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        components = vComponents;
+        nBudgetCopy = nBudget;
+    }
+
+    size_t nTotal = 0;
+    std::vector<size_t> vUsage(components.size());
+    for (size_t i = 0; i < components.size(); ++i) {
+        vUsage[i] = components[i].usage();
+        if (components[i].fInBudget)
+            nTotal += vUsage[i];
+    }
+
+    const bool fPressure = nBudgetCopy > 0 && nTotal > nBudgetCopy;
+    if (fPressure)
+        LogPrint(BCLog::DB, "Memory usage %.1fMiB over the budget of %.1fMiB\n", nTotal * (1.0 / 1024 / 1024), nBudgetCopy * (1.0 / 1024 / 1024));
+
+    for (size_t i = 0; i < components.size(); ++i) {
+        const Component& c = components[i];
+        if (!c.evict)
+            continue;
+        size_t nTarget = fPressure ? c.nLimit / 2 : c.nLimit;
+        if (vUsage[i] <= nTarget)
+            continue;
+        LogPrint(BCLog::DB, "Evicting %s from %.1fMiB to %.1fMiB\n", c.strName, vUsage[i] * (1.0 / 1024 / 1024), nTarget * (1.0 / 1024 / 1024));
+        c.evict(nTarget);
+        CountEviction(c.strName);
+    }
+}
+
+std::vector<MemoryComponentInfo> MemoryGovernor::GetComponents() const
+{
+    std::vector<Component> components;
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        components = vComponents;
+    }
+
+    std::vector<MemoryComponentInfo> infos;
+    for (const Component& c : components)
+        infos.push_back(MemoryComponentInfo{ c.strName, c.nLimit, c.usage(), c.fInBudget, (bool)c.evict, c.nEvictions });
+    return infos;
+}
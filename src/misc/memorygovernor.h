@@ -0,0 +1,78 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef MAGNACHAIN_MEMORYGOVERNOR_H
+#define MAGNACHAIN_MEMORYGOVERNOR_H
+
+#include <functional>
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// 检查各组件内存用量的间隔(秒)
+static const int MEMORY_GOVERNOR_INTERVAL = 10;
+
+struct MemoryComponentInfo
+{
+    std::string strName;
+    size_t nLimit;
+    size_t nUsage;
+    bool fInBudget;
+    bool fEvictable;
+    uint64_t nEvictions;
+};
+
+/**
+ * Accounts the memory of the databases and in-process caches against the
+ * -dbcache budget.
+ *
+ * init.cpp splits the budget between the components and registers each one
+ * with its limit and a function returning its current usage. Components that
+ * can drop data also give an evict function, which is called with the size
+ * to shrink to. Check runs on the scheduler: a component over its limit is
+ * shrunk to the limit, and while the total of the budgeted components is
+ * over the budget every evictable component is shrunk to half of its limit.
+ * Components outside the budget, like the mempool, are only reported.
+ */
+class MemoryGovernor
+{
+public:
+    typedef std::function<size_t()> UsageFunc;
+    typedef std::function<void(size_t nTarget)> EvictFunc;
+
+    MemoryGovernor() : nBudget(0) {}
+
+    void SetBudget(size_t nBudgetIn);
+    size_t GetBudget() const;
+
+    // 同名组件会被替换
+    void Register(const std::string& strName, size_t nLimit, const UsageFunc& usage, const EvictFunc& evict = EvictFunc(), bool fInBudget = true);
+    // 在组件销毁前调用
+    void Clear();
+
+    void Check();
+
+    std::vector<MemoryComponentInfo> GetComponents() const;
+
+private:
+    struct Component
+    {
+        std::string strName;
+        size_t nLimit;
+        UsageFunc usage;
+        EvictFunc evict;
+        bool fInBudget;
+        uint64_t nEvictions;
+    };
+
+    mutable std::mutex cs;
+    size_t nBudget;
+    std::vector<Component> vComponents;
+
+    void CountEviction(const std::string& strName);
+};
+
+extern MemoryGovernor g_memoryGovernor;
+
+#endif // MAGNACHAIN_MEMORYGOVERNOR_H
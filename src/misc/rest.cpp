@@ -12,7 +12,9 @@
 #include "validation/validation.h"
 #include "net/http/httpserver.h"
 #include "rpc/blockchain.h"
+#include "rpc/contractrpc.h"
 #include "rpc/server.h"
+#include "smartcontract/contractquery.h"
 #include "io/streams.h"
 #include "thread/sync.h"
 #include "transaction/txmempool.h"
@@ -587,6 +589,46 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+// POST一个与querycontracts参数相同的json数组
+static bool rest_contractquery(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+
+    switch (rf) {
+    case RF_JSON: {
+        UniValue calls;
+        if (!calls.read(req->ReadBody()) || !calls.isArray())
+            return RESTERR(req, HTTP_BAD_REQUEST, "Body must be a json array of contract calls");
+
+        // 公开接口，整个请求共用一份指令数
+        UniValue queryObject;
+        try {
+            queryObject = QueryContracts(calls, std::max<int64_t>(1, gArgs.GetArg("-restcontractquerybudget", DEFAULT_REST_CONTRACT_QUERY_BUDGET)));
+        }
+        catch (const UniValue& objError) {
+            return RESTERR(req, HTTP_BAD_REQUEST, find_value(objError, "message").get_str());
+        }
+        catch (const std::exception& e) {
+            return RESTERR(req, HTTP_BAD_REQUEST, e.what());
+        }
+
+        std::string strJSON = queryObject.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: json)");
+    }
+    }
+
+    // not reached
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
 static const struct {
     const char* prefix;
     bool (*handler)(HTTPRequest* req, const std::string& strReq);
@@ -599,6 +641,7 @@ static const struct {
       {"/rest/mempool/contents", rest_mempool_contents},
       {"/rest/headers/", rest_headers},
       {"/rest/getutxos", rest_getutxos},
+      {"/rest/contractquery", rest_contractquery},
 };
 
 bool StartREST()
@@ -15,26 +15,39 @@
 #include <cppconn/resultset.h>
 #include <cppconn/statement.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+
+// 区块缓存，包含已写入和写入队列中的区块，由写入线程在写入失败时移除
+std::mutex csBlocks;
 std::map<uint256, DatabaseBlock> blocks;
+// 写入队列中的区块不从缓存清除
+std::set<uint256> setWritingBlocks;
 
 sql::Driver* sqlDriver;
+// 消息线程查询用，自动提交以读到写入线程提交的数据
 std::unique_ptr<sql::Connection> sqlConnection;
 std::unique_ptr<sql::Statement> sqlStatement;
 std::unique_ptr<sql::PreparedStatement> selectBlockStatement;
-std::unique_ptr<sql::PreparedStatement> insertBlockStatement;
-std::unique_ptr<sql::PreparedStatement> insertTransactionStatement;
-std::unique_ptr<sql::PreparedStatement> insertTxInStatement;
-std::unique_ptr<sql::PreparedStatement> insertTxOutStatement;
-std::unique_ptr<sql::PreparedStatement> insertContractStatement;
-std::unique_ptr<sql::PreparedStatement> insertBranchBlockDataStatement;
-std::unique_ptr<sql::PreparedStatement> insertPMTStatement;
-std::unique_ptr<sql::PreparedStatement> insertReportDataStatement;
-std::unique_ptr<sql::PreparedStatement> insertContractPrevDataItemStatement;
-std::unique_ptr<sql::PreparedStatement> insertContractInfoStatement;
+static const char SELECT_BLOCK_SQL[] = "SELECT `hashprevblock`, `hashskipblock`, `height` FROM `block` WHERE `blockhash` = ?;";
+// 写入线程的连接，每个区块一个事务
+std::unique_ptr<sql::Connection> sqlWriterConnection;
+
+class DatabaseWriter;
+std::unique_ptr<DatabaseWriter> databaseWriter;
+// 开始关闭后不再接受新的区块
+std::atomic<bool> fDBShutdown(false);
 
 int GetDatabaseBlock(DatabaseBlock* block, const uint256& hashBlock)
 {
     int height = -1;
+    std::unique_lock<std::mutex> lock(csBlocks);
     std::map<uint256, DatabaseBlock>::iterator iter = blocks.find(hashBlock);
     if (iter != blocks.end()) {
         height = iter->second.height;
@@ -46,6 +59,7 @@ int GetDatabaseBlock(DatabaseBlock* block, const uint256& hashBlock)
         }
     }
     else {
+        lock.unlock();
         selectBlockStatement->setString(1, hashBlock.ToString());
         std::unique_ptr<sql::ResultSet> resultSet(selectBlockStatement->executeQuery());
         if (resultSet == nullptr || !resultSet->next()) {
@@ -67,13 +81,15 @@ int GetDatabaseBlock(DatabaseBlock* block, const uint256& hashBlock)
 
 void AddDatabaseBlock(const uint256& hashBlock, const uint256& hashPrevBlock, const uint256& hashSkipBlock, const int height)
 {
+    std::lock_guard<std::mutex> lock(csBlocks);
     blocks[hashBlock] = std::move(DatabaseBlock{ hashBlock, hashPrevBlock, hashSkipBlock, height });
+    setWritingBlocks.insert(hashBlock);
 
     // clean cache
     std::vector<std::map<uint256, DatabaseBlock>::iterator> iters;
     int maturityHeight = std::max(height - COINBASE_MATURITY, 0);
     for (auto iter = blocks.begin(); iter != blocks.end();) {
-        if (iter->second.height < maturityHeight) {
+        if (iter->second.height < maturityHeight && !setWritingBlocks.count(iter->first)) {
             iter = blocks.erase(iter);
         }
         else {
@@ -155,90 +171,556 @@ MCBlockLocator MonitorGetLocator(const MCBlockIndex *pindex)
     return MCBlockLocator(vHave);
 }
 
-bool DBCreateTable()
+// 一条多行INSERT的参数
+struct MonitorValue
 {
-    int size = sizeof(sqls) / sizeof(char*);
-    for (int i = 0; i < size; ++i) {
-        if (!sqlStatement->execute(sqls[i])) {
-            const sql::SQLWarning* warnings = sqlStatement->getWarnings();
-            if (warnings != nullptr && warnings->getErrorCode() != 1050) {
-                LogPrintf("%s:%d => %s\n", __FUNCTION__, __LINE__, warnings->getMessage().c_str());
-                return false;
+    enum Type { INT, STRING, BLOB };
+
+    Type type;
+    int64_t n;
+    std::string str;
+};
+
+/**
+ * Collects the rows of one table and writes them with multi-row INSERTs.
+ * A statement holds at most MONITOR_ROWS_PER_INSERT rows and about
+ * MONITOR_BYTES_PER_INSERT bytes of values, and the prepared statements are
+ * kept by their row count.
+ */
+class BatchInsert
+{
+public:
+    BatchInsert(sql::Connection* conn, const std::string& strTable, const std::vector<std::string>& vColumns)
+        : conn(conn), nColumns(vColumns.size()), nRows(0), nRowBytes(0)
+    {
+        strPrefix = "INSERT INTO `" + strTable + "`(";
+        strRow = "(";
+        for (size_t i = 0; i < vColumns.size(); ++i) {
+            strPrefix += (i > 0 ? ", `" : "`") + vColumns[i] + "`";
+            strRow += (i > 0 ? ", ?" : "?");
+        }
+        strPrefix += ") VALUES";
+        strRow += ")";
+    }
+
+    BatchInsert& Int(int64_t n)
+    {
+        values.push_back(MonitorValue{ MonitorValue::INT, n, std::string() });
+        nRowBytes += sizeof(n);
+        return *this;
+    }
+
+    BatchInsert& String(const std::string& str)
+    {
+        values.push_back(MonitorValue{ MonitorValue::STRING, 0, str });
+        nRowBytes += str.size();
+        return *this;
+    }
+
+    BatchInsert& Blob(const std::string& str)
+    {
+        values.push_back(MonitorValue{ MonitorValue::BLOB, 0, str });
+        nRowBytes += str.size();
+        return *this;
+    }
+
+    // 一行的参数都加入后调用
+    void EndRow()
+    {
+        assert(values.size() == (nRows + 1) * nColumns);
+        vRowBytes.push_back(nRowBytes);
+        nRowBytes = 0;
+        ++nRows;
+    }
+
+    size_t Rows() const { return nRows; }
+
+    void Clear()
+    {
+        values.clear();
+        vRowBytes.clear();
+        nRows = 0;
+        nRowBytes = 0;
+    }
+
+    // 出错时抛出sql::SQLException
+    void Execute()
+    {
+        size_t nBegin = 0;
+        while (nBegin < nRows) {
+            size_t nEnd = nBegin;
+            size_t nBytes = 0;
+            while (nEnd < nRows && nEnd - nBegin < MONITOR_ROWS_PER_INSERT && (nEnd == nBegin || nBytes + vRowBytes[nEnd] <= MONITOR_BYTES_PER_INSERT))
+                nBytes += vRowBytes[nEnd++];
+
+            sql::PreparedStatement* statement = GetStatement(nEnd - nBegin);
+            std::vector<std::unique_ptr<std::istringstream>> streams;
+            for (size_t i = nBegin * nColumns; i < nEnd * nColumns; ++i) {
+                const MonitorValue& value = values[i];
+                unsigned int index = i - nBegin * nColumns + 1;
+                if (value.type == MonitorValue::INT) {
+                    statement->setInt64(index, value.n);
+                }
+                else if (value.type == MonitorValue::STRING) {
+                    statement->setString(index, value.str);
+                }
+                else {
+                    streams.emplace_back(new std::istringstream(value.str));
+                    statement->setBlob(index, streams.back().get());
+                }
             }
+            statement->executeUpdate();
+            nBegin = nEnd;
+        }
+        Clear();
+    }
+
+private:
+    sql::Connection* conn;
+    std::string strPrefix;
+    std::string strRow;
+    size_t nColumns;
+    std::vector<MonitorValue> values;
+    std::vector<size_t> vRowBytes;
+    size_t nRows;
+    size_t nRowBytes;
+    std::map<size_t, std::unique_ptr<sql::PreparedStatement>> mapStatements;
+
+    sql::PreparedStatement* GetStatement(size_t nCount)
+    {
+        std::unique_ptr<sql::PreparedStatement>& statement = mapStatements[nCount];
+        if (statement == nullptr) {
+            std::string sql = strPrefix;
+            for (size_t i = 0; i < nCount; ++i)
+                sql += (i > 0 ? ", " : " ") + strRow;
+            sql += ";";
+            statement.reset(conn->prepareStatement(sql));
+        }
+        return statement.get();
+    }
+};
+
+/**
+ * Writes the received blocks to MySQL on its own thread and connection.
+ *
+ * The message thread computes the height and skip block of a block, adds it
+ * to the block cache and queues it; it waits while MONITOR_WRITE_QUEUE
+ * blocks are already queued. The writer collects the rows of every table and
+ * writes each block in one transaction with multi-row INSERTs, so a block is
+ * either fully written or not at all. When a block fails to be written it is
+ * removed from the cache, and so are the queued blocks building on it, so
+ * they are requested again. The written rows per second and the queue depth
+ * are logged every MONITOR_STATS_INTERVAL seconds.
+ */
+class DatabaseWriter
+{
+public:
+    struct Job
+    {
+        std::shared_ptr<const MCBlock> pblock;
+        int height;
+        uint256 hashSkipBlock;
+    };
+
+    DatabaseWriter(sql::Connection* connIn, size_t nMaxQueueIn)
+        : conn(connIn), nMaxQueue(std::max<size_t>(1, nMaxQueueIn)), fShutdown(false),
+        insertBlock(conn, "block", { "blockhash", "hashprevblock", "hashskipblock", "hashmerkleroot",
+            "height", "version", "time", "bits", "nonce", "regtest", "branchid" }),
+        insertTransaction(conn, "transaction", { "txhash", "blockhash", "blockindex", "version", "locktime",
+            "branchvseeds", "branchseedspec6", "sendtobranchid", "sendtotxhexdata", "frombranchid", "fromtx",
+            "inamount", "reporttxid", "coinpreouthash", "provetxid" }),
+        insertTxIn(conn, "txin", { "txhash", "txindex", "outpointhash", "outpointindex", "sequence", "scriptsig" }),
+        insertTxOut(conn, "txout", { "txhash", "txindex", "value", "scriptpubkey" }),
+        insertContract(conn, "contract", { "txhash", "contractid", "sender", "codeorfunc", "args", "amountout", "signature" }),
+        insertBranchBlockData(conn, "branchblockdata", { "txhash", "version", "hashprevblock", "hashmerkleroot",
+            "hashmerklerootwithdata", "hashmerklerootwithprevdata", "time", "bits", "nonce",
+            "prevoutstakehash", "prevoutstakeindex", "blocksig", "branchid", "blockheight", "staketxdata" }),
+        insertPMT(conn, "pmt", { "txhash", "blockhash", "pmt" }),
+        insertReportData(conn, "reportdata", { "txhash", "reporttype", "reportedbranchid", "reportedblockhash",
+            "reportedtxhash", "contractcoins", "contractreportedspvproof", "contractprovetxhash", "contractprovespvproof" }),
+        insertContractPrevDataItem(conn, "contractprevdataitem", { "txhash", "contractid", "blockhash", "txindex" }),
+        insertContractInfo(conn, "contractinfo", { "txhash", "contractid", "txindex", "blockhash", "code", "data" }),
+        selectBlock(conn->prepareStatement(SELECT_BLOCK_SQL)),
+        nBlocks(0), nRows(0), nLastStatsTime(GetTime()), nLastStatsRows(0)
+    {
+        thread = std::thread(&TraceThread<std::function<void()> >, "monitorwriter", std::function<void()>(std::bind(&DatabaseWriter::ThreadMain, this)));
+    }
+
+    // 写完队列中的区块后退出
+    ~DatabaseWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(cs);
+            fShutdown = true;
         }
+        cond.notify_all();
+        condFull.notify_all();
+        thread.join();
     }
 
-    sqlConnection->setAutoCommit(false);
+    // 已开始关闭时返回false
+    bool Push(Job&& job)
+    {
+        std::unique_lock<std::mutex> lock(cs);
+        condFull.wait(lock, [this] { return fShutdown || queue.size() < nMaxQueue; });
+        if (fShutdown)
+            return false;
+        queue.push_back(std::move(job));
+        cond.notify_one();
+        return true;
+    }
 
+private:
+    sql::Connection* conn;
+    size_t nMaxQueue;
+
+    std::mutex cs;
+    std::condition_variable cond;
+    std::condition_variable condFull;
+    std::deque<Job> queue;
+    bool fShutdown;
+    std::thread thread;
+
+    BatchInsert insertBlock;
+    BatchInsert insertTransaction;
+    BatchInsert insertTxIn;
+    BatchInsert insertTxOut;
+    BatchInsert insertContract;
+    BatchInsert insertBranchBlockData;
+    BatchInsert insertPMT;
+    BatchInsert insertReportData;
+    BatchInsert insertContractPrevDataItem;
+    BatchInsert insertContractInfo;
+    // 与selectBlockStatement相同，语句不能跨线程共用
+    std::unique_ptr<sql::PreparedStatement> selectBlock;
+
+    // 写入失败的区块，其后续区块也不写入
+    std::set<uint256> setFailed;
+    uint64_t nBlocks;
+    uint64_t nRows;
+    int64_t nLastStatsTime;
+    uint64_t nLastStatsRows;
+
+    void ThreadMain()
+    {
+        // 连接器要求每个使用连接的线程初始化和释放线程数据
+        sqlDriver->threadInit();
+        std::unique_lock<std::mutex> lock(cs);
+        while (true) {
+            cond.wait(lock, [this] { return fShutdown || !queue.empty(); });
+            if (queue.empty())
+                break;
+
+            Job job = std::move(queue.front());
+            queue.pop_front();
+            size_t nQueue = queue.size();
+            condFull.notify_one();
+            lock.unlock();
+            WriteJob(job);
+            LogStats(nQueue);
+            lock.lock();
+        }
+        lock.unlock();
+        sqlDriver->threadEnd();
+    }
+
+    void WriteJob(const Job& job)
     {
-        char sql[] = "SELECT `hashprevblock`, `hashskipblock`, `height` FROM `block` WHERE `blockhash` = ?;";
-        selectBlockStatement.reset(sqlConnection->prepareStatement(sql));
+        const MCBlock& block = *job.pblock;
+        const uint256 hashBlock = block.GetHash();
+        bool fWritten = false;
+        if (setFailed.count(block.hashPrevBlock)) {
+            LogPrintf("%s:%d => skip %s, prev block was not written\n", __FUNCTION__, __LINE__, hashBlock.ToString());
+        }
+        else {
+            try {
+                AddBlock(block, job.height, job.hashSkipBlock);
+                AddTransactions(block);
+                size_t nBlockRows = Execute();
+                conn->commit();
+                nRows += nBlockRows;
+                ++nBlocks;
+                fWritten = true;
+            }
+            catch (sql::SQLException& e) {
+                LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, e.getErrorCode(), e.what());
+                ClearRows();
+                try {
+                    conn->rollback();
+                }
+                catch (sql::SQLException& ex) {
+                    LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, ex.getErrorCode(), ex.what());
+                }
+                // 主键冲突且区块记录已存在时与写入成功相同，其他表的冲突仍是失败
+                fWritten = e.getErrorCode() == 1062 && BlockExists(hashBlock);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(csBlocks);
+        setWritingBlocks.erase(hashBlock);
+        if (!fWritten) {
+            blocks.erase(hashBlock);
+            if (setFailed.size() >= MONITOR_WRITE_QUEUE_MAX)
+                setFailed.clear();
+            setFailed.insert(hashBlock);
+        }
     }
 
+    bool BlockExists(const uint256& hashBlock)
     {
-        char sql[] = "INSERT INTO `block`(`blockhash`, `hashprevblock`, `hashskipblock`, `hashmerkleroot`"
-            ", `height`, `version`, `time`, `bits`, `nonce`, `regtest`, `branchid`)"
-            " VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
-        insertBlockStatement.reset(sqlConnection->prepareStatement(sql));
+        try {
+            selectBlock->setString(1, hashBlock.ToString());
+            std::unique_ptr<sql::ResultSet> resultSet(selectBlock->executeQuery());
+            return resultSet != nullptr && resultSet->next();
+        }
+        catch (sql::SQLException& e) {
+            LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, e.getErrorCode(), e.what());
+            return false;
+        }
     }
 
+    size_t Execute()
     {
-        char sql[] = "INSERT INTO `transaction`(`txhash`, `blockhash`, `blockindex`, `version`, `locktime`"
-            ", `branchvseeds`, `branchseedspec6`, `sendtobranchid`, `sendtotxhexdata`, `frombranchid`, `fromtx`"
-            ", `inamount`, `reporttxid`, `coinpreouthash`, `provetxid`)"
-            " VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
-        insertTransactionStatement.reset(sqlConnection->prepareStatement(sql));
+        size_t nBlockRows = 0;
+        for (BatchInsert* insert : { &insertBlock, &insertTransaction, &insertTxIn, &insertTxOut, &insertContract,
+                 &insertBranchBlockData, &insertPMT, &insertReportData, &insertContractPrevDataItem, &insertContractInfo }) {
+            nBlockRows += insert->Rows();
+            insert->Execute();
+        }
+        return nBlockRows;
     }
 
+    void ClearRows()
     {
-        char sql[] = "INSERT INTO `txin`(`txhash`, `txindex`, `outpointhash`, `outpointindex`"
-            ", `sequence`, `scriptsig`) VALUES(?, ?, ?, ?, ?, ?);";
-        insertTxInStatement.reset(sqlConnection->prepareStatement(sql));
+        for (BatchInsert* insert : { &insertBlock, &insertTransaction, &insertTxIn, &insertTxOut, &insertContract,
+                 &insertBranchBlockData, &insertPMT, &insertReportData, &insertContractPrevDataItem, &insertContractInfo }) {
+            insert->Clear();
+        }
     }
 
+    void LogStats(size_t nQueue)
     {
-        char sql[] = "INSERT INTO `txout`(`txhash`, `txindex`, `value`, `scriptpubkey`) VALUES(?, ?, ?, ?);";
-        insertTxOutStatement.reset(sqlConnection->prepareStatement(sql));
+        int64_t nNow = GetTime();
+        if (nNow - nLastStatsTime < MONITOR_STATS_INTERVAL)
+            return;
+        LogPrintf("Monitor database: %u blocks, %u rows, %.1f rows/s, queue %u/%u\n", nBlocks, nRows,
+            (nRows - nLastStatsRows) / (double)(nNow - nLastStatsTime), nQueue, nMaxQueue);
+        nLastStatsTime = nNow;
+        nLastStatsRows = nRows;
     }
 
+    void AddBlock(const MCBlock& block, int height, const uint256& hashSkipBlock)
     {
-        char sql[] = "INSERT INTO `contract`(`txhash`, `contractid`, `sender`, `codeorfunc`, `args`"
-            ", `amountout`, `signature`) VALUES(?, ?, ?, ?, ?, ?, ?);";
-        insertContractStatement.reset(sqlConnection->prepareStatement(sql));
+        bool isGenesisBlock = block.hashPrevBlock.IsNull();
+        insertBlock.String(block.GetHash().ToString())
+            .String(isGenesisBlock ? std::string() : block.hashPrevBlock.ToString())
+            .String(isGenesisBlock ? std::string() : hashSkipBlock.ToString())
+            .String(block.hashMerkleRoot.ToString())
+            .Int(height)
+            .Int(block.nVersion)
+            .Int(block.nTime)
+            .Int(block.nBits)
+            .Int(block.nNonce)
+            .Int(gArgs.GetBoolArg("-regtest", false))
+            .String(gArgs.GetArg("-branchid", ""))
+            .EndRow();
+    }
+
+    void AddTxIn(const MCTransactionRef& tx)
+    {
+        const std::string& txHash(tx->GetHash().ToString());
+        for (uint32_t i = 0; i < tx->vin.size(); ++i) {
+            const MCTxIn& txin = tx->vin[i];
+            if (txin.prevout.IsNull()) {
+                continue;
+            }
+
+            insertTxIn.String(txHash)
+                .Int(i)
+                .String(txin.prevout.hash.ToString())
+                .Int(txin.prevout.n)
+                .Int(txin.nSequence)
+                .Blob(std::string(txin.scriptSig.begin(), txin.scriptSig.end()))
+                .EndRow();
+        }
     }
 
+    void AddTxOut(const MCTransactionRef& tx)
     {
-        char sql[] = "INSERT INTO `branchblockdata`(`txhash`, `version`, `hashprevblock`, `hashmerkleroot`"
-            ", `hashmerklerootwithdata`, `hashmerklerootwithprevdata`, `time`, `bits`, `nonce`"
-            ", `prevoutstakehash`, `prevoutstakeindex`, `blocksig`, `branchid`, `blockheight`, `staketxdata`)"
-            " VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
-        insertBranchBlockDataStatement.reset(sqlConnection->prepareStatement(sql));
+        const std::string& txHash(tx->GetHash().ToString());
+        for (uint32_t i = 0; i < tx->vout.size(); ++i) {
+            const MCTxOut& txout = tx->vout[i];
+            insertTxOut.String(txHash)
+                .Int(i)
+                .Int(txout.nValue)
+                .Blob(std::string(txout.scriptPubKey.begin(), txout.scriptPubKey.end()))
+                .EndRow();
+        }
     }
 
+    void AddContract(const MCTransactionRef& tx)
     {
-        char sql[] = "INSERT INTO `pmt`(`txhash`, `blockhash`, `pmt`) VALUES(?, ?, ?);";
-        insertPMTStatement.reset(sqlConnection->prepareStatement(sql));
+        const std::shared_ptr<const ContractData> contractData = tx->pContractData;
+        if (contractData == nullptr) {
+            return;
+        }
+
+        insertContract.String(tx->GetHash().ToString())
+            .String(contractData->address.ToString())
+            .String(HexStr(contractData->sender))
+            .Blob(contractData->codeOrFunc)
+            .Blob(contractData->args)
+            .Int(contractData->amountOut)
+            .Blob(std::string(contractData->signature.begin(), contractData->signature.end()))
+            .EndRow();
     }
 
+    void AddBranchBlockData(const MCTransactionRef& tx)
+    {
+        const std::shared_ptr<const MCBranchBlockInfo> branchBlockData = tx->pBranchBlockData;
+        if (branchBlockData == nullptr) {
+            return;
+        }
+
+        insertBranchBlockData.String(tx->GetHash().ToString())
+            .Int(branchBlockData->nVersion)
+            .String(branchBlockData->hashPrevBlock.ToString())
+            .String(branchBlockData->hashMerkleRoot.ToString())
+            .String(branchBlockData->hashMerkleRootWithData.ToString())
+            .String(branchBlockData->hashMerkleRootWithPrevData.ToString())
+            .Int(branchBlockData->nTime)
+            .Int(branchBlockData->nBits)
+            .Int(branchBlockData->nNonce)
+            .String(branchBlockData->prevoutStake.hash.ToString())
+            .Int(branchBlockData->prevoutStake.n)
+            .Blob(std::string(branchBlockData->vchBlockSig.begin(), branchBlockData->vchBlockSig.end()))
+            .String(branchBlockData->branchID.ToString())
+            .Int(branchBlockData->blockHeight)
+            .Blob(std::string(branchBlockData->vchStakeTxData.begin(), branchBlockData->vchStakeTxData.end()))
+            .EndRow();
+    }
+
+    void AddPMT(const MCTransactionRef& tx)
     {
-        char sql[] = "INSERT INTO `reportdata`(`txhash`, `reporttype`, `reportedbranchid`, `reportedblockhash`"
-            ", `reportedtxhash`, `contractcoins`, `contractreportedspvproof`, `contractprovetxhash`"
-            ", `contractprovespvproof`) VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?);";
-        insertReportDataStatement.reset(sqlConnection->prepareStatement(sql));
+        const std::shared_ptr<const MCSpvProof> spvProof = tx->pPMT;
+        if (spvProof == nullptr) {
+            return;
+        }
+
+        MCDataStream pmt(SER_DISK, CLIENT_VERSION);
+        spvProof->pmt.Serialize(pmt);
+        insertPMT.String(tx->GetHash().ToString())
+            .String(spvProof->blockhash.ToString())
+            .Blob(pmt.str())
+            .EndRow();
     }
 
+    void AddReportData(const MCTransactionRef& tx)
     {
-        char sql[] = "INSERT INTO `contractprevdataitem`(`txhash`, `contractid`, `blockhash`"
-            ", `txindex`) VALUES(?, ?, ?, ?);";
-        insertContractPrevDataItemStatement.reset(sqlConnection->prepareStatement(sql));
+        const std::shared_ptr<const ReportData> reportData = tx->pReportData;
+        if (reportData == nullptr) {
+            return;
+        }
+
+        // 非合约举报没有合约数据，相应字段写默认值
+        MCDataStream contractReportedSpvProof(SER_DISK, CLIENT_VERSION);
+        MCDataStream contractProveSpvProof(SER_DISK, CLIENT_VERSION);
+        MCAmount contractCoins = 0;
+        uint256 contractProveTxHash;
+        if (reportData->contractData != nullptr) {
+            reportData->contractData->reportedSpvProof.Serialize(contractReportedSpvProof);
+            reportData->contractData->proveSpvProof.Serialize(contractProveSpvProof);
+            contractCoins = reportData->contractData->reportedContractPrevData.coins;
+            contractProveTxHash = reportData->contractData->proveTxHash;
+        }
+
+        const uint256& txHash = tx->GetHash();
+        insertReportData.String(txHash.ToString())
+            .Int(reportData->reporttype)
+            .String(reportData->reportedBranchId.ToString())
+            .String(reportData->reportedBlockHash.ToString())
+            .String(reportData->reportedTxHash.ToString())
+            .Int(contractCoins)
+            .Blob(contractReportedSpvProof.str())
+            .String(contractProveTxHash.ToString())
+            .Blob(contractProveSpvProof.str())
+            .EndRow();
+
+        if (reportData->contractData != nullptr) {
+            for (const auto& item : reportData->contractData->reportedContractPrevData.items) {
+                insertContractPrevDataItem.String(txHash.ToString())
+                    .String(item.first.ToString())
+                    .String(item.second.blockHash.ToString())
+                    .Int(item.second.txIndex)
+                    .EndRow();
+            }
+            for (const auto& item : reportData->contractData->proveContractData) {
+                insertContractInfo.String(txHash.ToString())
+                    .String(item.first.ToString())
+                    .Int(item.second.txIndex)
+                    .String(item.second.blockHash.ToString())
+                    .Blob(item.second.code)
+                    .Blob(item.second.data)
+                    .EndRow();
+            }
+        }
     }
 
+    void AddTransactions(const MCBlock& block)
     {
-        char sql[] = "INSERT INTO `contractinfo`(`txhash`, `contractid`, `txindex`, `blockhash`"
-            ", `code`, `data`) VALUES(?, ?, ?, ?, ?, ?);";
-        insertContractInfoStatement.reset(sqlConnection->prepareStatement(sql));
+        const std::string& blockHash(block.GetHash().ToString());
+        for (uint32_t i = 0; i < block.vtx.size(); ++i) {
+            const MCTransactionRef& tx = block.vtx[i];
+            insertTransaction.String(tx->GetHash().ToString())
+                .String(blockHash)
+                .Int(i)
+                .Int(tx->nVersion)
+                .Int(tx->nLockTime)
+                .String(tx->branchVSeeds)
+                .String(tx->branchSeedSpec6)
+                .String(tx->sendToBranchid)
+                .Blob(tx->sendToTxHexData)
+                .String(tx->fromBranchId)
+                .Blob(std::string(tx->fromTx.begin(), tx->fromTx.end()))
+                .Int(tx->inAmount)
+                .String(tx->reporttxid.IsNull() ? std::string() : tx->reporttxid.ToString())
+                .String(tx->coinpreouthash.IsNull() ? std::string() : tx->coinpreouthash.ToString())
+                .String(tx->provetxid.IsNull() ? std::string() : tx->provetxid.ToString())
+                .EndRow();
+
+            AddTxIn(tx);
+            AddTxOut(tx);
+            AddContract(tx);
+            AddBranchBlockData(tx);
+            AddPMT(tx);
+            AddReportData(tx);
+        }
+    }
+};
+
+static sql::Connection* DBConnect()
+{
+    std::string dbhost = gArgs.GetArg("-dbhost", "localhost:3306");
+    std::string dbuser = gArgs.GetArg("-dbuser", "root");
+    std::string dbpassword = gArgs.GetArg("-dbpassword", "");
+    return sqlDriver->connect(dbhost, dbuser, dbpassword);
+}
+
+bool DBCreateTable()
+{
+    int size = sizeof(sqls) / sizeof(char*);
+    for (int i = 0; i < size; ++i) {
+        if (!sqlStatement->execute(sqls[i])) {
+            const sql::SQLWarning* warnings = sqlStatement->getWarnings();
+            if (warnings != nullptr && warnings->getErrorCode() != 1050) {
+                LogPrintf("%s:%d => %s\n", __FUNCTION__, __LINE__, warnings->getMessage().c_str());
+                return false;
+            }
+        }
     }
 
+    selectBlockStatement.reset(sqlConnection->prepareStatement(SELECT_BLOCK_SQL));
+
     return true;
 }
 
@@ -250,16 +732,10 @@ bool DBInitialize()
         return false;
     }
 
-    std::string dbhost = gArgs.GetArg("-dbhost", "localhost:3306");
-    std::string dbuser = gArgs.GetArg("-dbuser", "root");
-    std::string dbpassword = gArgs.GetArg("-dbpassword", "");
-    sqlConnection.reset(sqlDriver->connect(dbhost, dbuser, dbpassword));
+    sqlConnection.reset(DBConnect());
     if (sqlConnection == nullptr) {
-        const sql::SQLWarning* warnings = sqlConnection->getWarnings();
-        if (warnings != nullptr) {
-            printf("%s:%d => %s\n", __FUNCTION__, __LINE__, warnings->getMessage().c_str());
-            return false;
-        }
+        printf("%s:%d => Connect database fail\n", __FUNCTION__, __LINE__);
+        return false;
     }
 
     sqlStatement.reset(sqlConnection->createStatement());
@@ -275,10 +751,34 @@ bool DBInitialize()
     sqlStatement->execute(std::string("CREATE DATABASE IF NOT EXISTS `") + dbschema + "`;");
     sqlConnection->setSchema(dbschema);
 
-    return DBCreateTable();
+    if (!DBCreateTable())
+        return false;
+
+    // 写入线程使用独立的连接，每个区块一个事务
+    sql::Connection* writerConnection = DBConnect();
+    if (writerConnection == nullptr) {
+        printf("%s:%d => Connect database fail\n", __FUNCTION__, __LINE__);
+        return false;
+    }
+    writerConnection->setSchema(dbschema);
+    writerConnection->setAutoCommit(false);
+    sqlWriterConnection.reset(writerConnection);
+
+    int64_t nQueue = std::min<int64_t>(std::max<int64_t>(1, gArgs.GetArg("-dbwritequeue", MONITOR_WRITE_QUEUE)), MONITOR_WRITE_QUEUE_MAX);
+    databaseWriter.reset(new DatabaseWriter(writerConnection, nQueue));
+    LogPrintf("Using a queue of %d blocks for database writes\n", nQueue);
+    return true;
+}
+
+void DBShutdown()
+{
+    fDBShutdown = true;
+    databaseWriter.reset();
+    sqlWriterConnection.reset();
 }
 
-int WriteBlockHeader(const MCBlock& block, uint256* hashSkipBlock)
+// 计算区块的高度和跳跃区块，前一区块不存在时返回-1
+int GetBlockHeight(const MCBlock& block, uint256* hashSkipBlock)
 {
     bool isGenesisBlock = block.hashPrevBlock.IsNull();
 
@@ -314,38 +814,6 @@ int WriteBlockHeader(const MCBlock& block, uint256* hashSkipBlock)
         }
     }
 
-    // update
-    insertBlockStatement->setString(1, block.GetHash().ToString());
-    if (!block.hashPrevBlock.IsNull()) {
-        insertBlockStatement->setString(2, block.hashPrevBlock.ToString());
-    }
-    else {
-        insertBlockStatement->setString(2, std::string());
-    }
-
-    if (!isGenesisBlock) {
-        insertBlockStatement->setString(3, skipBlock.hashPrevBlock.ToString());
-    }
-    else {
-        insertBlockStatement->setString(3, std::string());
-    }
-
-    insertBlockStatement->setString(4, block.hashMerkleRoot.ToString());
-    insertBlockStatement->setInt(5, height);
-    insertBlockStatement->setInt(6, block.nVersion);
-    insertBlockStatement->setUInt(7, block.nTime);
-    insertBlockStatement->setUInt(8, block.nBits);
-    insertBlockStatement->setUInt(9, block.nNonce);
-    insertBlockStatement->setBoolean(10, gArgs.GetBoolArg("-regtest", false));
-    insertBlockStatement->setString(11, gArgs.GetArg("-branchid", ""));
-    if (!insertBlockStatement->executeUpdate()) {
-        const sql::SQLWarning* warnings = insertBlockStatement->getWarnings();
-        if (warnings != nullptr) {
-            LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, warnings->getErrorCode(), warnings->getMessage().c_str());
-            return -1;
-        }
-    }
-
     if (hashSkipBlock != nullptr) {
         *hashSkipBlock = skipBlock.hashPrevBlock;
     }
@@ -353,339 +821,37 @@ int WriteBlockHeader(const MCBlock& block, uint256* hashSkipBlock)
     return height;
 }
 
-bool WriteTxIn(const MCTransactionRef tx)
-{
-    const std::string& txHash(tx->GetHash().ToString());
-    for (uint32_t i = 0; i < tx->vin.size(); ++i) {
-        const MCTxIn& txin = tx->vin[i];
-        if (txin.prevout.IsNull()) {
-            continue;
-        }
-
-        const std::string scriptSig(txin.scriptSig.begin(), txin.scriptSig.end());
-        std::istringstream scriptSigStream(scriptSig);
-
-        insertTxInStatement->setString(1, txHash);
-        insertTxInStatement->setUInt(2, i);
-        insertTxInStatement->setString(3, txin.prevout.hash.ToString());
-        insertTxInStatement->setUInt(4, txin.prevout.n);
-        insertTxInStatement->setUInt(5, txin.nSequence);
-        insertTxInStatement->setBlob(6, &scriptSigStream);
-
-        if (!insertTxInStatement->executeUpdate()) {
-            const sql::SQLWarning* warnings = insertTxInStatement->getWarnings();
-            if (warnings != nullptr) {
-                LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, warnings->getErrorCode(), warnings->getMessage().c_str());
-                return false;
-            }
-        }
-    }
-
-    return true;
-}
-
-bool WriteTxOut(const MCTransactionRef tx)
-{
-    const std::string& txHash(tx->GetHash().ToString());
-    for (uint32_t i = 0; i < tx->vout.size(); ++i) {
-        const MCTxOut& txout = tx->vout[i];
-
-        const std::string scriptPubKey(txout.scriptPubKey.begin(), txout.scriptPubKey.end());
-        std::istringstream scriptPubKeyStream(scriptPubKey);
-
-        insertTxOutStatement->setString(1, txHash);
-        insertTxOutStatement->setUInt(2, i);
-        insertTxOutStatement->setInt64(3, txout.nValue);
-        insertTxOutStatement->setBlob(4, &scriptPubKeyStream);
-
-        if (!insertTxOutStatement->executeUpdate()) {
-            const sql::SQLWarning* warnings = insertTxOutStatement->getWarnings();
-            if (warnings != nullptr) {
-                LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, warnings->getErrorCode(), warnings->getMessage().c_str());
-                return false;
-            }
-        }
-    }
-
-    return true;
-}
-
-bool WriteContract(const MCTransactionRef tx)
-{
-    const std::shared_ptr<const ContractData> contractData = tx->pContractData;
-    if (contractData == nullptr) {
-        return true;
-    }
-
-    const std::string codeOrFunc(contractData->codeOrFunc);
-    std::istringstream codeOrFuncStream(codeOrFunc);
-    const std::string args(contractData->args);
-    std::istringstream argsStream(args);
-    const std::string signature(contractData->signature.begin(), contractData->signature.end());
-    std::istringstream signatureStream(signature);
-
-    insertContractStatement->setString(1, tx->GetHash().ToString());
-    insertContractStatement->setString(2, contractData->address.ToString());
-    insertContractStatement->setString(3, HexStr(contractData->sender));
-    insertContractStatement->setBlob(4, &codeOrFuncStream);
-    insertContractStatement->setBlob(5, &argsStream);
-    insertContractStatement->setInt64(6, contractData->amountOut);
-    insertContractStatement->setBlob(7, &signatureStream);
-
-    if (!insertContractStatement->executeUpdate()) {
-        const sql::SQLWarning* warnings = insertContractStatement->getWarnings();
-        if (warnings != nullptr) {
-            LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, warnings->getErrorCode(), warnings->getMessage().c_str());
-            return false;
-        }
-    }
-
-    return true;
-}
-
-bool WriteBranchBlockData(const MCTransactionRef tx)
-{
-    const std::shared_ptr<const MCBranchBlockInfo> branchBlockData = tx->pBranchBlockData;
-    if (branchBlockData == nullptr) {
-        return true;
-    }
-
-    const std::string blockSig(branchBlockData->vchBlockSig.begin(), branchBlockData->vchBlockSig.end());
-    std::istringstream blockSigStream(blockSig);
-    const std::string stakeTxData(branchBlockData->vchStakeTxData.begin(), branchBlockData->vchStakeTxData.end());
-    std::istringstream stakeTxDataStream(stakeTxData);
-
-    insertBranchBlockDataStatement->setString(1, tx->GetHash().ToString());
-    insertBranchBlockDataStatement->setInt(2, branchBlockData->nVersion);
-    insertBranchBlockDataStatement->setString(3, branchBlockData->hashPrevBlock.ToString());
-    insertBranchBlockDataStatement->setString(4, branchBlockData->hashMerkleRoot.ToString());
-    insertBranchBlockDataStatement->setString(5, branchBlockData->hashMerkleRootWithData.ToString());
-    insertBranchBlockDataStatement->setString(6, branchBlockData->hashMerkleRootWithPrevData.ToString());
-    insertBranchBlockDataStatement->setUInt(7, branchBlockData->nTime);
-    insertBranchBlockDataStatement->setUInt(8, branchBlockData->nBits);
-    insertBranchBlockDataStatement->setUInt(9, branchBlockData->nNonce);
-    insertBranchBlockDataStatement->setString(10, branchBlockData->prevoutStake.hash.ToString());
-    insertBranchBlockDataStatement->setUInt(11, branchBlockData->prevoutStake.n);
-    insertBranchBlockDataStatement->setBlob(12, &blockSigStream);
-    insertBranchBlockDataStatement->setString(13, branchBlockData->branchID.ToString());
-    insertBranchBlockDataStatement->setInt(14, branchBlockData->blockHeight);
-    insertBranchBlockDataStatement->setBlob(15, &stakeTxDataStream);
-
-    if (!insertBranchBlockDataStatement->executeUpdate()) {
-        const sql::SQLWarning* warnings = insertBranchBlockDataStatement->getWarnings();
-        if (warnings != nullptr) {
-            LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, warnings->getErrorCode(), warnings->getMessage().c_str());
-            return false;
-        }
-    }
-
-    return true;
-}
-
-bool WritePMT(const MCTransactionRef tx)
-{
-    const std::shared_ptr<const MCSpvProof> spvProof = tx->pPMT;
-    if (spvProof == nullptr) {
-        return true;
-    }
-
-    MCDataStream pmt(SER_DISK, CLIENT_VERSION);
-    spvProof->pmt.Serialize(pmt);
-    std::istringstream pmtStream(pmt.str());
-
-    insertPMTStatement->setString(1, tx->GetHash().ToString());
-    insertPMTStatement->setString(2, spvProof->blockhash.ToString());
-    insertPMTStatement->setBlob(3, &pmtStream);
-
-    if (!insertPMTStatement->executeUpdate()) {
-        const sql::SQLWarning* warnings = insertPMTStatement->getWarnings();
-        if (warnings != nullptr) {
-            LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, warnings->getErrorCode(), warnings->getMessage().c_str());
-            return false;
-        }
-    }
-
-    return true;
-}
-
-bool WriteContractPrevDataItem(const uint256& txHash, const MCContractID& contractId, const ContractPrevDataItem& item)
-{
-    insertContractPrevDataItemStatement->setString(1, txHash.ToString());
-    insertContractPrevDataItemStatement->setString(2, contractId.ToString());
-    insertContractPrevDataItemStatement->setString(3, item.blockHash.ToString());
-    insertContractPrevDataItemStatement->setInt(4, item.txIndex);
-
-    if (!insertContractPrevDataItemStatement->executeUpdate()) {
-        const sql::SQLWarning* warnings = insertContractPrevDataItemStatement->getWarnings();
-        if (warnings != nullptr) {
-            LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, warnings->getErrorCode(), warnings->getMessage().c_str());
-            return false;
-        }
-    }
-
-    return true;
-}
-
-bool WriteContractInfo(const uint256& txHash, const MCContractID& contractId, const ContractInfo& info)
-{
-    const std::string& code = info.code;
-    std::istringstream codeStream(code);
-    const std::string& data = info.data;
-    std::istringstream dataStream(data);
-
-    insertContractInfoStatement->setString(1, txHash.ToString());
-    insertContractInfoStatement->setString(2, contractId.ToString());
-    insertContractInfoStatement->setInt(3, info.txIndex);
-    insertContractInfoStatement->setString(4, info.blockHash.ToString());
-    insertContractInfoStatement->setBlob(5, &codeStream);
-    insertContractInfoStatement->setBlob(6, &dataStream);
-
-    if (!insertContractInfoStatement->executeUpdate()) {
-        const sql::SQLWarning* warnings = insertContractInfoStatement->getWarnings();
-        if (warnings != nullptr) {
-            LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, warnings->getErrorCode(), warnings->getMessage().c_str());
-            return false;
-        }
-    }
-
-    return true;
-}
-
-bool WriteReportData(const MCTransactionRef tx)
-{
-    const std::shared_ptr<const ReportData> reportData = tx->pReportData;
-    if (reportData == nullptr) {
-        return true;
-    }
-
-    MCDataStream contractReportedSpvProof(SER_DISK, CLIENT_VERSION);
-    MCDataStream contractProveSpvProof(SER_DISK, CLIENT_VERSION);
-    if (reportData->contractData != nullptr) {
-        reportData->contractData->reportedSpvProof.Serialize(contractReportedSpvProof);
-        reportData->contractData->proveSpvProof.Serialize(contractProveSpvProof);
-    }
-    std::istringstream contractReportedSpvProofStream(contractReportedSpvProof.str());
-    std::istringstream contractProveSpvProofStream(contractProveSpvProof.str());
-
-    insertReportDataStatement->setString(1, tx->GetHash().ToString());
-    insertReportDataStatement->setInt(2, reportData->reporttype);
-    insertReportDataStatement->setString(3, reportData->reportedBranchId.ToString());
-    insertReportDataStatement->setString(4, reportData->reportedBlockHash.ToString());
-    insertReportDataStatement->setString(5, reportData->reportedTxHash.ToString());
-    insertReportDataStatement->setInt64(6, reportData->contractData->reportedContractPrevData.coins);
-    insertReportDataStatement->setBlob(7, &contractReportedSpvProofStream);
-    insertReportDataStatement->setString(8, reportData->contractData->proveTxHash.ToString());
-    insertReportDataStatement->setBlob(9, &contractProveSpvProofStream);
-
-    if (!insertReportDataStatement->executeUpdate()) {
-        const sql::SQLWarning* warnings = insertReportDataStatement->getWarnings();
-        if (warnings != nullptr) {
-            LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, warnings->getErrorCode(), warnings->getMessage().c_str());
-            return false;
-        }
-    }
-
-    if (reportData->contractData != nullptr) {
-        const uint256& txHash = tx->GetHash();
-        for (auto item : reportData->contractData->reportedContractPrevData.items) {
-            if (!WriteContractPrevDataItem(txHash, item.first, item.second)) {
-                return false;
-            }
-        }
-        for (auto item : reportData->contractData->proveContractData) {
-            if (!WriteContractInfo(txHash, item.first, item.second)) {
-                return false;
-            }
-        }
-    }
-
-    return true;
-}
-
-bool WriteTransaction(const MCBlock& block)
+int WriteBlockToDatabase(const MCBlock& block)
 {
-    const std::string& blockHash(block.GetHash().ToString());
-    for (uint32_t i = 0; i < block.vtx.size(); ++i) {
-        MCTransactionRef tx = block.vtx[i];
-
-        std::string sendToTxHexData(tx->sendToTxHexData);
-        std::istringstream sendToTxHexDataStream(sendToTxHexData);
-
-        std::string fromTx(tx->fromTx.begin(), tx->fromTx.end());
-        std::istringstream fromTxStream(fromTx);
-
-        std::string reporttxid(tx->reporttxid.IsNull() ? std::string() : tx->reporttxid.ToString());
-        std::string coinpreouthash(tx->coinpreouthash.IsNull() ? std::string() : tx->coinpreouthash.ToString());
-        std::string provetxid(tx->provetxid.IsNull() ? std::string() : tx->provetxid.ToString());
-
-        insertTransactionStatement->setString(1, tx->GetHash().ToString());
-        insertTransactionStatement->setString(2, blockHash);
-        insertTransactionStatement->setUInt(3, i);
-        insertTransactionStatement->setInt(4, tx->nVersion);
-        insertTransactionStatement->setUInt(5, tx->nLockTime);
-        insertTransactionStatement->setString(6, tx->branchVSeeds);
-        insertTransactionStatement->setString(7, tx->branchSeedSpec6);
-        insertTransactionStatement->setString(8, tx->sendToBranchid);
-        insertTransactionStatement->setBlob(9, &sendToTxHexDataStream);
-        insertTransactionStatement->setString(10, tx->fromBranchId);
-        insertTransactionStatement->setBlob(11, &fromTxStream);
-        insertTransactionStatement->setInt64(12, tx->inAmount);
-        insertTransactionStatement->setString(13, reporttxid);
-        insertTransactionStatement->setString(14, coinpreouthash);
-        insertTransactionStatement->setString(15, provetxid);
-
-        if (!insertTransactionStatement->executeUpdate()) {
-            const sql::SQLWarning* warnings = insertTransactionStatement->getWarnings();
-            if (warnings != nullptr) {
-                LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, warnings->getErrorCode(), warnings->getMessage().c_str());
-                return false;
-            }
-        }
+    if (fDBShutdown || databaseWriter == nullptr)
+        return -1;
 
-        if (!WriteTxIn(tx)) {
-            return false;
-        }
-        if (!WriteTxOut(tx)) {
-            return false;
-        }
-        if (!WriteContract(tx)) {
-            return false;
-        }
-        if (!WriteBranchBlockData(tx)) {
-            return false;
-        }
-        if (!WritePMT(tx)) {
-            return false;
-        }
-        if (!WriteReportData(tx)) {
-            return false;
-        }
+    const uint256 hashBlock = block.GetHash();
+    {
+        std::lock_guard<std::mutex> lock(csBlocks);
+        if (blocks.count(hashBlock))
+            return -1;
     }
-    return true;
-}
 
-int WriteBlockToDatabase(const MCBlock& block)
-{
     int height = -1;
     try {
         uint256 hashSkipBlock;
-        height = WriteBlockHeader(block, &hashSkipBlock);
+        height = GetBlockHeight(block, &hashSkipBlock);
         if (height < 0)
             return -1;
-        if (!WriteTransaction(block))
-            return -1;
 
-        sqlConnection->commit();
-        AddDatabaseBlock(block.GetHash(), block.hashPrevBlock, hashSkipBlock, height);
+        // 先加入缓存，后续区块据此计算高度，写入在写入线程中进行
+        AddDatabaseBlock(hashBlock, block.hashPrevBlock, hashSkipBlock, height);
+        if (!databaseWriter->Push(DatabaseWriter::Job{ std::make_shared<const MCBlock>(block), height, hashSkipBlock })) {
+            std::lock_guard<std::mutex> lock(csBlocks);
+            setWritingBlocks.erase(hashBlock);
+            blocks.erase(hashBlock);
+            return -1;
+        }
     }
     catch (sql::SQLException e) {
         LogPrintf("%s:%d => %d:%s\n", __FUNCTION__, __LINE__, e.getErrorCode(), e.what());
-        if (e.getErrorCode() != 1062) {
-            throw e;
-        }
-        else {
-            return -1;
-        }
+        throw e;
     }
 
     return height;
@@ -1,6 +1,15 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+// 写入队列中最多的区块数，队列满时接收区块的线程等待
+static const int64_t MONITOR_WRITE_QUEUE = 16;
+static const int64_t MONITOR_WRITE_QUEUE_MAX = 1024;
+// 一条INSERT最多写入的行数和参数字节数
+static const size_t MONITOR_ROWS_PER_INSERT = 256;
+static const size_t MONITOR_BYTES_PER_INSERT = 1 << 20;
+// 输出写入速度和队列长度的间隔(秒)
+static const int64_t MONITOR_STATS_INTERVAL = 10;
+
 class DatabaseBlock
 {
 public:
@@ -21,6 +30,8 @@ public:
 };
 
 bool DBInitialize();
+// 写完队列中的区块后关闭写入线程
+void DBShutdown();
 const uint256 GetMaxHeightBlock();
 int WriteBlockToDatabase(const MCBlock& block);
 int GetDatabaseBlock(DatabaseBlock* block, const uint256& hashBlock);
@@ -9,6 +9,7 @@
 #include "misc/amount.h"
 #include "chain/chain.h"
 #include "chain/chainparams.h"
+#include "coding/base58.h"
 #include "validation/checkpoints.h"
 #include "transaction/coins.h"
 #include "consensus/validation.h"
@@ -1120,6 +1121,65 @@ UniValue verifychain(const JSONRPCRequest& request)
     return CVerifyDB().VerifyDB(Params(), pcoinsTip, nCheckLevel, nCheckDepth);
 }
 
+UniValue verifycoinamountindex(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 1)
+        throw std::runtime_error(
+            "verifycoinamountindex ( \"address\" )\n"
+            "\nCompares the balance index of the coin lists with a full scan of the listed outputs.\n"
+            "\nArguments:\n"
+            "1. \"address\"   (string, optional) The address or contract address to check, default is every indexed address.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"checked\": n,          (numeric) The number of addresses checked\n"
+            "  \"mismatches\": [       (array) The addresses whose index differs from the scan\n"
+            "    {\n"
+            "      \"key\": \"hex\",     (string) The hash160 the coin list is stored under\n"
+            "      \"index\": x.xxx,    (numeric) The balance from the index, null when not indexed yet\n"
+            "      \"scan\": x.xxx      (numeric) The balance from the scan\n"
+            "    }\n"
+            "    ,...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("verifycoinamountindex", "")
+            + HelpExampleRpc("verifycoinamountindex", "")
+        );
+
+    LOCK(cs_main);
+
+    std::vector<uint160> keys;
+    if (!request.params[0].isNull()) {
+        MagnaChainAddress address(request.params[0].get_str());
+        if (!address.IsValid() || address.IsScript())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+        keys.push_back(GetUint160(address.Get()));
+    }
+    else
+        pcoinListDb->GetAmountIndexKeys(keys);
+
+    int nHeight = chainActive.Height();
+    UniValue mismatches(UniValue::VARR);
+    for (const uint160& key : keys) {
+        CoinAmountIndex index;
+        bool indexed = pcoinListDb->ReadAmountIndex(key, index);
+        MCAmount nScan = pcoinListDb->ScanAmount(key, nHeight);
+        if (indexed && index.GetAmount(nHeight) == nScan)
+            continue;
+        // 全量查询的地址都已建立索引，单个地址未建立时也报告出来
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("key", HexStr(key.begin(), key.end())));
+        entry.push_back(Pair("index", indexed ? ValueFromAmount(index.GetAmount(nHeight)) : NullUniValue));
+        entry.push_back(Pair("scan", ValueFromAmount(nScan)));
+        mismatches.push_back(entry);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("checked", (int)keys.size()));
+    ret.push_back(Pair("mismatches", mismatches));
+    return ret;
+}
+
 /** Implementation of IsSuperMajority with better feedback */
 static UniValue SoftForkMajorityDesc(int version, MCBlockIndex* pindex, const Consensus::Params& consensusParams)
 {
@@ -1635,6 +1695,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,  {} },
     { "blockchain",         "pruneblockchain",        &pruneblockchain,        true,  {"height"} },
     { "blockchain",         "verifychain",            &verifychain,            true,  {"checklevel","nblocks"} },
+    { "blockchain",         "verifycoinamountindex",  &verifycoinamountindex,  true,  {"address"} },
 
     { "blockchain",         "preciousblock",          &preciousblock,          true,  {"blockhash"} },
 
@@ -3,6 +3,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include "rpc/branchchainrpc.h"
 #include "chain/branchchain.h"
+#include "chain/branchrpcclient.h"
+#include "chain/branchtransfer.h"
 
 #include "misc/amount.h"
 #include "coding/base58.h"
@@ -1046,6 +1048,82 @@ UniValue getbranchchainheight(const JSONRPCRequest& request)
     return retObj;
 }
 
+//查询跨链RPC连接和延迟
+UniValue getbranchrpcinfo(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw std::runtime_error(
+                "getbranchrpcinfo\n"
+                "\nReturns the connection pool and latency statistics of the rpc calls to other chains.\n"
+                "\nResult:\n"
+                "[\n"
+                "  {\n"
+                "    \"branchid\"    : \"xxx\",   (string) The target chain id\n"
+                "    \"host\"        : \"xxx\",   (string) The rpc host\n"
+                "    \"port\"        : n,       (numeric) The rpc port\n"
+                "    \"wallet\"      : \"xxx\",   (string) The rpc wallet\n"
+                "    \"connections\" : n,       (numeric) Open connections\n"
+                "    \"idle\"        : n,       (numeric) Idle connections\n"
+                "    \"queued\"      : n,       (numeric) Async calls waiting to be sent\n"
+                "    \"calls\"       : n,       (numeric) HTTP requests sent, a batch counts once\n"
+                "    \"requests\"    : n,       (numeric) JSON-RPC requests sent\n"
+                "    \"failures\"    : n,       (numeric) HTTP requests that failed\n"
+                "    \"retries\"     : n,       (numeric) Retries after a connection error\n"
+                "    \"avglatency\"  : x.xxx,   (numeric) Average latency in milliseconds\n"
+                "    \"maxlatency\"  : x.xxx,   (numeric) Maximum latency in milliseconds\n"
+                "    \"lastlatency\" : x.xxx,   (numeric) Latency of the last call in milliseconds\n"
+                "  },...\n"
+                "]\n"
+                "\nExamples:\n"
+                + HelpExampleCli("getbranchrpcinfo", "")
+                + HelpExampleRpc("getbranchrpcinfo", "")
+                );
+
+    return GetBranchRPCInfo();
+}
+
+//查询跨链转账队列
+UniValue getbranchtransferinfo(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 1)
+        throw std::runtime_error(
+                "getbranchtransferinfo ( verbose )\n"
+                "\nReturns the state of the queue sending the cross-chain requests of matured blocks.\n"
+                "\nArguments:\n"
+                "1. verbose             (bool, optional, default=false) List the unfinished requests\n"
+                "\nResult:\n"
+                "{\n"
+                "  \"blocks\"  : n,          (numeric) Matured blocks not read yet\n"
+                "  \"pending\" : n,          (numeric) Requests waiting to be sent or retried\n"
+                "  \"sending\" : n,          (numeric) Requests waiting for a reply\n"
+                "  \"done\"    : n,          (numeric) Requests accepted by the target chain\n"
+                "  \"failed\"  : n,          (numeric) Requests rejected or given up\n"
+                "  \"entries\" : [           (array) Unfinished requests, only if verbose\n"
+                "    {\n"
+                "      \"txid\"      : \"xxx\", (string) The transaction\n"
+                "      \"blockhash\" : \"xxx\", (string) The block of the transaction\n"
+                "      \"method\"    : \"xxx\", (string) The rpc method\n"
+                "      \"tochain\"   : \"xxx\", (string) The target chain\n"
+                "      \"status\"    : \"xxx\", (string) pending, sending or failed\n"
+                "      \"tries\"     : n,     (numeric) Times sent\n"
+                "      \"time\"      : n,     (numeric) Time added\n"
+                "      \"nexttry\"   : n,     (numeric) Time of the next try\n"
+                "      \"lasterror\" : \"xxx\", (string) The last error\n"
+                "    },...\n"
+                "  ]\n"
+                "}\n"
+                "\nExamples:\n"
+                + HelpExampleCli("getbranchtransferinfo", "true")
+                + HelpExampleRpc("getbranchtransferinfo", "true")
+                );
+
+    if (pBranchTransferQueue == nullptr)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Branch transfer queue is not started");
+
+    bool fVerbose = request.params.size() > 0 && request.params[0].get_bool();
+    return pBranchTransferQueue->GetInfo(fVerbose);
+}
+
 //重发侧链头到主链
 UniValue resendbranchchainblockinfo(const JSONRPCRequest& request)
 {
@@ -1643,6 +1721,7 @@ UniValue handlebranchreport(const JSONRPCRequest& request)
 
     MCTransactionRef tx = MakeTransactionRef(std::move(mtxTrans1));
 
+    LOCK(cs_main);// protect g_pBranchDb
     const uint256 reportedBranchId = tx->pReportData->reportedBranchId;
     if (!g_pBranchDb->HasBranchData(reportedBranchId))
         throw JSONRPCError(RPC_INTERNAL_ERROR, strprintf("Invalid reported branch id %s", reportedBranchId.ToString().c_str()));
@@ -1990,6 +2069,7 @@ UniValue handlebranchprove(const JSONRPCRequest& request)
     uint256 proveFlagHash = GetProveTxHashKey(*tx);
     const uint256& rpBranchId = tx->pProveData->branchId;
     const uint256& rpBlockId = tx->pProveData->blockHash;
+    LOCK(cs_main);// protect g_pBranchDb
     if (g_pBranchDb->GetTxReportState(rpBranchId, rpBlockId, proveFlagHash) != RP_FLAG_REPORTED){
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Invalid report transaction");
     }
@@ -2140,12 +2220,12 @@ UniValue getreporttxdata(const JSONRPCRequest& request)
     if (ptxReport == nullptr)
         throw JSONRPCError(RPC_INVALID_REQUEST, "read tx data fail");
 
+    LOCK(cs_main);// protect g_pBranchDb
     int confirmations = 0;
     if (mapBlockIndex.count(hashBlock))
         confirmations = chainActive.Height() - mapBlockIndex[hashBlock]->nHeight;
 
     // get mine coin prevouthash
-    //LOCK(cs_main);// protect g_pBranchDb
     uint256 prevouthash;
     BranchData branchdata = g_pBranchDb->GetBranchData(ptxReport->pReportData->reportedBranchId);// don't check
     if (branchdata.mapHeads.count(ptxReport->pReportData->reportedBlockHash)){
@@ -2273,12 +2353,12 @@ UniValue getprovetxdata(const JSONRPCRequest& request)
     if (ptxProve == nullptr)
         throw JSONRPCError(RPC_INVALID_REQUEST, "read tx data fail");
 
+    LOCK(cs_main);// protect g_pBranchDb
     int confirmations = 0;
     if (mapBlockIndex.count(hashBlock))
         confirmations = chainActive.Height() - mapBlockIndex[hashBlock]->nHeight;
 
     // get mine coin prevouthash
-    // LOCK(cs_main);// protect g_pBranchDb
     
     if (!g_pBranchDb->HasBranchData(ptxProve->pProveData->branchId)){
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Invalid prove transaction data.");
@@ -2317,6 +2397,8 @@ static const CRPCCommand commands[] =
     { "branchchain",        "submitbranchblockinfo",     &submitbranchblockinfo,       true, {"tx_hex_data"}},
     { "branchchain",        "getbranchchainheight",      &getbranchchainheight,        false,{ "branchid" } },
     { "branchchain",        "resendbranchchainblockinfo",&resendbranchchainblockinfo,  false,{ "height" } },
+    { "branchchain",        "getbranchrpcinfo",          &getbranchrpcinfo,            true, {} },
+    { "branchchain",        "getbranchtransferinfo",     &getbranchtransferinfo,       true, {"verbose"} },
 
     { "branchchain",        "redeemmortgagecoinstatement",&redeemmortgagecoinstatement,false, {"txid", "voutindex"}},
     { "branchchain",        "redeemmortgagecoin",        &redeemmortgagecoin,          false,{ "txid", "voutindex" } },
@@ -138,9 +138,15 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "disconnectnode", 1, "nodeid" },
     //{ "getaddresscoins",0,"address" },
     { "getaddresscoins",1,"withscript" },
+    { "getaddresscoins",2,"count" },
+    { "getaddresscoins",3,"after" },
     { "updateminingreservetxsize", 0, "reservesize"},
     { "updateminingreservetxsize", 1, "reservesize" },
     { "updateminingreservetxsize", 2, "reservesize" },
+    { "getcontractcacheinfo", 0, "reset" },
+    { "getcontractprofile", 1, "reset" },
+    { "querycontracts", 0, "calls" },
+    { "getbranchtransferinfo", 0, "verbose" },
     // Echo with conversion (For testing only)
     { "echojson", 0, "arg0" },
     { "echojson", 1, "arg1" },
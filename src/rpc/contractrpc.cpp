@@ -0,0 +1,316 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpc/contractrpc.h"
+#include "rpc/server.h"
+#include "chain/chain.h"
+#include "coding/base58.h"
+#include "smartcontract/contractcache.h"
+#include "smartcontract/contractprofiler.h"
+#include "smartcontract/contractquery.h"
+#include "smartcontract/smartcontract.h"
+#include "utils/util.h"
+#include "univalue.h"
+
+#include <stdint.h>
+
+UniValue getcontractcacheinfo(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 1)
+        throw std::runtime_error(
+            "getcontractcacheinfo ( reset )\n"
+            "\nReturns statistics of the shared contract code cache.\n"
+            "\nArguments:\n"
+            "1. reset          (boolean, optional, default=false) Drop all cached contract code after reading the statistics\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"entries\": xxxxx,       (numeric) Number of decompressed contract codes in the cache\n"
+            "  \"usage\": xxxxx,         (numeric) Memory used by the cache in bytes\n"
+            "  \"maxusage\": xxxxx,      (numeric) Maximum memory the cache may use in bytes\n"
+            "  \"hits\": xxxxx,          (numeric) Lookups served from the cache\n"
+            "  \"misses\": xxxxx,        (numeric) Lookups which had to decompress the stored code\n"
+            "  \"evictions\": xxxxx      (numeric) Entries evicted to stay below maxusage\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getcontractcacheinfo", "")
+            + HelpExampleRpc("getcontractcacheinfo", "")
+        );
+
+    ContractCodeCacheStats stats = g_contractCodeCache.GetStats();
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("entries", (uint64_t)stats.entries));
+    ret.push_back(Pair("usage", (uint64_t)stats.usage));
+    ret.push_back(Pair("maxusage", (uint64_t)stats.maxUsage));
+    ret.push_back(Pair("hits", stats.hits));
+    ret.push_back(Pair("misses", stats.misses));
+    ret.push_back(Pair("evictions", stats.evictions));
+
+    if (request.params.size() > 0 && request.params[0].get_bool())
+        g_contractCodeCache.Clear();
+
+    return ret;
+}
+
+UniValue getcontractstatepoolinfo(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw std::runtime_error(
+            "getcontractstatepoolinfo\n"
+            "\nReturns statistics of the shared lua state pool used for smart contract execution.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"idle\": xxxxx,          (numeric) Initialised states waiting in the pool\n"
+            "  \"inuse\": xxxxx,         (numeric) States currently executing contracts\n"
+            "  \"maxidle\": xxxxx,       (numeric) Maximum number of idle states kept (-contractstatepool)\n"
+            "  \"acquires\": xxxxx,      (numeric) Total number of states handed out\n"
+            "  \"created\": xxxxx,       (numeric) States created because the pool was empty\n"
+            "  \"destroyed\": xxxxx,     (numeric) States closed because the pool was full\n"
+            "  \"avgwaitus\": xxxxx      (numeric) Average time in microseconds to obtain a state\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getcontractstatepoolinfo", "")
+            + HelpExampleRpc("getcontractstatepoolinfo", "")
+        );
+
+    LuaStatePoolStats stats = g_luaStatePool.GetStats();
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("idle", (uint64_t)stats.idle));
+    ret.push_back(Pair("inuse", (uint64_t)stats.inUse));
+    ret.push_back(Pair("maxidle", (uint64_t)stats.maxIdle));
+    ret.push_back(Pair("acquires", stats.acquires));
+    ret.push_back(Pair("created", stats.created));
+    ret.push_back(Pair("destroyed", stats.destroyed));
+    ret.push_back(Pair("avgwaitus", stats.acquires > 0 ? (double)stats.acquireMicros / stats.acquires : 0.0));
+    return ret;
+}
+
+UniValue getcontractprofile(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 2)
+        throw std::runtime_error(
+            "getcontractprofile ( \"contractaddress\" reset )\n"
+            "\nReturns the contract execution profile collected since start or the last reset (-contractprofile).\n"
+            "Time and instructions of a function include the contracts it calls.\n"
+            "\nArguments:\n"
+            "1. \"contractaddress\"  (string, optional) Only return this contract, \"\" for all contracts\n"
+            "2. reset              (boolean, optional, default=false) Clear the collected profile after reading it\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"enabled\": true|false,      (boolean) Whether contract execution is being profiled\n"
+            "  \"sampleinterval\": xxxxx,    (numeric) Instructions between two samples of the running lua function\n"
+            "  \"contracts\": [              (array) Contracts ordered by instructions used\n"
+            "    {\n"
+            "      \"contractaddress\": \"xxx\", (string) The contract address\n"
+            "      \"calls\": xxxxx,          (numeric) Number of calls\n"
+            "      \"instructions\": xxxxx,   (numeric) Instructions (gas) used\n"
+            "      \"timeus\": xxxxx,         (numeric) Wall time in microseconds\n"
+            "      \"functions\": [           (array) Per entry function, the same fields plus\n"
+            "        {\n"
+            "          \"name\": \"xxx\",       (string) Called function, \"(publish)\" for publishing\n"
+            "          \"calls\": xxxxx,      (numeric) Number of calls\n"
+            "          \"failures\": xxxxx,   (numeric) Calls which failed\n"
+            "          \"instructions\": xxxxx, (numeric) Instructions (gas) used\n"
+            "          \"timeus\": xxxxx,     (numeric) Wall time in microseconds\n"
+            "          \"allocbytes\": xxxxx, (numeric) Bytes allocated by the lua state\n"
+            "          \"databytes\": xxxxx   (numeric) Msgpack bytes of contract data read and written\n"
+            "        }, ...\n"
+            "      ],\n"
+            "      \"samples\": { \"function:line\": n, ... }  (object) Samples per running lua function\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getcontractprofile", "")
+            + HelpExampleCli("getcontractprofile", "\"\" true")
+            + HelpExampleRpc("getcontractprofile", "")
+        );
+
+    MCContractID filterId;
+    bool filter = request.params.size() > 0 && !request.params[0].get_str().empty();
+    if (filter) {
+        MagnaChainAddress contractAddr(request.params[0].get_str());
+        if (!contractAddr.GetContractID(filterId))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid contract address");
+    }
+
+    std::map<MCContractID, ContractProfile> profiles = g_contractProfiler.GetProfiles();
+    if (request.params.size() > 1 && request.params[1].get_bool())
+        g_contractProfiler.Reset();
+
+    std::vector<std::pair<int64_t, UniValue>> contracts;
+    for (const auto& item : profiles) {
+        if (filter && item.first != filterId)
+            continue;
+
+        ContractFunctionProfile total;
+        UniValue functions(UniValue::VARR);
+        for (const auto& fi : item.second.functions) {
+            const ContractFunctionProfile& profile = fi.second;
+            total.calls += profile.calls;
+            total.instructions += profile.instructions;
+            total.micros += profile.micros;
+
+            UniValue function(UniValue::VOBJ);
+            function.push_back(Pair("name", fi.first));
+            function.push_back(Pair("calls", profile.calls));
+            function.push_back(Pair("failures", profile.failures));
+            function.push_back(Pair("instructions", profile.instructions));
+            function.push_back(Pair("timeus", profile.micros));
+            function.push_back(Pair("allocbytes", profile.allocBytes));
+            function.push_back(Pair("databytes", profile.dataBytes));
+            functions.push_back(function);
+        }
+
+        UniValue samples(UniValue::VOBJ);
+        for (const auto& si : item.second.samples)
+            samples.push_back(Pair(si.first, si.second));
+
+        UniValue contract(UniValue::VOBJ);
+        contract.push_back(Pair("contractaddress", MagnaChainAddress(item.first).ToString()));
+        contract.push_back(Pair("calls", total.calls));
+        contract.push_back(Pair("instructions", total.instructions));
+        contract.push_back(Pair("timeus", total.micros));
+        contract.push_back(Pair("functions", functions));
+        contract.push_back(Pair("samples", samples));
+        contracts.emplace_back(total.instructions, contract);
+    }
+    std::stable_sort(contracts.begin(), contracts.end(), [](const std::pair<int64_t, UniValue>& a, const std::pair<int64_t, UniValue>& b) {
+        return a.first > b.first;
+    });
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("enabled", g_contractProfiler.IsEnabled()));
+    ret.push_back(Pair("sampleinterval", g_contractProfiler.GetInterval()));
+    UniValue arr(UniValue::VARR);
+    for (auto& contract : contracts)
+        arr.push_back(contract.second);
+    ret.push_back(Pair("contracts", arr));
+    return ret;
+}
+
+UniValue QueryContracts(const UniValue& calls, int64_t nInstructionBudget)
+{
+    if (calls.size() > MAX_CONTRACT_QUERY_BATCH)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Too many calls, max num is %u", MAX_CONTRACT_QUERY_BATCH));
+
+    std::vector<ContractQuery> queries(calls.size());
+    for (unsigned int i = 0; i < calls.size(); ++i) {
+        const UniValue& call = calls[i];
+        if (!call.isObject())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, expected object");
+        RPCTypeCheckObj(call,
+            {
+                {"contractaddress", UniValueType(UniValue::VSTR)},
+                {"function", UniValueType(UniValue::VSTR)},
+                {"params", UniValueType(UniValue::VARR)},
+                {"sender", UniValueType(UniValue::VSTR)},
+                {"amount", UniValueType()},
+            }, true, true);
+
+        ContractQuery& query = queries[i];
+        query.contractAddr.SetString(find_value(call, "contractaddress").get_str());
+        if (!query.contractAddr.IsContractID())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid contract address");
+
+        query.function = find_value(call, "function").get_str();
+        if (query.function.empty())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid function name for call");
+
+        const UniValue& args = find_value(call, "params");
+        query.args = args.isNull() ? UniValue(UniValue::VARR) : args;
+
+        const UniValue& sender = find_value(call, "sender");
+        query.senderAddr = query.contractAddr;
+        if (!sender.isNull()) {
+            query.senderAddr.SetString(sender.get_str());
+            if (!query.senderAddr.IsValid())
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid sender address");
+        }
+
+        const UniValue& amount = find_value(call, "amount");
+        if (!amount.isNull()) {
+            query.amount = AmountFromValue(amount);
+            if (query.amount < 0)
+                throw JSONRPCError(RPC_TYPE_ERROR, "Invalid amount for call");
+        }
+    }
+
+    std::vector<ContractQueryResult> results;
+    const MCBlockIndex* pTip = nullptr;
+    RunContractQueries(queries, results, pTip, nInstructionBudget);
+
+    UniValue arr(UniValue::VARR);
+    for (const ContractQueryResult& result : results) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("success", result.success));
+        obj.push_back(Pair("return", result.ret));
+        if (!result.error.empty())
+            obj.push_back(Pair("error", result.error));
+        arr.push_back(obj);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("blockhash", pTip->GetBlockHash().GetHex()));
+    ret.push_back(Pair("height", pTip->nHeight));
+    ret.push_back(Pair("results", arr));
+    return ret;
+}
+
+UniValue querycontracts(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw std::runtime_error(
+            "querycontracts [{\"contractaddress\":\"address\",\"function\":\"name\",...},...]\n"
+            "\nExecute read-only contract calls in parallel against the current tip and return all results.\n"
+            "Nothing is saved and no transaction is built. Contract data is read as of the tip block,\n"
+            "calls pending in the mempool are not included.\n"
+            "\nArguments:\n"
+            "1. \"calls\"                 (array, required) At most " + std::to_string(MAX_CONTRACT_QUERY_BATCH) + " calls\n"
+            "     [\n"
+            "       {\n"
+            "         \"contractaddress\":\"address\", (string, required) The contract to call\n"
+            "         \"function\":\"name\",           (string, required) The function to call\n"
+            "         \"params\":[...],                (array, optional) Function arguments (string, number or boolean)\n"
+            "         \"sender\":\"address\",          (string, optional, default=contractaddress) Address seen as msg.sender\n"
+            "         \"amount\":x.xxx                 (numeric, optional, default=0) Amount seen as msg.value\n"
+            "       }\n"
+            "       ,...\n"
+            "     ]\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"blockhash\": \"hash\",      (string) The tip the calls ran against\n"
+            "  \"height\": n,              (numeric) Height of that block\n"
+            "  \"results\": [              (array) One entry per call, in request order\n"
+            "    {\n"
+            "      \"success\": true|false, (boolean) Whether the call succeeded\n"
+            "      \"return\": [...],       (array) Values returned by the contract, or its error\n"
+            "      \"error\": \"message\"     (string, optional) Why the call could not run\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("querycontracts", "\"[{\\\"contractaddress\\\":\\\"address\\\",\\\"function\\\":\\\"balanceOf\\\",\\\"params\\\":[\\\"owner\\\"]}]\"")
+            + HelpExampleRpc("querycontracts", "[{\"contractaddress\":\"address\",\"function\":\"balanceOf\",\"params\":[\"owner\"]}]")
+        );
+
+    RPCTypeCheck(request.params, {UniValue::VARR});
+    return QueryContracts(request.params[0]);
+}
+
+static const CRPCCommand commands[] =
+{ //  category              name                      actor (function)         okSafe argNames
+  //  --------------------- ------------------------  -----------------------  ------ ----------
+    { "contract",           "getcontractcacheinfo",   &getcontractcacheinfo,   true,  {"reset"} },
+    { "contract",           "getcontractstatepoolinfo", &getcontractstatepoolinfo, true, {} },
+    { "contract",           "getcontractprofile",     &getcontractprofile,     true,  {"contractaddress","reset"} },
+    { "contract",           "querycontracts",         &querycontracts,         true,  {"calls"} },
+};
+
+void RegisterContractRPCCommands(CRPCTable &t)
+{
+    for (unsigned int vcidx = 0; vcidx < ARRAYLEN(commands); vcidx++)
+        t.appendCommand(commands[vcidx].name, &commands[vcidx]);
+}
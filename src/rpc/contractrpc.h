@@ -0,0 +1,18 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef MAGNACHAIN_RPC_CONTRACTRPC_H
+#define MAGNACHAIN_RPC_CONTRACTRPC_H
+
+#include <stdint.h>
+
+class JSONRPCRequest;
+class UniValue;
+
+/** Batch of read-only contract calls, also served by REST /rest/contractquery */
+UniValue querycontracts(const JSONRPCRequest& request);
+/** Run the calls of querycontracts, the lua instructions of all calls are bounded by a positive nInstructionBudget */
+UniValue QueryContracts(const UniValue& calls, int64_t nInstructionBudget = 0);
+
+#endif
@@ -7,6 +7,7 @@
 #include "coding/base58.h"
 #include "chain/chain.h"
 #include "misc/clientversion.h"
+#include "misc/memorygovernor.h"
 #include "io/core_io.h"
 #include "init.h"
 #include "validation/validation.h"
@@ -545,6 +546,7 @@ UniValue getmemoryinfo(const JSONRPCRequest& request)
             "1. \"mode\" determines what kind of information is returned. This argument is optional, the default mode is \"stats\".\n"
             "  - \"stats\" returns general statistics about memory usage in the daemon.\n"
             "  - \"mallocinfo\" returns an XML string describing low-level heap state (only available if compiled with glibc 2.10+).\n"
+            "  - \"components\" returns the memory used by the databases and caches against the -dbcache budget.\n"
             "\nResult (mode \"stats\"):\n"
             "{\n"
             "  \"locked\": {               (json object) Information about locked memory manager\n"
@@ -558,6 +560,20 @@ UniValue getmemoryinfo(const JSONRPCRequest& request)
             "}\n"
             "\nResult (mode \"mallocinfo\"):\n"
             "\"<malloc version=\"1\">...\"\n"
+            "\nResult (mode \"components\"):\n"
+            "{\n"
+            "  \"budget\": xxxxx,           (numeric) Bytes of the -dbcache budget\n"
+            "  \"usage\": xxxxx,            (numeric) Bytes used by the components counted in the budget\n"
+            "  \"components\": {\n"
+            "    \"name\": {                (json object) One database or cache\n"
+            "      \"usage\": xxxxx,        (numeric) Bytes used\n"
+            "      \"limit\": xxxxx,        (numeric) Bytes given to the component\n"
+            "      \"inbudget\": true|false, (boolean) If the usage is counted in the budget\n"
+            "      \"evictable\": true|false, (boolean) If the component drops data when over its limit\n"
+            "      \"evictions\": xxxxx     (numeric) Number of times data was dropped\n"
+            "    }, ...\n"
+            "  }\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmemoryinfo", "")
             + HelpExampleRpc("getmemoryinfo", "")
@@ -574,6 +590,25 @@ UniValue getmemoryinfo(const JSONRPCRequest& request)
 #else
         throw JSONRPCError(RPC_INVALID_PARAMETER, "mallocinfo is only available when compiled with glibc 2.10+");
 #endif
+    } else if (mode == "components") {
+        UniValue components(UniValue::VOBJ);
+        uint64_t nUsage = 0;
+        for (const MemoryComponentInfo& info : g_memoryGovernor.GetComponents()) {
+            UniValue obj(UniValue::VOBJ);
+            obj.push_back(Pair("usage", (uint64_t)info.nUsage));
+            obj.push_back(Pair("limit", (uint64_t)info.nLimit));
+            obj.push_back(Pair("inbudget", info.fInBudget));
+            obj.push_back(Pair("evictable", info.fEvictable));
+            obj.push_back(Pair("evictions", info.nEvictions));
+            components.push_back(Pair(info.strName, obj));
+            if (info.fInBudget)
+                nUsage += info.nUsage;
+        }
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("budget", (uint64_t)g_memoryGovernor.GetBudget()));
+        obj.push_back(Pair("usage", nUsage));
+        obj.push_back(Pair("components", components));
+        return obj;
     } else {
         throw JSONRPCError(RPC_INVALID_PARAMETER, "unknown mode " + mode);
     }
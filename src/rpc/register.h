@@ -22,6 +22,8 @@ void RegisterMiningRPCCommands(CRPCTable &tableRPC);
 void RegisterRawTransactionRPCCommands(CRPCTable &tableRPC);
 /** Register branchchain rpc commands */
 void RegisterBranchChainRPCCommands(CRPCTable &tableRPC);
+/** Register smart contract rpc commands */
+void RegisterContractRPCCommands(CRPCTable &tableRPC);
 
 static inline void RegisterAllCoreRPCCommands(CRPCTable &t)
 {
@@ -31,6 +33,7 @@ static inline void RegisterAllCoreRPCCommands(CRPCTable &t)
     RegisterMiningRPCCommands(t);
     RegisterRawTransactionRPCCommands(t);
 	RegisterBranchChainRPCCommands(t);
+    RegisterContractRPCCommands(t);
 }
 
 #endif
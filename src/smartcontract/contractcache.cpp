@@ -0,0 +1,121 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "smartcontract/contractcache.h"
+
+#include "coding/hash.h"
+#include "misc/memusage.h"
+#include "misc/random.h"
+#include "utils/util.h"
+
+ContractCodeCache g_contractCodeCache(DEFAULT_MAX_CONTRACT_CODE_CACHE_SIZE << 20);
+
+ContractCodeCache::ContractCodeCache(size_t maxUsageIn)
+    : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())),
+    maxUsage(maxUsageIn), usage(0), hits(0), misses(0), evictions(0)
+{
+}
+
+size_t ContractCodeCache::EntryUsage(const std::string& code)
+{
+    // 链表结点 + 哈希结点 + shared_ptr控制块 + 代码本身
+    return memusage::MallocUsage(sizeof(LRU_LIST::value_type) + 2 * sizeof(void*)) +
+        memusage::MallocUsage(sizeof(CODE_MAP::value_type) + sizeof(void*)) +
+        memusage::MallocUsage(sizeof(std::string) + 2 * sizeof(void*)) +
+        memusage::MallocUsage(code.capacity());
+}
+
+ContractCodeKey ContractCodeCache::ComputeKey(const MCContractID& contractId, const std::string& rawCode) const
+{
+    ContractCodeKey key;
+    key.contractId = contractId;
+    key.codeHash = CSipHasher(k0, k1).Write((const unsigned char*)rawCode.data(), rawCode.size()).Finalize();
+    key.codeLen = rawCode.size();
+    return key;
+}
+
+ContractCodeCache::CodePtr ContractCodeCache::Lookup(const ContractCodeKey& key)
+{
+    LOCK(cs);
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        misses++;
+        return CodePtr();
+    }
+
+    hits++;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+}
+
+ContractCodeCache::CodePtr ContractCodeCache::Insert(const ContractCodeKey& key, std::string&& code)
+{
+    CodePtr ptr = std::make_shared<const std::string>(std::move(code));
+    size_t entryUsage = EntryUsage(*ptr);
+
+    LOCK(cs);
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        // 其他线程已经加载过
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+    }
+
+    // 超出缓存上限的代码不缓存，直接返回给调用者使用
+    if (entryUsage > maxUsage)
+        return ptr;
+
+    Evict(entryUsage);
+    lru.emplace_front(key, ptr);
+    entries.emplace(key, lru.begin());
+    usage += entryUsage;
+    return ptr;
+}
+
+void ContractCodeCache::Evict(size_t needUsage)
+{
+    AssertLockHeld(cs);
+    while (!lru.empty() && usage + needUsage > maxUsage) {
+        auto& back = lru.back();
+        usage -= EntryUsage(*back.second);
+        entries.erase(back.first);
+        lru.pop_back();
+        evictions++;
+    }
+}
+
+void ContractCodeCache::SetMaxUsage(size_t maxUsageIn)
+{
+    LOCK(cs);
+    maxUsage = maxUsageIn;
+    Evict(0);
+}
+
+void ContractCodeCache::Clear()
+{
+    LOCK(cs);
+    lru.clear();
+    entries.clear();
+    usage = 0;
+}
+
+ContractCodeCacheStats ContractCodeCache::GetStats() const
+{
+    ContractCodeCacheStats stats;
+    LOCK(cs);
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.evictions = evictions;
+    stats.entries = entries.size();
+    stats.usage = usage;
+    stats.maxUsage = maxUsage;
+    return stats;
+}
+
+// To be called once in AppInitMain/BasicTestingSetup to size the code cache.
+void InitContractCodeCache()
+{
+    int64_t maxSize = std::min(std::max((int64_t)0, gArgs.GetArg("-maxcontractcodecache", DEFAULT_MAX_CONTRACT_CODE_CACHE_SIZE)), MAX_MAX_CONTRACT_CODE_CACHE_SIZE);
+    g_contractCodeCache.SetMaxUsage((size_t)maxSize << 20);
+    LogPrintf("Using %d MiB for contract code cache\n", maxSize);
+}
@@ -0,0 +1,97 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef CONTRACT_CACHE_H
+#define CONTRACT_CACHE_H
+
+#include "key/pubkey.h"
+#include "thread/sync.h"
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+// 默认合约代码缓存大小(MiB)
+static const int64_t DEFAULT_MAX_CONTRACT_CODE_CACHE_SIZE = 32;
+static const int64_t MAX_MAX_CONTRACT_CODE_CACHE_SIZE = 4096;
+
+// 合约代码缓存键: 合约ID + 存盘代码的哈希
+struct ContractCodeKey
+{
+    MCContractID contractId;
+    uint64_t codeHash;
+    uint32_t codeLen;
+
+    bool operator==(const ContractCodeKey& other) const
+    {
+        return contractId == other.contractId && codeHash == other.codeHash && codeLen == other.codeLen;
+    }
+};
+
+struct ContractCodeKeyHasher
+{
+    size_t operator()(const ContractCodeKey& key) const
+    {
+        return key.codeHash ^ key.contractId.GetUint64(0);
+    }
+};
+
+struct ContractCodeCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t usage = 0;
+    size_t maxUsage = 0;
+};
+
+/**
+ * Process wide, size bounded cache of decompressed contract bytecode.
+ * Every SmartLuaState shares it, so a hot contract is only inflated once
+ * instead of once per call in mempool acceptance, mining and block connection.
+ * The bytecode is still loaded into the lua_State on every call: function
+ * prototypes kept in a pooled state would count towards its lua allocation
+ * limit and make LUA_ERRMEM depend on what the state executed before.
+ */
+class ContractCodeCache
+{
+public:
+    typedef std::shared_ptr<const std::string> CodePtr;
+
+private:
+    typedef std::list<std::pair<ContractCodeKey, CodePtr>> LRU_LIST;
+    typedef std::unordered_map<ContractCodeKey, LRU_LIST::iterator, ContractCodeKeyHasher> CODE_MAP;
+
+    mutable MCCriticalSection cs;
+    uint64_t k0, k1;
+    size_t maxUsage;
+    size_t usage;
+    LRU_LIST lru;
+    CODE_MAP entries;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+    static size_t EntryUsage(const std::string& code);
+    void Evict(size_t needUsage);
+
+public:
+    explicit ContractCodeCache(size_t maxUsageIn);
+
+    ContractCodeKey ComputeKey(const MCContractID& contractId, const std::string& rawCode) const;
+    CodePtr Lookup(const ContractCodeKey& key);
+    CodePtr Insert(const ContractCodeKey& key, std::string&& code);
+
+    void SetMaxUsage(size_t maxUsageIn);
+    void Clear();
+    ContractCodeCacheStats GetStats() const;
+};
+
+extern ContractCodeCache g_contractCodeCache;
+
+void InitContractCodeCache();
+
+#endif
@@ -1,10 +1,13 @@
 // Copyright (c) 2016-2019 The MagnaChain Core developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
-#include <boost/bind.hpp>
 #include <boost/thread.hpp>
+#include <algorithm>
+#include <limits>
+#include <memory>
 
 #include "smartcontract/contractdb.h"
+#include "misc/memusage.h"
 #include "coding/base58.h"
 #include "univalue.h"
 #include "transaction/txmempool.h"
@@ -94,155 +97,329 @@ void ContractContext::ClearAll()
 }
 
 ContractDataDB::ContractDataDB(const fs::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
-    : db(path, nCacheSize, fMemory, fWipe, true), writeBatch(db), removeBatch(db), threadPool(boost::thread::hardware_concurrency())
+    : db(path, nCacheSize, fMemory, fWipe, true), writeBatch(db), removeBatch(db),
+    speculation(gArgs.GetBoolArg("-contractspeculation", DEFAULT_CONTRACT_SPECULATION)), speculatedTxs(0), reexecutedTxs(0),
+    executor(boost::thread::hardware_concurrency()), nCacheLimit(DEFAULT_CONTRACT_DATA_CACHE_SIZE),
+    nConfirmHeight(-1)
 {
-    for (int i = 0; i < threadPool.size(); ++i) {
-        threadPool.schedule(boost::bind(InitializeThread, this));
-    }
 }
 
-void ContractDataDB::InitializeThread(ContractDataDB* contractDB)
+// 记录合约执行时读取的币数量，执行结果留在独立的CoinAmountCache中，确认后再合并到共享缓存
+class CoinAmountTracker : public CoinAmountCacheBase
 {
+public:
+    explicit CoinAmountTracker(CoinAmountCache* sharedIn) : shared(sharedIn) {}
+
+    MCAmount GetAmount(const uint160& key) const override
+    {
+        MCAmount value = shared->GetAmount(key);
+        reads[key] = value;
+        return value;
+    }
+
+    // 将local中有变化的币数量合并到共享缓存，并记录被修改的key
+    bool Apply(CoinAmountCache& local, std::set<uint160>& written) const
     {
-        LOCK(contractDB->cs_cache);
-        contractDB->threadId2SmartLuaState.insert(std::make_pair(boost::this_thread::get_id(), new SmartLuaState()));
+        for (auto& item : reads) {
+            MCAmount value = local.GetAmount(item.first);
+            if (value == item.second)
+                continue;
+
+            bool success = (value > item.second) ? shared->IncAmount(item.first, value - item.second)
+                                                 : shared->DecAmount(item.first, item.second - value);
+            if (!success)
+                return false;
+            written.insert(item.first);
+        }
+        return true;
+    }
+
+    mutable std::map<uint160, MCAmount> reads;
+
+private:
+    CoinAmountCache* shared;
+};
+
+// 组内一笔合约交易的推测执行
+struct SpeculativeContractTx
+{
+    SmartContractThreadData threadData;
+    CoinAmountTracker coinTracker;
+    CoinAmountCache coinAmountCache;
+    std::set<MCContractID> readSet;     // 执行期间访问过的合约
+    ContractPrevData prevData;          // 执行前的prevContractData，重新执行时恢复
+    bool success;
+
+    explicit SpeculativeContractTx(CoinAmountCache* shared)
+        : coinTracker(shared), coinAmountCache(&coinTracker), success(false) {}
+};
+
+bool static AddAssociationTransactions(MCBlock* pBlock, int txIndex, SmartContractThreadData* threadData)
+{
+    const MCTransactionRef tx = pBlock->vtx[txIndex];
+    if (tx->IsNull()) {
+        LogPrintf("%s:%d => tx is null\n", __FUNCTION__, __LINE__);
+        return false;
+    }
+
+    threadData->associationTransactions.insert(tx->GetHash());
+    for (int j = 0; j < tx->vin.size(); ++j) {
+        if (!tx->vin[j].prevout.hash.IsNull() && !tx->IsStake()) {// branch first block's stake tx's input is from the same block(支链第一个块的stake交易的输入来自同一区块中的交易，其他情况下stake的输入不可能来自同一区块)
+            threadData->associationTransactions.insert(tx->vin[j].prevout.hash);
+        }
     }
-    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+    return true;
 }
 
-void ContractDataDB::ExecutiveTransactionContract(MCBlock* pBlock, SmartContractThreadData* threadData)
+bool ContractDataDB::RunTransactionContract(SmartLuaState* sls, MCBlock* pBlock, int i, SmartContractThreadData* threadData, std::string& strError)
 {
-    auto it = threadId2SmartLuaState.find(boost::this_thread::get_id());
-    if (it == threadId2SmartLuaState.end()) {
-        throw std::runtime_error(strprintf("%s:%d it == threadId2SmartLuaState.end()\n", __FUNCTION__, __LINE__));
+    const MCTransactionRef tx = pBlock->vtx[i];
+    if (!tx->IsSmartContract()) {
+        return true;
     }
 
-    SmartLuaState* sls = it->second;
-    if (sls == nullptr) {
-        throw std::runtime_error(strprintf("%s:%d sls == nullptr\n", __FUNCTION__, __LINE__));
+    bool mainChain = Params().IsMainChain();
+    MCContractID contractId = tx->pContractData->address;
+    MagnaChainAddress contractAddr(contractId);
+    MagnaChainAddress senderAddr(tx->pContractData->sender.GetID());
+    MCAmount amount = GetTxContractOut(*tx);
+
+    UniValue ret(UniValue::VARR);
+    if (tx->nVersion == MCTransaction::PUBLISH_CONTRACT_VERSION) {
+        std::string rawCode = tx->pContractData->codeOrFunc;
+        sls->Initialize(true, threadData->pPrevBlockIndex->GetBlockTime(), threadData->blockHeight, i, senderAddr,
+            &threadData->contractContext, threadData->pPrevBlockIndex, SmartLuaState::SAVE_TYPE_CACHE, nullptr);
+        if (!PublishContract(sls, contractAddr, rawCode, ret, true)
+            || tx->pContractData->amountOut != 0 || tx->pContractData->amountOut != sls->contractOut) {
+            strError = "publish contract fail";
+            return false;
+        }
     }
+    else if (tx->nVersion == MCTransaction::CALL_CONTRACT_VERSION) {
+        const std::string& strFuncName = tx->pContractData->codeOrFunc;
+        UniValue args;
+        args.read(tx->pContractData->args);
+
+        sls->Initialize(false, threadData->pPrevBlockIndex->GetBlockTime(), threadData->blockHeight, i, senderAddr, &threadData->contractContext,
+            threadData->pPrevBlockIndex, SmartLuaState::SAVE_TYPE_CACHE, threadData->pCoinAmountCache);
+        if (!CallContract(sls, contractAddr, amount, strFuncName, args, ret) || tx->pContractData->amountOut != sls->contractOut) {
+            strError = "call contract fail";
+            return false;
+        }
 
-#ifndef _DEBUG
-    try {
-#endif
-        bool mainChain = Params().IsMainChain();
-        if (!mainChain) {
-            threadData->contractContext.txFinalData.resize(threadData->groupSize);
+        if (tx->pContractData->amountOut > 0 && sls->recipients.size() == 0) {
+            strError = "tx->pContractData->amountOut > 0 && sls->recipients.size() == 0";
+            return false;
         }
 
-        std::map<MCContractID, uint256> contract2txid;
-        for (int i = threadData->offset; i < threadData->offset + threadData->groupSize; ++i) {
-            if (interrupt) {
-                return;
+        MCAmount total = 0;
+        for (int j = 0; j < sls->recipients.size(); ++j) {
+            if (!tx->IsExistVout(sls->recipients[j])) {
+                strError = "vout not exist";
+                return false;
             }
+            total += sls->recipients[j].nValue;
+        }
 
-            const MCTransactionRef tx = pBlock->vtx[i];
-            if (tx->IsNull()) {
-                LogPrintf("%s:%d => tx is null\n", __FUNCTION__, __LINE__);
-                interrupt = true;
-                return;
-            }
+        if (total != tx->pContractData->amountOut || tx->pContractData->amountOut != sls->contractOut) {
+            strError = "amount not match";
+            return false;
+        }
 
-            threadData->associationTransactions.insert(tx->GetHash());
-            for (int j = 0; j < tx->vin.size(); ++j) {
-                if (!tx->vin[j].prevout.hash.IsNull() && !tx->IsStake()) {// branch first block's stake tx's input is from the same block(支链第一个块的stake交易的输入来自同一区块中的交易，其他情况下stake的输入不可能来自同一区块)
-                    threadData->associationTransactions.insert(tx->vin[j].prevout.hash);
-                }
+        if (!mainChain) {
+            threadData->contractContext.txFinalData[i - threadData->offset].coins = threadData->pCoinAmountCache->GetAmount(contractId);
+        }
+
+        if (tx->pContractData->amountOut > 0) {
+            threadData->pCoinAmountCache->DecAmount(tx->pContractData->address, tx->pContractData->amountOut);
+        }
+
+        const std::vector<MCTxOut>& vout = tx->vout;
+        for (int i = 0; i < vout.size(); ++i) {
+            const MCScript& scriptPubKey = vout[i].scriptPubKey;
+            if (scriptPubKey.IsContract()) {
+                opcodetype opcode;
+                std::vector<unsigned char> vch;
+                MCScript::const_iterator pc = scriptPubKey.begin();
+                MCScript::const_iterator end = scriptPubKey.end();
+                scriptPubKey.GetOp(pc, opcode, vch);
+
+                assert(opcode == OP_CONTRACT || opcode == OP_CONTRACT_CHANGE);
+                vch.clear();
+                vch.assign(pc + 1, end);
+                uint160 key = uint160(vch);
+                MCContractID contractId = MCContractID(key);
+                threadData->pCoinAmountCache->IncAmount(contractId, vout[i].nValue);
             }
+        }
+    }
 
-            if (!tx->IsSmartContract()) {
-                continue;
+    if (!mainChain) {
+        for (auto it : sls->contractDataFrom) {
+            pBlock->prevContractData[i].items[it.first].blockHash = it.second.blockHash;
+            pBlock->prevContractData[i].items[it.first].txIndex = it.second.txIndex;
+        }
+        threadData->contractContext.txFinalData[i - threadData->offset].data = threadData->contractContext.cache;
+    }
+    threadData->contractContext.Commit();
+    sls->contractDataFrom.clear();
+    return true;
+}
+
+void ContractDataDB::SpeculateTransactionContract(SmartLuaState* sls, MCBlock* pBlock, SpeculativeContractTx* spec)
+{
+    if (interrupt) {
+        return;
+    }
+
+    std::string strError;
+    try {
+        spec->success = RunTransactionContract(sls, pBlock, spec->threadData.offset, &spec->threadData, strError);
+        if (!spec->success)
+            LogPrint(BCLog::CONTRACT, "%s:%d => speculative execution of tx %d failed: %s\n", __FUNCTION__, __LINE__, spec->threadData.offset, strError);
+        spec->readSet = sls->contractIds;
+        for (auto& item : spec->threadData.contractContext.data)
+            spec->readSet.insert(item.first);
+    }
+    catch (const std::exception& e) {
+        LogPrint(BCLog::CONTRACT, "%s:%d => speculative execution of tx %d failed: %s\n", __FUNCTION__, __LINE__, spec->threadData.offset, e.what());
+        spec->success = false;
+    }
+}
+
+// 组内的合约交易先基于组开始时的数据并发地推测执行，记录各自访问过的合约和币数量；
+// 再按区块顺序逐笔确认，访问了本组之前交易已修改的数据(或推测执行失败)的交易
+// 在当前数据上重新执行，因此结果与按顺序串行执行完全一致
+void ContractDataDB::ExecutiveGroupSpeculatively(SmartLuaState* sls, MCBlock* pBlock, SmartContractThreadData* threadData)
+{
+    bool mainChain = Params().IsMainChain();
+    std::vector<std::unique_ptr<SpeculativeContractTx>> specs;
+    for (int i = threadData->offset; i < threadData->offset + threadData->groupSize; ++i) {
+        if (interrupt) {
+            return;
+        }
+
+        if (!AddAssociationTransactions(pBlock, i, threadData)) {
+            interrupt = true;
+            return;
+        }
+
+        if (pBlock->vtx[i]->IsSmartContract()) {
+            SpeculativeContractTx* spec = new SpeculativeContractTx(threadData->pCoinAmountCache);
+            specs.emplace_back(spec);
+            spec->threadData.offset = i;
+            spec->threadData.groupSize = 1;
+            spec->threadData.blockHeight = threadData->blockHeight;
+            spec->threadData.pPrevBlockIndex = threadData->pPrevBlockIndex;
+            spec->threadData.pCoinAmountCache = &spec->coinAmountCache;
+            if (!mainChain) {
+                spec->threadData.contractContext.txFinalData.resize(1);
+                spec->prevData = pBlock->prevContractData[i];
             }
+        }
+    }
 
-            MCContractID contractId = tx->pContractData->address;
-            MagnaChainAddress contractAddr(contractId);
-            MagnaChainAddress senderAddr(tx->pContractData->sender.GetID());
-            MCAmount amount = GetTxContractOut(*tx);
-
-            UniValue ret(UniValue::VARR);
-            if (tx->nVersion == MCTransaction::PUBLISH_CONTRACT_VERSION) {
-                std::string rawCode = tx->pContractData->codeOrFunc;
-                sls->Initialize(true, threadData->pPrevBlockIndex->GetBlockTime(), threadData->blockHeight, i, senderAddr,
-                    &threadData->contractContext, threadData->pPrevBlockIndex, SmartLuaState::SAVE_TYPE_CACHE, nullptr);
-                if (!PublishContract(sls, contractAddr, rawCode, ret, true)
-                    || tx->pContractData->amountOut != 0 || tx->pContractData->amountOut != sls->contractOut) {
-                    LogPrintf("%s:%d => publish contract fail\n", __FUNCTION__, __LINE__);
-                    interrupt = true;
-                    return;
-                }
+    // 只有一笔合约交易时没有推测执行的必要
+    bool speculated = (specs.size() > 1);
+    if (speculated) {
+        ContractExecutor::TaskGroup batch;
+        for (auto& spec : specs) {
+            executor.Submit(batch, std::bind(&ContractDataDB::SpeculateTransactionContract, this, std::placeholders::_1, pBlock, spec.get()));
+        }
+        executor.Wait(batch);
+        speculatedTxs += specs.size();
+    }
+
+    std::set<uint160> coinWritten;
+    for (auto& spec : specs) {
+        if (interrupt) {
+            return;
+        }
+
+        int i = spec->threadData.offset;
+        bool conflict = !spec->success;
+        for (auto it = spec->readSet.begin(); !conflict && it != spec->readSet.end(); ++it) {
+            conflict = (threadData->contractContext.data.count(*it) > 0);
+        }
+        for (auto it = spec->coinTracker.reads.begin(); !conflict && it != spec->coinTracker.reads.end(); ++it) {
+            conflict = (coinWritten.count(it->first) > 0);
+        }
+
+        if (!conflict) {
+            for (auto& item : spec->threadData.contractContext.data)
+                threadData->contractContext.data[item.first] = std::move(item.second);
+            if (!mainChain)
+                threadData->contractContext.txFinalData[i - threadData->offset] = std::move(spec->threadData.contractContext.txFinalData[0]);
+            if (!spec->coinTracker.Apply(spec->coinAmountCache, coinWritten)) {
+                LogPrintf("%s:%d => apply coin amount fail\n", __FUNCTION__, __LINE__);
+                interrupt = true;
+                return;
             }
-            else if (tx->nVersion == MCTransaction::CALL_CONTRACT_VERSION) {
-                const std::string& strFuncName = tx->pContractData->codeOrFunc;
-                UniValue args;
-                args.read(tx->pContractData->args);
-
-                sls->Initialize(false, threadData->pPrevBlockIndex->GetBlockTime(), threadData->blockHeight, i, senderAddr, &threadData->contractContext,
-                    threadData->pPrevBlockIndex, SmartLuaState::SAVE_TYPE_CACHE, threadData->pCoinAmountCache);
-                if (!CallContract(sls, contractAddr, amount, strFuncName, args, ret) || tx->pContractData->amountOut != sls->contractOut) {
-                    LogPrintf("%s:%d => call contract fail\n", __FUNCTION__, __LINE__);
-                    interrupt = true;
-                    return;
-                }
+            continue;
+        }
 
-                if (tx->pContractData->amountOut > 0 && sls->recipients.size() == 0) {
-                    LogPrintf("%s:%d => tx->pContractData->amountOut > 0 && sls->recipients.size() == 0\n", __FUNCTION__, __LINE__);
-                    interrupt = true;
-                    return;
-                }
+        if (speculated)
+            ++reexecutedTxs;
+        if (!mainChain)
+            pBlock->prevContractData[i] = spec->prevData;
+
+        CoinAmountTracker coinTracker(threadData->pCoinAmountCache);
+        CoinAmountCache coinAmountCache(&coinTracker);
+        CoinAmountCache* pSharedCoinAmountCache = threadData->pCoinAmountCache;
+        threadData->pCoinAmountCache = &coinAmountCache;
+        std::string strError;
+        bool success = RunTransactionContract(sls, pBlock, i, threadData, strError);
+        threadData->pCoinAmountCache = pSharedCoinAmountCache;
+        if (!success) {
+            LogPrintf("%s:%d => %s\n", __FUNCTION__, __LINE__, strError);
+            interrupt = true;
+            return;
+        }
+        if (!coinTracker.Apply(coinAmountCache, coinWritten)) {
+            LogPrintf("%s:%d => apply coin amount fail\n", __FUNCTION__, __LINE__);
+            interrupt = true;
+            return;
+        }
+    }
+}
 
-                MCAmount total = 0;
-                for (int j = 0; j < sls->recipients.size(); ++j) {
-                    if (!tx->IsExistVout(sls->recipients[j])) {
-                        LogPrintf("%s:%d => vout not exist\n", __FUNCTION__, __LINE__);
-                        interrupt = true;
-                        return;
-                    }
-                    total += sls->recipients[j].nValue;
-                }
+void ContractDataDB::ExecutiveTransactionContract(SmartLuaState* sls, MCBlock* pBlock, SmartContractThreadData* threadData)
+{
+    int64_t start = GetTimeMicros();
+    ExecutiveGroup(sls, pBlock, threadData);
+    threadData->execMicros = GetTimeMicros() - start;
+}
 
-                if (total != tx->pContractData->amountOut || tx->pContractData->amountOut != sls->contractOut) {
-                    LogPrintf("%s:%d => amount not match\n", __FUNCTION__, __LINE__);
-                    interrupt = true;
-                    return;
-                }
+void ContractDataDB::ExecutiveGroup(SmartLuaState* sls, MCBlock* pBlock, SmartContractThreadData* threadData)
+{
+#ifndef _DEBUG
+    try {
+#endif
+        if (!Params().IsMainChain()) {
+            threadData->contractContext.txFinalData.resize(threadData->groupSize);
+        }
 
-                if (!mainChain) {
-                    threadData->contractContext.txFinalData[i].coins = threadData->pCoinAmountCache->GetAmount(contractId);
-                }
-                
-                if (tx->pContractData->amountOut > 0) {
-                    threadData->pCoinAmountCache->DecAmount(tx->pContractData->address, tx->pContractData->amountOut);
-                }
+        if (speculation) {
+            ExecutiveGroupSpeculatively(sls, pBlock, threadData);
+            return;
+        }
 
-                const std::vector<MCTxOut>& vout = tx->vout;
-                for (int i = 0; i < vout.size(); ++i) {
-                    const MCScript& scriptPubKey = vout[i].scriptPubKey;
-                    if (scriptPubKey.IsContract()) {
-                        opcodetype opcode;
-                        std::vector<unsigned char> vch;
-                        MCScript::const_iterator pc = scriptPubKey.begin();
-                        MCScript::const_iterator end = scriptPubKey.end();
-                        scriptPubKey.GetOp(pc, opcode, vch);
-
-                        assert(opcode == OP_CONTRACT || opcode == OP_CONTRACT_CHANGE);
-                        vch.clear();
-                        vch.assign(pc + 1, end);
-                        uint160 key = uint160(vch);
-                        MCContractID contractId = MCContractID(key);
-                        threadData->pCoinAmountCache->IncAmount(contractId, vout[i].nValue);
-                    }
-                }
+        for (int i = threadData->offset; i < threadData->offset + threadData->groupSize; ++i) {
+            if (interrupt) {
+                return;
             }
 
-            if (!mainChain) {
-                for (auto it : sls->contractDataFrom) {
-                    pBlock->prevContractData[i].items[it.first].blockHash = it.second.blockHash;
-                    pBlock->prevContractData[i].items[it.first].txIndex = it.second.txIndex;
-                }
-                threadData->contractContext.txFinalData[i - threadData->offset].data = threadData->contractContext.cache;
+            if (!AddAssociationTransactions(pBlock, i, threadData)) {
+                interrupt = true;
+                return;
+            }
+
+            std::string strError;
+            if (!RunTransactionContract(sls, pBlock, i, threadData, strError)) {
+                LogPrintf("%s:%d => %s\n", __FUNCTION__, __LINE__, strError);
+                interrupt = true;
+                return;
             }
-            threadData->contractContext.Commit();
-            sls->contractDataFrom.clear();
         }
 #ifndef _DEBUG
     }
@@ -283,16 +460,45 @@ bool ContractDataDB::RunBlockContract(MCBlock* pBlock, ContractContext* pContrac
     if (!mainChain) {
         pBlock->prevContractData.resize(size);
     }
+    std::vector<int> order(pBlock->groupSize.size());
     for (int i = 0; i < pBlock->groupSize.size(); ++i) {
         threadData[i].offset = offset;
         threadData[i].groupSize = pBlock->groupSize[i];
         threadData[i].blockHeight = blockHeight;
         threadData[i].pPrevBlockIndex = pPrevBlockIndex;
         threadData[i].pCoinAmountCache = pCoinAmountCache;
-        threadPool.schedule(boost::bind(&ContractDataDB::ExecutiveTransactionContract, this, pBlock, &threadData[i]));
         offset += pBlock->groupSize[i];
+        order[i] = i;
+    }
+
+    // 大的分组先提交，空闲的线程再从其他线程的队列中取任务
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return pBlock->groupSize[a] > pBlock->groupSize[b]; });
+    int64_t start = GetTimeMicros();
+    std::vector<int64_t> busyMicros = executor.GetBusyMicros();
+    uint64_t steals = executor.GetSteals();
+    uint64_t speculated = speculatedTxs;
+    uint64_t reexecuted = reexecutedTxs;
+    ContractExecutor::TaskGroup groups;
+    for (int i : order) {
+        executor.Submit(groups, std::bind(&ContractDataDB::ExecutiveTransactionContract, this, std::placeholders::_1, pBlock, &threadData[i]));
+    }
+    executor.Wait(groups);
+
+    if (LogAcceptCategory(BCLog::CONTRACT)) {
+        int64_t elapsed = GetTimeMicros() - start;
+        int64_t criticalPath = 0;
+        for (auto& data : threadData)
+            criticalPath = std::max(criticalPath, data.execMicros);
+
+        std::vector<int64_t> busyMicrosNow = executor.GetBusyMicros();
+        std::string idle;
+        for (size_t i = 0; i < busyMicrosNow.size(); ++i)
+            idle += strprintf("%s%.2f", i > 0 ? "," : "", std::max<int64_t>(0, elapsed - (busyMicrosNow[i] - busyMicros[i])) * 0.001);
+
+        LogPrint(BCLog::CONTRACT, "%s: %u txs in %u groups, %.2fms, critical path %.2fms, idle per worker [%s]ms, %u steals, %u speculated, %u re-executed\n",
+            __FUNCTION__, pBlock->vtx.size(), pBlock->groupSize.size(), elapsed * 0.001, criticalPath * 0.001, idle,
+            executor.GetSteals() - steals, speculatedTxs - speculated, reexecutedTxs - reexecuted);
     }
-    threadPool.wait();
 
     if (interrupt) {
         throw std::runtime_error(strprintf("%s:%d => run contract interrupt", __FUNCTION__, __LINE__));
@@ -356,42 +562,46 @@ bool ContractDataDB::WriteBlockContractInfoToDisk(MCBlockIndex* pBlockIndex, Con
     MCDBBatch writeBatch(db);
     size_t maxBatchSize = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
     for (auto ci : pContractContext->data) {
-        DBContractInfo& contractInfo = contractData[ci.first];
+        ContractDataShard& shard = GetShard(ci.first);
+        LOCK(shard.cs);
+        auto di = shard.data.find(ci.first);
+        if (di == shard.data.end()) {
+            // 合约可能已被换出，先读取已存盘的高度列表，避免存盘时覆盖
+            DBContractInfo dbContractInfo;
+            db.Read(ci.first, dbContractInfo);
+            di = shard.Insert(ci.first, std::move(dbContractInfo));
+        }
+        DBContractInfo& contractInfo = di->second;
+        shard.Touch(contractInfo);
         if (contractInfo.code.empty())
             contractInfo.code = ci.second.code;
         ci.second.blockHash = pBlockIndex->GetBlockHash();
 
-        // 将区块插入对应的结点中
-        auto insertPoint = contractInfo.items.end();
-        for (auto it = contractInfo.items.begin(); it != contractInfo.items.end(); ++it) {
-            if (pBlockIndex->nHeight < it->blockHeight) {
-                insertPoint = contractInfo.items.insert(it, DBContractInfoByHeight());
-                insertPoint->blockHeight = pBlockIndex->nHeight;
-                break;
-            }
-            else if (pBlockIndex->nHeight == it->blockHeight) {
-                insertPoint = it;
-                break;
-            }
-        }
-
+        // 将区块插入对应高度的结点中
+        auto insertPoint = contractInfo.items.find(pBlockIndex->nHeight);
         if (insertPoint == contractInfo.items.end()) {
-            insertPoint = contractInfo.items.insert(insertPoint, DBContractInfoByHeight());
-            insertPoint->blockHeight = pBlockIndex->nHeight;
+            insertPoint = contractInfo.items.emplace(pBlockIndex->nHeight, DBContractInfoByHeight()).first;
+            insertPoint->second.blockHeight = pBlockIndex->nHeight;
+            insertPoint->second.loaded = true;
+        }
+        else {
+            LoadHeightItem(ci.first, insertPoint->second);
         }
 
-        for (int i = 0; i < insertPoint->vecBlockHash.size(); ++i) {
-            if (insertPoint->vecBlockHash[i] == ci.second.blockHash) {
-                insertPoint->vecBlockHash.erase(insertPoint->vecBlockHash.begin() + i);
-                insertPoint->vecBlockContractData.erase(insertPoint->vecBlockContractData.begin() + i);
+        for (int i = 0; i < insertPoint->second.vecBlockHash.size(); ++i) {
+            if (insertPoint->second.vecBlockHash[i] == ci.second.blockHash) {
+                insertPoint->second.vecBlockHash.erase(insertPoint->second.vecBlockHash.begin() + i);
+                insertPoint->second.vecBlockContractData.erase(insertPoint->second.vecBlockContractData.begin() + i);
                 break;
             }
         }
 
         // 待存盘的合约数据
-        insertPoint->dirty = true;
-        insertPoint->vecBlockHash.emplace_back(ci.second.blockHash);
-        insertPoint->vecBlockContractData.emplace_back(ci.second.data);
+        insertPoint->second.dirty = true;
+        insertPoint->second.vecBlockHash.emplace_back(ci.second.blockHash);
+        insertPoint->second.vecBlockContractData.emplace_back(ci.second.data);
+        shard.UpdateUsage(contractInfo);
+        TrimShard(shard, nCacheLimit / CONTRACT_DATA_SHARDS);
 
         // 数据存盘
         MCHashWriter keyHash(SER_GETHASH, 0);
@@ -427,72 +637,81 @@ bool ContractDataDB::UpdateBlockContractToDisk(MCBlockIndex* pBlockIndex)
     removeBatch.Clear();
     MCDBBatch writeBatch(db);
     MCBlockIndex* newConfirmBlock = pBlockIndex->GetAncestor(confirmBlockHeight);
-    for (auto& ci : contractData) {
-        auto& contractInfo = ci.second;
-        auto saveIt = contractInfo.items.end();
-
-        for (auto heightIt = contractInfo.items.begin(); heightIt != contractInfo.items.end();) {
-            // 将小于确认区块以下的不属于该链的区块数据移除掉
-            if (heightIt->blockHeight <= confirmBlockHeight) {
-                for (int i = 0; i < heightIt->vecBlockHash.size();) {
-                    BlockMap::iterator bi = mapBlockIndex.find(heightIt->vecBlockHash[i]);
-                    if (bi == mapBlockIndex.end() || 
-                        newConfirmBlock->GetAncestor(heightIt->blockHeight)->GetBlockHash() != heightIt->vecBlockHash[i]) {
-                        MCHashWriter keyHash(SER_GETHASH, 0);
-                        keyHash << ci.first << heightIt->vecBlockHash[i];
-                        removeBatch.Erase(keyHash.GetHash());
-
-                        heightIt->dirty = true;
-                        heightIt->vecBlockHash.erase(heightIt->vecBlockHash.begin() + i);
-                        heightIt->vecBlockContractData.erase(heightIt->vecBlockContractData.begin() + i);
-                        continue;
-                    }
-                    else {
-                        ++i;
+    nConfirmHeight = confirmBlockHeight;
+    for (auto& shard : shards) {
+        LOCK(shard.cs);
+        for (auto& ci : shard.data) {
+            auto& contractInfo = ci.second;
+            auto saveIt = contractInfo.items.end();
+
+            for (auto heightIt = contractInfo.items.begin(); heightIt != contractInfo.items.end();) {
+                // 将小于确认区块以下的不属于该链的区块数据移除掉
+                if (heightIt->second.blockHeight <= confirmBlockHeight) {
+                    LoadHeightItem(ci.first, heightIt->second);
+                    for (int i = 0; i < heightIt->second.vecBlockHash.size();) {
+                        BlockMap::iterator bi = mapBlockIndex.find(heightIt->second.vecBlockHash[i]);
+                        if (bi == mapBlockIndex.end() || 
+                            newConfirmBlock->GetAncestor(heightIt->second.blockHeight)->GetBlockHash() != heightIt->second.vecBlockHash[i]) {
+                            MCHashWriter keyHash(SER_GETHASH, 0);
+                            keyHash << ci.first << heightIt->second.vecBlockHash[i];
+                            removeBatch.Erase(keyHash.GetHash());
+
+                            heightIt->second.dirty = true;
+                            heightIt->second.vecBlockHash.erase(heightIt->second.vecBlockHash.begin() + i);
+                            heightIt->second.vecBlockContractData.erase(heightIt->second.vecBlockContractData.begin() + i);
+                            continue;
+                        }
+                        else {
+                            ++i;
+                        }
                     }
+                    assert(heightIt->second.vecBlockHash.size() == 1 && heightIt->second.vecBlockContractData.size() == 1);
                 }
-                assert(heightIt->vecBlockHash.size() == 1 && heightIt->vecBlockContractData.size() == 1);
-            }
 
-            if (heightIt->blockHeight < removeBlockHeight) {
-                // 保留当前即将移除块以下的最近一笔数据，防止程序退出时区块链保存信息不完整导致加载到错误数据
-                if (saveIt != contractInfo.items.end()) {
-                    // 移除存盘数据
-                    assert(saveIt->vecBlockHash.size() == 1);
-                    MCHashWriter keyBlockHash(SER_GETHASH, 0);
-                    keyBlockHash << ci.first << *saveIt->vecBlockHash.begin();
-                    removeBatch.Erase(keyBlockHash.GetHash());
+                if (heightIt->second.blockHeight < removeBlockHeight) {
+                    // 保留当前即将移除块以下的最近一笔数据，防止程序退出时区块链保存信息不完整导致加载到错误数据
+                    if (saveIt != contractInfo.items.end()) {
+                        // 移除存盘数据
+                        assert(saveIt->second.vecBlockHash.size() == 1);
+                        MCHashWriter keyBlockHash(SER_GETHASH, 0);
+                        keyBlockHash << ci.first << *saveIt->second.vecBlockHash.begin();
+                        removeBatch.Erase(keyBlockHash.GetHash());
+
+                        MCHashWriter keyHeightHash(SER_GETHASH, 0);
+                        keyHeightHash << ci.first << saveIt->second.blockHeight;
+                        removeBatch.Erase(keyHeightHash.GetHash());
+                        contractInfo.items.erase(saveIt);
+                    }
+                    saveIt = heightIt;
 
+                    if (contractInfo.items.size() == 1)
+                        removes.emplace_back(ci.first);
+                }
+
+                if (heightIt->second.dirty) {
+                    heightIt->second.dirty = false;
                     MCHashWriter keyHeightHash(SER_GETHASH, 0);
-                    keyHeightHash << ci.first << saveIt->blockHeight;
-                    removeBatch.Erase(keyHeightHash.GetHash());
-                    contractInfo.items.erase(saveIt);
+                    keyHeightHash << ci.first << heightIt->second.blockHeight;
+                    writeBatch.Write(keyHeightHash.GetHash(), heightIt->second.vecBlockHash);
+                    if (writeBatch.SizeEstimate() > maxBatchSize) {
+                        if (!WriteBatch(writeBatch))
+                            return false;
+                    }
                 }
-                saveIt = heightIt;
 
-                if (contractInfo.items.size() == 1)
-                    removes.emplace_back(ci.first);
+                ++heightIt;
             }
 
-            if (heightIt->dirty) {
-                heightIt->dirty = false;
-                MCHashWriter keyHeightHash(SER_GETHASH, 0);
-                keyHeightHash << ci.first << heightIt->blockHeight;
-                writeBatch.Write(keyHeightHash.GetHash(), heightIt->vecBlockHash);
-                if (writeBatch.SizeEstimate() > maxBatchSize) {
-                    if (!WriteBatch(writeBatch))
-                        return false;
-                }
+            writeBatch.Write(ci.first, ci.second);
+            if (writeBatch.SizeEstimate() > maxBatchSize) {
+                if (!WriteBatch(writeBatch))
+                    return false;
             }
-
-            ++heightIt;
-        }
-
-        writeBatch.Write(ci.first, ci.second);
-        if (writeBatch.SizeEstimate() > maxBatchSize) {
-            if (!WriteBatch(writeBatch))
-                return false;
+            shard.UpdateUsage(contractInfo);
         }
+        if (!PruneEvictedContracts(shard, removeBlockHeight, writeBatch, maxBatchSize))
+            return false;
+        TrimShard(shard, nCacheLimit / CONTRACT_DATA_SHARDS);
     }
 
     if (writeBatch.SizeEstimate() > 0) {
@@ -503,63 +722,291 @@ bool ContractDataDB::UpdateBlockContractToDisk(MCBlockIndex* pBlockIndex)
     return true;
 }
 
+// 已换出的合约不在上面的遍历中，最高高度也低于清理高度时从磁盘读出高度列表，只保留最高的一个，
+// 与缓存中的合约清理结果一致。调用者需持有cs_cache和所在分片的锁
+bool ContractDataDB::PruneEvictedContracts(ContractDataShard& shard, int removeBlockHeight, MCDBBatch& writeBatch, size_t maxBatchSize)
+{
+    for (auto it = shard.evicted.begin(); it != shard.evicted.end();) {
+        if (it->second >= removeBlockHeight) {
+            ++it;
+            continue;
+        }
+
+        DBContractInfo contractInfo;
+        if (db.Read(it->first, contractInfo) && contractInfo.items.size() > 1) {
+            auto lastIt = std::prev(contractInfo.items.end());
+            for (auto heightIt = contractInfo.items.begin(); heightIt != lastIt;) {
+                LoadHeightItem(it->first, heightIt->second);
+                for (const uint256& blockHash : heightIt->second.vecBlockHash) {
+                    MCHashWriter keyBlockHash(SER_GETHASH, 0);
+                    keyBlockHash << it->first << blockHash;
+                    removeBatch.Erase(keyBlockHash.GetHash());
+                }
+                MCHashWriter keyHeightHash(SER_GETHASH, 0);
+                keyHeightHash << it->first << heightIt->second.blockHeight;
+                removeBatch.Erase(keyHeightHash.GetHash());
+                heightIt = contractInfo.items.erase(heightIt);
+            }
+            writeBatch.Write(it->first, contractInfo);
+            if (writeBatch.SizeEstimate() > maxBatchSize) {
+                if (!WriteBatch(writeBatch))
+                    return false;
+            }
+        }
+        it = shard.evicted.erase(it);
+    }
+    return true;
+}
+
 void ContractDataDB::PruneContractInfo()
 {
     LOCK(cs_cache);
     if (removeBatch.SizeEstimate() > 0)
         WriteBatch(removeBatch);
 
-    for (uint160& contractId : removes)
-        contractData.erase(contractId);
+    for (uint160& contractId : removes) {
+        ContractDataShard& shard = GetShard(contractId);
+        LOCK(shard.cs);
+        auto di = shard.data.find(contractId);
+        if (di != shard.data.end())
+            shard.Erase(di);
+    }
     removes.clear();
 }
 
-int ContractDataDB::GetContractInfo(const MCContractID& contractId, ContractInfo& contractInfo, MCBlockIndex* prevBlockIndex)
+// 字符串超出内部缓冲时才占用堆内存
+static size_t StringUsage(const std::string& str)
 {
-    LOCK(cs_cache);
+    return str.capacity() > 15 ? memusage::MallocUsage(str.capacity() + 1) : 0;
+}
 
-    // 检查是否在缓存中，不存在则尝试加载
-    auto di = contractData.find(contractId);
-    if (di == contractData.end()) {
-        DBContractInfo contractInfo;
-        if (!db.Read(contractId, contractInfo)) {
-            return -1;
+// 一个合约在缓存中的估算内存，包括所在的map和LRU结点
+static size_t ContractUsage(const DBContractInfo& info)
+{
+    size_t usage = memusage::MallocUsage(sizeof(memusage::stl_tree_node<std::pair<const MCContractID, DBContractInfo>>));
+    usage += memusage::MallocUsage(sizeof(uint160) + 2 * sizeof(void*));
+    usage += StringUsage(info.code) + memusage::DynamicUsage(info.items);
+    for (const auto& item : info.items) {
+        usage += memusage::DynamicUsage(item.second.vecBlockHash) + memusage::DynamicUsage(item.second.vecBlockContractData);
+        for (const std::string& data : item.second.vecBlockContractData)
+            usage += StringUsage(data);
+    }
+    return usage;
+}
+
+ContractDataShard::DATA::iterator ContractDataShard::Insert(const MCContractID& contractId, DBContractInfo&& info)
+{
+    auto ret = data.emplace(contractId, std::move(info));
+    if (ret.second) {
+        evicted.erase(contractId);
+        lru.push_front(contractId);
+        ret.first->second.lruIt = lru.begin();
+        ret.first->second.usage = 0;
+        UpdateUsage(ret.first->second);
+    }
+    return ret.first;
+}
+
+void ContractDataShard::Erase(DATA::iterator it)
+{
+    usage -= it->second.usage;
+    lru.erase(it->second.lruIt);
+    data.erase(it);
+}
+
+void ContractDataShard::Touch(DBContractInfo& info)
+{
+    lru.splice(lru.begin(), lru, info.lruIt);
+}
+
+void ContractDataShard::UpdateUsage(DBContractInfo& info)
+{
+    usage -= info.usage;
+    info.usage = ContractUsage(info);
+    usage += info.usage;
+}
+
+size_t ContractDataDB::DynamicMemoryUsage() const
+{
+    size_t usage = 0;
+    for (const auto& shard : shards) {
+        LOCK(shard.cs);
+        usage += shard.usage;
+    }
+    return usage;
+}
+
+// 有未存盘数据，或有未确认高度的分叉数据的合约不整个换出
+bool ContractDataDB::IsPinned(const DBContractInfo& info) const
+{
+    if (!info.items.empty() && info.items.rbegin()->first > nConfirmHeight)
+        return true;
+    for (const auto& item : info.items) {
+        if (item.second.dirty)
+            return true;
+    }
+    return false;
+}
+
+// 从最久未用的合约开始换出，最近使用的合约保留，调用者需持有分片的锁
+void ContractDataDB::TrimShard(ContractDataShard& shard, size_t nLimit)
+{
+    auto it = shard.lru.end();
+    while (shard.usage > nLimit && it != shard.lru.begin() && std::prev(it) != shard.lru.begin()) {
+        --it;
+        auto di = shard.data.find(MCContractID(*it));
+        assert(di != shard.data.end());
+        if (!IsPinned(di->second)) {
+            if (di->second.items.size() > 1)
+                shard.evicted[di->first] = di->second.items.rbegin()->first;
+            it = std::next(it);
+            shard.Erase(di);
+            continue;
         }
-        else {
-            contractData[contractId] = contractInfo;
-            di = contractData.find(contractId);
+
+        // 固定的合约只丢弃已存盘的数据，使用时按区块哈希重新读取
+        for (auto& item : di->second.items) {
+            if (item.second.dirty)
+                continue;
+            for (std::string& data : item.second.vecBlockContractData)
+                std::string().swap(data);
         }
+        shard.UpdateUsage(di->second);
     }
+}
 
-    // 遍历获取相应节点的数据
+void ContractDataDB::EvictContractData(size_t nTarget)
+{
+    for (auto& shard : shards) {
+        LOCK(shard.cs);
+        TrimShard(shard, nTarget / CONTRACT_DATA_SHARDS);
+    }
+}
+
+void ContractDataDB::SetCacheLimit(size_t nLimit)
+{
+    nCacheLimit = nLimit;
+    EvictContractData(nLimit);
+}
+
+ContractDataShard& ContractDataDB::GetShard(const MCContractID& contractId)
+{
+    return shards[*contractId.begin() % CONTRACT_DATA_SHARDS];
+}
+
+// 按需加载某高度下各分叉的区块哈希，调用者需持有所在分片的锁
+void ContractDataDB::LoadHeightItem(const MCContractID& contractId, DBContractInfoByHeight& item)
+{
+    if (item.loaded || item.dirty)
+        return;
+
+    MCHashWriter keyHeightHash(SER_GETHASH, 0);
+    keyHeightHash << contractId << item.blockHeight;
+    db.Read(keyHeightHash.GetHash(), item.vecBlockHash);
+    item.vecBlockContractData.resize(item.vecBlockHash.size());
+    item.loaded = true;
+}
+
+int ContractDataDB::GetContractInfo(const MCContractID& contractId, ContractInfo& contractInfo, MCBlockIndex* prevBlockIndex)
+{
+    ContractDataShard& shard = GetShard(contractId);
     MCBlockIndex* prevBlock = (prevBlockIndex ? prevBlockIndex : chainActive.Tip());
-    // 链表最末尾存储最高的区块
-    for (auto it = di->second.items.rbegin(); it != di->second.items.rend(); ++it) {
-        if (prevBlock->nHeight >= it->blockHeight) {
-            MCBlockIndex* targetBlockIndex = prevBlock->GetAncestor(it->blockHeight);
-            if (it->vecBlockHash.size() == 0) {
-                MCHashWriter keyHeightHash(SER_GETHASH, 0);
-                keyHeightHash << contractId << it->blockHeight;
-                db.Read(keyHeightHash.GetHash(), it->vecBlockHash);
-                it->vecBlockContractData.resize(it->vecBlockHash.size());
-            }
-            for (int i = 0; i < it->vecBlockHash.size(); ++i) {
-                if (it->vecBlockHash[i] == targetBlockIndex->GetBlockHash()) {
-                    if (it->vecBlockContractData[i].empty()) {
-                        MCHashWriter keyHash(SER_GETHASH, 0);
-                        keyHash << contractId << it->vecBlockHash[i];
-                        db.Read(keyHash.GetHash(), it->vecBlockContractData[i]);
+
+    // 在分片锁内查找，缺少的数据释放锁后从磁盘读取，装入缓存后再重新查找
+    while (true) {
+        int32_t loadHeight = -1;
+        uint256 loadBlockHash;
+        int32_t foundHeight = -1;
+        {
+            LOCK(shard.cs);
+            auto di = shard.data.find(contractId);
+            if (di != shard.data.end()) {
+                DBContractInfo::HEIGHT_ITEMS& items = di->second.items;
+                auto it = items.upper_bound(prevBlock->nHeight);
+                while (it != items.begin()) {
+                    --it;
+                    DBContractInfoByHeight& item = it->second;
+                    if (!item.loaded && !item.dirty) {
+                        loadHeight = item.blockHeight;
+                        break;
                     }
 
-                    contractInfo.txIndex = 0;
-                    contractInfo.code = di->second.code;
-                    contractInfo.blockHash = it->vecBlockHash[i];
-                    contractInfo.data = it->vecBlockContractData[i];
-                    return it->blockHeight;
+                    const uint256& targetBlockHash = prevBlock->GetAncestor(item.blockHeight)->GetBlockHash();
+                    for (int i = 0; i < item.vecBlockHash.size(); ++i) {
+                        if (item.vecBlockHash[i] == targetBlockHash) {
+                            contractInfo.txIndex = 0;
+                            contractInfo.code = di->second.code;
+                            contractInfo.blockHash = item.vecBlockHash[i];
+                            contractInfo.data = item.vecBlockContractData[i];
+                            foundHeight = item.blockHeight;
+                            break;
+                        }
+                    }
+                    if (foundHeight >= 0) {
+                        if (!contractInfo.data.empty()) {
+                            shard.Touch(di->second);
+                            return foundHeight;
+                        }
+                        loadBlockHash = contractInfo.blockHash;
+                        break;
+                    }
                 }
+                if (loadHeight < 0 && foundHeight < 0)
+                    return -1;
             }
         }
-    }
 
-    return -1;
+        if (foundHeight >= 0) {
+            // 数据可能本身为空，读取后直接返回，不再重新查找
+            MCHashWriter keyHash(SER_GETHASH, 0);
+            keyHash << contractId << loadBlockHash;
+            db.Read(keyHash.GetHash(), contractInfo.data);
+
+            LOCK(shard.cs);
+            auto di = shard.data.find(contractId);
+            if (di != shard.data.end()) {
+                auto it = di->second.items.find(foundHeight);
+                if (it != di->second.items.end()) {
+                    DBContractInfoByHeight& item = it->second;
+                    for (int i = 0; i < item.vecBlockHash.size(); ++i) {
+                        if (item.vecBlockHash[i] == loadBlockHash && item.vecBlockContractData[i].empty())
+                            item.vecBlockContractData[i] = contractInfo.data;
+                    }
+                }
+                shard.Touch(di->second);
+                shard.UpdateUsage(di->second);
+                TrimShard(shard, nCacheLimit / CONTRACT_DATA_SHARDS);
+            }
+            return foundHeight;
+        }
+        else if (loadHeight >= 0) {
+            std::vector<uint256> vecBlockHash;
+            MCHashWriter keyHeightHash(SER_GETHASH, 0);
+            keyHeightHash << contractId << loadHeight;
+            db.Read(keyHeightHash.GetHash(), vecBlockHash);
+
+            LOCK(shard.cs);
+            auto di = shard.data.find(contractId);
+            if (di != shard.data.end()) {
+                auto it = di->second.items.find(loadHeight);
+                if (it != di->second.items.end() && !it->second.loaded && !it->second.dirty) {
+                    it->second.vecBlockHash = std::move(vecBlockHash);
+                    it->second.vecBlockContractData.resize(it->second.vecBlockHash.size());
+                    it->second.loaded = true;
+                }
+                shard.Touch(di->second);
+                shard.UpdateUsage(di->second);
+                TrimShard(shard, nCacheLimit / CONTRACT_DATA_SHARDS);
+            }
+        }
+        else {
+            DBContractInfo dbContractInfo;
+            if (!db.Read(contractId, dbContractInfo))
+                return -1;
+
+            LOCK(shard.cs);
+            shard.Insert(contractId, std::move(dbContractInfo));
+            TrimShard(shard, nCacheLimit / CONTRACT_DATA_SHARDS);
+        }
+    }
 }
@@ -5,7 +5,14 @@
 #define CONTRACT_DB_H
 
 #include "transaction/txdb.h"
-#include <boost/threadpool.hpp>
+#include "smartcontract/contractexecutor.h"
+
+#include <list>
+
+// 默认按组串行执行组内的合约交易
+static const bool DEFAULT_CONTRACT_SPECULATION = false;
+// 合约缓存的默认内存上限，启动时由内存管理按-dbcache重新设置
+static const size_t DEFAULT_CONTRACT_DATA_CACHE_SIZE = 64 << 20;
 
 // 合约某高度存盘数据项
 class ContractDataSave
@@ -28,6 +35,7 @@ class DBContractInfoByHeight
 {
 public:
     bool dirty = false;
+    bool loaded = false;
     int32_t blockHeight;
     std::vector<uint256> vecBlockHash;
     std::vector<std::string> vecBlockContractData;
@@ -39,18 +47,36 @@ public:
     }
 };
 
-// 区块关联的智能合约存盘数据
+// 区块关联的智能合约存盘数据，按高度索引各版本，同一高度下为各分叉的数据
 class DBContractInfo
 {
 public:
+    typedef std::map<int32_t, DBContractInfoByHeight> HEIGHT_ITEMS;
+
     std::string code;
-    std::list<DBContractInfoByHeight> items;
+    HEIGHT_ITEMS items;
+
+    // 以下不存盘，由所在分片维护
+    size_t usage = 0;
+    std::list<uint160>::iterator lruIt;
 
     ADD_SERIALIZE_METHODS;
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action) {
         READWRITE(code);
-        READWRITE(items);
+        // 与原先std::list<DBContractInfoByHeight>的存盘格式一致，每项只有高度
+        std::vector<int32_t> heights;
+        if (!ser_action.ForRead()) {
+            heights.reserve(items.size());
+            for (auto& item : items)
+                heights.push_back(item.first);
+        }
+        READWRITE(heights);
+        if (ser_action.ForRead()) {
+            items.clear();
+            for (int32_t height : heights)
+                items[height].blockHeight = height;
+        }
     }
 };
 
@@ -100,9 +126,33 @@ struct SmartContractThreadData
     MCBlockIndex* pPrevBlockIndex;
     CoinAmountCache* pCoinAmountCache;
     std::set<uint256> associationTransactions;
+    int64_t execMicros;
 };
 
+struct SpeculativeContractTx;
+
 typedef std::map<uint256, std::vector<std::map<MCContractID, ContractInfo>>> BLOCK_CONTRACT_DATA;
+
+// 合约缓存按合约ID分片，各分片独立加锁，各占缓存上限的一份
+static const int CONTRACT_DATA_SHARDS = 16;
+struct ContractDataShard
+{
+    typedef std::map<MCContractID, DBContractInfo> DATA;
+
+    mutable MCCriticalSection cs;
+    DATA data;
+    std::list<uint160> lru; // 最近使用的在前
+    size_t usage = 0;
+    // 整个换出时有多个高度的合约及其最高高度，该高度低于清理高度后从磁盘清理旧的高度
+    std::map<MCContractID, int32_t> evicted;
+
+    // 以下调用者需持有cs
+    DATA::iterator Insert(const MCContractID& contractId, DBContractInfo&& info);
+    void Erase(DATA::iterator it);
+    void Touch(DBContractInfo& info);
+    void UpdateUsage(DBContractInfo& info);
+};
+
 class ContractDataDB
 {
 private:
@@ -111,12 +161,18 @@ private:
     MCDBBatch writeBatch;
     MCDBBatch removeBatch;
     std::vector<uint160> removes;
-    boost::threadpool::pool threadPool;
-    std::map<boost::thread::id, SmartLuaState*> threadId2SmartLuaState;
     mutable MCCriticalSection cs_cache;
+    bool speculation;
+    std::atomic<uint64_t> speculatedTxs;
+    std::atomic<uint64_t> reexecutedTxs;
+    ContractExecutor executor;
+    std::atomic<size_t> nCacheLimit;
+    std::atomic<int32_t> nConfirmHeight;
 
     // 合约缓存，同时包含多个合约对应的多个块合约数据快照
-    std::map<MCContractID, DBContractInfo> contractData;
+    // cs_cache只保护存盘批次，读取合约只锁所在分片，磁盘读取在锁外进行
+    // 各分片按LRU换出，有未存盘数据或未确认分叉数据的合约只丢弃已存盘的数据
+    ContractDataShard shards[CONTRACT_DATA_SHARDS];
     BLOCK_CONTRACT_DATA blockContractData;
     std::map<int, std::vector<std::pair<uint256, bool>>> mapHeightHash;
 
@@ -128,12 +184,32 @@ public:
     ContractDataDB(const ContractDataDB&) = delete;
     ContractDataDB& operator=(const ContractDataDB&) = delete;
     ContractDataDB(const fs::path& path, size_t nCacheSize, bool fMemory, bool fWipe);
-    static void InitializeThread(ContractDataDB* contractDB);
 
     int GetContractInfo(const MCContractID& contractId, ContractInfo& contractInfo, MCBlockIndex* currentPrevBlockIndex);
 
     bool RunBlockContract(MCBlock* pBlock, ContractContext* pContractContext, CoinAmountCache* pCoinAmountCache);
-    void ExecutiveTransactionContract(MCBlock* pBlock, SmartContractThreadData* threadData);
+    void ExecutiveTransactionContract(SmartLuaState* sls, MCBlock* pBlock, SmartContractThreadData* threadData);
+
+private:
+    bool RunTransactionContract(SmartLuaState* sls, MCBlock* pBlock, int txIndex, SmartContractThreadData* threadData, std::string& strError);
+    void ExecutiveGroup(SmartLuaState* sls, MCBlock* pBlock, SmartContractThreadData* threadData);
+    void ExecutiveGroupSpeculatively(SmartLuaState* sls, MCBlock* pBlock, SmartContractThreadData* threadData);
+    void SpeculateTransactionContract(SmartLuaState* sls, MCBlock* pBlock, SpeculativeContractTx* spec);
+    ContractDataShard& GetShard(const MCContractID& contractId);
+    void LoadHeightItem(const MCContractID& contractId, DBContractInfoByHeight& item);
+    bool IsPinned(const DBContractInfo& info) const;
+    void TrimShard(ContractDataShard& shard, size_t nLimit);
+    bool PruneEvictedContracts(ContractDataShard& shard, int removeBlockHeight, MCDBBatch& writeBatch, size_t maxBatchSize);
+
+public:
+
+    MCDBWrapper* GetDb() { return &db; }
+    // 缓存的合约数据的估算内存
+    size_t DynamicMemoryUsage() const;
+    // 换出缓存的合约数据直到不超过nTarget，下次使用时从磁盘重新读取
+    void EvictContractData(size_t nTarget);
+    // 设置上限并换出超出部分
+    void SetCacheLimit(size_t nLimit);
 
     bool WriteBatch(MCDBBatch& batch);
     bool WriteBlockContractInfoToDisk(MCBlockIndex* pBlockIndex, ContractContext* contractContext);
@@ -0,0 +1,174 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "smartcontract/contractexecutor.h"
+#include "smartcontract/smartcontract.h"
+#include "utils/util.h"
+#include "utils/utiltime.h"
+
+#include <deque>
+#include <thread>
+
+struct ContractExecutor::Worker
+{
+    std::mutex cs;
+    std::deque<std::pair<TaskGroup*, Task>> tasks;
+    SmartLuaState sls;
+    std::atomic<int64_t> busyMicros;
+    std::thread thread;
+
+    Worker() : busyMicros(0) {}
+};
+
+// 当前线程所属的执行器及工作线程序号
+static thread_local ContractExecutor* currentExecutor = nullptr;
+static thread_local int currentWorker = -1;
+
+ContractExecutor::ContractExecutor(int threads)
+    : queued(0), steals(0), nextWorker(0), shutdown(false)
+{
+    for (int i = 0; i < std::max(1, threads); ++i)
+        workers.emplace_back(new Worker());
+    for (int i = 0; i < (int)workers.size(); ++i)
+        workers[i]->thread = std::thread(&TraceThread<std::function<void()> >, "contract", std::function<void()>(std::bind(&ContractExecutor::ThreadMain, this, i)));
+}
+
+ContractExecutor::~ContractExecutor()
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        shutdown = true;
+    }
+    cond.notify_all();
+    for (auto& worker : workers)
+        worker->thread.join();
+}
+
+void ContractExecutor::Submit(TaskGroup& group, Task task)
+{
+    ++group.pending;
+
+    // 工作线程提交的子任务放入自己的队列，其余轮流分配
+    int target = (currentExecutor == this) ? currentWorker : (int)(nextWorker++ % workers.size());
+    {
+        std::lock_guard<std::mutex> lock(workers[target]->cs);
+        workers[target]->tasks.emplace_back(&group, std::move(task));
+        ++queued;
+    }
+
+    std::lock_guard<std::mutex> lock(cs);
+    cond.notify_all();
+}
+
+void ContractExecutor::Wait(TaskGroup& group)
+{
+    if (currentExecutor != this) {
+        std::unique_lock<std::mutex> lock(cs);
+        cond.wait(lock, [&] { return group.pending == 0; });
+        return;
+    }
+
+    // 在工作线程中等待时先执行本批次尚未开始的任务，剩下的都在其他线程执行中
+    while (RunOne(currentWorker, &group)) {
+    }
+
+    int64_t start = GetTimeMicros();
+    {
+        std::unique_lock<std::mutex> lock(cs);
+        cond.wait(lock, [&] { return group.pending == 0; });
+    }
+    workers[currentWorker]->busyMicros -= GetTimeMicros() - start;
+}
+
+std::vector<int64_t> ContractExecutor::GetBusyMicros() const
+{
+    std::vector<int64_t> ret;
+    for (auto& worker : workers)
+        ret.push_back(worker->busyMicros);
+    return ret;
+}
+
+// 从deque中取出一个任务，only不为空时只取该批次的任务
+static bool TakeTask(std::deque<std::pair<ContractExecutor::TaskGroup*, ContractExecutor::Task>>& tasks, bool back,
+    ContractExecutor::TaskGroup* only, std::pair<ContractExecutor::TaskGroup*, ContractExecutor::Task>& entry)
+{
+    if (only == nullptr) {
+        if (tasks.empty())
+            return false;
+        if (back) {
+            entry = std::move(tasks.back());
+            tasks.pop_back();
+        }
+        else {
+            entry = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        return true;
+    }
+
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        auto it = back ? tasks.begin() + (tasks.size() - 1 - i) : tasks.begin() + i;
+        if (it->first == only) {
+            entry = std::move(*it);
+            tasks.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ContractExecutor::RunOne(int self, TaskGroup* only)
+{
+    std::pair<TaskGroup*, Task> entry;
+    bool found = false;
+    {
+        Worker& worker = *workers[self];
+        std::lock_guard<std::mutex> lock(worker.cs);
+        found = TakeTask(worker.tasks, true, only, entry);
+    }
+
+    for (size_t i = 1; !found && i < workers.size(); ++i) {
+        Worker& victim = *workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.cs);
+        found = TakeTask(victim.tasks, false, only, entry);
+        if (found)
+            ++steals;
+    }
+
+    if (!found)
+        return false;
+    --queued;
+
+    int64_t start = GetTimeMicros();
+    try {
+        entry.second(&workers[self]->sls);
+    }
+    catch (const std::exception& e) {
+        LogPrintf("%s:%d => task exception %s\n", __FUNCTION__, __LINE__, e.what());
+    }
+    // 等待中执行的任务已计入外层任务的时间
+    if (only == nullptr)
+        workers[self]->busyMicros += GetTimeMicros() - start;
+
+    if (--entry.first->pending == 0) {
+        std::lock_guard<std::mutex> lock(cs);
+        cond.notify_all();
+    }
+    return true;
+}
+
+void ContractExecutor::ThreadMain(int self)
+{
+    currentExecutor = this;
+    currentWorker = self;
+
+    while (true) {
+        if (RunOne(self, nullptr))
+            continue;
+
+        std::unique_lock<std::mutex> lock(cs);
+        cond.wait(lock, [&] { return shutdown || queued > 0; });
+        if (shutdown)
+            return;
+    }
+}
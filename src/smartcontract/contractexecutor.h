@@ -0,0 +1,70 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef CONTRACT_EXECUTOR_H
+#define CONTRACT_EXECUTOR_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+class SmartLuaState;
+
+/**
+ * Work-stealing executor for the contract transactions of a block.
+ *
+ * Every worker owns a SmartLuaState, which is handed to each task it runs,
+ * and a deque of tasks. A worker takes its own newest task first and steals
+ * the oldest task of another worker when its deque is empty, so a long group
+ * never leaves other cores idle while work is queued elsewhere. Tasks may
+ * submit further tasks and wait for them; a waiting worker runs the tasks of
+ * that batch which have not been started yet instead of blocking. Those run
+ * with the same SmartLuaState, so a task must not keep anything in it across
+ * Wait.
+ */
+class ContractExecutor
+{
+public:
+    typedef std::function<void(SmartLuaState*)> Task;
+
+    // 一批任务，Wait等待其全部完成
+    class TaskGroup
+    {
+        friend class ContractExecutor;
+        std::atomic<int> pending;
+
+    public:
+        TaskGroup() : pending(0) {}
+    };
+
+    explicit ContractExecutor(int threads);
+    ~ContractExecutor();
+
+    void Submit(TaskGroup& group, Task task);
+    void Wait(TaskGroup& group);
+
+    int WorkerCount() const { return (int)workers.size(); }
+    // 各工作线程累计执行任务的时间(微秒)，不含等待子任务时的空闲
+    std::vector<int64_t> GetBusyMicros() const;
+    uint64_t GetSteals() const { return steals; }
+
+private:
+    struct Worker;
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    std::mutex cs;
+    std::condition_variable cond;
+    std::atomic<int> queued;
+    std::atomic<uint64_t> steals;
+    std::atomic<unsigned int> nextWorker;
+    bool shutdown;
+
+    bool RunOne(int self, TaskGroup* only);
+    void ThreadMain(int self);
+};
+
+#endif
@@ -0,0 +1,312 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "smartcontract/contractnative.h"
+#include "coding/base58.h"
+#include "coding/hash.h"
+
+extern "C"
+{
+#include "lua/lua.h"
+#include "lua/lauxlib.h"
+
+void luaD_limitinstruction(lua_State* L, long instructions);
+}
+
+#include <math.h>
+#include <stdlib.h>
+
+typedef long long NativeInt;
+
+// 无论lua_Number为整数还是double都能精确表示的范围，参数和结果都限制在其中
+static const NativeInt NATIVE_INT_MAX = 1LL << 53;
+static const NativeInt NATIVE_INT_MIN = -NATIVE_INT_MAX;
+
+static const char* NATIVE_LIB = "contractnative.lib";
+
+// 注意：lua_error以longjmp返回，调用之前不能有需要析构的C++对象
+
+// 在转换之前排除超出范围的值，lua_Number为double时还排除NaN、无穷大和小数
+static bool IsNativeInt(lua_Number n)
+{
+    return n >= NATIVE_INT_MIN && n <= NATIVE_INT_MAX && floor(n) == n;
+}
+
+static NativeInt CheckInt(lua_State* L, int idx)
+{
+    if (lua_type(L, idx) != LUA_TNUMBER)
+        luaL_typerror(L, idx, "number");
+    lua_Number n = lua_tonumber(L, idx);
+    if (!IsNativeInt(n))
+        luaL_argerror(L, idx, "integer out of range");
+    return (NativeInt)n;
+}
+
+static NativeInt CheckRange(lua_State* L, NativeInt value)
+{
+    if (value < NATIVE_INT_MIN || value > NATIVE_INT_MAX)
+        luaL_error(L, "integer overflow");
+    return value;
+}
+
+static NativeInt CheckAmount(lua_State* L, int idx)
+{
+    NativeInt amount = CheckInt(L, idx);
+    if (amount < 0)
+        luaL_argerror(L, idx, "negative amount");
+    return amount;
+}
+
+// 参数都在±2^53内，long long运算本身不会溢出
+static NativeInt CheckedAdd(lua_State* L, NativeInt a, NativeInt b)
+{
+    return CheckRange(L, a + b);
+}
+
+static NativeInt CheckedSub(lua_State* L, NativeInt a, NativeInt b)
+{
+    return CheckRange(L, a - b);
+}
+
+static int NativeAdd(lua_State* L)
+{
+    luaD_limitinstruction(L, GAS_NATIVE_ARITH);
+    lua_pushnumber(L, CheckedAdd(L, CheckInt(L, 1), CheckInt(L, 2)));
+    return 1;
+}
+
+static int NativeSub(lua_State* L)
+{
+    luaD_limitinstruction(L, GAS_NATIVE_ARITH);
+    lua_pushnumber(L, CheckedSub(L, CheckInt(L, 1), CheckInt(L, 2)));
+    return 1;
+}
+
+static int NativeMul(lua_State* L)
+{
+    luaD_limitinstruction(L, GAS_NATIVE_ARITH);
+    NativeInt a = CheckInt(L, 1);
+    NativeInt b = CheckInt(L, 2);
+    if (b != 0 && llabs(a) > NATIVE_INT_MAX / llabs(b))
+        luaL_error(L, "integer overflow");
+    lua_pushnumber(L, a * b);
+    return 1;
+}
+
+// 向零取整
+static int NativeDiv(lua_State* L)
+{
+    luaD_limitinstruction(L, GAS_NATIVE_ARITH);
+    NativeInt a = CheckInt(L, 1);
+    NativeInt b = CheckInt(L, 2);
+    if (b == 0)
+        luaL_error(L, "division by zero");
+    lua_pushnumber(L, a / b);
+    return 1;
+}
+
+// 读取map[key]，不存在为0，经过元方法以支持延迟加载的存盘数据
+static NativeInt GetBalance(lua_State* L, int map, int key)
+{
+    lua_pushvalue(L, key);
+    lua_gettable(L, map);
+    NativeInt balance = 0;
+    if (!lua_isnil(L, -1)) {
+        if (lua_type(L, -1) != LUA_TNUMBER)
+            luaL_error(L, "balance is not a number");
+        if (!IsNativeInt(lua_tonumber(L, -1)))
+            luaL_error(L, "balance out of range");
+        balance = (NativeInt)lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+    return balance;
+}
+
+static void SetBalance(lua_State* L, int map, int key, NativeInt balance)
+{
+    lua_pushvalue(L, key);
+    lua_pushnumber(L, balance);
+    lua_settable(L, map);
+}
+
+static int NativeBalanceOf(lua_State* L)
+{
+    luaD_limitinstruction(L, GAS_NATIVE_BALANCE);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checkany(L, 2);
+    lua_pushnumber(L, GetBalance(L, 1, 2));
+    return 1;
+}
+
+static int NativeCredit(lua_State* L)
+{
+    luaD_limitinstruction(L, 2 * GAS_NATIVE_BALANCE);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checkany(L, 2);
+    NativeInt amount = CheckAmount(L, 3);
+    NativeInt balance = CheckedAdd(L, GetBalance(L, 1, 2), amount);
+    SetBalance(L, 1, 2, balance);
+    lua_pushnumber(L, balance);
+    return 1;
+}
+
+static NativeInt Debit(lua_State* L, int map, int key, NativeInt amount)
+{
+    NativeInt balance = GetBalance(L, map, key);
+    if (balance < amount)
+        luaL_error(L, "insufficient balance");
+    SetBalance(L, map, key, balance - amount);
+    return balance - amount;
+}
+
+static int NativeDebit(lua_State* L)
+{
+    luaD_limitinstruction(L, 2 * GAS_NATIVE_BALANCE);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checkany(L, 2);
+    lua_pushnumber(L, Debit(L, 1, 2, CheckAmount(L, 3)));
+    return 1;
+}
+
+static int NativeTransfer(lua_State* L)
+{
+    luaD_limitinstruction(L, 4 * GAS_NATIVE_BALANCE);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checkany(L, 2);
+    luaL_checkany(L, 3);
+    NativeInt amount = CheckAmount(L, 4);
+    Debit(L, 1, 2, amount);
+    SetBalance(L, 1, 3, CheckedAdd(L, GetBalance(L, 1, 3), amount));
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// 只接受数字或可选负号加十进制数字的字符串
+static int NativeToInt(lua_State* L)
+{
+    luaD_limitinstruction(L, GAS_NATIVE_CONVERT);
+    if (lua_type(L, 1) == LUA_TNUMBER) {
+        if (IsNativeInt(lua_tonumber(L, 1)))
+            lua_pushvalue(L, 1);
+        else
+            lua_pushnil(L);
+        return 1;
+    }
+    if (lua_type(L, 1) != LUA_TSTRING) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    size_t len = 0;
+    const char* str = lua_tolstring(L, 1, &len);
+    size_t i = (len > 0 && str[0] == '-') ? 1 : 0;
+    bool negative = (i == 1);
+    if (i == len) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    NativeInt value = 0;
+    for (; i < len; ++i) {
+        if (str[i] < '0' || str[i] > '9' || value > (NATIVE_INT_MAX - (str[i] - '0')) / 10) {
+            lua_pushnil(L);
+            return 1;
+        }
+        value = value * 10 + (str[i] - '0');
+    }
+    lua_pushnumber(L, negative ? -value : value);
+    return 1;
+}
+
+static int CheckAddress(lua_State* L, bool contract)
+{
+    luaD_limitinstruction(L, GAS_NATIVE_ADDRESS);
+    bool valid = false;
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        MagnaChainAddress address(lua_tostring(L, 1));
+        valid = address.IsValid() && (address.IsContractID() == contract);
+    }
+    lua_pushboolean(L, valid);
+    return 1;
+}
+
+static int NativeIsAddress(lua_State* L)
+{
+    return CheckAddress(L, false);
+}
+
+static int NativeIsContract(lua_State* L)
+{
+    return CheckAddress(L, true);
+}
+
+static int NativeHash160(lua_State* L)
+{
+    size_t len = 0;
+    const char* data = luaL_checklstring(L, 1, &len);
+    luaD_limitinstruction(L, GAS_NATIVE_HASH * (1 + (long)(len / 64)));
+    const unsigned char* begin = (const unsigned char*)data;
+    uint160 hash = Hash160(begin, begin + len);
+    static const char digits[] = "0123456789abcdef";
+    char hex[2 * sizeof(hash)];
+    for (size_t i = 0; i < sizeof(hash); ++i) {
+        hex[2 * i] = digits[hash.begin()[i] >> 4];
+        hex[2 * i + 1] = digits[hash.begin()[i] & 15];
+    }
+    lua_pushlstring(L, hex, sizeof(hex));
+    return 1;
+}
+
+static int NativeReadOnly(lua_State* L)
+{
+    return luaL_error(L, "table.native is read-only");
+}
+
+static const luaL_Reg nativeFuncs[] = {
+    {"add", NativeAdd},
+    {"sub", NativeSub},
+    {"mul", NativeMul},
+    {"div", NativeDiv},
+    {"balanceof", NativeBalanceOf},
+    {"credit", NativeCredit},
+    {"debit", NativeDebit},
+    {"transfer", NativeTransfer},
+    {"toint", NativeToInt},
+    {"isaddress", NativeIsAddress},
+    {"iscontract", NativeIsContract},
+    {"hash160", NativeHash160},
+    {nullptr, nullptr}
+};
+
+void OpenContractNativeLib(lua_State* L)
+{
+    lua_getglobal(L, "table");
+    lua_newtable(L);
+
+    // 合约只能通过只读代理访问，setmetatable也无法替换受保护的元表
+    lua_newtable(L);
+    lua_newtable(L);
+    luaL_register(L, nullptr, nativeFuncs);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, NativeReadOnly);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "__metatable");
+    lua_setmetatable(L, -2);
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, NATIVE_LIB);
+    lua_setfield(L, -2, "native");
+    lua_pop(L, 1);
+}
+
+void SetContractNativeLib(lua_State* L, bool enabled)
+{
+    lua_getglobal(L, "table");
+    if (enabled)
+        lua_getfield(L, LUA_REGISTRYINDEX, NATIVE_LIB);
+    else
+        lua_pushnil(L);
+    lua_setfield(L, -2, "native");
+    lua_pop(L, 1);
+}
@@ -0,0 +1,47 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef CONTRACT_NATIVE_H
+#define CONTRACT_NATIVE_H
+
+struct lua_State;
+
+// 原生函数的固定gas，另有调用本身的虚拟机指令
+static const long GAS_NATIVE_ARITH = 2;
+static const long GAS_NATIVE_BALANCE = 3;    // 每次读写余额表
+static const long GAS_NATIVE_CONVERT = 10;
+static const long GAS_NATIVE_ADDRESS = 100;
+static const long GAS_NATIVE_HASH = 20;      // 另按每64字节再收一次
+
+/**
+ * Deterministic library of common contract operations implemented in C++,
+ * reachable from contracts as table.native:
+ *
+ *   add/sub/mul/div(a, b)            integer arithmetic, errors on overflow
+ *                                    and division by zero
+ *   balanceof(map, key)              map[key] or 0
+ *   credit/debit(map, key, amount)   add to / take from map[key], debit errors
+ *                                    when the balance is too low
+ *   transfer(map, from, to, amount)  debit from and credit to
+ *   toint(value)                     integer from a number or a plain decimal
+ *                                    string, nil otherwise
+ *   isaddress/iscontract(str)        address validation with the node's base58
+ *   hash160(str)                     hex of Hash160 of the bytes
+ *
+ * Each function charges a fixed amount of gas. The balance helpers go through
+ * metamethods, so they work on lazily loaded PersistentData tables. The
+ * library hangs off the table library because the sandbox already hands that
+ * to every contract and restores it when a state is returned to the pool;
+ * adding a new sandbox global would change the gas of every existing call.
+ * table.native itself is a read-only proxy with a protected metatable.
+ *
+ * Arguments, balances and results are limited to +-2^53, the range in which a
+ * lua number is exact whether LUA_NUMBER is an integer or a double; values
+ * outside it raise an error before any conversion and toint returns nil. Contracts only see the library from
+ * Consensus::Params::ContractNativeLibHeight on, see SetContractNativeLib.
+ */
+void OpenContractNativeLib(lua_State* L);
+// 按调用所在区块高度显示或隐藏table.native
+void SetContractNativeLib(lua_State* L, bool enabled);
+
+#endif
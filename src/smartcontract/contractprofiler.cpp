@@ -0,0 +1,137 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "smartcontract/contractprofiler.h"
+#include "smartcontract/smartcontract.h"
+#include "coding/base58.h"
+#include "utils/util.h"
+
+#include <string.h>
+#include <vector>
+
+ContractProfiler g_contractProfiler;
+
+bool ContractSampleKey::operator<(const ContractSampleKey& b) const
+{
+    if (contractId != b.contractId)
+        return contractId < b.contractId;
+    if (line != b.line)
+        return line < b.line;
+    return strcmp(name, b.name) < 0;
+}
+
+void ContractProfileBuffer::Clear()
+{
+    functions.clear();
+    samples.clear();
+}
+
+void ContractProfileBuffer::RecordCall(const MCContractID& contractId, const std::string& function, bool success,
+    int64_t instructions, int64_t micros, int64_t allocBytes, int64_t dataBytes)
+{
+    ContractFunctionProfile& profile = functions[std::make_pair(contractId, function)];
+    profile.calls++;
+    if (!success)
+        profile.failures++;
+    profile.instructions += instructions;
+    profile.micros += micros;
+    profile.allocBytes += allocBytes;
+    profile.dataBytes += dataBytes;
+}
+
+void ContractProfileBuffer::RecordSample(const MCContractID& contractId, const char* name, int line)
+{
+    ContractSampleKey key;
+    key.contractId = contractId;
+    key.line = line;
+    strncpy(key.name, name, sizeof(key.name) - 1);
+    key.name[sizeof(key.name) - 1] = '\0';
+    samples[key]++;
+}
+
+// 采样钩子，只读取调用栈，不执行lua代码，记录到当前SmartLuaState的缓冲中
+static void ContractProfileHook(lua_State* L)
+{
+    SmartLuaState* sls = (SmartLuaState*)L->userData;
+    if (sls == nullptr || sls->contractAddrs.empty())
+        return;
+
+    lua_Debug ar;
+    if (lua_getstack(L, 0, &ar) == 0 || lua_getinfo(L, "nS", &ar) == 0)
+        return;
+
+    MCContractID contractId;
+    if (!sls->contractAddrs.back().GetContractID(contractId))
+        return;
+    sls->profileBuffer.RecordSample(contractId, ar.name ? ar.name : ar.what, ar.linedefined);
+}
+
+void ContractProfiler::SetInterval(int64_t n)
+{
+    interval = (n <= 0) ? 0 : std::max(n, MIN_CONTRACT_PROFILE_INTERVAL);
+}
+
+void ContractProfiler::Attach(lua_State* L) const
+{
+    int64_t n = interval;
+    L->profile_hook = (n > 0) ? ContractProfileHook : nullptr;
+    L->profile_interval = n;
+    L->profile_countdown = n;
+}
+
+// 函数名由调用者决定，限制每个合约的条目数
+template <typename T>
+static T& GetProfileEntry(std::map<std::string, T>& entries, const std::string& key)
+{
+    auto it = entries.find(key);
+    if (it != entries.end())
+        return it->second;
+    if (entries.size() >= MAX_CONTRACT_PROFILE_KEYS)
+        return entries["(other)"];
+    return entries[key];
+}
+
+void ContractProfiler::Merge(ContractProfileBuffer& buffer)
+{
+    // 在锁外格式化采样位置
+    std::vector<std::pair<ContractSampleKey, std::string>> locations;
+    locations.reserve(buffer.samples.size());
+    for (const auto& sample : buffer.samples)
+        locations.emplace_back(sample.first, strprintf("%s:%d", sample.first.name, sample.first.line));
+
+    {
+        LOCK(cs);
+        for (const auto& item : buffer.functions) {
+            ContractFunctionProfile& profile = GetProfileEntry(profiles[item.first.first].functions, item.first.second);
+            profile.calls += item.second.calls;
+            profile.failures += item.second.failures;
+            profile.instructions += item.second.instructions;
+            profile.micros += item.second.micros;
+            profile.allocBytes += item.second.allocBytes;
+            profile.dataBytes += item.second.dataBytes;
+        }
+        for (const auto& location : locations)
+            GetProfileEntry(profiles[location.first.contractId].samples, location.second) += buffer.samples[location.first];
+    }
+    buffer.Clear();
+}
+
+std::map<MCContractID, ContractProfile> ContractProfiler::GetProfiles() const
+{
+    LOCK(cs);
+    return profiles;
+}
+
+void ContractProfiler::Reset()
+{
+    LOCK(cs);
+    profiles.clear();
+}
+
+// To be called once in AppInitMain to apply -contractprofile.
+void InitContractProfiler()
+{
+    g_contractProfiler.SetInterval(gArgs.GetArg("-contractprofile", DEFAULT_CONTRACT_PROFILE_INTERVAL));
+    if (g_contractProfiler.IsEnabled())
+        LogPrintf("Profiling contract execution, sampling every %d instructions\n", g_contractProfiler.GetInterval());
+}
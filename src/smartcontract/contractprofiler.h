@@ -0,0 +1,111 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef CONTRACT_PROFILER_H
+#define CONTRACT_PROFILER_H
+
+#include "key/pubkey.h"
+#include "thread/sync.h"
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <utility>
+
+struct lua_State;
+
+// 默认不开启合约性能统计，开启时的默认采样间隔(指令数)
+static const int64_t DEFAULT_CONTRACT_PROFILE_INTERVAL = 0;
+static const int64_t MIN_CONTRACT_PROFILE_INTERVAL = 100;
+// 每个合约最多记录的不同函数数和采样位置数，超出的合并到"(other)"
+static const size_t MAX_CONTRACT_PROFILE_KEYS = 256;
+
+// 合约函数的累计执行统计，时间和指令数包含其内部调用的其他合约
+struct ContractFunctionProfile
+{
+    uint64_t calls = 0;
+    uint64_t failures = 0;
+    int64_t instructions = 0;
+    int64_t micros = 0;
+    int64_t allocBytes = 0;
+    int64_t dataBytes = 0;
+};
+
+struct ContractProfile
+{
+    std::map<std::string, ContractFunctionProfile> functions;
+    // 采样时正在执行的lua函数("函数名:定义行") -> 采样次数
+    std::map<std::string, uint64_t> samples;
+};
+
+// 采样位置，函数名截断后按值保存，采样时不格式化字符串
+struct ContractSampleKey
+{
+    MCContractID contractId;
+    int line;
+    char name[32];
+
+    bool operator<(const ContractSampleKey& b) const;
+};
+
+/**
+ * Calls and samples recorded by one SmartLuaState without locking. They are
+ * merged into the profiler, and the sample keys formatted, once the outermost
+ * contract call ends.
+ */
+class ContractProfileBuffer
+{
+public:
+    std::map<std::pair<MCContractID, std::string>, ContractFunctionProfile> functions;
+    std::map<ContractSampleKey, uint64_t> samples;
+
+    bool IsEmpty() const { return functions.empty() && samples.empty(); }
+    void Clear();
+
+    void RecordCall(const MCContractID& contractId, const std::string& function, bool success,
+        int64_t instructions, int64_t micros, int64_t allocBytes, int64_t dataBytes);
+    void RecordSample(const MCContractID& contractId, const char* name, int line);
+};
+
+/**
+ * Opt-in execution profiler for smart contracts, aggregated over all blocks
+ * since start or the last reset.
+ *
+ * Every contract call records instructions, wall time, bytes allocated by the
+ * lua state and msgpack bytes of PersistentData read and written, keyed by
+ * contract and entry function. In addition the lua function which is running
+ * is sampled every N instructions from luaD_limitinstruction. The hook only
+ * inspects the call stack, so gas and results are the same with profiling on.
+ * Calls and samples go to the buffer of the SmartLuaState and are merged here
+ * once per outermost call. Each contract keeps at most MAX_CONTRACT_PROFILE_KEYS
+ * functions and sample locations, later ones are counted under "(other)".
+ */
+class ContractProfiler
+{
+private:
+    mutable MCCriticalSection cs;
+    std::atomic<int64_t> interval;
+    std::map<MCContractID, ContractProfile> profiles;
+
+public:
+    ContractProfiler() : interval(DEFAULT_CONTRACT_PROFILE_INTERVAL) {}
+
+    bool IsEnabled() const { return interval > 0; }
+    int64_t GetInterval() const { return interval; }
+    void SetInterval(int64_t n);
+
+    // 从池中取出lua_State时按当前设置安装或移除采样钩子
+    void Attach(lua_State* L) const;
+
+    // 合并后清空buffer
+    void Merge(ContractProfileBuffer& buffer);
+
+    std::map<MCContractID, ContractProfile> GetProfiles() const;
+    void Reset();
+};
+
+extern ContractProfiler g_contractProfiler;
+
+void InitContractProfiler();
+
+#endif
@@ -0,0 +1,146 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "smartcontract/contractquery.h"
+#include "smartcontract/contractdb.h"
+#include "smartcontract/contractexecutor.h"
+#include "smartcontract/smartcontract.h"
+#include "transaction/coins.h"
+#include "utils/util.h"
+#include "validation/validation.h"
+
+#include <atomic>
+#include <mutex>
+
+static ContractExecutor* pContractQueryExecutor = nullptr;
+
+// 固定链顶时的合约余额，被调用的合约在第一次读取时才固定
+class ContractQueryAmounts : public CoinAmountCacheBase
+{
+public:
+    ContractQueryAmounts() : pTip(nullptr) {}
+
+    // 以下两个在执行查询前于cs_main下调用
+    void SetTip(const MCBlockIndex* pTipIn)
+    {
+        AssertLockHeld(cs_main);
+        pTip = pTipIn;
+    }
+
+    void Pin(const uint160& key)
+    {
+        AssertLockHeld(cs_main);
+        std::lock_guard<std::mutex> lock(cs);
+        if (!amounts.count(key))
+            amounts[key] = pCoinAmountCache->GetAmount(key);
+    }
+
+    MCAmount GetAmount(const uint160& key) const override
+    {
+        {
+            std::lock_guard<std::mutex> lock(cs);
+            auto it = amounts.find(key);
+            if (it != amounts.end())
+                return it->second;
+        }
+
+        MCAmount value = 0;
+        {
+            LOCK(cs_main);
+            if (chainActive.Tip() != pTip)
+                throw std::runtime_error(strprintf("%s => chain tip changed during the query", __FUNCTION__));
+            value = pCoinAmountCache->GetAmount(key);
+        }
+        std::lock_guard<std::mutex> lock(cs);
+        return amounts.emplace(key, value).first->second;
+    }
+
+private:
+    const MCBlockIndex* pTip;
+    mutable std::mutex cs;
+    mutable std::map<uint160, MCAmount> amounts;
+};
+
+static void RunContractQuery(SmartLuaState* sls, const ContractQuery* query, MCBlockIndex* pTip, ContractQueryAmounts* pCoinAmounts,
+    std::atomic<int64_t>* pBudget, ContractQueryResult* result)
+{
+    result->ret = UniValue(UniValue::VARR);
+
+    // 先按单次调用的上限预留指令数，执行后退回未用的部分
+    if (pBudget != nullptr && pBudget->fetch_sub(MAX_CONTRACT_CALL) < MAX_CONTRACT_CALL) {
+        pBudget->fetch_add(MAX_CONTRACT_CALL);
+        result->success = false;
+        result->error = "Instruction budget of the query is used up";
+        return;
+    }
+
+    // 私有的空快照缓存，合约数据只从链顶读取，查询不保存数据
+    ContractContext contractContext;
+    CoinAmountCache coinAmountCache(pCoinAmounts);
+    MagnaChainAddress contractAddr = query->contractAddr;
+    MagnaChainAddress senderAddr = query->senderAddr;
+
+    try {
+        sls->Initialize(false, pTip->GetBlockTime(), pTip->nHeight + 1, -1, senderAddr, &contractContext, pTip, SmartLuaState::SAVE_TYPE_NONE, &coinAmountCache);
+        result->success = CallContract(sls, contractAddr, query->amount, query->function, query->args, result->ret);
+    }
+    catch (const std::exception& e) {
+        result->success = false;
+        result->error = e.what();
+    }
+    // 失败的调用不知道执行了多少指令，按上限计
+    if (pBudget != nullptr && result->success)
+        pBudget->fetch_add(MAX_CONTRACT_CALL - std::min<int64_t>(sls->runningTimes, MAX_CONTRACT_CALL));
+    sls->Clear();
+}
+
+void RunContractQueries(const std::vector<ContractQuery>& queries, std::vector<ContractQueryResult>& results, const MCBlockIndex*& pinnedTip,
+    int64_t nInstructionBudget)
+{
+    results.clear();
+    results.resize(queries.size());
+
+    // 在cs_main下固定链顶，并读出被调用合约的余额，嵌套调用的合约在读取时再固定
+    MCBlockIndex* pTip = nullptr;
+    ContractQueryAmounts coinAmounts;
+    {
+        LOCK(cs_main);
+        pTip = chainActive.Tip();
+        coinAmounts.SetTip(pTip);
+        for (const ContractQuery& query : queries) {
+            MCContractID contractId;
+            if (query.contractAddr.GetContractID(contractId))
+                coinAmounts.Pin(contractId);
+        }
+    }
+    pinnedTip = pTip;
+
+    std::atomic<int64_t> budget(nInstructionBudget);
+    std::atomic<int64_t>* pBudget = nInstructionBudget > 0 ? &budget : nullptr;
+    if (pContractQueryExecutor == nullptr || queries.size() <= 1) {
+        SmartLuaState sls;
+        for (size_t i = 0; i < queries.size(); ++i)
+            RunContractQuery(&sls, &queries[i], pTip, &coinAmounts, pBudget, &results[i]);
+        return;
+    }
+
+    ContractExecutor::TaskGroup batch;
+    for (size_t i = 0; i < queries.size(); ++i)
+        pContractQueryExecutor->Submit(batch, std::bind(RunContractQuery, std::placeholders::_1, &queries[i], pTip, &coinAmounts, pBudget, &results[i]));
+    pContractQueryExecutor->Wait(batch);
+}
+
+// To be called once in AppInitMain to start the query threads.
+void InitContractQuery()
+{
+    int threads = std::min(std::max(0, (int)gArgs.GetArg("-contractquerythreads", DEFAULT_CONTRACT_QUERY_THREADS)), MAX_CONTRACT_QUERY_THREADS);
+    if (threads > 0)
+        pContractQueryExecutor = new ContractExecutor(threads);
+    LogPrintf("Using %d threads for read-only contract queries\n", threads);
+}
+
+void StopContractQuery()
+{
+    delete pContractQueryExecutor;
+    pContractQueryExecutor = nullptr;
+}
@@ -0,0 +1,63 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef CONTRACT_QUERY_H
+#define CONTRACT_QUERY_H
+
+#include "misc/amount.h"
+#include "coding/base58.h"
+#include "univalue.h"
+
+#include <string>
+#include <vector>
+
+class MCBlockIndex;
+
+// 只读合约查询的线程数，0表示在调用线程中依次执行
+static const int DEFAULT_CONTRACT_QUERY_THREADS = 4;
+static const int MAX_CONTRACT_QUERY_THREADS = 64;
+// 一次批量查询的最大调用数
+static const unsigned int MAX_CONTRACT_QUERY_BATCH = 1000;
+// REST的一次批量查询中所有调用共用的lua指令数
+static const int64_t DEFAULT_REST_CONTRACT_QUERY_BUDGET = 1000000;
+
+// 一次只读合约调用
+struct ContractQuery
+{
+    MagnaChainAddress contractAddr;
+    MagnaChainAddress senderAddr;
+    MCAmount amount = 0;
+    std::string function;
+    UniValue args;
+};
+
+struct ContractQueryResult
+{
+    bool success = false;
+    UniValue ret;
+    std::string error;
+};
+
+/**
+ * Run read-only contract calls against the current tip.
+ *
+ * The tip and the balances of the called contracts are pinned once under
+ * cs_main, then the calls run in parallel on the query executor without it.
+ * A contract reached through a nested call is pinned when it is first read;
+ * if the tip has moved by then, that call fails rather than mixing two tips.
+ * Each call gets an empty private ContractContext and nothing is saved, so
+ * the results reflect the state after the pinned block (pending mempool
+ * calls are not included) and never touch shared contract state. The
+ * executor threads reuse their SmartLuaState and draw lua states from the
+ * shared pool.
+ *
+ * A positive nInstructionBudget bounds the lua instructions of the whole
+ * batch; calls that would exceed it fail without running.
+ */
+void RunContractQueries(const std::vector<ContractQuery>& queries, std::vector<ContractQueryResult>& results, const MCBlockIndex*& pinnedTip,
+    int64_t nInstructionBudget = 0);
+
+void InitContractQuery();
+void StopContractQuery();
+
+#endif
@@ -0,0 +1,817 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "smartcontract/contractstorage.h"
+
+extern "C"
+{
+#include "lua/lauxlib.h"
+#include "lua/ltable.h"
+}
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <new>
+#include <unordered_map>
+
+static const char* STORAGE_PACK = "contractstorage.pack";
+static const char* STORAGE_UNPACK = "contractstorage.unpack";
+static const char* STORAGE_LIVE = "contractstorage.live";
+static const char* STORAGE_CANONICAL = "contractstorage.canonical";
+static const char* STORAGE_LAZY = "contractstorage.lazy";
+static const char* LAZY_DATA_META = "contractstorage.lazydata";
+static const char* CANONICAL_CACHE_META = "contractstorage.canonicalcache";
+
+// 与lua_cmsgpack.c中LUACMSGPACK_MAX_NESTING一致
+static const int MAX_PACK_NESTING = 16;
+// 扫描时允许的最大嵌套层数，更深的数据交给cmsgpack处理
+static const int MAX_SCAN_DEPTH = 256;
+
+// 代理元表中的字段
+enum
+{
+    PROXY_DATA = 1,     // LazyContractData userdata，同时作为"已删除"标记
+    PROXY_SHADOW,       // 已读取或写入的键的当前值
+    PROXY_LOADED,       // 已解码的原始值
+    PROXY_JOURNAL,      // 写入记录: 键, 是否为nil
+    PROXY_BLOB,         // 原始数据，保证data指针有效
+};
+
+struct LazyContractData
+{
+    const char* data;
+    size_t len;
+    std::vector<ContractDataField> fields;
+    std::unordered_map<std::string, size_t> keyIndex;   // 键 -> fields中最后一次出现的位置
+    int journalSize;
+};
+
+// 嵌套字段的规范化编码缓存，放在C++堆上，不占用合约的lua内存限额
+struct CanonicalCache
+{
+    std::unordered_map<std::string, std::string> entries;
+    size_t usage;
+};
+
+static inline uint32_t ReadBE(const unsigned char* p, int n)
+{
+    uint32_t v = 0;
+    for (int i = 0; i < n; ++i)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static bool IsNaNKey(const unsigned char* p)
+{
+    if (p[0] == 0xca) {
+        float f;
+        unsigned char b[4] = { p[4], p[3], p[2], p[1] };
+        memcpy(&f, b, 4);
+        return isnan(f);
+    }
+    if (p[0] == 0xcb) {
+        double d;
+        unsigned char b[8] = { p[8], p[7], p[6], p[5], p[4], p[3], p[2], p[1] };
+        memcpy(&d, b, 8);
+        return isnan(d);
+    }
+    return false;
+}
+
+// 跳过一个msgpack值，只接受cmsgpack解码不会出错的数据
+static bool SkipValue(const unsigned char*& p, const unsigned char* end, int depth, bool mapKey)
+{
+    if (p >= end || depth > MAX_SCAN_DEPTH)
+        return false;
+
+    const unsigned char b = *p;
+    size_t need = 0;
+    size_t items = 0;
+    bool map = false;
+
+    if (b <= 0x7f || b >= 0xe0 || b == 0xc2 || b == 0xc3)
+        need = 1;
+    else if ((b & 0xe0) == 0xa0)
+        need = 1 + (b & 0x1f);
+    else if ((b & 0xf0) == 0x90) {
+        need = 1;
+        items = b & 0x0f;
+    }
+    else if ((b & 0xf0) == 0x80) {
+        need = 1;
+        items = b & 0x0f;
+        map = true;
+    }
+    else {
+        switch (b) {
+        case 0xc0: if (mapKey) return false; need = 1; break;
+        case 0xcc: case 0xd0: need = 2; break;
+        case 0xcd: case 0xd1: need = 3; break;
+        case 0xce: case 0xd2: case 0xca: need = 5; break;
+        case 0xcf: case 0xd3: case 0xcb: need = 9; break;
+        case 0xd9: if (end - p < 2) return false; need = 2 + ReadBE(p + 1, 1); break;
+        case 0xda: if (end - p < 3) return false; need = 3 + ReadBE(p + 1, 2); break;
+        case 0xdb: if (end - p < 5) return false; need = 5 + (size_t)ReadBE(p + 1, 4); break;
+        case 0xdc: if (end - p < 3) return false; need = 3; items = ReadBE(p + 1, 2); break;
+        case 0xdd: if (end - p < 5) return false; need = 5; items = ReadBE(p + 1, 4); break;
+        case 0xde: if (end - p < 3) return false; need = 3; items = ReadBE(p + 1, 2); map = true; break;
+        case 0xdf: if (end - p < 5) return false; need = 5; items = ReadBE(p + 1, 4); map = true; break;
+        default: return false;
+        }
+    }
+
+    if ((size_t)(end - p) < need)
+        return false;
+    // lua_settable不接受nil,NaN及table作为键
+    if (mapKey && (IsNaNKey(p) || items > 0 || (b & 0xf0) == 0x80 || (b & 0xf0) == 0x90 || (b >= 0xdc && b <= 0xdf)))
+        return false;
+    p += need;
+
+    if (items > (size_t)(end - p))
+        return false;
+    for (size_t i = 0; i < items; ++i) {
+        if (map && !SkipValue(p, end, depth + 1, true))
+            return false;
+        if (!SkipValue(p, end, depth + 1, false))
+            return false;
+    }
+    return true;
+}
+
+bool ScanContractData(const char* data, size_t len, std::vector<ContractDataField>& fields)
+{
+    fields.clear();
+    const unsigned char* begin = (const unsigned char*)data;
+    const unsigned char* end = begin + len;
+    const unsigned char* p = begin;
+    if (len == 0)
+        return false;
+
+    size_t count = 0;
+    if ((*p & 0xf0) == 0x80) {
+        count = *p & 0x0f;
+        p += 1;
+    }
+    else if (*p == 0xde && len >= 3) {
+        count = ReadBE(p + 1, 2);
+        p += 3;
+    }
+    else if (*p == 0xdf && len >= 5) {
+        count = ReadBE(p + 1, 4);
+        p += 5;
+    }
+    else
+        return false;
+
+    if (count == 0 || count > (size_t)(end - p))
+        return false;
+
+    fields.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (p >= end)
+            return false;
+
+        ContractDataField field;
+        const unsigned char b = *p;
+        size_t header;
+        if ((b & 0xe0) == 0xa0) {
+            header = 1;
+            field.keyLen = b & 0x1f;
+        }
+        else if (b == 0xd9 && end - p >= 2) {
+            header = 2;
+            field.keyLen = ReadBE(p + 1, 1);
+        }
+        else if (b == 0xda && end - p >= 3) {
+            header = 3;
+            field.keyLen = ReadBE(p + 1, 2);
+        }
+        else if (b == 0xdb && end - p >= 5) {
+            header = 5;
+            field.keyLen = ReadBE(p + 1, 4);
+        }
+        else
+            return false;
+
+        if ((size_t)(end - p) < header + field.keyLen)
+            return false;
+        field.keyOffset = p + header - begin;
+        p += header + field.keyLen;
+
+        field.valueOffset = p - begin;
+        if (!SkipValue(p, end, 1, false))
+            return false;
+        field.valueLen = p - begin - field.valueOffset;
+        fields.push_back(field);
+    }
+
+    // 多个顶层对象的数据由cmsgpack处理
+    return p == end;
+}
+
+static void EncodeString(std::string& buf, const char* s, size_t len)
+{
+    // 与mp_encode_bytes一致
+    if (len < 32)
+        buf += (char)(0xa0 | len);
+    else if (len <= 0xff) {
+        buf += (char)0xd9;
+        buf += (char)len;
+    }
+    else if (len <= 0xffff) {
+        buf += (char)0xda;
+        buf += (char)(len >> 8);
+        buf += (char)len;
+    }
+    else {
+        buf += (char)0xdb;
+        buf += (char)(len >> 24);
+        buf += (char)(len >> 16);
+        buf += (char)(len >> 8);
+        buf += (char)len;
+    }
+    buf.append(s, len);
+}
+
+static void EncodeMapHeader(std::string& buf, size_t n)
+{
+    // 与mp_encode_map一致
+    if (n <= 15)
+        buf += (char)(0x80 | n);
+    else if (n <= 0xffff) {
+        buf += (char)0xde;
+        buf += (char)(n >> 8);
+        buf += (char)n;
+    }
+    else {
+        buf += (char)0xdf;
+        buf += (char)(n >> 24);
+        buf += (char)(n >> 16);
+        buf += (char)(n >> 8);
+        buf += (char)n;
+    }
+}
+
+static inline bool IsNilValue(const LazyContractData* lazy, const ContractDataField& field)
+{
+    return (unsigned char)lazy->data[field.valueOffset] == 0xc0;
+}
+
+static inline bool IsNestedValue(const LazyContractData* lazy, const ContractDataField& field)
+{
+    unsigned char b = lazy->data[field.valueOffset];
+    return (b & 0xe0) == 0x80 || (b >= 0xdc && b <= 0xdf);
+}
+
+// 若idx处为未展开的代理，返回其数据
+static LazyContractData* GetLazyData(lua_State* L, int idx)
+{
+    if (lua_type(L, idx) != LUA_TTABLE)
+        return nullptr;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, STORAGE_LIVE);
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    LazyContractData* lazy = (LazyContractData*)lua_touserdata(L, -1);
+    lua_pop(L, 2);
+    return lazy;
+}
+
+// 解码一个字段的值并压栈
+static void PushFieldValue(lua_State* L, const LazyContractData* lazy, const ContractDataField& field)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, STORAGE_UNPACK);
+    lua_pushlstring(L, lazy->data + field.valueOffset, field.valueLen);
+    lua_call(L, 1, 1);
+}
+
+// 用cmsgpack编码idx处的值，其嵌套层次与作为顶层表的字段时相同
+static void EncodeValue(lua_State* L, int idx, std::string& buf)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, STORAGE_PACK);
+    lua_createtable(L, 0, 1);
+    lua_pushboolean(L, 1);
+    lua_pushvalue(L, idx);
+    lua_rawset(L, -3);
+    lua_call(L, 1, 1);
+
+    // {[true] = v} => 0x81 0xc3 v
+    size_t len = 0;
+    const char* s = lua_tolstring(L, -1, &len);
+    assert(len > 2 && (unsigned char)s[0] == 0x81 && (unsigned char)s[1] == 0xc3);
+    buf.append(s + 2, len - 2);
+    lua_pop(L, 1);
+}
+
+// 对未修改的字段，输出与解码后再编码相同的结果
+static void EncodeCanonicalField(lua_State* L, const LazyContractData* lazy, const ContractDataField& field, std::string& buf)
+{
+    // 标量的编码是唯一的，直接复制
+    if (!IsNestedValue(lazy, field)) {
+        buf.append(lazy->data + field.valueOffset, field.valueLen);
+        return;
+    }
+
+    // 嵌套表的键顺序取决于解码后的表结构，结果按原始数据缓存
+    lua_getfield(L, LUA_REGISTRYINDEX, STORAGE_CANONICAL);
+    CanonicalCache* cache = (CanonicalCache*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    std::string raw(lazy->data + field.valueOffset, field.valueLen);
+    auto it = cache->entries.find(raw);
+    if (it != cache->entries.end()) {
+        buf += it->second;
+        return;
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, STORAGE_UNPACK);
+    lua_pushlstring(L, raw.data(), raw.size());
+    lua_call(L, 1, 1);
+    std::string canonical;
+    EncodeValue(L, lua_gettop(L), canonical);
+    lua_pop(L, 1);
+    buf += canonical;
+
+    size_t usage = raw.size() + canonical.size();
+    if (cache->usage + usage > MAX_STATE_CANONICAL_CACHE_SIZE) {
+        cache->entries.clear();
+        cache->usage = 0;
+    }
+    if (usage <= MAX_STATE_CANONICAL_CACHE_SIZE) {
+        cache->usage += usage;
+        cache->entries.emplace(std::move(raw), std::move(canonical));
+    }
+}
+
+// 在target表上重放旧流程对PersistentData的插入顺序，值只区分是否为nil
+static void ReplayKeys(lua_State* L, const LazyContractData* lazy, int target, int journal)
+{
+    for (const ContractDataField& field : lazy->fields) {
+        lua_pushlstring(L, lazy->data + field.keyOffset, field.keyLen);
+        if (IsNilValue(lazy, field))
+            lua_pushnil(L);
+        else
+            lua_pushboolean(L, 1);
+        lua_rawset(L, target);
+    }
+
+    for (int i = 1; i <= lazy->journalSize; ++i) {
+        lua_rawgeti(L, journal, 2 * i - 1);
+        lua_rawgeti(L, journal, 2 * i);
+        bool isNil = lua_toboolean(L, -1) != 0;
+        lua_pop(L, 1);
+        if (isNil)
+            lua_pushnil(L);
+        else
+            lua_pushboolean(L, 1);
+        lua_rawset(L, target);
+    }
+}
+
+// 将代理展开为与旧流程完全一致的表
+static void MaterializeProxy(lua_State* L, int idx)
+{
+    LazyContractData* lazy = GetLazyData(L, idx);
+    if (lazy == nullptr)
+        return;
+
+    int top = lua_gettop(L);
+    lua_getfield(L, LUA_REGISTRYINDEX, STORAGE_LIVE);
+    lua_pushvalue(L, idx);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+
+    lua_getmetatable(L, idx);
+    int mt = lua_gettop(L);
+    lua_rawgeti(L, mt, PROXY_DATA);
+    int marker = lua_gettop(L);
+    lua_rawgeti(L, mt, PROXY_SHADOW);
+    int shadow = lua_gettop(L);
+    lua_rawgeti(L, mt, PROXY_JOURNAL);
+    int journal = lua_gettop(L);
+    lua_rawgeti(L, mt, PROXY_BLOB);
+
+    // 写入代理时虚拟机已在其中建立了nil结点，先恢复为新建表的状态
+    lua_pushnil(L);
+    lua_setmetatable(L, idx);
+    luaH_reset(L, (Table*)lua_topointer(L, idx));
+
+    ReplayKeys(L, lazy, idx, journal);
+
+    // 填入实际值
+    lua_pushnil(L);
+    while (lua_next(L, shadow) != 0) {
+        // 值为nil的键在重放后已经是nil
+        if (!lua_rawequal(L, -1, marker)) {
+            lua_pushvalue(L, -2);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, idx);
+        }
+        lua_pop(L, 1);
+    }
+    for (size_t i = 0; i < lazy->fields.size(); ++i) {
+        const ContractDataField& field = lazy->fields[i];
+        if (IsNilValue(lazy, field))
+            continue;
+        std::string key(lazy->data + field.keyOffset, field.keyLen);
+        if (lazy->keyIndex.find(key)->second != i)
+            continue;
+
+        lua_pushlstring(L, key.data(), key.size());
+        lua_pushvalue(L, -1);
+        lua_rawget(L, shadow);
+        bool touched = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (touched) {
+            lua_pop(L, 1);
+            continue;
+        }
+        PushFieldValue(L, lazy, field);
+        lua_rawset(L, idx);
+    }
+
+    lua_settop(L, top);
+}
+
+static void MaterializeAll(lua_State* L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, STORAGE_LIVE);
+    int live = lua_gettop(L);
+    while (true) {
+        lua_pushnil(L);
+        if (lua_next(L, live) == 0)
+            break;
+        lua_pop(L, 1);
+        MaterializeProxy(L, lua_gettop(L));
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+// 编码idx处的值时是否会经过未展开的代理，或超出cmsgpack的嵌套限制
+static bool ReachesProxy(lua_State* L, int idx, int live, int level)
+{
+    if (lua_type(L, idx) != LUA_TTABLE)
+        return false;
+    if (level >= MAX_PACK_NESTING)
+        return true;
+
+    lua_pushvalue(L, idx);
+    lua_rawget(L, live);
+    bool proxy = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    if (proxy)
+        return true;
+
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        int top = lua_gettop(L);
+        if (ReachesProxy(L, top - 1, live, level + 1) || ReachesProxy(L, top, live, level + 1)) {
+            lua_pop(L, 2);
+            return true;
+        }
+        lua_pop(L, 1);
+    }
+    return false;
+}
+
+// 只编码被访问过的字段，其余直接复制原始数据
+static bool FastPack(lua_State* L, LazyContractData* lazy)
+{
+    int top = lua_gettop(L);
+    lua_getfield(L, LUA_REGISTRYINDEX, STORAGE_LIVE);
+    int live = lua_gettop(L);
+    lua_getmetatable(L, 1);
+    int mt = lua_gettop(L);
+    lua_rawgeti(L, mt, PROXY_SHADOW);
+    int shadow = lua_gettop(L);
+    lua_rawgeti(L, mt, PROXY_LOADED);
+    int loaded = lua_gettop(L);
+    lua_rawgeti(L, mt, PROXY_JOURNAL);
+    int journal = lua_gettop(L);
+
+    lua_newtable(L);
+    int order = lua_gettop(L);
+    ReplayKeys(L, lazy, order, journal);
+
+    size_t count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, order) != 0) {
+        lua_pop(L, 1);
+        count++;
+    }
+    if (count == 0) {
+        lua_settop(L, top);
+        return false;
+    }
+
+    std::string buf;
+    buf.reserve(lazy->len);
+    EncodeMapHeader(buf, count);
+    lua_pushnil(L);
+    while (lua_next(L, order) != 0) {
+        lua_pop(L, 1);
+        size_t keyLen = 0;
+        const char* key = lua_tolstring(L, -1, &keyLen);
+        EncodeString(buf, key, keyLen);
+
+        auto it = lazy->keyIndex.find(std::string(key, keyLen));
+        lua_pushvalue(L, -1);
+        lua_rawget(L, shadow);
+        int value = lua_gettop(L);
+        bool unchanged = lua_isnil(L, value);
+        if (!unchanged && it != lazy->keyIndex.end() && !IsNestedValue(lazy, lazy->fields[it->second])) {
+            // 读取过但未修改的标量
+            lua_pushvalue(L, value - 1);
+            lua_rawget(L, loaded);
+            unchanged = lua_rawequal(L, -1, value) != 0;
+            lua_pop(L, 1);
+        }
+
+        if (unchanged) {
+            assert(it != lazy->keyIndex.end());
+            EncodeCanonicalField(L, lazy, lazy->fields[it->second], buf);
+        }
+        else {
+            if (ReachesProxy(L, value, live, 1)) {
+                lua_settop(L, top);
+                return false;
+            }
+            EncodeValue(L, value, buf);
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_settop(L, top);
+    lua_pushlstring(L, buf.data(), buf.size());
+    return true;
+}
+
+static int LazyIndex(lua_State* L)
+{
+    if (lua_type(L, 2) != LUA_TSTRING) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_getmetatable(L, 1);
+    lua_rawgeti(L, 3, PROXY_DATA);
+    LazyContractData* lazy = (LazyContractData*)lua_touserdata(L, 4);
+    lua_rawgeti(L, 3, PROXY_SHADOW);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, 5);
+    if (!lua_isnil(L, 6)) {
+        if (lua_rawequal(L, 6, 4))
+            lua_pushnil(L);
+        return 1;
+    }
+    lua_pop(L, 1);
+
+    size_t keyLen = 0;
+    const char* key = lua_tolstring(L, 2, &keyLen);
+    auto it = lazy->keyIndex.find(std::string(key, keyLen));
+    if (it == lazy->keyIndex.end()) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    PushFieldValue(L, lazy, lazy->fields[it->second]);
+    lua_pushvalue(L, 2);
+    if (lua_isnil(L, 6))
+        lua_pushvalue(L, 4);
+    else
+        lua_pushvalue(L, 6);
+    lua_rawset(L, 5);
+    if (!lua_isnil(L, 6)) {
+        lua_rawgeti(L, 3, PROXY_LOADED);
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, 6);
+        lua_rawset(L, -3);
+    }
+    lua_settop(L, 6);
+    return 1;
+}
+
+static int LazyNewIndex(lua_State* L)
+{
+    lua_settop(L, 3);
+    if (lua_type(L, 2) != LUA_TSTRING) {
+        // 非字符串键可能改变数组部分，直接展开
+        MaterializeProxy(L, 1);
+        lua_rawset(L, 1);
+        return 0;
+    }
+
+    lua_getmetatable(L, 1);
+    lua_rawgeti(L, 4, PROXY_DATA);
+    LazyContractData* lazy = (LazyContractData*)lua_touserdata(L, 5);
+    lua_rawgeti(L, 4, PROXY_SHADOW);
+    lua_rawgeti(L, 4, PROXY_JOURNAL);
+
+    lazy->journalSize++;
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, 7, 2 * lazy->journalSize - 1);
+    lua_pushboolean(L, lua_isnil(L, 3));
+    lua_rawseti(L, 7, 2 * lazy->journalSize);
+
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, lua_isnil(L, 3) ? 5 : 3);
+    lua_rawset(L, 6);
+    return 0;
+}
+
+static int LazyUnpack(lua_State* L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, STORAGE_LAZY);
+    bool enabled = lua_toboolean(L, -1) != 0;
+    lua_pop(L, 1);
+
+    std::vector<ContractDataField> fields;
+    size_t len = 0;
+    const char* data = nullptr;
+    if (enabled && lua_gettop(L) == 1 && lua_type(L, 1) == LUA_TSTRING) {
+        data = lua_tolstring(L, 1, &len);
+        if (!ScanContractData(data, len, fields))
+            data = nullptr;
+    }
+
+    if (data == nullptr) {
+        int top = lua_gettop(L);
+        lua_getfield(L, LUA_REGISTRYINDEX, STORAGE_UNPACK);
+        lua_insert(L, 1);
+        lua_call(L, top, LUA_MULTRET);
+        return lua_gettop(L);
+    }
+
+    LazyContractData* lazy = new (lua_newuserdata(L, sizeof(LazyContractData))) LazyContractData();
+    luaL_getmetatable(L, LAZY_DATA_META);
+    lua_setmetatable(L, -2);
+    int ud = lua_gettop(L);
+    lazy->data = data;
+    lazy->len = len;
+    lazy->journalSize = 0;
+    lazy->fields.swap(fields);
+    for (size_t i = 0; i < lazy->fields.size(); ++i)
+        lazy->keyIndex[std::string(data + lazy->fields[i].keyOffset, lazy->fields[i].keyLen)] = i;
+
+    lua_newtable(L);
+    int proxy = lua_gettop(L);
+    lua_createtable(L, PROXY_BLOB, 2);
+    lua_pushcfunction(L, LazyIndex);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, LazyNewIndex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushvalue(L, ud);
+    lua_rawseti(L, -2, PROXY_DATA);
+    lua_newtable(L);
+    lua_rawseti(L, -2, PROXY_SHADOW);
+    lua_newtable(L);
+    lua_rawseti(L, -2, PROXY_LOADED);
+    lua_newtable(L);
+    lua_rawseti(L, -2, PROXY_JOURNAL);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, PROXY_BLOB);
+    lua_setmetatable(L, proxy);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, STORAGE_LIVE);
+    lua_pushvalue(L, proxy);
+    lua_pushvalue(L, ud);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return 1;
+}
+
+static int LazyPack(lua_State* L)
+{
+    int top = lua_gettop(L);
+    if (top == 1) {
+        LazyContractData* lazy = GetLazyData(L, 1);
+        if (lazy != nullptr && FastPack(L, lazy))
+            return 1;
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, STORAGE_LIVE);
+    int live = lua_gettop(L);
+    bool reaches = false;
+    lua_pushnil(L);
+    if (lua_next(L, live) != 0) {
+        lua_pop(L, 2);
+        for (int i = 1; i <= top && !reaches; ++i)
+            reaches = ReachesProxy(L, i, live, 0);
+    }
+    lua_settop(L, top);
+    if (reaches)
+        MaterializeAll(L);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, STORAGE_PACK);
+    lua_insert(L, 1);
+    lua_call(L, top, 1);
+    return 1;
+}
+
+static int MaterializeArgs(lua_State* L)
+{
+    int top = lua_gettop(L);
+    for (int i = 1; i <= top; ++i)
+        MaterializeProxy(L, i);
+
+    // 在同一调用帧中执行原函数，参数错误信息中的函数名与未包装时一致
+    lua_CFunction func = lua_tocfunction(L, lua_upvalueindex(2));
+    return func(L);
+}
+
+static int LazyDataGC(lua_State* L)
+{
+    LazyContractData* lazy = (LazyContractData*)lua_touserdata(L, 1);
+    lazy->~LazyContractData();
+    return 0;
+}
+
+static int CanonicalCacheGC(lua_State* L)
+{
+    CanonicalCache* cache = (CanonicalCache*)lua_touserdata(L, 1);
+    cache->~CanonicalCache();
+    return 0;
+}
+
+static void WrapRawAccess(lua_State* L, int table, const char* name)
+{
+    lua_getfield(L, table, name);
+    if (lua_iscfunction(L, -1)) {
+        // 库函数最多使用一个upvalue(如pairs中的next)，放在包装函数的相同位置
+        if (lua_getupvalue(L, -1, 1) == nullptr)
+            lua_pushnil(L);
+        lua_insert(L, -2);
+        lua_pushcclosure(L, MaterializeArgs, 2);
+        lua_setfield(L, table, name);
+    }
+    else
+        lua_pop(L, 1);
+}
+
+void OpenContractStorage(lua_State* L)
+{
+    int top = lua_gettop(L);
+
+    luaL_newmetatable(L, LAZY_DATA_META);
+    lua_pushcfunction(L, LazyDataGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    CanonicalCache* cache = new (lua_newuserdata(L, sizeof(CanonicalCache))) CanonicalCache();
+    cache->usage = 0;
+    luaL_newmetatable(L, CANONICAL_CACHE_META);
+    lua_pushcfunction(L, CanonicalCacheGC);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, STORAGE_CANONICAL);
+    ResetContractStorage(L);
+    SetContractStorageLazy(L, true);
+
+    lua_getglobal(L, "cmsgpack");
+    int cmsgpack = lua_gettop(L);
+    lua_getfield(L, cmsgpack, "pack");
+    lua_setfield(L, LUA_REGISTRYINDEX, STORAGE_PACK);
+    lua_getfield(L, cmsgpack, "unpack");
+    lua_setfield(L, LUA_REGISTRYINDEX, STORAGE_UNPACK);
+    lua_pushcfunction(L, LazyPack);
+    lua_setfield(L, cmsgpack, "pack");
+    lua_pushcfunction(L, LazyUnpack);
+    lua_setfield(L, cmsgpack, "unpack");
+
+    // 直接访问表内容的库函数
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    int globals = lua_gettop(L);
+    WrapRawAccess(L, globals, "next");
+    WrapRawAccess(L, globals, "pairs");
+    WrapRawAccess(L, globals, "ipairs");
+    WrapRawAccess(L, globals, "unpack");
+    WrapRawAccess(L, globals, "setmetatable");
+
+    lua_getglobal(L, "table");
+    int table = lua_gettop(L);
+    std::vector<std::string> names;
+    lua_pushnil(L);
+    while (lua_next(L, table) != 0) {
+        lua_pop(L, 1);
+        if (lua_type(L, -1) == LUA_TSTRING)
+            names.push_back(lua_tostring(L, -1));
+    }
+    for (const std::string& name : names)
+        WrapRawAccess(L, table, name.c_str());
+
+    lua_settop(L, top);
+}
+
+void SetContractStorageLazy(lua_State* L, bool lazy)
+{
+    lua_pushboolean(L, lazy);
+    lua_setfield(L, LUA_REGISTRYINDEX, STORAGE_LAZY);
+}
+
+void ResetContractStorage(lua_State* L)
+{
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, STORAGE_LIVE);
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef CONTRACT_STORAGE_H
+#define CONTRACT_STORAGE_H
+
+extern "C"
+{
+#include "lua/lua.h"
+}
+
+#include <string>
+#include <vector>
+
+// 按键缓存的嵌套数据规范化结果的最大字节数(每个lua_State)
+static const size_t MAX_STATE_CANONICAL_CACHE_SIZE = 1 << 20;
+
+// 合约存盘数据(msgpack map)中的一个顶层字段
+struct ContractDataField
+{
+    size_t keyOffset;
+    size_t keyLen;
+    size_t valueOffset;
+    size_t valueLen;
+};
+
+/**
+ * Split the packed PersistentData of a contract into its top level fields
+ * without decoding them. Only a map with string keys which the cmsgpack
+ * decoder would accept is handled, anything else returns false and has to
+ * go through the eager decoder.
+ */
+bool ScanContractData(const char* data, size_t len, std::vector<ContractDataField>& fields);
+
+/**
+ * Key level access to contract storage.
+ *
+ * cmsgpack.unpack/pack in the contract states are replaced, so that
+ * callContract gets a proxy table for PersistentData whose fields are only
+ * decoded when the contract reads them, while writes are journaled. On pack
+ * the untouched fields are copied from the stored data and only touched ones
+ * are encoded again. The key order of the real table the old eager path would
+ * have built is replayed, so the packed data - and with it
+ * hashMerkleRootWithData - is byte for byte the same, and because all of this
+ * runs in C the instruction count of a call does not change either.
+ * Library functions which access tables raw (next, pairs, table.insert, ...)
+ * turn a proxy into the real table first.
+ * A proxy still uses less lua heap than the unpacked table, so which calls hit
+ * the allocation limit changes; callers enable it per call from
+ * Consensus::Params::ContractLazyStorageHeight with SetContractStorageLazy.
+ */
+void OpenContractStorage(lua_State* L);
+// 关闭时cmsgpack.unpack按原流程完整解码，打包结果和内存占用与未替换时一致
+void SetContractStorageLazy(lua_State* L, bool lazy);
+// 合约调用结束，丢弃所有未展开的代理
+void ResetContractStorage(lua_State* L);
+
+#endif
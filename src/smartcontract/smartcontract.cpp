@@ -3,6 +3,10 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "smartcontract/smartcontract.h"
+#include "smartcontract/contractcache.h"
+#include "smartcontract/contractnative.h"
+#include "smartcontract/contractprofiler.h"
+#include "smartcontract/contractstorage.h"
 #include "coding/base58.h"
 #include "script/standard.h"
 #include "transaction/txmempool.h"
@@ -16,6 +20,7 @@
 #include "wallet/coincontrol.h"
 #include "univalue.h"
 #include "mining/miner.h"
+#include "chain/chainparams.h"
 #include "consensus/merkle.h"
 #include "policy/policy.h"
 
@@ -459,8 +464,15 @@ bool PublishContract(SmartLuaState* sls, MagnaChainAddress& contractAddr, std::s
     lua_State* L = sls->GetLuaState(contractAddr);
     L->limit_instruction = maxCallNum;
     SetContractMsg(L, contractAddr.ToString(), sls->originAddr.ToString(), sls->originAddr.ToString(), 0, sls->timestamp, sls->blockHeight);
+    int64_t profileStart = g_contractProfiler.IsEnabled() ? GetTimeMicros() : 0;
+    lu_mem allocStart = G(L)->allocbytes;
     bool success = PublishContract(L, rawCode, maxCallNum, data, ret);
     maxCallNum = L->limit_instruction;
+    if (profileStart > 0) {
+        sls->profileBuffer.RecordCall(contractId, "(publish)", success, MAX_CONTRACT_CALL - std::max(maxCallNum, 0L),
+            GetTimeMicros() - profileStart, G(L)->allocbytes - allocStart, data.size());
+        g_contractProfiler.Merge(sls->profileBuffer);
+    }
     if (success) {
         rawCode = CompressCode(rawCode);
         sls->runningTimes = MAX_CONTRACT_CALL - maxCallNum;
@@ -524,10 +536,21 @@ bool PublishContract(SmartLuaState* sls, MCWallet* pWallet, const std::string& s
     return success;
 }
 
-bool static CallContract(lua_State* L, const std::string& rawCode, const std::string& data, 
+// 从共享缓存获取解压后的合约字节码，未命中时解压并放入缓存
+ContractCodeCache::CodePtr static GetContractCode(const MCContractID& contractId, const std::string& rawCode)
+{
+    ContractCodeKey key = g_contractCodeCache.ComputeKey(contractId, rawCode);
+    ContractCodeCache::CodePtr code = g_contractCodeCache.Lookup(key);
+    if (!code)
+        code = g_contractCodeCache.Insert(key, DecompressCode(rawCode));
+    return code;
+}
+
+bool static CallContract(lua_State* L, const MCContractID& contractId, const std::string& rawCode, const std::string& data, 
     const std::string& strFuncName, const UniValue& args, long& maxCallNum, std::string& dataout, UniValue& ret)
 {
-    const std::string& code = DecompressCode(rawCode);
+    ContractCodeCache::CodePtr codePtr = GetContractCode(contractId, rawCode);
+    const std::string& code = *codePtr;
 
     maxCallNum -= GAS_CONTRACT_BYTE;
     int top = lua_gettop(L);
@@ -638,8 +661,15 @@ bool static CallContractReal(SmartLuaState* sls, MagnaChainAddress& contractAddr
     lua_State* L = sls->GetLuaState(contractAddr);
     L->limit_instruction = maxCallNum;
     SetContractMsg(L, contractAddr.ToString(), sls->originAddr.ToString(), senderAddr, amount, sls->timestamp, sls->blockHeight);
-    bool success = CallContract(L, contractInfo.code, contractInfo.data, strFuncName, args, maxCallNum, data, ret);
+    long startCallNum = maxCallNum;
+    int64_t profileStart = g_contractProfiler.IsEnabled() ? GetTimeMicros() : 0;
+    lu_mem allocStart = G(L)->allocbytes;
+    bool success = CallContract(L, contractId, contractInfo.code, contractInfo.data, strFuncName, args, maxCallNum, data, ret);
     maxCallNum = L->limit_instruction;
+    if (profileStart > 0) {
+        sls->profileBuffer.RecordCall(contractId, strFuncName, success, startCallNum - std::max(maxCallNum, 0L),
+            GetTimeMicros() - profileStart, G(L)->allocbytes - allocStart, contractInfo.data.size() + data.size());
+    }
     if (success) {
         sls->deltaDataLen += std::max(0, (int32_t)(data.size() - contractInfo.data.size()));
 
@@ -651,6 +681,9 @@ bool static CallContractReal(SmartLuaState* sls, MagnaChainAddress& contractAddr
     }
     sls->ReleaseLuaState(L);
     sls->internalCallNum--;
+    // 最外层调用结束时合并性能统计
+    if (sls->internalCallNum == 0 && !sls->profileBuffer.IsEmpty())
+        g_contractProfiler.Merge(sls->profileBuffer);
 
     return success;
 }
@@ -808,37 +841,320 @@ void SmartLuaState::Initialize(bool isPublish, int64_t timestamp, int blockHeigh
     }
 }
 
-lua_State* SmartLuaState::GetLuaState(MagnaChainAddress& contractAddr)
+LuaStatePool g_luaStatePool;
+
+static const char* SANDBOX_TABLE_SNAPSHOT = "sandboxtable";
+static const char* SANDBOX_GLOBALS = "sandboxglobals";
+static const char* SANDBOX_GLOBALS_SNAPSHOT = "sandboxglobalssnapshot";
+static const char* SANDBOX_SETFENV = "sandboxsetfenv";
+static const char* SANDBOX_SETFENV_STRICT = "sandboxsetfenvstrict";
+
+// 激活高度后沙盒中的setfenv只能修改合约自身lua函数的环境，不允许level 0(线程全局表)
+// 以及调用链上更外层的函数，避免合约改动被池化复用的lua_State
+int static SandboxSetfenv(lua_State* L)
+{
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (lua_isnumber(L, 1)) {
+        if (lua_tointeger(L, 1) != 1)
+            return luaL_argerror(L, 1, "only level 1 is allowed");
+        lua_Debug ar;
+        if (lua_getstack(L, 1, &ar) == 0)
+            return luaL_argerror(L, 1, "invalid level");
+        lua_getinfo(L, "f", &ar);
+        lua_replace(L, 1);
+    }
+    if (!lua_isfunction(L, 1) || lua_iscfunction(L, 1))
+        return luaL_error(L, "'setfenv' cannot change environment of given object");
+
+    lua_settop(L, 2);
+    lua_setfenv(L, 1);
+    return 1;
+}
+
+void SetContractSandboxSetfenv(lua_State* L, bool strict)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, strict ? SANDBOX_SETFENV_STRICT : SANDBOX_SETFENV);
+    lua_setglobal(L, "setfenv");
+}
+
+// 把src表的内容逐项复制到dst表，两个索引均为绝对索引
+static void CopyTableFields(lua_State* L, int src, int dst)
+{
+    lua_pushnil(L);
+    while (lua_next(L, src) != 0) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, dst);
+    }
+}
+
+LuaStatePool::LuaStatePool()
+    : maxIdle(DEFAULT_CONTRACT_STATE_POOL_SIZE), inUse(0), acquires(0), created(0), destroyed(0), acquireMicros(0)
+{
+}
+
+LuaStatePool::~LuaStatePool()
+{
+    LOCK(cs);
+    for (lua_State* L : idleStates)
+        lua_close(L);
+    idleStates.clear();
+}
+
+lua_State* LuaStatePool::CreateState()
+{
+    lua_State* L = lua_open();
+    if (L == nullptr) {
+        error("cannot create state: not enough memory\n");
+        return nullptr;
+    }
+
+    luaL_openlibs(L);
+    luaopen_cmsgpack(L);
+    OpenContractStorage(L);
+    OpenContractNativeLib(L);
+
+    if (luaL_dostring(L, initscript)) {
+        error("%s\n", lua_tostring(L, -1));
+        lua_close(L);
+        return nullptr;
+    }
+
+    lua_pushcfunction(L, InternalCallContract);
+    lua_setglobal(L, "callcontract");
+    lua_pushcfunction(L, SendCoins);
+    lua_setglobal(L, "send");
+    lua_settop(L, 0);
+
+    // 原有的和受限的setfenv都放在注册表中，切换时不分配内存
+    lua_getglobal(L, "setfenv");
+    lua_setfield(L, LUA_REGISTRYINDEX, SANDBOX_SETFENV);
+    lua_pushcfunction(L, SandboxSetfenv);
+    lua_setfield(L, LUA_REGISTRYINDEX, SANDBOX_SETFENV_STRICT);
+
+    // 沙盒环境直接引用了table库，保存一份快照以便归还时重建
+    lua_newtable(L);
+    lua_getglobal(L, "table");
+    CopyTableFields(L, 2, 1);
+    lua_pop(L, 1);
+    lua_setfield(L, LUA_REGISTRYINDEX, SANDBOX_TABLE_SNAPSHOT);
+
+    // 全局表本身及其内容也保存下来，归还时恢复
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    lua_setfield(L, LUA_REGISTRYINDEX, SANDBOX_GLOBALS);
+    lua_newtable(L);
+    CopyTableFields(L, LUA_GLOBALSINDEX, 1);
+    lua_setfield(L, LUA_REGISTRYINDEX, SANDBOX_GLOBALS_SNAPSHOT);
+
+    if (!ApplyFreshBaseline(L)) {
+        lua_close(L);
+        return nullptr;
+    }
+
+    L->limit_on = 1;
+    return L;
+}
+
+// 按未池化前的方式新建一个状态(标准库、cmsgpack、initscript、callcontract和send)，
+// 不做gc，记录此时的内存计数和gc阈值。lua_State和global_State后来新增的字段不计入
+static bool MeasureFreshState(LuaStateBaseline& baseline)
+{
+    lua_State* L = lua_open();
+    if (L == nullptr)
+        return error("cannot create state: not enough memory\n");
+
+    luaL_openlibs(L);
+    luaopen_cmsgpack(L);
+    if (luaL_dostring(L, initscript)) {
+        error("%s\n", lua_tostring(L, -1));
+        lua_close(L);
+        return false;
+    }
+    lua_pushcfunction(L, InternalCallContract);
+    lua_setglobal(L, "callcontract");
+    lua_pushcfunction(L, SendCoins);
+    lua_setglobal(L, "send");
+
+    global_State* g = G(L);
+    int64_t addedBytes = sizeof(g->allocbytes) + sizeof(g->memoffset) + sizeof(lua_State) - offsetof(lua_State, profile_hook);
+    baseline.bytes = (int64_t)g->totalbytes - addedBytes;
+    baseline.threshold = (int64_t)g->GCthreshold - addedBytes;
+    lua_close(L);
+    return true;
+}
+
+bool LuaStatePool::GetFreshBaseline(LuaStateBaseline& baseline)
 {
+    static LuaStateBaseline fresh;
+    static const bool valid = MeasureFreshState(fresh);
+    baseline = fresh;
+    return valid;
+}
+
+// 完整gc后仍残留的内存(池自身的快照、沙盒库、字符串表和栈的扩容等)都从计数中扣除，
+// 每次调用开始时的内存计数和gc阈值与未池化前新建的状态相同，不受池的实现影响
+bool LuaStatePool::ApplyFreshBaseline(lua_State* L)
+{
+    LuaStateBaseline baseline;
+    if (!GetFreshBaseline(baseline))
+        return false;
+
+    global_State* g = G(L);
+    g->memoffset = 0;
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    g->memoffset = (l_mem)g->totalbytes - (l_mem)baseline.bytes;
+    g->GCthreshold = (lu_mem)((l_mem)baseline.threshold + g->memoffset);
+    return true;
+}
+
+void LuaStatePool::ResetState(lua_State* L)
+{
+    lua_settop(L, 0);
+    L->userData = nullptr;
+    L->profile_hook = nullptr;
+
+    // 重新指向创建时的全局表，并按快照恢复其内容
+    lua_getfield(L, LUA_REGISTRYINDEX, SANDBOX_GLOBALS);
+    lua_replace(L, LUA_GLOBALSINDEX);
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    lua_pushnil(L);
+    lua_setmetatable(L, 1);
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, 1);
+    }
+    lua_getfield(L, LUA_REGISTRYINDEX, SANDBOX_GLOBALS_SNAPSHOT);
+    CopyTableFields(L, 2, 1);
+    lua_settop(L, 0);
+
+    // table库可能被合约改动，换成快照的新副本
+    lua_newtable(L);
+    lua_getfield(L, LUA_REGISTRYINDEX, SANDBOX_TABLE_SNAPSHOT);
+    CopyTableFields(L, 2, 1);
+    lua_pop(L, 1);
+    lua_setglobal(L, "table");
+
+    ResetContractStorage(L);
+}
+
+lua_State* LuaStatePool::Acquire()
+{
+    int64_t start = GetTimeMicros();
     lua_State* L = nullptr;
-    if (luaStates.size() > 0) {
-        L = luaStates.back();
-        luaStates.pop();
-        lua_settop(L, 0);
+    {
+        LOCK(cs);
+        acquires++;
+        if (!idleStates.empty()) {
+            L = idleStates.back();
+            idleStates.pop_back();
+        }
     }
-    else {
-        L = lua_open();
-        if (L == nullptr) {
-            error("cannot create state: not enough memory\n");
-            return nullptr;
+
+    bool create = (L == nullptr);
+    if (create)
+        L = CreateState();
+
+    LOCK(cs);
+    if (L != nullptr) {
+        inUse++;
+        if (create)
+            created++;
+    }
+    acquireMicros += GetTimeMicros() - start;
+    return L;
+}
+
+void LuaStatePool::Release(lua_State* L)
+{
+    ResetState(L);
+
+    // 每次归还都做完整gc，上次调用的垃圾不会计入下次调用的内存上限
+    ApplyFreshBaseline(L);
+
+    bool close = false;
+    {
+        LOCK(cs);
+        inUse--;
+        if (idleStates.size() < maxIdle)
+            idleStates.push_back(L);
+        else {
+            close = true;
+            destroyed++;
         }
+    }
 
-        luaL_openlibs(L);
-        luaopen_cmsgpack(L);
+    if (close)
+        lua_close(L);
+}
 
-        if (luaL_dostring(L, initscript)) {
-            error("%s\n", lua_tostring(L, -1));
-            return nullptr;
+void LuaStatePool::Initialize(size_t maxIdleIn)
+{
+    std::vector<lua_State*> states;
+    {
+        LOCK(cs);
+        maxIdle = maxIdleIn;
+        while (idleStates.size() > maxIdle) {
+            states.push_back(idleStates.back());
+            idleStates.pop_back();
+            destroyed++;
         }
+    }
+    for (lua_State* L : states)
+        lua_close(L);
 
-        lua_pushcfunction(L, InternalCallContract);
-        lua_setglobal(L, "callcontract");
-        lua_pushcfunction(L, SendCoins);
-        lua_setglobal(L, "send");
+    // 预先创建状态，避免首批合约交易承担初始化开销
+    while (true) {
+        {
+            LOCK(cs);
+            if (idleStates.size() >= maxIdle)
+                break;
+        }
+        lua_State* L = CreateState();
+        if (L == nullptr)
+            break;
 
-        L->userData = this;
-        L->limit_on = 1;
+        LOCK(cs);
+        created++;
+        idleStates.push_back(L);
     }
+}
+
+LuaStatePoolStats LuaStatePool::GetStats() const
+{
+    LuaStatePoolStats stats;
+    LOCK(cs);
+    stats.idle = idleStates.size();
+    stats.inUse = inUse;
+    stats.maxIdle = maxIdle;
+    stats.acquires = acquires;
+    stats.created = created;
+    stats.destroyed = destroyed;
+    stats.acquireMicros = acquireMicros;
+    return stats;
+}
+
+void InitLuaStatePool()
+{
+    int poolSize = std::min(std::max(0, (int)gArgs.GetArg("-contractstatepool", DEFAULT_CONTRACT_STATE_POOL_SIZE)), MAX_CONTRACT_STATE_POOL_SIZE);
+    int64_t start = GetTimeMicros();
+    g_luaStatePool.Initialize(poolSize);
+    LogPrintf("Using %d pre-warmed lua states for smart contract execution (%.2fms)\n", poolSize, (GetTimeMicros() - start) * 0.001);
+}
+
+lua_State* SmartLuaState::GetLuaState(MagnaChainAddress& contractAddr)
+{
+    lua_State* L = g_luaStatePool.Acquire();
+    if (L == nullptr)
+        throw std::runtime_error(strprintf("%s => acquire lua state fail", __FUNCTION__));
+    L->userData = this;
+    const Consensus::Params& consensus = Params().GetConsensus();
+    SetContractStorageLazy(L, blockHeight >= consensus.ContractLazyStorageHeight);
+    SetContractNativeLib(L, blockHeight >= consensus.ContractNativeLibHeight);
+    SetContractSandboxSetfenv(L, blockHeight >= consensus.ContractSandboxSetfenvHeight);
+    g_contractProfiler.Attach(L);
 
     MCContractID contractId;
     contractAddr.GetContractID(contractId);
@@ -851,8 +1167,7 @@ lua_State* SmartLuaState::GetLuaState(MagnaChainAddress& contractAddr)
 void SmartLuaState::ReleaseLuaState(lua_State* L)
 {
     contractAddrs.resize(contractAddrs.size() - 1);
-    lua_gc(L, LUA_GCCOLLECT, 0); /* stop collector during initialization */
-    luaStates.push(L);
+    g_luaStatePool.Release(L);
 }
 
 void SmartLuaState::Clear()
@@ -873,6 +1188,7 @@ void SmartLuaState::Clear()
     contractIds.clear();
     contractAddrs.clear();
     contractDataFrom.clear();
+    profileBuffer.Clear();
 }
 
 void SmartLuaState::SetContractInfo(const MCContractID& contractId, ContractInfo& contractInfo, bool cache)
@@ -886,14 +1202,16 @@ void SmartLuaState::SetContractInfo(const MCContractID& contractId, ContractInfo
 
 bool SmartLuaState::GetContractInfo(const MCContractID& contractId, ContractInfo& contractInfo)
 {
-    LOCK(contractCS);
-
-    // 直接从快照缓存中读取
-    if (!pContractContext->GetData(contractId, contractInfo)) {
-        if (mpContractDb->GetContractInfo(contractId, contractInfo, pPrevBlockIndex) < 0)
-            return false;
+    // 直接从快照缓存中读取，未命中时在锁外读取合约数据库
+    bool cached;
+    {
+        LOCK(contractCS);
+        cached = pContractContext->GetData(contractId, contractInfo);
     }
+    if (!cached && mpContractDb->GetContractInfo(contractId, contractInfo, pPrevBlockIndex) < 0)
+        return false;
 
+    LOCK(contractCS);
     if (contractDataFrom.count(contractId) == 0) {
         contractDataFrom[contractId] = contractInfo;
     }
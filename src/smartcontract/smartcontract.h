@@ -19,18 +19,85 @@ extern "C"
 #include "key/pubkey.h"
 #include "univalue.h"
 #include "smartcontract/contractdb.h"
+#include "smartcontract/contractprofiler.h"
 #include "coding/base58.h"
 
 const int MAX_CONTRACT_FILE_LEN = 65536;
 const int MAX_CONTRACT_CALL = 15000;
 const int MAX_DATA_LEN = 1024 * 1024;
 
+// 默认保留的空闲lua_State数量
+static const int DEFAULT_CONTRACT_STATE_POOL_SIZE = 16;
+static const int MAX_CONTRACT_STATE_POOL_SIZE = 1024;
+
 class Coin;
 class MCWallet;
 class MCWalletTx;
 class MagnaChainAddress;
 class MakeBranchTxUTXO;
 
+struct LuaStatePoolStats
+{
+    size_t idle = 0;
+    size_t inUse = 0;
+    size_t maxIdle = 0;
+    uint64_t acquires = 0;
+    uint64_t created = 0;
+    uint64_t destroyed = 0;
+    int64_t acquireMicros = 0;
+};
+
+// 未池化前新建的lua_State在首次调用前的内存计数和gc阈值
+struct LuaStateBaseline
+{
+    int64_t bytes = 0;
+    int64_t threshold = 0;
+};
+
+/**
+ * Process wide pool of initialised, sandboxed lua_States shared by mempool
+ * acceptance, block assembly and block validation. A state is created once
+ * (lua_open, libs, cmsgpack, initscript) and afterwards only reset when it is
+ * handed back: stack cleared, the globals table and the table library restored
+ * from the snapshots taken at creation, and a full collect. Memory that survives
+ * the collect is excluded from the lua allocation limit and replaced by the count
+ * of a state opened the way contracts were opened before pooling, so every call
+ * starts from the same bytes on every node whatever the pool itself allocates.
+ */
+class LuaStatePool
+{
+private:
+    mutable MCCriticalSection cs;
+    std::vector<lua_State*> idleStates;
+    size_t maxIdle;
+    size_t inUse;
+    uint64_t acquires;
+    uint64_t created;
+    uint64_t destroyed;
+    int64_t acquireMicros;
+
+    static lua_State* CreateState();
+    static void ResetState(lua_State* L);
+    static bool ApplyFreshBaseline(lua_State* L);
+
+public:
+    LuaStatePool();
+    ~LuaStatePool();
+
+    lua_State* Acquire();
+    void Release(lua_State* L);
+    static bool GetFreshBaseline(LuaStateBaseline& baseline);
+
+    void Initialize(size_t maxIdleIn);
+    LuaStatePoolStats GetStats() const;
+};
+
+extern LuaStatePool g_luaStatePool;
+
+void InitLuaStatePool();
+// 按调用所在区块高度选择原有的或受限的setfenv，见Consensus::Params::ContractSandboxSetfenvHeight
+void SetContractSandboxSetfenv(lua_State* L, bool strict);
+
 class SmartLuaState
 {
 public:
@@ -56,12 +123,12 @@ public:
     int internalCallNum = 0;
     CoinAmountCache* pCoinAmountCache;
     std::map<MCContractID, ContractInfo> contractDataFrom;
+    ContractProfileBuffer profileBuffer;    // 本次调用的性能统计，最外层调用结束时合并
 
 private:
     mutable MCCriticalSection contractCS;
     ContractContext* pContractContext = nullptr;
     MCBlockIndex* pPrevBlockIndex = nullptr;
-    std::queue<lua_State*> luaStates;
     MCTransactionRef tx;
 
 public:
@@ -8,6 +8,8 @@
 #include "coding/uint256.h"
 #include "coding/arith_uint256.h"
 #include "chain/chainparams.h"
+#include "misc/random.h"
+#include "misc/clientversion.h"
 
 #include "test/test_magnachain.h"
 
@@ -24,6 +26,15 @@ public:
     {
         BranchDb::AddBlockInfoTxData(transaction, mainBlockHash, iTxVtxIndex, modifyBranch);
     }
+    bool WriteModify(const std::set<uint256>& modifyBranch)
+    {
+        return WriteModifyToDB(modifyBranch);
+    }
+    // 按旧版本格式写入整个branch
+    void WriteLegacy(const uint256& branchid, const BranchData& data)
+    {
+        db.Write(branchid, data);
+    }
 };
 
 void AddBlockInfoTx(MCMutableTransaction &mtx, const uint256 &branchid, MCBlockHeader &header, const uint32_t &nbits, uint32_t &preblockH, uint32_t &t, MCBranchBlockInfo &firstBlock, BranchDbTest &branchdb, uint256 &temphash, const size_t &txindex, std::set<uint256> &modifyBranch)
@@ -549,4 +560,218 @@ BOOST_AUTO_TEST_CASE(branchdb_flushreportprove)
     }
 }
 
+// 在tip后接一个随机nNonce的区块
+static uint256 AddNonceBlock(BranchData& data, const uint256& prevHash, uint32_t work)
+{
+    const BranchBlockData& prev = data.mapHeads[prevHash];
+    BranchBlockData blockdata;
+    blockdata.header.hashPrevBlock = prevHash;
+    blockdata.header.nNonce = GetRand(1000000);
+    blockdata.header.nTime = GetRand(1 << 30);
+    blockdata.nHeight = prev.nHeight + 1;
+    blockdata.nChainWork = prev.nChainWork + arith_uint256(work);
+    blockdata.pStakeTx = MakeTransactionRef();
+    blockdata.deadstatus = BranchBlockData::eLive;
+    data.AddNewBlockData(blockdata);
+    return blockdata.header.GetHash();
+}
+
+static uint64_t WalkNonceSum(BranchData& data, uint256 hash, int count)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < count; ++i) {
+        const BranchBlockData& blockdata = data.mapHeads[hash];
+        sum += blockdata.header.nNonce;
+        hash = blockdata.header.hashPrevBlock;
+    }
+    return sum;
+}
+
+BOOST_AUTO_TEST_CASE(branchdb_chainnonce)
+{
+    uint256 branchid = uint256S("8af97c9b85ebf8b0f16b4c50cd1fa72c50dfa5d1bec93625c1dde7a4f211b65e");
+    BranchData data;
+    data.InitBranchGenesisBlockData(branchid);
+
+    uint256 forkHash = data.TipHash();
+    for (int i = 0; i < 150; ++i) {
+        uint256 tip = AddNonceBlock(data, data.TipHash(), 1);
+        if (i == 100)
+            forkHash = tip;
+    }
+    BOOST_CHECK_EQUAL(data.vecChainNonce.size(), data.vecChainActive.size());
+
+    // 分叉链工作量更大，切换后失效的部分重新计算
+    uint256 forkTip = forkHash;
+    for (int i = 0; i < 60; ++i)
+        forkTip = AddNonceBlock(data, forkTip, 2);
+    BOOST_CHECK(data.TipHash() == forkTip);
+    BOOST_CHECK_EQUAL(data.vecChainNonce.size(), data.vecChainActive.size());
+
+    uint64_t sum = 0;
+    for (int height = 0; height <= data.Height(); height += 7) {
+        const uint256& hash = data.vecChainActive[height];
+        int count = std::min(100, height + 1);
+        BOOST_CHECK(data.GetChainNonceSum(hash, height, count, sum));
+        BOOST_CHECK_EQUAL(sum, WalkNonceSum(data, hash, count));
+    }
+    BOOST_CHECK(!data.GetChainNonceSum(uint256(), data.Height(), 1, sum));
+    BOOST_CHECK(!data.GetChainNonceSum(forkTip, data.Height(), data.Height() + 2, sum));
+
+    // 反序列化后重建
+    MCDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << data;
+    BranchData loaded;
+    ss >> loaded;
+    BOOST_CHECK(loaded.vecChainNonce == data.vecChainNonce);
+
+    data.RemoveBlock(forkTip);
+    BOOST_CHECK_EQUAL(data.vecChainNonce.size(), data.vecChainActive.size());
+}
+
+BOOST_AUTO_TEST_CASE(branchdb_storage)
+{
+    uint256 branchid = uint256S("8af97c9b85ebf8b0f16b4c50cd1fa72c50dfa5d1bec93625c1dde7a4f211b65e");
+    const MCBlock& genesisblock = BranchParams(branchid).GenesisBlock();
+    fs::path path = fs::temp_directory_path() / fs::unique_path();
+
+    VBRANCH_CHAIN vecChain;
+    size_t nHeads = 0;
+    {
+        BranchDbTest branchdb(path, 8 << 20, false, false);
+        BOOST_CHECK(branchdb.Upgrade());
+
+        uint256 temphash;
+        uint32_t t = 0;
+        size_t txindex = 2;
+        std::set<uint256> modifyBranch;
+        MCBranchBlockInfo firstBlock;
+        firstBlock.branchID = branchid;
+        firstBlock.hashPrevBlock = genesisblock.GetHash();
+        firstBlock.nBits = genesisblock.nBits;
+        firstBlock.blockHeight = 0;
+        MCVectorWriter cvw{ SER_NETWORK, INIT_PROTO_VERSION, firstBlock.vchStakeTxData, 0, MakeTransactionRef() };
+
+        // 主链5个块，之后从高度2分叉出更长的链，每步都写盘
+        MCMutableTransaction mtx;
+        MCBlockHeader header = genesisblock.GetBlockHeader();
+        MCBlockHeader forkHeader;
+        uint32_t preblockH = 0;
+        for (int i = 0; i < 5; ++i) {
+            AddBlockInfoTx(mtx, branchid, header, genesisblock.nBits, preblockH, t, firstBlock, branchdb, temphash, txindex, modifyBranch);
+            mtx.pBranchBlockData->GetBlockHeader(header);
+            if (preblockH == 2)
+                forkHeader = header;
+            BOOST_CHECK(branchdb.WriteModify(modifyBranch));
+        }
+        header = forkHeader;
+        preblockH = 2;
+        for (int i = 0; i < 4; ++i) {
+            AddBlockInfoTx(mtx, branchid, header, genesisblock.nBits, preblockH, t, firstBlock, branchdb, temphash, txindex, modifyBranch);
+            mtx.pBranchBlockData->GetBlockHeader(header);
+            BOOST_CHECK(branchdb.WriteModify(modifyBranch));
+        }
+        BOOST_CHECK(branchdb.GetBranchTipHash(branchid) == header.GetHash());
+        BOOST_CHECK_EQUAL(branchdb.GetBranchHeight(branchid), 6U);
+        vecChain = branchdb.GetActiveChain(branchid);
+        nHeads = branchdb.GetBranchData(branchid).mapHeads.size();
+        BOOST_CHECK_EQUAL(nHeads, 10U);
+    }
+    {
+        // 重新打开后按需读入
+        BranchDbTest branchdb(path, 8 << 20, false, false);
+        BOOST_CHECK(branchdb.Upgrade());
+        BOOST_CHECK(branchdb.HasBranchData(branchid));
+        BOOST_CHECK(branchdb.GetActiveChain(branchid) == vecChain);
+        BOOST_CHECK_EQUAL(branchdb.GetBranchHeight(branchid), 6U);
+        BranchData data = branchdb.GetBranchData(branchid);
+        BOOST_CHECK_EQUAL(data.mapHeads.size(), nHeads);
+        BOOST_CHECK(data.vecChainNonce.size() == vecChain.size());
+        BOOST_CHECK(!data.IsDirty());
+        BOOST_CHECK(!branchdb.HasBranchData(GetRandHash()));
+
+        // 查询不存在的branch不会留下缓存
+        uint256 unknownid = GetRandHash();
+        size_t nUsage = branchdb.DynamicMemoryUsage();
+        BOOST_CHECK_EQUAL(branchdb.GetBranchData(unknownid).vecChainActive.size(), 1U);
+        BOOST_CHECK(!branchdb.HasBranchData(unknownid));
+        BOOST_CHECK_EQUAL(branchdb.DynamicMemoryUsage(), nUsage);
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(branchdb_upgrade)
+{
+    uint256 branchid = uint256S("8af97c9b85ebf8b0f16b4c50cd1fa72c50dfa5d1bec93625c1dde7a4f211b65e");
+    fs::path path = fs::temp_directory_path() / fs::unique_path();
+
+    BranchData legacy;
+    legacy.InitBranchGenesisBlockData(branchid);
+    for (int i = 0; i < 20; ++i) {
+        AddNonceBlock(legacy, legacy.TipHash(), 1);
+        legacy.SnapshotBlockTip(GetRandHash());
+    }
+    {
+        BranchDbTest branchdb(path, 8 << 20, false, false);
+        branchdb.WriteLegacy(branchid, legacy);
+        BOOST_CHECK(!branchdb.HasBranchData(branchid));
+        BOOST_CHECK(branchdb.Upgrade());
+        BOOST_CHECK(branchdb.HasBranchData(branchid));
+    }
+    {
+        BranchDbTest branchdb(path, 8 << 20, false, false);
+        BOOST_CHECK(branchdb.Upgrade());
+        BranchData data = branchdb.GetBranchData(branchid);
+        BOOST_CHECK(data.vecChainActive == legacy.vecChainActive);
+        BOOST_CHECK(data.mapSnapshotBlockTip == legacy.mapSnapshotBlockTip);
+        BOOST_CHECK_EQUAL(data.mapHeads.size(), legacy.mapHeads.size());
+        for (const auto& mi : legacy.mapHeads) {
+            BOOST_REQUIRE(data.mapHeads.count(mi.first));
+            BOOST_CHECK(data.mapHeads[mi.first].header.GetHash() == mi.first);
+            BOOST_CHECK(data.mapHeads[mi.first].nChainWork == mi.second.nChainWork);
+        }
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(branchcache_view)
+{
+    uint256 branchid = uint256S("8af97c9b85ebf8b0f16b4c50cd1fa72c50dfa5d1bec93625c1dde7a4f211b65e");
+    const MCBlock& genesisblock = BranchParams(branchid).GenesisBlock();
+    BranchDbTest branchdb(fs::temp_directory_path() / fs::unique_path(), 8 << 20, false, false);
+
+    uint256 temphash;
+    uint32_t t = 0;
+    size_t txindex = 2;
+    std::set<uint256> modifyBranch;
+    MCBranchBlockInfo firstBlock;
+    firstBlock.branchID = branchid;
+    firstBlock.nBits = genesisblock.nBits;
+    MCVectorWriter cvw{ SER_NETWORK, INIT_PROTO_VERSION, firstBlock.vchStakeTxData, 0, MakeTransactionRef() };
+
+    MCMutableTransaction mtx;
+    MCBlockHeader header = genesisblock.GetBlockHeader();
+    uint32_t preblockH = 0;
+    for (int i = 0; i < 3; ++i) {
+        AddBlockInfoTx(mtx, branchid, header, genesisblock.nBits, preblockH, t, firstBlock, branchdb, temphash, txindex, modifyBranch);
+        mtx.pBranchBlockData->GetBlockHeader(header);
+    }
+
+    // 缓存没有修改过的branch直接读数据库中的数据
+    BranchCache branchcache(&branchdb);
+    const BranchData& dbData = branchdb.GetBranchData(branchid);
+    BOOST_CHECK(&branchcache.GetBranchData(branchid) == &dbData);
+    BOOST_CHECK(branchcache.GetBranchTipHash(branchid) == header.GetHash());
+
+    // 加入缓存后返回缓存自己的数据，数据库不变
+    mtx.nVersion = MCTransaction::SYNC_BRANCH_INFO;
+    mtx.pBranchBlockData.reset(new MCBranchBlockInfo(*mtx.pBranchBlockData));
+    mtx.pBranchBlockData->hashPrevBlock = header.GetHash();
+    mtx.pBranchBlockData->blockHeight = ++preblockH;
+    mtx.pBranchBlockData->nTime = t++;
+    branchcache.AddToCache(MCTransaction(mtx));
+    BOOST_CHECK(&branchcache.GetBranchData(branchid) != &dbData);
+    BOOST_CHECK_EQUAL(dbData.mapHeads.size(), 4U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
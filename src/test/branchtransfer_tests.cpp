@@ -0,0 +1,207 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain/branchtransfer.h"
+#include "chain/chainparams.h"
+#include "consensus/merkle.h"
+#include "misc/random.h"
+#include "validation/validation.h"
+
+#include "test/test_magnachain.h"
+
+#include <boost/test/unit_test.hpp>
+
+static BranchTransferEntry MakeEntry(const std::string& strToChainId)
+{
+    BranchTransferEntry entry;
+    entry.nType = BranchTransferEntry::TRANS_STEP2;
+    entry.txid = GetRandHash();
+    entry.blockHash = GetRandHash();
+    entry.strToChainId = strToChainId;
+    entry.strMethod = "makebranchtransaction";
+    entry.strParams = "[\"00\"]";
+    entry.nTime = 1000;
+    return entry;
+}
+
+BOOST_FIXTURE_TEST_SUITE(branchtransfer_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(branchtransfer_persist)
+{
+    fs::path path = fs::temp_directory_path() / fs::unique_path();
+    BranchTransferEntry entry = MakeEntry("nochain");
+    uint256 blockHash = GetRandHash();
+    {
+        BranchTransferQueue queue(path, 1 << 20, false, false);
+        BOOST_CHECK(queue.AddEntry(entry));
+        BOOST_CHECK(!queue.AddEntry(entry));
+        queue.PushBlock(blockHash, 10);
+        BOOST_CHECK_EQUAL(find_value(queue.GetInfo(false), "blocks").get_int(), 1);
+    }
+    {
+        // 重启后请求和未展开的区块都还在，同一交易不会重复加入
+        BranchTransferQueue queue(path, 1 << 20, false, false);
+        BranchTransferEntry loaded;
+        BOOST_CHECK(queue.GetEntry(entry.nType, entry.txid, loaded));
+        BOOST_CHECK(loaded.blockHash == entry.blockHash);
+        BOOST_CHECK_EQUAL(loaded.strToChainId, entry.strToChainId);
+        BOOST_CHECK_EQUAL(loaded.strParams, entry.strParams);
+        BOOST_CHECK(!queue.AddEntry(entry));
+        UniValue info = queue.GetInfo(true);
+        BOOST_CHECK_EQUAL(find_value(info, "blocks").get_int(), 1);
+        BOOST_CHECK_EQUAL(find_value(info, "pending").get_int(), 1);
+        BOOST_CHECK_EQUAL(find_value(info, "entries").size(), 1);
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(branchtransfer_backoff)
+{
+    BranchTransferQueue queue(fs::temp_directory_path() / fs::unique_path(), 1 << 20, true, false);
+    BranchTransferEntry entry = MakeEntry("nochain");
+    BOOST_CHECK(queue.AddEntry(entry));
+
+    // 没有目标链的RPC配置，每次失败后间隔加倍
+    int64_t nNow = 1000;
+    queue.ProcessOnce(nNow);
+    BranchTransferEntry state;
+    BOOST_REQUIRE(queue.GetEntry(entry.nType, entry.txid, state));
+    BOOST_CHECK_EQUAL(state.nTries, 1);
+    BOOST_CHECK_EQUAL(state.nNextTry, nNow + BRANCH_TRANSFER_RETRY_INTERVAL);
+    BOOST_CHECK(!state.strLastError.empty());
+
+    queue.ProcessOnce(nNow + BRANCH_TRANSFER_RETRY_INTERVAL - 1);
+    BOOST_REQUIRE(queue.GetEntry(entry.nType, entry.txid, state));
+    BOOST_CHECK_EQUAL(state.nTries, 1);
+
+    nNow += BRANCH_TRANSFER_RETRY_INTERVAL;
+    queue.ProcessOnce(nNow);
+    BOOST_REQUIRE(queue.GetEntry(entry.nType, entry.txid, state));
+    BOOST_CHECK_EQUAL(state.nTries, 2);
+    BOOST_CHECK_EQUAL(state.nNextTry, nNow + 2 * BRANCH_TRANSFER_RETRY_INTERVAL);
+
+    while (state.nStatus == BranchTransferEntry::PENDING) {
+        BOOST_CHECK(state.nNextTry - state.nLastTry <= BRANCH_TRANSFER_MAX_RETRY_INTERVAL);
+        nNow = state.nNextTry;
+        queue.ProcessOnce(nNow);
+        BOOST_REQUIRE(queue.GetEntry(entry.nType, entry.txid, state));
+    }
+    BOOST_CHECK_EQUAL(state.nStatus, BranchTransferEntry::FAILED);
+    BOOST_CHECK_EQUAL(state.nTries, BRANCH_TRANSFER_MAX_TRIES);
+    BOOST_CHECK_EQUAL(find_value(queue.GetInfo(false), "failed").get_int(), 1);
+
+    // 失败的记录保留一段时间后清除
+    queue.ProcessOnce(nNow + BRANCH_TRANSFER_KEEP_TIME);
+    BOOST_CHECK(queue.GetEntry(entry.nType, entry.txid, state));
+    queue.ProcessOnce(nNow + BRANCH_TRANSFER_KEEP_TIME + 1);
+    BOOST_CHECK(!queue.GetEntry(entry.nType, entry.txid, state));
+    BOOST_CHECK(queue.AddEntry(entry));
+}
+
+BOOST_FIXTURE_TEST_CASE(branchtransfer_no_rpc_config, TestingSetup)
+{
+    // 含一笔跨链转账的区块，目标链没有RPC配置
+    MCMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = MCScript() << OP_0 << OP_0;
+    coinbase.vout.resize(1);
+    MCMutableTransaction step1;
+    step1.nVersion = MCTransaction::TRANS_BRANCH_VERSION_S1;
+    step1.sendToBranchid = "unregisteredbranch";
+    step1.sendToTxHexData = "00";
+    step1.vin.resize(1);
+    step1.vin[0].prevout = MCOutPoint(GetRandHash(), 0);
+    step1.vout.resize(1);
+    MCBlock block;
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+    block.vtx.push_back(MakeTransactionRef(step1));
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+
+    MCDiskBlockPos pos(1000, 0);
+    {
+        MCAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!fileout.IsNull());
+        fileout << block;
+    }
+    uint256 blockHash = block.GetHash();
+    uint256 missingHash = GetRandHash();
+
+    // 主链上接着两个区块，第二个的数据读不到；另有一个不在主链上的区块
+    MCBlockHeader unreadableHeader = block.GetBlockHeader();
+    unreadableHeader.nNonce = 1;
+    MCBlockHeader staleHeader = block.GetBlockHeader();
+    staleHeader.nNonce = 2;
+    MCBlockIndex index(block), unreadable(unreadableHeader), stale(staleHeader);
+    index.nFile = pos.nFile;
+    index.nDataPos = pos.nPos;
+    unreadable.nFile = pos.nFile + 1;
+    for (MCBlockIndex* pindex : { &index, &unreadable, &stale })
+        pindex->nStatus |= BLOCK_HAVE_DATA;
+    MCBlockIndex* pOldTip = nullptr;
+    {
+        LOCK(cs_main);
+        pOldTip = chainActive.Tip();
+        index.pprev = stale.pprev = pOldTip;
+        index.nHeight = stale.nHeight = pOldTip->nHeight + 1;
+        unreadable.pprev = &index;
+        unreadable.nHeight = index.nHeight + 1;
+        index.phashBlock = &mapBlockIndex.insert(std::make_pair(blockHash, &index)).first->first;
+        unreadable.phashBlock = &mapBlockIndex.insert(std::make_pair(unreadableHeader.GetHash(), &unreadable)).first->first;
+        stale.phashBlock = &mapBlockIndex.insert(std::make_pair(staleHeader.GetHash(), &stale)).first->first;
+        chainActive.SetTip(&unreadable);
+    }
+
+    fs::path path = fs::temp_directory_path() / fs::unique_path();
+    {
+        BranchTransferQueue queue(path, 1 << 20, false, false);
+        queue.PushBlock(missingHash, 5);
+        queue.PushBlock(stale.GetBlockHash(), stale.nHeight);
+        queue.PushBlock(blockHash, index.nHeight);
+        queue.PushBlock(unreadable.GetBlockHash(), unreadable.nHeight);
+        queue.ProcessOnce(1000);
+
+        // 请求照常保存，发送时才因缺少配置而重试
+        BranchTransferEntry entry;
+        BOOST_REQUIRE(queue.GetEntry(BranchTransferEntry::TRANS_STEP2, block.vtx[1]->GetHash(), entry));
+        BOOST_CHECK_EQUAL(entry.strToChainId, "unregisteredbranch");
+        BOOST_CHECK_EQUAL(entry.strMethod, "makebranchtransaction");
+        BOOST_CHECK(entry.blockHash == blockHash);
+        BOOST_CHECK_EQUAL(entry.nTries, 1);
+        BOOST_CHECK_EQUAL(entry.nStatus, BranchTransferEntry::PENDING);
+
+        // 不在主链上的区块丢弃，读不到的区块保留记录
+        BOOST_CHECK_EQUAL(find_value(queue.GetInfo(false), "blocks").get_int(), 1);
+        queue.ProcessOnce(1001);
+        BOOST_CHECK_EQUAL(find_value(queue.GetInfo(false), "blocks").get_int(), 1);
+    }
+    {
+        BranchTransferQueue queue(path, 1 << 20, false, false);
+        BranchTransferEntry entry;
+        BOOST_CHECK(queue.GetEntry(BranchTransferEntry::TRANS_STEP2, block.vtx[1]->GetHash(), entry));
+        BOOST_CHECK_EQUAL(find_value(queue.GetInfo(false), "blocks").get_int(), 1);
+
+        // 重试次数用完后放弃
+        int64_t nNow = 2000;
+        for (int i = 1; i < BRANCH_TRANSFER_MAX_TRIES; ++i) {
+            queue.ProcessOnce(nNow);
+            nNow += BRANCH_TRANSFER_MAX_RETRY_INTERVAL;
+        }
+        BOOST_CHECK_EQUAL(find_value(queue.GetInfo(false), "blocks").get_int(), 1);
+        queue.ProcessOnce(nNow);
+        BOOST_CHECK_EQUAL(find_value(queue.GetInfo(false), "blocks").get_int(), 0);
+    }
+    {
+        BranchTransferQueue queue(path, 1 << 20, false, false);
+        BOOST_CHECK_EQUAL(find_value(queue.GetInfo(false), "blocks").get_int(), 0);
+    }
+    fs::remove_all(path);
+
+    LOCK(cs_main);
+    chainActive.SetTip(pOldTip);
+    mapBlockIndex.erase(blockHash);
+    mapBlockIndex.erase(unreadableHeader.GetHash());
+    mapBlockIndex.erase(staleHeader.GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "transaction/coins.h"
+#include "transaction/txdb.h"
 #include "script/standard.h"
 #include "coding/uint256.h"
 #include "transaction/undo.h"
@@ -856,4 +857,149 @@ BOOST_AUTO_TEST_CASE(ccoins_write)
                     CheckWriteCoins(parent_value, child_value, parent_value, parent_flags, child_flags, parent_flags);
 }
 
+
+BOOST_AUTO_TEST_CASE(coinamount_index_buckets)
+{
+    Coin coin(MCTxOut(100, MCScript()), 10, false);
+    Coin coinbase1(MCTxOut(20, MCScript()), 10, true);
+    Coin coinbase2(MCTxOut(3, MCScript()), 12, true);
+
+    CoinAmountIndex index;
+    index.AddCoin(coin);
+    index.AddCoin(coinbase1);
+    index.AddCoin(coinbase2);
+    BOOST_CHECK_EQUAL(index.GetAmount(10), 100);
+    BOOST_CHECK_EQUAL(index.GetAmount(10 + COINBASE_MATURITY), 120);
+    BOOST_CHECK_EQUAL(index.GetAmount(12 + COINBASE_MATURITY), 123);
+
+    // 反序列化后重新计算coinbase总额
+    MCDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << index;
+    CoinAmountIndex index2;
+    ss >> index2;
+    BOOST_CHECK_EQUAL(index2.GetAmount(12 + COINBASE_MATURITY), 123);
+
+    index2.RemoveCoin(coinbase1);
+    index2.RemoveCoin(coin);
+    BOOST_CHECK(index2.coinbase.count(10) == 0);
+    BOOST_CHECK_EQUAL(index2.GetAmount(12 + COINBASE_MATURITY), 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(coinamount_index_import, TestingSetup)
+{
+    MCKey key;
+    key.MakeNewKey(true);
+    const uint160 addr = key.GetPubKey().GetID();
+    MCScript script = GetScriptForDestination(key.GetPubKey().GetID());
+    int nHeight = chainActive.Height();
+
+    std::vector<MCOutPoint> outpoints;
+    {
+        MCCoinsViewCache view(pcoinsTip);
+        for (int i = 0; i < 10; ++i) {
+            MCOutPoint outpoint(InsecureRand256(), i);
+            view.AddCoin(outpoint, Coin(MCTxOut(1000 + i, script), nHeight, false), false);
+            outpoints.push_back(outpoint);
+        }
+        view.Flush();
+    }
+    BOOST_CHECK_EQUAL(pcoinListDb->GetAmount(addr, nHeight), 10045);
+    BOOST_CHECK_EQUAL(pcoinListDb->ScanAmount(addr, nHeight), 10045);
+    // 花费时要能从db中取到coin的脚本
+    BOOST_CHECK(pcoinsTip->Flush());
+
+    // 花费后再恢复，与断开区块时一样
+    {
+        MCCoinsViewCache view(pcoinsTip);
+        BOOST_CHECK(view.SpendCoin(outpoints[3]));
+        view.Flush();
+    }
+    BOOST_CHECK_EQUAL(pcoinListDb->GetAmount(addr, nHeight), 10042);
+    BOOST_CHECK_EQUAL(pcoinListDb->ScanAmount(addr, nHeight), 10042);
+    {
+        MCCoinsViewCache view(pcoinsTip);
+        view.AddCoin(outpoints[3], Coin(MCTxOut(1003, script), nHeight, false), false);
+        view.Flush();
+    }
+    BOOST_CHECK_EQUAL(pcoinListDb->GetAmount(addr, nHeight), 10045);
+
+    pcoinListDb->Flush();
+    CoinAmountIndex index;
+    BOOST_CHECK(pcoinListDb->ReadAmountIndex(addr, index));
+    BOOST_CHECK_EQUAL(index.GetAmount(nHeight), 10045);
+    std::vector<uint160> keys;
+    pcoinListDb->GetAmountIndexKeys(keys);
+    BOOST_CHECK(std::find(keys.begin(), keys.end(), addr) != keys.end());
+}
+
+
+static std::vector<MCOutPoint> ReadCoinPages(const uint160& addr, size_t nPageSize)
+{
+    std::vector<MCOutPoint> all, page;
+    MCOutPoint last;
+    const MCOutPoint* pStart = nullptr;
+    do {
+        pcoinListDb->GetCoins(addr, pStart, nPageSize, page);
+        all.insert(all.end(), page.begin(), page.end());
+        if (!page.empty()) {
+            last = page.back();
+            pStart = &last;
+        }
+    } while (page.size() == nPageSize);
+    return all;
+}
+
+BOOST_FIXTURE_TEST_CASE(coinlist_upgrade_and_pages, TestingSetup)
+{
+    MCKey key;
+    key.MakeNewKey(true);
+    const uint160 addr = key.GetPubKey().GetID();
+    MCScript script = GetScriptForDestination(key.GetPubKey().GetID());
+
+    // 旧格式的整个列表存在一条记录中
+    CoinList oldList;
+    std::set<MCOutPoint> expected;
+    for (int i = 0; i < 5; ++i) {
+        oldList.coins.push_back(MCOutPoint(InsecureRand256(), i));
+        expected.insert(oldList.coins.back());
+    }
+    MCDBWrapper* db = pcoinsdbview->GetDb();
+    BOOST_CHECK(db->Write(std::make_pair('A', addr), oldList));
+    BOOST_CHECK(pcoinListDb->Upgrade());
+    BOOST_CHECK(!db->Exists(std::make_pair('A', addr)));
+    BOOST_CHECK(ReadCoinPages(addr, 2) == std::vector<MCOutPoint>(expected.begin(), expected.end()));
+
+    // 未写盘的修改与db中的记录合并
+    std::vector<MCOutPoint> added;
+    {
+        MCCoinsViewCache view(pcoinsTip);
+        for (int i = 0; i < 4; ++i) {
+            MCOutPoint outpoint(InsecureRand256(), i);
+            view.AddCoin(outpoint, Coin(MCTxOut(1000, script), chainActive.Height(), false), false);
+            added.push_back(outpoint);
+            expected.insert(outpoint);
+        }
+        view.Flush();
+    }
+    BOOST_CHECK(ReadCoinPages(addr, 3) == std::vector<MCOutPoint>(expected.begin(), expected.end()));
+    pcoinListDb->Flush();
+    BOOST_CHECK(ReadCoinPages(addr, 3) == std::vector<MCOutPoint>(expected.begin(), expected.end()));
+
+    BOOST_CHECK(pcoinsTip->Flush());
+    {
+        MCCoinsViewCache view(pcoinsTip);
+        BOOST_CHECK(view.SpendCoin(added[1]));
+        view.Flush();
+    }
+    expected.erase(added[1]);
+    BOOST_CHECK(ReadCoinPages(addr, 4) == std::vector<MCOutPoint>(expected.begin(), expected.end()));
+
+    // 整个读出后留在读缓存中，分页从缓存读
+    BOOST_CHECK(pcoinListDb->GetList(addr)->coins == std::vector<MCOutPoint>(expected.begin(), expected.end()));
+    BOOST_CHECK(ReadCoinPages(addr, 2) == std::vector<MCOutPoint>(expected.begin(), expected.end()));
+    pcoinListDb->Flush();
+    BOOST_CHECK(pcoinListDb->GetList(addr)->coins.size() == expected.size());
+    BOOST_CHECK_EQUAL(pcoinListDb->GetAmount(addr, chainActive.Height()), 3000);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
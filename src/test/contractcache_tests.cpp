@@ -0,0 +1,75 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "smartcontract/contractcache.h"
+
+#include "test/test_magnachain.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(contractcache_tests, BasicTestingSetup)
+
+static MCContractID ContractIdFromInt(unsigned char n)
+{
+    MCContractID contractId;
+    *contractId.begin() = n;
+    return contractId;
+}
+
+BOOST_AUTO_TEST_CASE(contractcache_lookup)
+{
+    ContractCodeCache cache(1 << 20);
+    MCContractID contractId = ContractIdFromInt(1);
+    std::string rawCode = "compressed code";
+
+    ContractCodeKey key = cache.ComputeKey(contractId, rawCode);
+    BOOST_CHECK(!cache.Lookup(key));
+
+    ContractCodeCache::CodePtr code = cache.Insert(key, std::string("code"));
+    BOOST_CHECK_EQUAL(*code, "code");
+    BOOST_CHECK_EQUAL(*cache.Lookup(cache.ComputeKey(contractId, rawCode)), "code");
+
+    // same contract with different stored code must not hit
+    BOOST_CHECK(!cache.Lookup(cache.ComputeKey(contractId, rawCode + "x")));
+    // same code under another contract must not hit either
+    BOOST_CHECK(!cache.Lookup(cache.ComputeKey(ContractIdFromInt(2), rawCode)));
+
+    ContractCodeCacheStats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.entries, 1U);
+    BOOST_CHECK_EQUAL(stats.hits, 1U);
+    BOOST_CHECK_EQUAL(stats.misses, 3U);
+    BOOST_CHECK_EQUAL(stats.evictions, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(contractcache_eviction)
+{
+    const std::string code(10000, 'c');
+    ContractCodeCache cache(45000);
+    std::vector<ContractCodeKey> keys;
+    for (unsigned char i = 0; i < 8; ++i) {
+        keys.push_back(cache.ComputeKey(ContractIdFromInt(i), code));
+        cache.Insert(keys.back(), std::string(code));
+        // keep the first contract hot
+        BOOST_CHECK(cache.Lookup(keys[0]));
+    }
+
+    ContractCodeCacheStats stats = cache.GetStats();
+    BOOST_CHECK(stats.usage <= stats.maxUsage);
+    BOOST_CHECK(stats.evictions > 0);
+    BOOST_CHECK_EQUAL(stats.entries + stats.evictions, 8U);
+    BOOST_CHECK(cache.Lookup(keys[0]));
+    BOOST_CHECK(cache.Lookup(keys[7]));
+    BOOST_CHECK(!cache.Lookup(keys[1]));
+
+    // entries larger than the whole cache are handed out but not kept
+    ContractCodeKey big = cache.ComputeKey(ContractIdFromInt(100), code);
+    BOOST_CHECK_EQUAL(cache.Insert(big, std::string(50000, 'b'))->size(), 50000U);
+    BOOST_CHECK(!cache.Lookup(big));
+
+    cache.SetMaxUsage(0);
+    BOOST_CHECK_EQUAL(cache.GetStats().entries, 0U);
+    BOOST_CHECK_EQUAL(cache.GetStats().usage, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
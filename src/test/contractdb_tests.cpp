@@ -0,0 +1,276 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain/chainparams.h"
+#include "coding/base58.h"
+#include "coding/hash.h"
+#include "consensus/consensus.h"
+#include "io/streams.h"
+#include "key/key.h"
+#include "smartcontract/contractdb.h"
+#include "smartcontract/smartcontract.h"
+#include "transaction/coins.h"
+#include "utils/utilstrencodings.h"
+#include "validation/validation.h"
+
+#include "test/test_magnachain.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(contractdb_tests, BasicTestingSetup)
+
+// 按高度索引后存盘格式与原先的std::list<DBContractInfoByHeight>一致
+BOOST_AUTO_TEST_CASE(contractdb_info_serialize)
+{
+    std::list<DBContractInfoByHeight> oldItems;
+    for (int32_t height : {3, 10, 42}) {
+        oldItems.emplace_back();
+        oldItems.back().blockHeight = height;
+    }
+    MCDataStream oldStream(SER_DISK, CLIENT_VERSION);
+    oldStream << std::string("code") << oldItems;
+
+    DBContractInfo info;
+    oldStream >> info;
+    BOOST_CHECK_EQUAL(info.code, "code");
+    BOOST_REQUIRE_EQUAL(info.items.size(), 3U);
+    BOOST_CHECK_EQUAL(info.items.rbegin()->second.blockHeight, 42);
+
+    MCDataStream newStream(SER_DISK, CLIENT_VERSION);
+    newStream << info;
+    MCDataStream expected(SER_DISK, CLIENT_VERSION);
+    expected << std::string("code") << oldItems;
+    BOOST_CHECK(newStream.str() == expected.str());
+
+    // 不高于某高度的最高版本
+    auto it = info.items.upper_bound(41);
+    BOOST_REQUIRE(it != info.items.begin());
+    BOOST_CHECK_EQUAL((--it)->first, 10);
+    BOOST_CHECK(info.items.upper_bound(2) == info.items.begin());
+}
+
+BOOST_FIXTURE_TEST_CASE(contractdb_cache_eviction, TestingSetup)
+{
+    // 一条只有索引的链，高于确认高度的合约数据不会被整个换出
+    int checkDepth = gArgs.GetArg("-checkblocks", DEFAULT_CHECKBLOCKS) / Params().GetConsensus().nPowTargetSpacing;
+    std::vector<uint256> vHash(checkDepth + 10);
+    std::vector<MCBlockIndex> vIndex(vHash.size());
+    for (size_t i = 0; i < vIndex.size(); ++i) {
+        vHash[i] = GetRandHash();
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = i > 0 ? &vIndex[i - 1] : nullptr;
+        vIndex[i].phashBlock = &mapBlockIndex.insert(std::make_pair(vHash[i], &vIndex[i])).first->first;
+    }
+    MCBlockIndex* pindex = &vIndex[1];
+    MCBlockIndex* ptip = &vIndex.back();
+
+    ContractDataDB db(GetDataDir() / "contract_eviction", 1 << 20, true, true);
+    std::vector<MCContractID> contractIds;
+    for (int i = 0; i < 200; ++i) {
+        MCContractID contractId(Hash160(ParseHex(GetRandHash().ToString())));
+        ContractInfo info;
+        info.code = "code";
+        info.data = std::string(1000, 'a' + i % 26);
+        db.contractContext.SetData(contractId, info);
+        contractIds.push_back(contractId);
+    }
+    BOOST_CHECK(db.WriteBlockContractInfoToDisk(pindex, &db.contractContext));
+    BOOST_CHECK(db.UpdateBlockContractToDisk(pindex));
+    db.contractContext.ClearAll();
+    size_t nFull = db.DynamicMemoryUsage();
+    BOOST_CHECK(nFull > 200 * 1000);
+
+    // 未确认的合约只丢弃数据，读取时重新加载
+    db.SetCacheLimit(0);
+    size_t nPinned = db.DynamicMemoryUsage();
+    BOOST_CHECK(nPinned < nFull / 2);
+    ContractInfo info;
+    BOOST_CHECK_EQUAL(db.GetContractInfo(contractIds[5], info, pindex), 1);
+    BOOST_CHECK_EQUAL(info.data, std::string(1000, 'a' + 5));
+
+    // 确认后整个换出，每个分片保留最近使用的一个
+    db.SetCacheLimit(DEFAULT_CONTRACT_DATA_CACHE_SIZE);
+    BOOST_CHECK(db.UpdateBlockContractToDisk(ptip));
+    db.SetCacheLimit(0);
+    BOOST_CHECK(db.DynamicMemoryUsage() < nPinned);
+    for (size_t i = 0; i < contractIds.size(); ++i) {
+        BOOST_CHECK_EQUAL(db.GetContractInfo(contractIds[i], info, ptip), 1);
+        BOOST_CHECK_EQUAL(info.code, "code");
+        BOOST_CHECK_EQUAL(info.data, std::string(1000, 'a' + i % 26));
+    }
+    BOOST_CHECK(db.DynamicMemoryUsage() < nFull / 4);
+
+    for (const uint256& hash : vHash)
+        mapBlockIndex.erase(hash);
+}
+
+BOOST_FIXTURE_TEST_CASE(contractdb_evicted_prune, TestingSetup)
+{
+    uint32_t nOldSafeHeight = REDEEM_SAFE_HEIGHT;
+    REDEEM_SAFE_HEIGHT = 10;
+    int checkDepth = gArgs.GetArg("-checkblocks", DEFAULT_CHECKBLOCKS) / Params().GetConsensus().nPowTargetSpacing;
+    std::vector<uint256> vHash(2 * checkDepth + REDEEM_SAFE_HEIGHT + 10);
+    std::vector<MCBlockIndex> vIndex(vHash.size());
+    for (size_t i = 0; i < vIndex.size(); ++i) {
+        vHash[i] = GetRandHash();
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = i > 0 ? &vIndex[i - 1] : nullptr;
+        vIndex[i].phashBlock = &mapBlockIndex.insert(std::make_pair(vHash[i], &vIndex[i])).first->first;
+    }
+
+    // 每个合约在高度1和2各有一份数据，确认后大部分被整个换出
+    ContractDataDB db(GetDataDir() / "contract_evicted_prune", 1 << 20, true, true);
+    std::vector<MCContractID> contractIds;
+    for (int i = 0; i < 100; ++i)
+        contractIds.push_back(MCContractID(Hash160(ParseHex(GetRandHash().ToString()))));
+    for (int height = 1; height <= 2; ++height) {
+        for (const MCContractID& contractId : contractIds) {
+            ContractInfo info;
+            info.code = "code";
+            info.data = std::string(100, 'a' + height);
+            db.contractContext.SetData(contractId, info);
+        }
+        BOOST_CHECK(db.WriteBlockContractInfoToDisk(&vIndex[height], &db.contractContext));
+        db.contractContext.ClearAll();
+    }
+    BOOST_CHECK(db.UpdateBlockContractToDisk(&vIndex[checkDepth + 2]));
+    db.SetCacheLimit(0);
+
+    // 清理高度超过2后，换出的合约同样只保留高度2的数据
+    BOOST_CHECK(db.UpdateBlockContractToDisk(&vIndex.back()));
+    db.PruneContractInfo();
+    for (const MCContractID& contractId : contractIds) {
+        DBContractInfo dbInfo;
+        BOOST_REQUIRE(db.GetDb()->Read(contractId, dbInfo));
+        BOOST_REQUIRE_EQUAL(dbInfo.items.size(), 1U);
+        BOOST_CHECK_EQUAL(dbInfo.items.begin()->first, 2);
+        MCHashWriter keyHash(SER_GETHASH, 0);
+        keyHash << contractId << vHash[1];
+        BOOST_CHECK(!db.GetDb()->Exists(keyHash.GetHash()));
+
+        ContractInfo info;
+        BOOST_CHECK_EQUAL(db.GetContractInfo(contractId, info, &vIndex.back()), 1);
+        BOOST_CHECK_EQUAL(info.data, std::string(100, 'a' + 2));
+    }
+
+    REDEEM_SAFE_HEIGHT = nOldSafeHeight;
+    for (const uint256& hash : vHash)
+        mapBlockIndex.erase(hash);
+}
+
+static const char* speculationContractCode =
+    "function init()\n"
+    "    PersistentData = {}\n"
+    "    PersistentData.calls = 0\n"
+    "    PersistentData.callers = {}\n"
+    "end\n"
+    "function work(n)\n"
+    "    PersistentData.calls = PersistentData.calls + n\n"
+    "    PersistentData.callers[msg.sender] = PersistentData.calls\n"
+    "end\n";
+
+// 执行结果按存盘格式序列化后比较
+struct ContractGroupResult
+{
+    std::string data;
+    std::string txFinalData;
+    std::string prevContractData;
+};
+
+static ContractGroupResult RunContractGroup(bool speculation, const MCBlock& blockIn, MCBlockIndex* pPrevIndex,
+    const std::vector<MCContractID>& contractIds, MagnaChainAddress& senderAddr)
+{
+    gArgs.ForceSetArg("-contractspeculation", speculation ? "1" : "0");
+    ContractDataDB* pOldContractDb = mpContractDb;
+    ContractDataDB db(GetDataDir() / strprintf("contract_speculation_%d", speculation), 1 << 20, true, true);
+    mpContractDb = &db;
+
+    SmartLuaState sls;
+    for (const MCContractID& contractId : contractIds) {
+        MagnaChainAddress contractAddr(contractId);
+        std::string code = speculationContractCode;
+        UniValue ret(UniValue::VARR);
+        sls.Initialize(true, pPrevIndex->GetBlockTime(), pPrevIndex->nHeight, -1, senderAddr, nullptr, pPrevIndex, SmartLuaState::SAVE_TYPE_DATA, nullptr);
+        BOOST_REQUIRE(PublishContract(&sls, contractAddr, code, ret, false));
+    }
+    BOOST_REQUIRE(db.WriteBlockContractInfoToDisk(pPrevIndex, &db.contractContext));
+    db.contractContext.ClearAll();
+
+    MCBlock block(blockIn);
+    CoinAmountTemp coinAmountTemp;
+    CoinAmountCache coinAmountCache(&coinAmountTemp);
+    ContractContext contractContext;
+    BOOST_REQUIRE(db.RunBlockContract(&block, &contractContext, &coinAmountCache));
+    mpContractDb = pOldContractDb;
+
+    ContractGroupResult result;
+    MCDataStream ssData(SER_DISK, CLIENT_VERSION);
+    ssData << contractContext.data;
+    result.data = ssData.str();
+    MCDataStream ssFinal(SER_DISK, CLIENT_VERSION);
+    for (const ContractTxFinalData& finalData : contractContext.txFinalData)
+        ssFinal << finalData.coins << finalData.data;
+    result.txFinalData = ssFinal.str();
+    MCDataStream ssPrev(SER_DISK, CLIENT_VERSION);
+    ssPrev << block.prevContractData;
+    result.prevContractData = ssPrev.str();
+    return result;
+}
+
+// 推测执行与串行执行同一个有冲突的区块，结果(包括支链的txFinalData和prevContractData)必须完全一致
+BOOST_FIXTURE_TEST_CASE(contractdb_speculation, TestingSetup)
+{
+    SelectParams(MCBaseChainParams::BRANCH);
+
+    uint256 prevHash = GetRandHash();
+    MCBlockIndex prevIndex;
+    prevIndex.nHeight = 1;
+    prevIndex.nTime = GetTime();
+    prevIndex.phashBlock = &mapBlockIndex.insert(std::make_pair(prevHash, &prevIndex)).first->first;
+
+    MCKey key;
+    key.MakeNewKey(true);
+    MCPubKey pubKey = key.GetPubKey();
+    MagnaChainAddress senderAddr(pubKey.GetID());
+    std::vector<MCContractID> contractIds;
+    for (int i = 0; i < 20; ++i)
+        contractIds.push_back(MCContractID(Hash160(ParseHex(GetRandHash().ToString()))));
+
+    // 第一组各自调用不同的合约；第二组每3笔中有1笔调用热点合约并向其转币，
+    // 第二组不从0开始，检查组内txFinalData的下标
+    MCBlock block;
+    block.hashPrevBlock = prevHash;
+    const int firstGroup = 3, secondGroup = 12;
+    for (int i = 0; i < firstGroup + secondGroup; ++i) {
+        bool hot = (i >= firstGroup && (i - firstGroup) % 3 == 0);
+        MCMutableTransaction tx;
+        tx.nVersion = MCTransaction::CALL_CONTRACT_VERSION;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = MCOutPoint(GetRandHash(), 0);
+        tx.pContractData.reset(new ContractData);
+        tx.pContractData->address = contractIds[hot ? 0 : i + 1];
+        tx.pContractData->sender = pubKey;
+        tx.pContractData->codeOrFunc = "work";
+        tx.pContractData->args = strprintf("[%d]", i + 1);
+        tx.pContractData->amountOut = 0;
+        if (hot)
+            tx.vout.push_back(MCTxOut((i + 1) * COIN, GetScriptForDestination(contractIds[0])));
+        block.vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+    block.groupSize.push_back(firstGroup);
+    block.groupSize.push_back(secondGroup);
+
+    ContractGroupResult serial = RunContractGroup(false, block, &prevIndex, contractIds, senderAddr);
+    ContractGroupResult speculative = RunContractGroup(true, block, &prevIndex, contractIds, senderAddr);
+    BOOST_CHECK(!serial.data.empty());
+    BOOST_CHECK(serial.data == speculative.data);
+    BOOST_CHECK(serial.txFinalData == speculative.txFinalData);
+    BOOST_CHECK(serial.prevContractData == speculative.prevContractData);
+
+    gArgs.ForceSetArg("-contractspeculation", DEFAULT_CONTRACT_SPECULATION ? "1" : "0");
+    mapBlockIndex.erase(prevHash);
+    SelectParams(MCBaseChainParams::MAIN);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,144 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "smartcontract/contractnative.h"
+#include "coding/base58.h"
+#include "key/key.h"
+
+extern "C"
+{
+#include "lua/lstate.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+}
+
+#include "test/test_magnachain.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(contractnative_tests, BasicTestingSetup)
+
+static const char* transferScript =
+    "local native = table.native\n"
+    "function luatransfer(b, from, to, amount)\n"
+    "  local balance = b[from] or 0\n"
+    "  if amount < 0 or balance < amount then error('insufficient balance') end\n"
+    "  b[from] = balance - amount\n"
+    "  b[to] = (b[to] or 0) + amount\n"
+    "  return true\n"
+    "end\n"
+    "function run(name)\n"
+    "  local f = (name == 'native') and native.transfer or luatransfer\n"
+    "  local b = {alice = 1000}\n"
+    "  for i = 1, 20 do f(b, 'alice', 'bob', 7) f(b, 'bob', 'carol', 3) end\n"
+    "  return b.alice * 1000000 + b.bob * 1000 + b.carol\n"
+    "end\n";
+
+static lua_State* NewNativeState()
+{
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+    OpenContractNativeLib(L);
+    BOOST_REQUIRE(luaL_dostring(L, transferScript) == 0);
+    L->limit_on = 1;
+    return L;
+}
+
+// 执行一段代码，返回是否成功，结果留在栈顶
+static bool RunNative(lua_State* L, const std::string& code)
+{
+    lua_settop(L, 0);
+    L->limit_instruction = 1000000;
+    return luaL_loadstring(L, code.c_str()) == 0 && lua_pcall(L, 0, 1, 0) == 0;
+}
+
+static std::string NativeString(lua_State* L, const std::string& code)
+{
+    BOOST_REQUIRE(RunNative(L, code));
+    return lua_isnil(L, -1) ? "nil" : lua_tostring(L, -1);
+}
+
+BOOST_AUTO_TEST_CASE(contractnative_arith)
+{
+    lua_State* L = NewNativeState();
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.add(2, 3)"), "5");
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.sub(2, 3)"), "-1");
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.mul(-4, 3)"), "-12");
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.div(-7, 2)"), "-3");
+    // 参数和结果限制在±2^53内
+    BOOST_CHECK_EQUAL(NativeString(L, "return tostring(table.native.add(9007199254740991, 1) == 9007199254740992)"), "true");
+    BOOST_CHECK(!RunNative(L, "return table.native.add(9007199254740992, 1)"));
+    BOOST_CHECK(!RunNative(L, "return table.native.sub(-9007199254740992, 1)"));
+    BOOST_CHECK(!RunNative(L, "return table.native.mul(134217728, 134217728)"));
+    BOOST_CHECK(!RunNative(L, "return table.native.mul(-134217728, 134217729)"));
+    BOOST_CHECK_EQUAL(NativeString(L, "return tostring(table.native.mul(-67108864, 134217728) == -9007199254740992)"), "true");
+    BOOST_CHECK(!RunNative(L, "return table.native.add(9007199254740994, 0)"));
+    BOOST_CHECK(!RunNative(L, "return table.native.div(1, 0)"));
+    BOOST_CHECK(!RunNative(L, "return table.native.add('1', 2)"));
+    BOOST_CHECK(!RunNative(L, "local b = {a = -9007199254740994} return table.native.balanceof(b, 'a')"));
+
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.toint('-120')"), "-120");
+    BOOST_CHECK_EQUAL(NativeString(L, "return tostring(table.native.toint('9007199254740992') == 9007199254740992)"), "true");
+    BOOST_CHECK_EQUAL(NativeString(L, "return tostring(table.native.toint('-9007199254740992') == -9007199254740992)"), "true");
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.toint('9007199254740993')"), "nil");
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.toint('9223372036854775808')"), "nil");
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.toint(9007199254740994)"), "nil");
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.toint('0x10')"), "nil");
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.toint('-')"), "nil");
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.toint({})"), "nil");
+    lua_close(L);
+}
+
+BOOST_AUTO_TEST_CASE(contractnative_balance)
+{
+    lua_State* L = NewNativeState();
+    BOOST_CHECK_EQUAL(NativeString(L, "local b = {} table.native.credit(b, 'a', 5) return table.native.balanceof(b, 'a') + table.native.balanceof(b, 'x')"), "5");
+    BOOST_CHECK(!RunNative(L, "local b = {a = 5} return table.native.debit(b, 'a', 6)"));
+    BOOST_CHECK(!RunNative(L, "local b = {a = 5} return table.native.credit(b, 'a', -1)"));
+    BOOST_CHECK(!RunNative(L, "local b = {a = 'x'} return table.native.balanceof(b, 'a')"));
+
+    // 与lua实现结果一致且消耗更少的指令
+    BOOST_REQUIRE(RunNative(L, "return run('lua')"));
+    long luaGas = 1000000 - L->limit_instruction;
+    int64_t luaResult = lua_tonumber(L, -1);
+    BOOST_REQUIRE(RunNative(L, "return run('native')"));
+    long nativeGas = 1000000 - L->limit_instruction;
+    BOOST_CHECK_EQUAL(luaResult, (int64_t)lua_tonumber(L, -1));
+    BOOST_CHECK_EQUAL(luaResult, 860080060LL);
+    BOOST_CHECK(nativeGas < luaGas);
+    BOOST_TEST_MESSAGE(strprintf("transfer gas: lua %d native %d", luaGas, nativeGas));
+
+    // 合约不能修改或替换原生库
+    BOOST_CHECK(!RunNative(L, "table.native.add = nil"));
+    BOOST_CHECK(!RunNative(L, "setmetatable(table.native, {})"));
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.add(1, 1)"), "2");
+
+    // 激活高度之前合约看不到原生库
+    SetContractNativeLib(L, false);
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native"), "nil");
+    SetContractNativeLib(L, true);
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.add(1, 1)"), "2");
+    lua_close(L);
+}
+
+BOOST_AUTO_TEST_CASE(contractnative_address)
+{
+    lua_State* L = NewNativeState();
+    MCKey key;
+    key.MakeNewKey(true);
+    std::string keyAddr = MagnaChainAddress(key.GetPubKey().GetID()).ToString();
+    MCContractID contractId;
+    *contractId.begin() = 1;
+    std::string contractAddr = MagnaChainAddress(contractId).ToString();
+
+    BOOST_CHECK_EQUAL(NativeString(L, "return tostring(table.native.isaddress('" + keyAddr + "'))"), "true");
+    BOOST_CHECK_EQUAL(NativeString(L, "return tostring(table.native.isaddress('" + contractAddr + "'))"), "false");
+    BOOST_CHECK_EQUAL(NativeString(L, "return tostring(table.native.iscontract('" + contractAddr + "'))"), "true");
+    BOOST_CHECK_EQUAL(NativeString(L, "return tostring(table.native.isaddress('abc'))"), "false");
+    BOOST_CHECK_EQUAL(NativeString(L, "return tostring(table.native.isaddress(1))"), "false");
+    BOOST_CHECK_EQUAL(NativeString(L, "return table.native.hash160('')"), "b472a266d0bd89c13706a4132ccfb16f7c3b9fcb");
+    lua_close(L);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
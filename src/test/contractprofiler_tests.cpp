@@ -0,0 +1,142 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "smartcontract/contractprofiler.h"
+
+extern "C"
+{
+#include "lua/lstate.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+}
+
+#include "test/test_magnachain.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(contractprofiler_tests, BasicTestingSetup)
+
+static const char* profileScript =
+    "function inner(n)\n"
+    "  local t = {}\n"
+    "  for i = 1, n do t[i] = {i} end\n"
+    "  return #t\n"
+    "end\n"
+    "function outer()\n"
+    "  local sum = 0\n"
+    "  for i = 1, 200 do sum = sum + inner(i % 17) end\n"
+    "  return sum\n"
+    "end\n";
+
+static int profileSamples = 0;
+
+static void CountingProfileHook(lua_State* L)
+{
+    lua_Debug ar;
+    if (lua_getstack(L, 0, &ar) != 0 && lua_getinfo(L, "nS", &ar) != 0)
+        profileSamples++;
+}
+
+// 采样不能改变gas消耗和内存占用
+BOOST_AUTO_TEST_CASE(contractprofiler_same_gas)
+{
+    long gas[2];
+    lu_mem totalBytes[2];
+    for (int hook = 0; hook < 2; ++hook) {
+        lua_State* L = luaL_newstate();
+        luaL_openlibs(L);
+        BOOST_REQUIRE(luaL_dostring(L, profileScript) == 0);
+        lua_gc(L, LUA_GCSTOP, 0);
+        if (hook) {
+            L->profile_hook = CountingProfileHook;
+            L->profile_interval = L->profile_countdown = 50;
+        }
+        L->limit_on = 1;
+        L->limit_instruction = 10000000;
+        lua_getglobal(L, "outer");
+        BOOST_REQUIRE(lua_pcall(L, 0, 1, 0) == 0);
+        gas[hook] = L->limit_instruction;
+        totalBytes[hook] = G(L)->totalbytes;
+        BOOST_CHECK(G(L)->allocbytes >= G(L)->totalbytes);
+        lua_close(L);
+    }
+    BOOST_CHECK_EQUAL(gas[0], gas[1]);
+    BOOST_CHECK_EQUAL(totalBytes[0], totalBytes[1]);
+    BOOST_CHECK(profileSamples > 0);
+}
+
+BOOST_AUTO_TEST_CASE(contractprofiler_record)
+{
+    ContractProfiler profiler;
+    BOOST_CHECK(!profiler.IsEnabled());
+    profiler.SetInterval(1);
+    BOOST_CHECK_EQUAL(profiler.GetInterval(), MIN_CONTRACT_PROFILE_INTERVAL);
+
+    MCContractID contractId;
+    *contractId.begin() = 1;
+    ContractProfileBuffer buffer;
+    buffer.RecordCall(contractId, "f", true, 100, 10, 64, 8);
+    buffer.RecordCall(contractId, "f", false, 50, 5, 32, 0);
+    buffer.RecordSample(contractId, "f", 1);
+    buffer.RecordSample(contractId, "f", 1);
+    profiler.Merge(buffer);
+
+    std::map<MCContractID, ContractProfile> profiles = profiler.GetProfiles();
+    BOOST_REQUIRE_EQUAL(profiles.size(), 1U);
+    const ContractFunctionProfile& profile = profiles[contractId].functions["f"];
+    BOOST_CHECK_EQUAL(profile.calls, 2U);
+    BOOST_CHECK_EQUAL(profile.failures, 1U);
+    BOOST_CHECK_EQUAL(profile.instructions, 150);
+    BOOST_CHECK_EQUAL(profile.allocBytes, 96);
+    BOOST_CHECK_EQUAL(profiles[contractId].samples["f:1"], 2U);
+
+    // 缓冲中的记录合并一次，采样位置合并时才格式化
+    buffer.RecordCall(contractId, "f", true, 10, 1, 0, 0);
+    buffer.RecordSample(contractId, "f", 1);
+    buffer.RecordSample(contractId, "f", 1);
+    buffer.RecordSample(contractId, "g", 7);
+    BOOST_CHECK_EQUAL(buffer.samples.size(), 2U);
+    profiler.Merge(buffer);
+    BOOST_CHECK(buffer.IsEmpty());
+    profiles = profiler.GetProfiles();
+    BOOST_CHECK_EQUAL(profiles[contractId].functions["f"].calls, 3U);
+    BOOST_CHECK_EQUAL(profiles[contractId].functions["f"].instructions, 160);
+    BOOST_CHECK_EQUAL(profiles[contractId].samples["f:1"], 4U);
+    BOOST_CHECK_EQUAL(profiles[contractId].samples["g:7"], 1U);
+
+    profiler.Reset();
+    BOOST_CHECK(profiler.GetProfiles().empty());
+}
+
+// 每个合约的函数数和采样位置数有上限，超出的计入"(other)"
+BOOST_AUTO_TEST_CASE(contractprofiler_max_keys)
+{
+    ContractProfiler profiler;
+    MCContractID contractId;
+    *contractId.begin() = 1;
+    ContractProfileBuffer buffer;
+    const size_t nExtra = 10;
+    for (size_t i = 0; i < MAX_CONTRACT_PROFILE_KEYS + nExtra; i++) {
+        buffer.RecordCall(contractId, strprintf("f%d", i), true, 1, 0, 0, 0);
+        buffer.RecordSample(contractId, "f", i);
+    }
+    profiler.Merge(buffer);
+
+    std::map<MCContractID, ContractProfile> profiles = profiler.GetProfiles();
+    BOOST_CHECK_EQUAL(profiles[contractId].functions.size(), MAX_CONTRACT_PROFILE_KEYS + 1);
+    BOOST_CHECK_EQUAL(profiles[contractId].functions["(other)"].calls, nExtra);
+    BOOST_CHECK_EQUAL(profiles[contractId].samples.size(), MAX_CONTRACT_PROFILE_KEYS + 1);
+    BOOST_CHECK_EQUAL(profiles[contractId].samples["(other)"], nExtra);
+
+    // 已有的条目继续累计
+    buffer.RecordCall(contractId, "f0", true, 1, 0, 0, 0);
+    buffer.RecordCall(contractId, "g", true, 1, 0, 0, 0);
+    profiler.Merge(buffer);
+    profiles = profiler.GetProfiles();
+    BOOST_CHECK_EQUAL(profiles[contractId].functions["f0"].calls, 2U);
+    BOOST_CHECK_EQUAL(profiles[contractId].functions["(other)"].calls, nExtra + 1);
+    BOOST_CHECK_EQUAL(profiles[contractId].functions.size(), MAX_CONTRACT_PROFILE_KEYS + 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,153 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "smartcontract/contractstorage.h"
+
+extern "C"
+{
+#include "lua/lstate.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+}
+
+#include "test/test_magnachain.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(contractstorage_tests, BasicTestingSetup)
+
+// 随机生成存盘数据，再随机读写后重新打包
+static const char* storageScript =
+    "function gen(_, seed)\n"
+    "  math.randomseed(seed)\n"
+    "  local t = {}\n"
+    "  for i = 1, math.random(0, 40) do\n"
+    "    local k = string.format('k%d', math.random(1, 50))\n"
+    "    local r = math.random(1, 6)\n"
+    "    if r == 1 then t[k] = math.random(1, 100000)\n"
+    "    elseif r == 2 then t[k] = string.format('s%d', math.random(1, 100000))\n"
+    "    elseif r == 3 then t[k] = {a = math.random(1, 5), b = {'x', 'y', math.random()}, c = {p = 1, r = {s = 3}}}\n"
+    "    elseif r == 4 then t[k] = true\n"
+    "    elseif r == 5 then local m = {} for j = 1, math.random(1, 10) do m[string.format('m%d', math.random(1, 20))] = j end t[k] = m\n"
+    "    else t[k] = nil end\n"
+    "  end\n"
+    "  for i = 1, math.random(0, 10) do t[string.format('k%d', math.random(1, 50))] = nil end\n"
+    "  return cmsgpack.pack(t)\n"
+    "end\n"
+    "function run(blob, seed)\n"
+    "  local d = cmsgpack.unpack(blob)\n"
+    "  math.randomseed(seed)\n"
+    "  local out = 0\n"
+    "  for i = 1, math.random(1, 40) do\n"
+    "    local r = math.random(1, 10)\n"
+    "    local k = string.format('k%d', math.random(1, 60))\n"
+    "    if r <= 3 then if d[k] ~= nil then out = out + 1 end\n"
+    "    elseif r <= 5 then d[k] = math.random(1, 100)\n"
+    "    elseif r == 6 then d[k] = nil\n"
+    "    elseif r == 7 then local v = d[k] if type(v) == 'table' then v.a = (v.a or 0) + 1 end\n"
+    "    elseif r == 8 then if math.random(1, 10) == 1 then for kk, vv in pairs(d) do out = out + 1 end end\n"
+    "    elseif r == 9 then if math.random(1, 20) == 1 then d[math.random(1, 3)] = 'n' end\n"
+    "    else d[k] = {x = math.random(1, 3)} end\n"
+    "  end\n"
+    "  return cmsgpack.pack(d), out\n"
+    "end\n";
+
+static lua_State* NewStorageState(bool lazy)
+{
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+    luaopen_cmsgpack(L);
+    if (lazy)
+        OpenContractStorage(L);
+    BOOST_REQUIRE(luaL_dostring(L, storageScript) == 0);
+    L->limit_on = 1;
+    return L;
+}
+
+static std::string CallStorage(lua_State* L, const char* func, const std::string& arg, int seed, long& gas)
+{
+    L->limit_instruction = 100000000;
+    lua_settop(L, 0);
+    lua_getglobal(L, func);
+    lua_pushlstring(L, arg.data(), arg.size());
+    lua_pushnumber(L, seed);
+    BOOST_REQUIRE(lua_pcall(L, 2, 2, 0) == 0);
+    size_t len;
+    const char* data = lua_tolstring(L, 1, &len);
+    std::string ret(data, len);
+    if (lua_isnumber(L, 2))
+        ret += strprintf("|%d", (int)lua_tointeger(L, 2));
+    gas = L->limit_instruction;
+    lua_settop(L, 0);
+    return ret;
+}
+
+BOOST_AUTO_TEST_CASE(contractstorage_scan)
+{
+    std::vector<ContractDataField> fields;
+    // {"a"=1, "bc"={1}}
+    const char data[] = "\x82\xa1" "a" "\x01\xa2" "bc" "\x91\x01";
+    BOOST_CHECK(ScanContractData(data, sizeof(data) - 1, fields));
+    BOOST_REQUIRE_EQUAL(fields.size(), 2U);
+    BOOST_CHECK_EQUAL(std::string(data + fields[0].keyOffset, fields[0].keyLen), "a");
+    BOOST_CHECK_EQUAL(fields[0].valueLen, 1U);
+    BOOST_CHECK_EQUAL(std::string(data + fields[1].keyOffset, fields[1].keyLen), "bc");
+    BOOST_CHECK_EQUAL(fields[1].valueOffset + fields[1].valueLen, sizeof(data) - 1);
+
+    // 截断、多余数据、非字符串键、非map及空map都交给原来的解码流程
+    BOOST_CHECK(!ScanContractData(data, sizeof(data) - 2, fields));
+    const char trailing[] = "\x81\xa1" "a" "\x01\x01";
+    BOOST_CHECK(!ScanContractData(trailing, sizeof(trailing) - 1, fields));
+    const char intKey[] = "\x81\x01\x01";
+    BOOST_CHECK(!ScanContractData(intKey, sizeof(intKey) - 1, fields));
+    const char array[] = "\x91\x01";
+    BOOST_CHECK(!ScanContractData(array, sizeof(array) - 1, fields));
+    const char empty[] = "\x80";
+    BOOST_CHECK(!ScanContractData(empty, sizeof(empty) - 1, fields));
+    // 嵌套map的键不能为nil
+    const char nilKey[] = "\x81\xa1" "a" "\x81\xc0\x01";
+    BOOST_CHECK(!ScanContractData(nilKey, sizeof(nilKey) - 1, fields));
+}
+
+BOOST_AUTO_TEST_CASE(contractstorage_same_as_eager)
+{
+    lua_State* eager = NewStorageState(false);
+    lua_State* lazy = NewStorageState(true);
+
+    for (int seed = 1; seed <= 500; ++seed) {
+        long eagerGas, lazyGas;
+        std::string blob = CallStorage(eager, "gen", std::string(), seed, eagerGas);
+        std::string eagerResult = CallStorage(eager, "run", blob, seed, eagerGas);
+        std::string lazyResult = CallStorage(lazy, "run", blob, seed, lazyGas);
+        BOOST_CHECK(eagerResult == lazyResult);
+        BOOST_CHECK_EQUAL(eagerGas, lazyGas);
+        ResetContractStorage(lazy);
+    }
+
+    lua_close(eager);
+    lua_close(lazy);
+}
+
+// 包装后的库函数出错时仍报告原函数名，pairs/ipairs的upvalue保持不变
+BOOST_AUTO_TEST_CASE(contractstorage_wrapped_functions)
+{
+    lua_State* L = NewStorageState(true);
+    L->limit_instruction = 1000000;
+    BOOST_CHECK(luaL_dostring(L, "table.insert(nil, 1)") != 0);
+    BOOST_CHECK(std::string(lua_tostring(L, -1)).find("bad argument #1 to 'insert'") != std::string::npos);
+    BOOST_CHECK(luaL_dostring(L, "pairs(nil)") != 0);
+    BOOST_CHECK(std::string(lua_tostring(L, -1)).find("bad argument #1 to 'pairs'") != std::string::npos);
+    BOOST_CHECK(luaL_dostring(L, "local n = 0 for k, v in pairs({a = 1, b = 2}) do n = n + v end for i, v in ipairs({3, 4}) do n = n + v end assert(n == 10)") == 0);
+
+    // 未激活时按原流程完整解码
+    const char* check = "local d = cmsgpack.unpack(cmsgpack.pack({a = 1})) assert(d.a == 1) return getmetatable(d) ~= nil";
+    BOOST_REQUIRE(luaL_dostring(L, check) == 0);
+    BOOST_CHECK(lua_toboolean(L, -1));
+    SetContractStorageLazy(L, false);
+    BOOST_REQUIRE(luaL_dostring(L, check) == 0);
+    BOOST_CHECK(!lua_toboolean(L, -1));
+    lua_close(L);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
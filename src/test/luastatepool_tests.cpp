@@ -0,0 +1,110 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain/chainparams.h"
+#include "smartcontract/smartcontract.h"
+
+#include "test/test_magnachain.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(luastatepool_tests, BasicTestingSetup)
+
+// 通过沙盒中的callContract执行合约函数，返回是否成功，返回值从栈上第3个开始
+static bool CallSandbox(lua_State* L, const std::string& code, const std::string& funcname)
+{
+    lua_settop(L, 0);
+    L->limit_instruction = 1000000;
+    lua_getglobal(L, "callContract");
+    lua_pushnumber(L, MAX_DATA_LEN);
+    lua_pushstring(L, code.c_str());
+    lua_pushnil(L);
+    lua_pushstring(L, funcname.c_str());
+    BOOST_REQUIRE(lua_pcall(L, 4, LUA_MULTRET, 0) == 0);
+    return lua_toboolean(L, 1) != 0;
+}
+
+BOOST_AUTO_TEST_CASE(luastatepool_setfenv)
+{
+    LuaStatePool pool;
+    lua_State* L = pool.Acquire();
+    BOOST_REQUIRE(L != nullptr);
+
+    // 激活前与原来一样可以修改线程全局表
+    SetContractSandboxSetfenv(L, false);
+    BOOST_CHECK(CallSandbox(L, "function f() setfenv(0, {}) end", "f"));
+    BOOST_CHECK(!CallSandbox(L, "function f() setfenv(next, {}) end", "f"));
+    pool.Release(L);
+    BOOST_CHECK(pool.Acquire() == L);
+
+    // 激活后只能修改合约自身函数的环境
+    SetContractSandboxSetfenv(L, true);
+    BOOST_CHECK(!CallSandbox(L, "function f() setfenv(0, {}) end", "f"));
+    BOOST_CHECK(!CallSandbox(L, "function f() setfenv(2, {}) end", "f"));
+    BOOST_CHECK(!CallSandbox(L, "function f() setfenv(next, {}) end", "f"));
+    BOOST_CHECK(CallSandbox(L, "function f() local g = function() return x end setfenv(g, {x = 7}) return g() end", "f"));
+    BOOST_CHECK_EQUAL(lua_tonumber(L, 3), 7);
+    BOOST_CHECK(CallSandbox(L, "function f() setfenv(1, {}) end", "f"));
+
+    // 绕过沙盒直接破坏线程全局表和table库，归还后再取出应与新建的状态一致
+    L->limit_instruction = 1000000;
+    BOOST_REQUIRE(luaL_dostring(L, "table.insert = nil setmetatable(_G, {__index = error}) setfenv(0, {})") == 0);
+    pool.Release(L);
+    BOOST_CHECK(pool.Acquire() == L);
+
+    lua_getglobal(L, "table");
+    BOOST_CHECK(lua_istable(L, -1));
+    SetContractSandboxSetfenv(L, true);
+    BOOST_CHECK(CallSandbox(L, "function f() local t = {} table.insert(t, 5) return t[1] end", "f"));
+    BOOST_CHECK_EQUAL(lua_tonumber(L, 3), 5);
+    pool.Release(L);
+}
+
+// 按调用所在高度选择setfenv，主网尚未激活，regtest从0激活
+static bool SetfenvLevel0(const std::string& chainName, int height)
+{
+    SelectParams(chainName);
+    SmartLuaState sls;
+    sls.blockHeight = height;
+    MagnaChainAddress contractAddr;
+    contractAddr.Set(MCContractID());
+    lua_State* L = sls.GetLuaState(contractAddr);
+    BOOST_REQUIRE(L != nullptr);
+    bool success = CallSandbox(L, "function f() setfenv(0, {}) end", "f");
+    sls.ReleaseLuaState(L);
+    return success;
+}
+
+BOOST_AUTO_TEST_CASE(luastatepool_setfenv_height)
+{
+    BOOST_CHECK(SetfenvLevel0(MCBaseChainParams::MAIN, 100));
+    BOOST_CHECK(!SetfenvLevel0(MCBaseChainParams::REGTEST, 0));
+    BOOST_CHECK(!SetfenvLevel0(MCBaseChainParams::REGTEST, 100));
+    SelectParams(MCBaseChainParams::MAIN);
+}
+
+BOOST_AUTO_TEST_CASE(luastatepool_memory)
+{
+    LuaStatePool pool;
+    lua_State* L = pool.Acquire();
+    BOOST_REQUIRE(L != nullptr);
+    global_State* g = G(L);
+    LuaStateBaseline baseline;
+    BOOST_REQUIRE(LuaStatePool::GetFreshBaseline(baseline));
+    BOOST_CHECK(baseline.bytes > 0);
+
+    // 池自身的快照和沙盒库不计入，新建的状态与未池化前计数相同
+    BOOST_CHECK_EQUAL((l_mem)g->totalbytes - g->memoffset, baseline.bytes);
+    BOOST_CHECK_EQUAL((l_mem)g->GCthreshold - g->memoffset, baseline.threshold);
+
+    // 大量字符串使字符串表扩容，完整gc后仍有残留
+    BOOST_CHECK(CallSandbox(L, "function f() local t = {} for i = 1, 5000 do t[i] = tostring(i + 0.5) end return #t end", "f"));
+    pool.Release(L);
+    BOOST_CHECK(pool.Acquire() == L);
+    BOOST_CHECK_EQUAL((l_mem)g->totalbytes - g->memoffset, baseline.bytes);
+    BOOST_CHECK_EQUAL((l_mem)g->GCthreshold - g->memoffset, baseline.threshold);
+    pool.Release(L);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,64 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "misc/memorygovernor.h"
+
+#include "test/test_magnachain.h"
+
+#include <boost/test/unit_test.hpp>
+
+static const MemoryComponentInfo* FindComponent(const std::vector<MemoryComponentInfo>& infos, const std::string& strName)
+{
+    for (const MemoryComponentInfo& info : infos) {
+        if (info.strName == strName)
+            return &info;
+    }
+    return nullptr;
+}
+
+BOOST_FIXTURE_TEST_SUITE(memorygovernor_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(memorygovernor_limits)
+{
+    MemoryGovernor governor;
+    governor.SetBudget(1000);
+
+    size_t nCache = 500;
+    size_t nFixed = 100;
+    size_t nOutside = 5000;
+    governor.Register("cache", 400, [&] { return nCache; }, [&](size_t nTarget) { nCache = nTarget; });
+    governor.Register("fixed", 200, [&] { return nFixed; });
+    governor.Register("outside", 100, [&] { return nOutside; }, MemoryGovernor::EvictFunc(), false);
+
+    // 超过自身上限的组件换出到上限，预算外的组件不计入总量
+    governor.Check();
+    BOOST_CHECK_EQUAL(nCache, 400);
+    BOOST_CHECK_EQUAL(nOutside, 5000);
+
+    std::vector<MemoryComponentInfo> infos = governor.GetComponents();
+    BOOST_REQUIRE_EQUAL(infos.size(), 3);
+    const MemoryComponentInfo* cache = FindComponent(infos, "cache");
+    BOOST_REQUIRE(cache != nullptr);
+    BOOST_CHECK(cache->fEvictable);
+    BOOST_CHECK_EQUAL(cache->nUsage, 400);
+    BOOST_CHECK_EQUAL(cache->nEvictions, 1);
+    const MemoryComponentInfo* fixed = FindComponent(infos, "fixed");
+    BOOST_REQUIRE(fixed != nullptr);
+    BOOST_CHECK(!fixed->fEvictable);
+    BOOST_CHECK(!FindComponent(infos, "outside")->fInBudget);
+
+    // 总量超出预算时可换出的组件缩到上限的一半
+    nFixed = 700;
+    governor.Check();
+    BOOST_CHECK_EQUAL(nCache, 200);
+    BOOST_CHECK_EQUAL(FindComponent(governor.GetComponents(), "cache")->nEvictions, 2);
+
+    // 同名组件被替换，清空后不再调用
+    governor.Register("fixed", 200, [] { return (size_t)0; });
+    BOOST_CHECK_EQUAL(governor.GetComponents().size(), 3);
+    governor.Clear();
+    BOOST_CHECK(governor.GetComponents().empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
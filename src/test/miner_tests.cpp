@@ -11,6 +11,7 @@
 #include "consensus/validation.h"
 #include "validation/validation.h"
 #include "mining/miner.h"
+#include "mining/stakesearch.h"
 #include "policy/policy.h"
 #include "key/pubkey.h"
 #include "script/standard.h"
@@ -23,6 +24,8 @@
 #include "test/test_magnachain.h"
 
 #include <memory>
+#include <set>
+#include <thread>
 
 #include <boost/test/unit_test.hpp>
 
@@ -541,4 +544,166 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity_need_rewrite)
     fCheckpointsEnabled = true;
 }
 
+
+BOOST_AUTO_TEST_CASE(stake_prescreen_matches_block_work)
+{
+    extern uint32_t GetBlockWork(const MCBlock& block, const MCOutPoint& out, uint256& block_hash);
+    LOCK(cs_main);
+    const Consensus::Params& consensus = Params().GetConsensus();
+
+    // 过了BigBoomHeight工作量才与币龄有关，在链顶后接一条只有索引的链
+    std::vector<uint256> vHash(consensus.BigBoomHeight + 100);
+    std::vector<MCBlockIndex> vIndex(vHash.size());
+    MCBlockIndex* pindexPrev = chainActive.Tip();
+    for (size_t i = 0; i < vIndex.size(); ++i) {
+        vHash[i] = InsecureRand256();
+        vIndex[i].pprev = pindexPrev;
+        vIndex[i].nHeight = pindexPrev->nHeight + 1;
+        vIndex[i].nTime = pindexPrev->nTime + consensus.nPowTargetSpacing;
+        vIndex[i].nBits = pindexPrev->nBits;
+        vIndex[i].phashBlock = &mapBlockIndex.insert(std::make_pair(vHash[i], &vIndex[i])).first->first;
+        vIndex[i].BuildSkip();
+        pindexPrev = &vIndex[i];
+    }
+
+    // 大部分输出是真实的币，其余不在UTXO中
+    std::vector<MCOutPoint> vCoins;
+    int nMeets = 0;
+    int nMisses = 0;
+    for (int i = 0; i < 40; ++i) {
+        MCKey key;
+        key.MakeNewKey(true);
+        MCScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+        MCOutPoint outpoint(InsecureRand256(), i);
+        if (i % 4 != 0) {
+            pcoinsTip->AddCoin(outpoint, Coin(MCTxOut(1000 * COIN, scriptPubKey), 1, false), false);
+            vCoins.push_back(outpoint);
+        }
+
+        // 与CreateNewBlock一样设置nNonce和nBits，区块中的其他交易不影响结果
+        MCBlock block;
+        block.hashPrevBlock = pindexPrev->GetBlockHash();
+        block.prevoutStake = outpoint;
+        UpdateTime(&block, consensus, pindexPrev);
+        MCMutableTransaction coinbaseTx;
+        coinbaseTx.vin.resize(1);
+        coinbaseTx.vin[0].prevout.SetNull();
+        coinbaseTx.vout.resize(2);
+        coinbaseTx.vout[0].scriptPubKey = scriptPubKey;
+        coinbaseTx.vout[0].nValue = 50 * COIN;
+        coinbaseTx.vout[1].scriptPubKey = MCScript() << OP_RETURN;
+        block.vtx.push_back(MakeTransactionRef(std::move(coinbaseTx)));
+        MCMutableTransaction stakeTx;
+        stakeTx.vin.resize(1);
+        stakeTx.vin[0].prevout = outpoint;
+        stakeTx.vout.resize(1);
+        stakeTx.vout[0].scriptPubKey = scriptPubKey;
+        block.vtx.push_back(MakeTransactionRef(std::move(stakeTx)));
+
+        block.nBits = GetNextWorkRequired(pindexPrev, &block, consensus);
+        uint256 hash;
+        block.nNonce = GetBlockWork(block, outpoint, hash);
+        arith_uint256 bnTarget;
+        bnTarget.SetCompact(block.nBits);
+        if (UintToArith256(hash) < bnTarget)
+            block.nBits = UintToArith256(hash).GetCompact();
+
+        MCValidationState state;
+        bool fMeets = StakeMeetsTarget(pindexPrev, scriptPubKey, outpoint, *pcoinsTip, consensus);
+        BOOST_CHECK_EQUAL(fMeets, CheckBlockWork(block, state, consensus));
+        if (fMeets) {
+            BOOST_CHECK(block.nNonce > 0);
+            nMeets++;
+        }
+        else
+            nMisses++;
+    }
+    // 两种结果都要覆盖到，没有币龄的输出达不到目标
+    BOOST_CHECK(nMeets > 0);
+    BOOST_CHECK(nMisses >= 10);
+
+    for (const MCOutPoint& outpoint : vCoins)
+        pcoinsTip->SpendCoin(outpoint);
+    for (const uint256& hash : vHash)
+        mapBlockIndex.erase(hash);
+}
+
+struct StakeSearchTestingSetup : public TestChain100Setup
+{
+    StakeSearchTestingSetup()
+    {
+        CreateAndProcessBlock({}, GetScriptForRawPubKey(coinbaseKey.GetPubKey()));
+        ::bitdb.MakeMock();
+        wallet.reset(new MCWallet(std::unique_ptr<MCWalletDBWrapper>(new MCWalletDBWrapper(&bitdb, "wallet_test.dat"))));
+        bool firstRun;
+        wallet->LoadWallet(firstRun);
+        {
+            LOCK(wallet->cs_wallet);
+            wallet->AddKeyPubKey(coinbaseKey, coinbaseKey.GetPubKey());
+        }
+        wallet->ScanForWalletTransactions(chainActive.Genesis());
+        RegisterValidationInterface(&search);
+    }
+
+    ~StakeSearchTestingSetup()
+    {
+        UnregisterValidationInterface(&search);
+        wallet.reset();
+        ::bitdb.Flush(true);
+        ::bitdb.Reset();
+    }
+
+    std::unique_ptr<MCWallet> wallet;
+    StakeSearch search;
+};
+
+BOOST_FIXTURE_TEST_CASE(stake_search_snapshot, StakeSearchTestingSetup)
+{
+    std::shared_ptr<StakeSnapshot> snapshot = search.GetSnapshot(wallet.get());
+    BOOST_CHECK(snapshot->pindexPrev == chainActive.Tip());
+    BOOST_REQUIRE(snapshot->vCandidates.size() > 2 * STAKE_CANDIDATE_CHUNK);
+    // 同一tip上未评估完的快照被所有线程共用
+    BOOST_CHECK(search.GetSnapshot(wallet.get()) == snapshot);
+
+    // 不预先检查工作量时每个候选都会被找到，两个搜索线程找到的输出互不重复
+    snapshot->fPrescreen = false;
+    std::vector<MCOutPoint> vFound[2];
+    auto searcher = [&](std::vector<MCOutPoint>& vOutpoints) {
+        size_t nPos = 0;
+        size_t nEnd = 0;
+        const StakeCandidate* pFound = nullptr;
+        while (search.FindStake(*snapshot, nPos, nEnd, pFound))
+            vOutpoints.push_back(pFound->outpoint);
+    };
+    std::thread thread0(searcher, std::ref(vFound[0]));
+    std::thread thread1(searcher, std::ref(vFound[1]));
+    thread0.join();
+    thread1.join();
+    std::set<MCOutPoint> setFound(vFound[0].begin(), vFound[0].end());
+    BOOST_CHECK_EQUAL(setFound.size(), vFound[0].size());
+    for (const MCOutPoint& outpoint : vFound[1])
+        BOOST_CHECK(setFound.insert(outpoint).second);
+    BOOST_CHECK_EQUAL(setFound.size(), snapshot->vCandidates.size());
+    BOOST_CHECK_EQUAL((uint64_t)snapshot->nEvaluated, snapshot->vCandidates.size());
+
+    // 新tip使旧快照失效，未评估的候选也不再返回，之后取得的是新tip的快照
+    BOOST_CHECK(!search.IsStale(*snapshot));
+    int nHeight = chainActive.Height();
+    SetMockTime(GetTime() + Params().GetConsensus().nPowTargetSpacing + 10000);
+    CreateAndProcessBlock({}, GetScriptForRawPubKey(coinbaseKey.GetPubKey()));
+    BOOST_REQUIRE_EQUAL(chainActive.Height(), nHeight + 1);
+    BOOST_CHECK(search.IsStale(*snapshot));
+    snapshot->nNext = 0;
+    size_t nPos = 0;
+    size_t nEnd = 0;
+    const StakeCandidate* pFound = nullptr;
+    BOOST_CHECK(!search.FindStake(*snapshot, nPos, nEnd, pFound));
+
+    std::shared_ptr<StakeSnapshot> current = search.GetSnapshot(wallet.get());
+    BOOST_CHECK(current != snapshot);
+    BOOST_CHECK(current->pindexPrev == chainActive.Tip());
+    BOOST_CHECK(!search.IsStale(*current));
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
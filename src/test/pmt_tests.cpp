@@ -107,6 +107,35 @@ BOOST_AUTO_TEST_CASE(pmt_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(pmt_levels)
+{
+    SeedInsecureRand(false);
+    static const unsigned int nTxCounts[] = {1, 2, 3, 7, 17, 100, 513};
+
+    for (unsigned int nTx : nTxCounts) {
+        std::vector<uint256> vTxid(nTx);
+        for (unsigned int j = 0; j < nTx; j++)
+            vTxid[j] = InsecureRand256();
+        std::vector<std::vector<uint256>> vLevels;
+        MCPartialMerkleTree::BuildLevels(vTxid, vLevels);
+        BOOST_CHECK(vLevels.back().size() == 1);
+
+        // 由各层哈希构建的树与直接由交易构建的完全相同
+        for (int att = 0; att < 8; att++) {
+            std::vector<bool> vMatch(nTx, false);
+            vMatch[InsecureRandRange(nTx)] = true;
+            if (att & 1)
+                vMatch[InsecureRandRange(nTx)] = true;
+
+            MCDataStream ss1(SER_NETWORK, PROTOCOL_VERSION);
+            ss1 << MCPartialMerkleTree(vTxid, vMatch);
+            MCDataStream ss2(SER_NETWORK, PROTOCOL_VERSION);
+            ss2 << MCPartialMerkleTree(vLevels, vMatch);
+            BOOST_CHECK(ss1.str() == ss2.str());
+        }
+    }
+}
+
 BOOST_AUTO_TEST_CASE(pmt_malleability)
 {
     std::vector<uint256> vTxid = {
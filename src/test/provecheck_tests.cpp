@@ -0,0 +1,89 @@
+// Copyright (c) 2016-2019 The MagnaChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain/branchchain.h"
+#include "key/key.h"
+#include "key/keystore.h"
+#include "misc/random.h"
+#include "script/interpreter.h"
+#include "script/sign.h"
+#include "script/standard.h"
+
+#include "test/test_magnachain.h"
+
+#include <boost/test/unit_test.hpp>
+
+static const unsigned int PROVE_CHECK_FLAGS = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY | SCRIPT_VERIFY_CHECKSEQUENCEVERIFY | SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_NULLDUMMY;
+
+BOOST_FIXTURE_TEST_SUITE(provecheck_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(provecheck_input)
+{
+    MCBasicKeyStore keystore;
+    MCKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+
+    MCMutableTransaction prevTx;
+    prevTx.vin.resize(1);
+    prevTx.vin[0].prevout = MCOutPoint(GetRandHash(), 0);
+    prevTx.vout.resize(1);
+    prevTx.vout[0].nValue = 10 * COIN;
+    prevTx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    MCTransaction prev(prevTx);
+
+    // 前一交易所在的支链区块
+    std::vector<uint256> vTxid(7);
+    for (uint256& txid : vTxid)
+        txid = GetRandHash();
+    vTxid[3] = prev.GetHash();
+    std::vector<std::vector<uint256>> vLevels;
+    MCPartialMerkleTree::BuildLevels(vTxid, vLevels);
+    const uint256 merkleRoot = vLevels.back()[0];
+    std::vector<bool> vMatch(vTxid.size(), false);
+    vMatch[3] = true;
+    MCPartialMerkleTree pmt(vTxid, vMatch);
+
+    MCMutableTransaction spendTx;
+    spendTx.vin.resize(1);
+    spendTx.vin[0].prevout = MCOutPoint(prev.GetHash(), 0);
+    spendTx.vout.resize(1);
+    spendTx.vout[0].nValue = 9 * COIN;
+    BOOST_REQUIRE(SignSignature(keystore, prev, spendTx, 0, SIGHASH_ALL));
+    MCTransactionRef spend = MakeTransactionRef(spendTx);
+    auto txdata = std::make_shared<PrecomputedTransactionData>(*spend);
+
+    const MCScript& scriptPubKey = prev.vout[0].scriptPubKey;
+    const MCAmount amount = prev.vout[0].nValue;
+    ProveInputCheck check(merkleRoot, pmt, prev.GetHash(), scriptPubKey, amount, spend, 0, PROVE_CHECK_FLAGS, "scriptcheck fail", txdata);
+    BOOST_CHECK(check());
+    // 已通过的检查从缓存返回
+    ProveInputCheck cached(merkleRoot, pmt, prev.GetHash(), scriptPubKey, amount, spend, 0, PROVE_CHECK_FLAGS, "scriptcheck fail", txdata);
+    BOOST_CHECK(cached());
+
+    ProveInputCheck badRoot(GetRandHash(), pmt, prev.GetHash(), scriptPubKey, amount, spend, 0, PROVE_CHECK_FLAGS, "scriptcheck fail", txdata);
+    BOOST_CHECK(!badRoot());
+    BOOST_CHECK(!badRoot.GetError().empty());
+
+    // 签名之后修改交易，脚本检查失败，合约转币只要求地址一致
+    spendTx.vout[0].nValue = 8 * COIN;
+    MCTransactionRef changed = MakeTransactionRef(spendTx);
+    auto changedData = std::make_shared<PrecomputedTransactionData>(*changed);
+    ProveInputCheck badSig(merkleRoot, pmt, prev.GetHash(), scriptPubKey, amount, changed, 0, PROVE_CHECK_FLAGS, "scriptcheck fail", changedData);
+    BOOST_CHECK(!badSig());
+    BOOST_CHECK_EQUAL(badSig.GetError(), "scriptcheck fail");
+    ProveInputCheck contractSpend(merkleRoot, pmt, prev.GetHash(), scriptPubKey, amount, changed, 0, PROVE_CHECK_FLAGS, "", changedData);
+    BOOST_CHECK(contractSpend());
+    // 合约转币通过后缓存的结果不能让要求脚本检查的同一输入通过
+    ProveInputCheck badSigAgain(merkleRoot, pmt, prev.GetHash(), scriptPubKey, amount, changed, 0, PROVE_CHECK_FLAGS, "scriptcheck fail", changedData);
+    BOOST_CHECK(!badSigAgain());
+
+    // swap 交换全部状态，供检查队列使用
+    ProveInputCheck swapped;
+    swapped.swap(badSig);
+    BOOST_CHECK_EQUAL(swapped.GetError(), "scriptcheck fail");
+    BOOST_CHECK(!swapped());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,6 +5,7 @@
 
 #include "test/test_magnachain.h"
 
+#include "chain/branchchain.h"
 #include "chain/chainparams.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
@@ -56,6 +57,7 @@ BasicTestingSetup::BasicTestingSetup(const std::string& chainName)
         SetupNetworking();
         InitSignatureCache();
         InitScriptExecutionCache();
+        InitProveCheckCache();
         fPrintToDebugLog = false; // don't want to write to debug.log file
         fCheckBlockIndex = true;
 		ECC_Stop();// in SelectParams has a pair function call(ECC_Start and ECC_Stop)
@@ -106,8 +108,10 @@ TestingSetup::TestingSetup(const std::string& chainName) : BasicTestingSetup(cha
             }
         }
         nScriptCheckThreads = 3;
-        for (int i=0; i < nScriptCheckThreads-1; i++)
+        for (int i=0; i < nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadProveCheck);
+        }
         g_connman = std::unique_ptr<MCConnman>(new MCConnman(0x1337, 0x1337)); // Deterministic randomness for tests.
         connman = g_connman.get();
         peerLogic.reset(new PeerLogicValidation(connman, scheduler, &ProcessMessage, &GetLocator));
@@ -8,15 +8,47 @@
 #include "utils/util.h"
 #include "utils/utilstrencodings.h"
 
+#include <algorithm>
+#include <map>
 #include <stdio.h>
 
 #include <boost/thread.hpp>
 
 #ifdef DEBUG_LOCKCONTENTION
-void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
+static boost::mutex contentionMutex;
+static std::map<std::string, LockContentionStats> mapLockContention;
+
+void PrintLockContention(const char* pszName, const char* pszFile, int nLine, int64_t nWaitMicros)
 {
+    LockContentionStats stats;
+    {
+        boost::unique_lock<boost::mutex> lock(contentionMutex);
+        LockContentionStats& site = mapLockContention[strprintf("%s %s:%d", pszName, pszFile, nLine)];
+        site.nCount++;
+        site.nWaitMicros += nWaitMicros;
+        stats = site;
+    }
     LogPrintf("LOCKCONTENTION: %s\n", pszName);
-    LogPrintf("Locker: %s:%d\n", pszFile, nLine);
+    LogPrintf("Locker: %s:%d waited %dus (%u times, %dus in total)\n", pszFile, nLine, nWaitMicros, stats.nCount, stats.nWaitMicros);
+}
+
+std::vector<std::pair<std::string, LockContentionStats> > GetLockContentionStats()
+{
+    std::vector<std::pair<std::string, LockContentionStats> > ret;
+    {
+        boost::unique_lock<boost::mutex> lock(contentionMutex);
+        ret.assign(mapLockContention.begin(), mapLockContention.end());
+    }
+    std::sort(ret.begin(), ret.end(), [](const std::pair<std::string, LockContentionStats>& a, const std::pair<std::string, LockContentionStats>& b) {
+        return a.second.nWaitMicros > b.second.nWaitMicros;
+    });
+    return ret;
+}
+
+void LogLockContentionStats()
+{
+    for (const std::pair<std::string, LockContentionStats>& site : GetLockContentionStats())
+        LogPrintf("LOCKCONTENTION: %s contended %u times, waited %dus\n", site.first, site.second.nCount, site.second.nWaitMicros);
 }
 #endif /* DEBUG_LOCKCONTENTION */
 
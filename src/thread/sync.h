@@ -8,11 +8,16 @@
 #define MAGNACHAIN_SYNC_H
 
 #include "thread/threadsafety.h"
+#include "utils/utiltime.h"
 
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/recursive_mutex.hpp>
 
+#include <string>
+#include <utility>
+#include <vector>
+
 
 ////////////////////////////////////////////////
 //                                            //
@@ -104,7 +109,18 @@ typedef AnnotatedMixin<boost::mutex> CWaitableCriticalSection;
 typedef boost::condition_variable MCConditionVariable;
 
 #ifdef DEBUG_LOCKCONTENTION
-void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
+/** Accumulated contention of one lock site */
+struct LockContentionStats
+{
+    uint64_t nCount;
+    int64_t nWaitMicros;
+    LockContentionStats() : nCount(0), nWaitMicros(0) {}
+};
+
+void PrintLockContention(const char* pszName, const char* pszFile, int nLine, int64_t nWaitMicros);
+/** Contention per lock site ("name file:line"), most waited first */
+std::vector<std::pair<std::string, LockContentionStats> > GetLockContentionStats();
+void LogLockContentionStats();
 #endif
 
 /** Wrapper around boost::unique_lock<Mutex> */
@@ -119,10 +135,11 @@ private:
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
 #ifdef DEBUG_LOCKCONTENTION
         if (!lock.try_lock()) {
-            PrintLockContention(pszName, pszFile, nLine);
+            int64_t nWaitStart = GetTimeMicros();
 #endif
             lock.lock();
 #ifdef DEBUG_LOCKCONTENTION
+            PrintLockContention(pszName, pszFile, nLine, GetTimeMicros() - nWaitStart);
         }
 #endif
     }
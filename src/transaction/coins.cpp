@@ -286,20 +286,7 @@ bool MCCoinsViewCache::HaveInputs(const MCTransaction& tx) const
 
 MCAmount CoinAmountDB::GetAmount(const uint160& key) const
 {
-    MCAmount nValue = 0;
-    CoinListPtr plist = pcoinListDb->GetList(key);
-    for (auto it = plist->coins.begin(); it != plist->coins.end(); ++it) {
-        const MCOutPoint& outpoint = *it;
-        const Coin& coin = pcoinsTip->AccessCoin(outpoint);
-
-        if (coin.IsSpent())
-            continue;
-        if (coin.IsCoinBase() && chainActive.Height() - coin.nHeight < COINBASE_MATURITY)
-            continue;
-
-        nValue += coin.out.nValue;
-    }
-    return nValue;
+    return pcoinListDb->GetAmount(key, chainActive.Height());
 }
 
 MCAmount CoinAmountTemp::GetAmount(const uint160& key) const
@@ -48,6 +48,20 @@ void MCPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const s
     }
 }
 
+void MCPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<std::vector<uint256>> &vLevels, const std::vector<bool> &vMatch) {
+    bool fParentOfMatch = false;
+    for (unsigned int p = pos << height; p < (pos+1) << height && p < nTransactions; p++)
+        fParentOfMatch |= vMatch[p];
+    vBits.push_back(fParentOfMatch);
+    if (height==0 || !fParentOfMatch) {
+        vHash.push_back(vLevels[height][pos]);
+    } else {
+        TraverseAndBuild(height-1, pos*2, vLevels, vMatch);
+        if (pos*2+1 < CalcTreeWidth(height-1))
+            TraverseAndBuild(height-1, pos*2+1, vLevels, vMatch);
+    }
+}
+
 uint256 MCPartialMerkleTree::TraverseAndExtract(int height, unsigned int pos, unsigned int &nBitsUsed, unsigned int &nHashUsed, std::vector<uint256> &vMatch, std::vector<unsigned int> &vnIndex) {
     if (nBitsUsed >= vBits.size()) {
         // overflowed the bits array - failure
@@ -102,6 +116,28 @@ MCPartialMerkleTree::MCPartialMerkleTree(const std::vector<uint256> &vTxid, cons
 
 MCPartialMerkleTree::MCPartialMerkleTree() : nTransactions(0), fBad(true) {}
 
+MCPartialMerkleTree::MCPartialMerkleTree(const std::vector<std::vector<uint256>> &vLevels, const std::vector<bool> &vMatch) : nTransactions(vLevels.empty() ? 0 : vLevels[0].size()), fBad(false) {
+    // the levels end at the root, so their count gives the height of the tree
+    assert(!vLevels.empty() && vLevels.back().size() == 1);
+    TraverseAndBuild(vLevels.size() - 1, 0, vLevels, vMatch);
+}
+
+void MCPartialMerkleTree::BuildLevels(const std::vector<uint256> &vTxid, std::vector<std::vector<uint256>> &vLevels) {
+    assert(vTxid.size() != 0);
+    vLevels.assign(1, vTxid);
+    while (vLevels.back().size() > 1) {
+        std::vector<uint256> level((vLevels.back().size() + 1) / 2);
+        const std::vector<uint256> &below = vLevels.back();
+        for (unsigned int pos = 0; pos < level.size(); pos++) {
+            // copy the left hash when the right one is beyond the end of the level, as CalcHash does
+            const uint256 &left = below[pos*2];
+            const uint256 &right = pos*2+1 < below.size() ? below[pos*2+1] : left;
+            level[pos] = Hash(BEGIN(left), END(left), BEGIN(right), END(right));
+        }
+        vLevels.push_back(std::move(level));
+    }
+}
+
 uint256 MCPartialMerkleTree::ExtractMatches(std::vector<uint256> &vMatch, std::vector<unsigned int> &vnIndex) {
     vMatch.clear();
     // An empty set will not work
@@ -73,6 +73,8 @@ protected:
 
     /** recursive function that traverses tree nodes, storing the data as bits and hashes */
     void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
+    /** same, taking the node hashes from the levels built by BuildLevels */
+    void TraverseAndBuild(int height, unsigned int pos, const std::vector<std::vector<uint256>> &vLevels, const std::vector<bool> &vMatch);
 
     /**
      * recursive function that traverses tree nodes, consuming the bits and hashes produced by TraverseAndBuild.
@@ -108,6 +110,15 @@ public:
     /** Construct a partial merkle tree from a list of transaction ids, and a mask that selects a subset of them */
     MCPartialMerkleTree(const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
 
+    /**
+     * Construct the same tree from the node hashes of every level, as built by BuildLevels.
+     * Building many trees of one block this way hashes the block's tree only once.
+     */
+    MCPartialMerkleTree(const std::vector<std::vector<uint256>> &vLevels, const std::vector<bool> &vMatch);
+
+    /** calculate the hashes of every level of the merkle tree, from the txids (level 0) up to the root */
+    static void BuildLevels(const std::vector<uint256> &vTxid, std::vector<std::vector<uint256>> &vLevels);
+
     MCPartialMerkleTree();
 
     /**
@@ -9,6 +9,7 @@
 #include "coding/base58.h"
 #include "chain/chainparams.h"
 #include "coding/hash.h"
+#include "consensus/consensus.h"
 #include "init.h"
 #include "misc/pow.h"
 #include "misc/random.h"
@@ -22,6 +23,7 @@
 
 #include <sstream>
 #include <iostream>
+#include <limits>
 #include <stdint.h>
 #include <boost/thread.hpp>
 #include <boost/iostreams/copy.hpp>
@@ -41,6 +43,8 @@ static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
 static const char DB_COINLIST = 'A';
+static const char DB_COINAMOUNT = 'a';
+static const char DB_COINLISTITEM = 'L';
 
 namespace
 {
@@ -465,7 +469,7 @@ struct CoinListEntry {
     uint160* addr;
     char key;
 
-    CoinListEntry(const uint160* ptr) : addr(const_cast<uint160*>(ptr)), key(DB_COINLIST) {}
+    CoinListEntry(const uint160* ptr, char k = DB_COINLIST) : addr(const_cast<uint160*>(ptr)), key(k) {}
 
     template <typename Stream>
     void Serialize(Stream& s) const
@@ -482,6 +486,37 @@ struct CoinListEntry {
     }
 };
 
+// 地址的一个输出，n按大端写入使db中的顺序与MCOutPoint相同
+struct CoinListItemEntry {
+    char key;
+    uint160 addr;
+    MCOutPoint outpoint;
+
+    CoinListItemEntry() : key(DB_COINLISTITEM) {}
+    CoinListItemEntry(const uint160& addrIn, const MCOutPoint& outpointIn) : key(DB_COINLISTITEM), addr(addrIn), outpoint(outpointIn) {}
+
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        s << key;
+        s << addr;
+        s << outpoint.hash;
+        uint32_t n = htobe32(outpoint.n);
+        s.write((char*)&n, 4);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s)
+    {
+        s >> key;
+        s >> addr;
+        s >> outpoint.hash;
+        uint32_t n;
+        s.read((char*)&n, 4);
+        outpoint.n = be32toh(n);
+    }
+};
+
 
 // coin list db
 static void CoinListGetParent(const MCOutPoint& outpoint, const Coin& coin, CoinList& kList)
@@ -570,9 +605,160 @@ static inline bool GetCoinDest(const MCOutPoint& outpoint, const Coin& coin, MCT
     return true;
 }
 
+void CoinAmountIndex::AddCoin(const Coin& coin)
+{
+    if (coin.IsCoinBase()) {
+        coinbase[coin.nHeight] += coin.out.nValue;
+        nCoinBaseAmount += coin.out.nValue;
+    }
+    else
+        nAmount += coin.out.nValue;
+}
+
+void CoinAmountIndex::RemoveCoin(const Coin& coin)
+{
+    if (coin.IsCoinBase()) {
+        auto it = coinbase.find(coin.nHeight);
+        if (it == coinbase.end())
+            return;
+        it->second -= coin.out.nValue;
+        nCoinBaseAmount -= coin.out.nValue;
+        if (it->second == 0)
+            coinbase.erase(it);
+    }
+    else
+        nAmount -= coin.out.nValue;
+}
+
+MCAmount CoinAmountIndex::GetAmount(int nTipHeight) const
+{
+    // 从最高的分组往回减去未成熟的部分，最多COINBASE_MATURITY组
+    MCAmount nValue = nAmount + nCoinBaseAmount;
+    for (auto it = coinbase.rbegin(); it != coinbase.rend() && nTipHeight - it->first < COINBASE_MATURITY; ++it)
+        nValue -= it->second;
+    return nValue;
+}
+
+CoinAmountIndex& CoinListDB::LoadAmountIndex(const uint160& addr)
+{
+    CoinAmountIndex& index = amountCache[addr];
+    // 升级前的数据没有索引，用修改前的列表和pcoinsTip建立，之后随列表一起更新
+    if (!plistDB->Read(CoinListEntry(&addr, DB_COINAMOUNT), index)) {
+        index = CoinAmountIndex();
+        const size_t nPageSize = 1000;
+        std::vector<MCOutPoint> page;
+        MCOutPoint last;
+        const MCOutPoint* pStart = nullptr;
+        do {
+            GetCoins(addr, pStart, nPageSize, page);
+            for (const MCOutPoint& outpoint : page) {
+                const Coin& coin = pcoinsTip->AccessCoin(outpoint);
+                if (!coin.IsSpent())
+                    index.AddCoin(coin);
+            }
+            if (!page.empty()) {
+                last = page.back();
+                pStart = &last;
+            }
+        } while (page.size() == nPageSize);
+    }
+    return index;
+}
+
+bool CoinListDB::HaveCoin(const uint160& addr, const MCOutPoint& outpoint) const
+{
+    auto pit = pending.find(addr);
+    if (pit != pending.end()) {
+        auto it = pit->second.find(outpoint);
+        if (it != pit->second.end())
+            return it->second;
+    }
+    auto rit = readCache.find(addr);
+    if (rit != readCache.end())
+        return rit->second.coins.count(outpoint) > 0;
+    return plistDB->Exists(CoinListItemEntry(addr, outpoint));
+}
+
+void CoinListDB::UpdateCoin(const uint160& addr, const MCOutPoint& outpoint, bool fAdd)
+{
+    pending[addr][outpoint] = fAdd;
+
+    auto rit = readCache.find(addr);
+    if (rit == readCache.end())
+        return;
+    std::set<MCOutPoint>& coins = rit->second.coins;
+    if (fAdd) {
+        if (coins.insert(outpoint).second)
+            ++nReadCacheCoins;
+    }
+    else
+        nReadCacheCoins -= coins.erase(outpoint);
+}
+
+void CoinListDB::CacheCoins(const uint160& addr, std::set<MCOutPoint>& coins) const
+{
+    if (coins.size() > MAX_COINLIST_CACHE_COINS)
+        return;
+    readCacheLru.push_front(addr);
+    CachedCoinList& cached = readCache[addr];
+    cached.coins.swap(coins);
+    cached.lru = readCacheLru.begin();
+    nReadCacheCoins += cached.coins.size();
+    TrimReadCache();
+}
+
+void CoinListDB::TrimReadCache() const
+{
+    // 刚读入的列表在最前面，不会被换出
+    while (nReadCacheCoins > MAX_COINLIST_CACHE_COINS && readCacheLru.size() > 1) {
+        auto it = readCache.find(readCacheLru.back());
+        nReadCacheCoins -= it->second.coins.size();
+        readCache.erase(it);
+        readCacheLru.pop_back();
+    }
+}
+
+bool CoinListDB::Upgrade()
+{
+    std::unique_ptr<MCDBIterator> pcursor(plistDB->NewIterator());
+    pcursor->Seek(std::make_pair(DB_COINLIST, uint160()));
+    if (!pcursor->Valid())
+        return true;
+
+    int64_t count = 0;
+    LogPrintf("Upgrading coin list database...\n");
+    size_t batch_size = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    MCDBBatch batch(*plistDB);
+    std::pair<char, uint160> key;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        if (!pcursor->GetKey(key) || key.first != DB_COINLIST)
+            break;
+
+        CoinList kList;
+        if (!pcursor->GetValue(kList))
+            return error("%s: cannot parse CoinList record", __func__);
+        for (const MCOutPoint& outpoint : kList.coins)
+            batch.Write(CoinListItemEntry(key.second, outpoint), true);
+        batch.Erase(CoinListEntry(&key.second));
+        ++count;
+
+        if (batch.SizeEstimate() > batch_size) {
+            plistDB->WriteBatch(batch);
+            batch.Clear();
+        }
+        pcursor->Next();
+    }
+    plistDB->WriteBatch(batch);
+    LogPrintf("Upgraded %d coin lists [%s].\n", count, ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
+
 void CoinListDB::ImportCoins(MCCoinsMap& mapCoins)
 {
-    MCCoinListMap& map = cache;
+    LOCK(cs);
     for (MCCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
         if (it->second.flags & MCCoinsCacheEntry::DIRTY) {
             const Coin& coin = it->second.coin;
@@ -583,41 +769,28 @@ void CoinListDB::ImportCoins(MCCoinsMap& mapCoins)
                 continue;
             }
 
-            CoinListPtr pList = nullptr;
             const uint160& key = GetUint160(dest);
-            MCCoinListMap::iterator mit = cache.find(key);
-            if (mit == cache.end()) {
-                pList.reset(new CoinList());
-                plistDB->Read(CoinListEntry(&key), *pList);
-                cache[key] = pList;
-            } else {
-                pList = mit->second;
-            }
+            MCCoinAmountMap::iterator ait = amountCache.find(key);
+            CoinAmountIndex& index = (ait != amountCache.end()) ? ait->second : LoadAmountIndex(key);
+            bool bGot = HaveCoin(key, outpoint);
 
             if (coin.IsSpent()) {
-                for (std::vector<MCOutPoint>::iterator vit = pList->coins.begin(); vit != pList->coins.end(); ++vit) {
-                    const MCOutPoint& to = *vit;
-                    if (to.hash == outpoint.hash && to.n == outpoint.n) {
-                        pList->coins.erase(vit);
-                        break;
-                    }
+                if (bGot) {
+                    // 此时pcoinsTip还未写入本次修改，取到的是花费前的coin
+                    const Coin& spent = pcoinsTip->AccessCoin(outpoint);
+                    if (!spent.IsSpent())
+                        index.RemoveCoin(spent);
+                    UpdateCoin(key, outpoint, false);
                 }
             } else {
-                bool bGot = false;
                 // safe check
-                for (std::vector<MCOutPoint>::iterator vit = pList->coins.begin(); vit != pList->coins.end(); ++vit) {
-                    const MCOutPoint& to = *vit;
-                    if (to.hash == outpoint.hash && to.n == outpoint.n) {
-                        bGot = true;
-                        LogPrint(BCLog::COINDB, "COIN_LIST, Readd trans : %s %d \n", to.hash.ToString(), to.n);
-                        //assert(false);//TODO: when db crash, and ReplayBlocks will make this happen.
-                        break;
-                    }
+                if (bGot) {
+                    LogPrint(BCLog::COINDB, "COIN_LIST, Readd trans : %s %d \n", outpoint.hash.ToString(), outpoint.n);
+                    //assert(false);//TODO: when db crash, and ReplayBlocks will make this happen.
+                } else {
+                    UpdateCoin(key, outpoint, true);
+                    index.AddCoin(coin);
                 }
-                if (!bGot)
-                    pList->coins.push_back(outpoint);
-                //if (!pList->parentInited)
-                //    CoinListGetParent(outpoint, coin, *pList);
             }
         }
     }
@@ -625,17 +798,21 @@ void CoinListDB::ImportCoins(MCCoinsMap& mapCoins)
 
 void CoinListDB::Flush(void)
 {
+    LOCK(cs);
     MCDBBatch batch(*plistDB);
 
     size_t iTotalCoin = 0;
     size_t batch_size = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
 
-    for (MCCoinListMap::iterator it = cache.begin(); it != cache.end(); ++it) {
+    for (auto it = pending.begin(); it != pending.end(); ++it) {
         const uint160& kKey = it->first;
-        const CoinList& kList = *it->second;
-        iTotalCoin += kList.coins.size();
-
-        batch.Write(CoinListEntry(&kKey), kList);
+        for (const auto& item : it->second) {
+            if (item.second)
+                batch.Write(CoinListItemEntry(kKey, item.first), true);
+            else
+                batch.Erase(CoinListItemEntry(kKey, item.first));
+        }
+        iTotalCoin += it->second.size();
 
         if (batch.SizeEstimate() > batch_size) {
             LogPrint(BCLog::COINDB, "COIN_LIST, Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
@@ -643,23 +820,138 @@ void CoinListDB::Flush(void)
             batch.Clear();
         }
     }
+    for (auto it = amountCache.begin(); it != amountCache.end(); ++it)
+        batch.Write(CoinListEntry(&it->first, DB_COINAMOUNT), it->second);
 
     LogPrint(BCLog::COINDB, "COIN_LIST, Writing final batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
     bool ret = plistDB->WriteBatch(batch);
-    LogPrint(BCLog::COINDB, "COIN_LIST, Writing final batch, Result: %d TotalCoin:%d \n", ret, iTotalCoin);
+    LogPrint(BCLog::COINDB, "COIN_LIST, Writing final batch, Result: %d ChangedCoin:%d \n", ret, iTotalCoin);
 
-    // clear all cache if writed to db
-    cache.clear();
+    // 读缓存已包含这些修改，继续保留
+    pending.clear();
+    amountCache.clear();
 }
 
 CoinListPtr CoinListDB::GetList(const uint160& addr) const
 {
-    // not cache list read from db, cause it's not modified
-    MCCoinListMap::const_iterator mit = cache.find(addr);
-    if (mit == cache.end()) {
-        CoinListPtr pList(new CoinList());
-        plistDB->Read(CoinListEntry(&addr), *pList);
+    LOCK(cs);
+    CoinListPtr pList(new CoinList());
+    auto rit = readCache.find(addr);
+    if (rit != readCache.end()) {
+        readCacheLru.splice(readCacheLru.begin(), readCacheLru, rit->second.lru);
+        pList->coins.assign(rit->second.coins.begin(), rit->second.coins.end());
         return pList;
     }
-    return mit->second;
+
+    std::vector<MCOutPoint> page;
+    GetCoins(addr, nullptr, std::numeric_limits<size_t>::max(), page);
+    std::set<MCOutPoint> coins(page.begin(), page.end());
+    pList->coins.swap(page);
+    CacheCoins(addr, coins);
+    return pList;
+}
+
+void CoinListDB::GetCoins(const uint160& addr, const MCOutPoint* pStart, size_t nLimit, std::vector<MCOutPoint>& coins) const
+{
+    LOCK(cs);
+    coins.clear();
+    auto rit = readCache.find(addr);
+    if (rit != readCache.end()) {
+        const std::set<MCOutPoint>& cached = rit->second.coins;
+        auto it = pStart ? cached.upper_bound(*pStart) : cached.begin();
+        for (; it != cached.end() && coins.size() < nLimit; ++it)
+            coins.push_back(*it);
+        return;
+    }
+
+    // 按相同的顺序合并db中的记录与未写盘的修改
+    static const std::map<MCOutPoint, bool> noDelta;
+    auto pit = pending.find(addr);
+    const std::map<MCOutPoint, bool>& delta = (pit != pending.end()) ? pit->second : noDelta;
+    auto dit = pStart ? delta.upper_bound(*pStart) : delta.begin();
+
+    std::unique_ptr<MCDBIterator> pcursor(plistDB->NewIterator());
+    pcursor->Seek(CoinListItemEntry(addr, pStart ? *pStart : MCOutPoint(uint256(), 0)));
+    CoinListItemEntry entry;
+    auto ReadEntry = [&]() {
+        return pcursor->Valid() && pcursor->GetKey(entry) && entry.key == DB_COINLISTITEM && entry.addr == addr;
+    };
+    bool dbValid = ReadEntry();
+    if (dbValid && pStart && entry.outpoint == *pStart) {
+        pcursor->Next();
+        dbValid = ReadEntry();
+    }
+
+    while (coins.size() < nLimit && (dbValid || dit != delta.end())) {
+        if (dit != delta.end() && (!dbValid || !(entry.outpoint < dit->first))) {
+            if (dbValid && entry.outpoint == dit->first) {
+                pcursor->Next();
+                dbValid = ReadEntry();
+            }
+            if (dit->second)
+                coins.push_back(dit->first);
+            ++dit;
+        } else {
+            coins.push_back(entry.outpoint);
+            pcursor->Next();
+            dbValid = ReadEntry();
+        }
+    }
+}
+
+MCAmount CoinListDB::GetAmount(const uint160& addr, int nTipHeight) const
+{
+    // 只读取不建立索引，可以在多个合约线程中同时读
+    CoinAmountIndex index;
+    if (ReadAmountIndex(addr, index))
+        return index.GetAmount(nTipHeight);
+    return ScanAmount(addr, nTipHeight);
+}
+
+MCAmount CoinListDB::ScanAmount(const uint160& addr, int nTipHeight) const
+{
+    MCAmount nValue = 0;
+    CoinListPtr plist = GetList(addr);
+    for (auto it = plist->coins.begin(); it != plist->coins.end(); ++it) {
+        const MCOutPoint& outpoint = *it;
+        const Coin& coin = pcoinsTip->AccessCoin(outpoint);
+
+        if (coin.IsSpent())
+            continue;
+        if (coin.IsCoinBase() && nTipHeight - coin.nHeight < COINBASE_MATURITY)
+            continue;
+
+        nValue += coin.out.nValue;
+    }
+    return nValue;
+}
+
+bool CoinListDB::ReadAmountIndex(const uint160& addr, CoinAmountIndex& index) const
+{
+    LOCK(cs);
+    MCCoinAmountMap::const_iterator mit = amountCache.find(addr);
+    if (mit != amountCache.end()) {
+        index = mit->second;
+        return true;
+    }
+    return plistDB->Read(CoinListEntry(&addr, DB_COINAMOUNT), index);
+}
+
+void CoinListDB::GetAmountIndexKeys(std::vector<uint160>& keys) const
+{
+    LOCK(cs);
+    std::set<uint160> setKeys;
+    for (const auto& item : amountCache)
+        setKeys.insert(item.first);
+
+    std::unique_ptr<MCDBIterator> pcursor(plistDB->NewIterator());
+    pcursor->Seek(std::make_pair(DB_COINAMOUNT, uint160()));
+    while (pcursor->Valid()) {
+        std::pair<char, uint160> key;
+        if (!pcursor->GetKey(key) || key.first != DB_COINAMOUNT)
+            break;
+        setKeys.insert(key.second);
+        pcursor->Next();
+    }
+    keys.assign(setKeys.begin(), setKeys.end());
 }
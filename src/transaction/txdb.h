@@ -12,9 +12,12 @@
 #include "chain/chain.h"
 #include "script/standard.h"
 
+#include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <utility>
+#include <unordered_map>
 #include <vector>
 
 class MCBlock;
@@ -146,6 +149,42 @@ public:
 	}
 };
 
+/**
+ * Running balance of the coins in an address's CoinList, kept next to the
+ * list and updated with it so a balance read does not have to look up every
+ * outpoint in the UTXO set. Coinbase outputs are bucketed by height because
+ * whether they count depends on the tip height at read time.
+ */
+class CoinAmountIndex
+{
+public:
+    MCAmount nAmount;                       // 非coinbase的总额
+    std::map<int, MCAmount> coinbase;       // coinbase按高度分组
+
+    CoinAmountIndex() : nAmount(0), nCoinBaseAmount(0) {}
+
+    void AddCoin(const Coin& coin);
+    void RemoveCoin(const Coin& coin);
+    // 与逐个查询utxo时相同，不计未成熟的coinbase
+    MCAmount GetAmount(int nTipHeight) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nAmount);
+        READWRITE(coinbase);
+        if (ser_action.ForRead()) {
+            nCoinBaseAmount = 0;
+            for (const auto& item : coinbase)
+                nCoinBaseAmount += item.second;
+        }
+    }
+
+private:
+    MCAmount nCoinBaseAmount;
+};
+
 class U160Hasher
 {
 public:
@@ -155,26 +194,66 @@ public:
 	}
 };
 
-typedef std::unordered_map<uint160, std::shared_ptr<CoinList>, U160Hasher> MCCoinListMap;
 typedef std::shared_ptr<CoinList> CoinListPtr;
+typedef std::unordered_map<uint160, CoinAmountIndex, U160Hasher> MCCoinAmountMap;
 
-// coin list db
+//! Max number of outpoints kept in the CoinListDB read cache
+static const size_t MAX_COINLIST_CACHE_COINS = 250000;
+
+/**
+ * Address to outpoint index of the UTXO set.
+ *
+ * Every (address, outpoint) pair is its own key, ordered by outpoint, so an
+ * address can be read in pages by prefix iteration and a flush only writes
+ * the outpoints that changed. Changes not yet flushed are kept per address
+ * and merged into every read. Lists that were read in full stay in an LRU
+ * cache across flushes and are updated in place by ImportCoins.
+ */
 class CoinListDB
 {
 public:
-    CoinListDB(MCDBWrapper* pDB) : plistDB(pDB)
+    CoinListDB(MCDBWrapper* pDB) : plistDB(pDB), nReadCacheCoins(0)
     {
         assert(pDB);
 	}
 
 protected:
+	struct CachedCoinList
+	{
+		std::set<MCOutPoint> coins;
+		std::list<uint160>::iterator lru;
+	};
+
 	MCDBWrapper* plistDB;
-	MCCoinListMap cache;
+	mutable MCCriticalSection cs;
+	// 未写盘的修改，true为增加，false为删除
+	std::unordered_map<uint160, std::map<MCOutPoint, bool>, U160Hasher> pending;
+	MCCoinAmountMap amountCache;    // 本次写盘前修改过的地址
+	mutable std::unordered_map<uint160, CachedCoinList, U160Hasher> readCache;
+	mutable std::list<uint160> readCacheLru;
+	mutable size_t nReadCacheCoins;
+
+	CoinAmountIndex& LoadAmountIndex(const uint160& addr);
+	bool HaveCoin(const uint160& addr, const MCOutPoint& outpoint) const;
+	void UpdateCoin(const uint160& addr, const MCOutPoint& outpoint, bool fAdd);
+	void CacheCoins(const uint160& addr, std::set<MCOutPoint>& coins) const;
+	void TrimReadCache() const;
 
 public:
+	// 把旧格式中每个地址一条的列表拆成每个输出一条
+	bool Upgrade();
 	void Flush(void);
 	void ImportCoins(MCCoinsMap& cacheCoins);
 	CoinListPtr GetList(const uint160& addr) const;
+	// 按outpoint顺序读取pStart之后的最多nLimit个输出，少于nLimit个时已读完
+	void GetCoins(const uint160& addr, const MCOutPoint* pStart, size_t nLimit, std::vector<MCOutPoint>& coins) const;
+
+	// 读余额索引，尚未建立索引的地址退回到逐个查询utxo
+	MCAmount GetAmount(const uint160& addr, int nTipHeight) const;
+	// 逐个查询utxo统计余额，用于建立和校验索引
+	MCAmount ScanAmount(const uint160& addr, int nTipHeight) const;
+	bool ReadAmountIndex(const uint160& addr, CoinAmountIndex& index) const;
+	void GetAmountIndexKeys(std::vector<uint160>& keys) const;
 };
 
 #endif // MAGNACHAIN_TXDB_H
@@ -254,6 +254,7 @@ const CLogCategoryDesc LogCategories[] =
     {BCLog::MINING, "mining"},
     {BCLog::TRANSACTION, "transaction"},
     {BCLog::WALLET, "wallet"},
+    {BCLog::CONTRACT, "contract"},
     {BCLog::ALL, "1"},
     {BCLog::ALL, "all"},
 };
@@ -106,6 +106,7 @@ namespace BCLog {
 		MINING      = (1 << 22),
         TRANSACTION = (1 << 23),
         WALLET      = (1 << 24),
+        CONTRACT    = (1 << 25),
         ALL         = ~(uint32_t)0,
     };
 }
@@ -48,6 +48,7 @@
 #include "chain//branchchain.h"
 #include "script/sign.h"
 #include "chain/branchdb.h"
+#include "chain/provebuilder.h"
 #include "transaction/merkleblock.h"
 #include "rpc/server.h"
 
@@ -3092,6 +3093,7 @@ MCBlockIndex* AddToBlockIndex(const MCBlockHeader& block)
     }
     pindexNew->nTimeMax = (pindexNew->pprev ? std::max(pindexNew->pprev->nTimeMax, pindexNew->nTime) : pindexNew->nTime);
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
+    pindexNew->nChainNonce = (pindexNew->pprev ? pindexNew->pprev->nChainNonce : 0) + pindexNew->nNonce;
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
     if (pindexBestHeader == nullptr || pindexBestHeader->nChainWork < pindexNew->nChainWork)
         pindexBestHeader = pindexNew;
@@ -3855,11 +3857,8 @@ bool ProcessNewBlock(const MCChainParams& chainparams, std::shared_ptr<MCBlock>
     ProcessBlockBranchChain();
 
     // check and remove invalid contract transaction
-    std::string strErr;
     if (!Params().IsMainChain())
-        SendBranchBlockHeader(pblock, &strErr);
-    if (!strErr.empty())
-        LogPrint(BCLog::BRANCH, "SendBranchBlockHeader fail when ProcessNewBlock: %s", strErr.c_str());
+        SendBranchBlockHeaderAsync(pblock);
     
     LogPrint(BCLog::MINING, "%s useTime:%I, height:%d\n", __FUNCTION__, GetTimeMillis() - start, pindex->nHeight);
     return true;
@@ -4127,6 +4126,7 @@ bool static LoadBlockIndexDB(const MCChainParams& chainparams)
     {
         MCBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+        pindex->nChainNonce = (pindex->pprev ? pindex->pprev->nChainNonce : 0) + pindex->nNonce;
         pindex->nTimeMax = (pindex->pprev ? std::max(pindex->pprev->nTimeMax, pindex->nTime) : pindex->nTime);
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
@@ -5259,73 +5259,64 @@ std::string GetBranchTxProof(const MCBlock& block,  const std::set<uint256>& set
 //    return true;
 //}
 
-bool GetTxVinBlockData(const MCBlock& block, const MCTransactionRef& ptx, std::vector<ProveDataItem>& vectProveData)
+// 读出区块的undo数据，找出指定交易的每个输入所在的区块，undo数据只读一次
+static bool GetTxVinSources(const MCBlock& block, const std::vector<size_t>& vTxIndex, std::vector<ProveBuilder::InputRef>& inputs)
 {
-    if (ptx->IsCoinBase())
-        return false;
-
-    if (mapBlockIndex.count(block.GetHash()) == 0)
-        return false;
+    LOCK(cs_main);
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
+    if (mi == mapBlockIndex.end())
+        return error("%s: block %s not found", __func__, block.GetHash().ToString());
 
-    const MCBlockIndex* pindex = mapBlockIndex[block.GetHash()];
+    const MCBlockIndex* pindex = mi->second;
     MCBlockUndo blockUndo;
     MCDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull()) {
-        return false;
+    if (pos.IsNull() || pindex->pprev == nullptr) {
+        return error("%s: no undo data for block %s", __func__, block.GetHash().ToString());
     }
     if (!UndoReadFromDisk(blockUndo, pos, pindex->pprev->GetBlockHash())) {
-        return false;
+        return error("%s: read undo data of block %s fail", __func__, block.GetHash().ToString());
     }
 
-    if (blockUndo.vtxundo.size() + 1 != block.vtx.size()) {
-        return false;
+    // 每笔非coinbase交易一条undo记录，下面按i - 1取
+    if (block.vtx.empty() || blockUndo.vtxundo.size() != block.vtx.size() - 1) {
+        return error("%s: undo data of block %s has %u txs, block has %u", __func__, block.GetHash().ToString(),
+            blockUndo.vtxundo.size(), block.vtx.size());
     }
 
-    MCTxUndo txundo;
-    for (size_t i=1; i<block.vtx.size(); i++) {
-        if (block.vtx[i]->GetHash() == ptx->GetHash()) {
-            txundo = blockUndo.vtxundo[i-1];
-            break;
+    for (size_t n = 0; n < vTxIndex.size(); n++) {
+        const size_t i = vTxIndex[n];
+        if (i == 0 || i >= block.vtx.size() || block.vtx[i]->IsCoinBase())
+            return error("%s: invalid tx index %u", __func__, i);
+        const MCTransactionRef& ptx = block.vtx[i];
+
+        const MCTxUndo& txundo = blockUndo.vtxundo[i - 1];
+        if (txundo.vprevout.size() != ptx->vin.size())
+            return error("%s: undo data of tx %s mismatch its inputs", __func__, ptx->GetHash().ToString());
+        for (size_t j = 0; j < ptx->vin.size(); j++) {
+            const MCBlockIndex* pinblockindex = chainActive[txundo.vprevout[j].nHeight];
+            if (pinblockindex == nullptr)
+                return error("%s: source block of input %u of tx %s not in active chain", __func__, j, ptx->GetHash().ToString());
+            inputs.push_back(ProveBuilder::InputRef{ n, j, pinblockindex, ptx->vin[j].prevout.hash });
         }
     }
+    return true;
+}
 
-    const MCChainParams& params = Params();
-    const Consensus::Params& consensusParams = params.GetConsensus();
-    for (size_t i=0; i< ptx->vin.size(); i++) {
-        const Coin &coin = txundo.vprevout[i];
-        const MCBlockIndex *pinblockindex = chainActive[coin.nHeight];
-        MCBlock inblock;
-        if (ReadBlockFromDisk(inblock, pinblockindex, consensusParams)) {
-            if (coin.out.scriptPubKey.IsContract()) {
-                MCContractID contractId;
-                coin.out.scriptPubKey.GetContractAddr(contractId);
-            }
-
-            MCTransactionRef tmpTx;
-            for (size_t j = 0; j < inblock.vtx.size(); j++) {
-                if (inblock.vtx[j]->GetHash() == ptx->vin[i].prevout.hash) {
-                    tmpTx = inblock.vtx[j];
-                    break;
-                }
-            }
-
-            std::set<uint256> setTxids;
-            setTxids.insert(tmpTx->GetHash());
-
-            std::shared_ptr<MCSpvProof> pSpvPf(NewSpvProof(inblock, setTxids));
-
-            ProveDataItem pData;
-            MCVectorWriter cvw{ SER_NETWORK, INIT_PROTO_VERSION, pData.tx, 0, *tmpTx };
-            pData.pCSP = *pSpvPf;
-            pData.blockHash = block.GetHash();
+// 构建区块中指定交易所有输入的证明，vectProves[n]对应vTxIndex[n]
+static bool GetTxsVinBlockData(const MCBlock& block, const std::vector<size_t>& vTxIndex, std::vector<std::vector<ProveDataItem>>& vectProves)
+{
+    std::vector<ProveBuilder::InputRef> inputs;
+    if (!GetTxVinSources(block, vTxIndex, inputs))
+        return false;
 
-            vectProveData.emplace_back(pData);
+    vectProves.resize(vTxIndex.size());
+    for (size_t n = 0; n < vTxIndex.size(); n++)
+        vectProves[n].resize(block.vtx[vTxIndex[n]]->vin.size());
 
-        }
-        else
-            return false;
-    }
-    return true;
+    if (pProveBuilder)
+        return pProveBuilder->BuildInputProves(inputs, block.GetHash(), vectProves);
+    ProveBuilder builder(DEFAULT_PROVE_BLOCK_CACHE, 0);
+    return builder.BuildInputProves(inputs, block.GetHash(), vectProves);
 }
 
 bool GetProveInfo(const MCBlock& block, int blockHeight, MCBlockIndex* pPrevBlockIndex, const int txIndex, std::shared_ptr<ProveData> pProveData)
@@ -5351,9 +5342,11 @@ bool GetProveInfo(const MCBlock& block, int blockHeight, MCBlockIndex* pPrevBloc
     if (tx->IsCoinBase())
         return false;
 
-    CoinAmountTemp amountTemp;
-    bool success = GetTxVinBlockData(block, tx, pProveData->vectProveData);
-    return success;
+    std::vector<std::vector<ProveDataItem>> vectProves;
+    if (!GetTxsVinBlockData(block, std::vector<size_t>(1, txIndex), vectProves))
+        return false;
+    pProveData->vectProveData.insert(pProveData->vectProveData.end(), vectProves[0].begin(), vectProves[0].end());
+    return true;
 }
 
 //构建coinbase交易的证明
@@ -5366,13 +5359,16 @@ bool GetProveOfCoinbase(std::shared_ptr<ProveData>& pProveData, MCBlock& block)
 
     //create vtx transaction's prove data
     //exclude coinbase, stake transaction
-    for (int i = 2; i < block.vtx.size(); i++) {
-        const MCTransactionRef& ptx = block.vtx[i];
-        pProveData->vecBlockTxProve.emplace_back();
-        std::vector<ProveDataItem>& vectProveData = pProveData->vecBlockTxProve.back();
-        if (!GetTxVinBlockData(block, ptx, vectProveData)){
-            return false;
-        }
-    }
+    std::vector<size_t> vTxIndex;
+    for (size_t i = 2; i < block.vtx.size(); i++)
+        vTxIndex.push_back(i);
+    if (vTxIndex.empty())
+        return true;
+
+    std::vector<std::vector<ProveDataItem>> vectProves;
+    if (!GetTxsVinBlockData(block, vTxIndex, vectProves))
+        return false;
+    for (std::vector<ProveDataItem>& vectProveData : vectProves)
+        pProveData->vecBlockTxProve.emplace_back(std::move(vectProveData));
     return true;
 }
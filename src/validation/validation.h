@@ -171,6 +171,7 @@ typedef std::unordered_map<uint256, MCBlockIndex*, BlockHasher> BlockMap;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockWeight;
+extern int64_t nLastBlockTemplateTime;
 extern const std::string strMessageMagic;
 extern CWaitableCriticalSection csBestBlock;
 extern MCConditionVariable cvBlockChange;
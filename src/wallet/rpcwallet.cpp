@@ -3728,11 +3728,17 @@ UniValue getaddresscoins(const JSONRPCRequest& request)
 {
 	if (request.fHelp || request.params.size() < 1 || request.params.size() > 5)
 		throw std::runtime_error(
-			"getaddresscoins fromaddress\n"
-			"\nGet coins by magnachain address\n"
+			"getaddresscoins fromaddress ( withscript count after )\n"
+			"\nGet coins by magnachain address, ordered by outpoint\n"
 			"\nArguments:\n"
 			"1. \"address\"                      (string, required) The address for input coins\n"
             "2. \"withscript\"                   (bool, optional) Option for return script or not, default false.\n"
+            "3. count                          (numeric, optional) Max number of coins to return, default 0 returns all.\n"
+            "4. after                          (json object, optional) Return coins after this one, pass the last coin of the previous page\n"
+            "     {\n"
+            "       \"txhash\":\"id\",             (string, required) The transaction id\n"
+            "       \"outn\":n                    (numeric, required) The output number\n"
+            "     }\n"
 			"\nReturns the coins of the address\n"
 			"\nResult:\n"
 			"[                   (array of json object)\n"
@@ -3747,6 +3753,7 @@ UniValue getaddresscoins(const JSONRPCRequest& request)
 			"]\n"
 			"\nExamples:\n"
 			+ HelpExampleCli("getaddresscoins", "XWzFXFXehphGkSHHebNo3NwR3wMBfTeiPj")
+			+ HelpExampleCli("getaddresscoins", "XWzFXFXehphGkSHHebNo3NwR3wMBfTeiPj false 100 '{\"txhash\":\"a08e6907dbbd3d809776dbfc5d82e371b764ed838b5655e72f463568df1aadf0\",\"outn\":1}'")
 			+ HelpExampleRpc("getaddresscoins", "XWzFXFXehphGkSHHebNo3NwR3wMBfTeiPj")
 		);
 
@@ -3768,12 +3775,31 @@ UniValue getaddresscoins(const JSONRPCRequest& request)
             fwithscript = true;
     }
 
-	CoinListPtr plist = pcoinListDb->GetList((const uint160&)kFromKeyId);
+    size_t nCount = 0;
+    if (!request.params[2].isNull()) {
+        if (request.params[2].get_int() < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
+        nCount = request.params[2].get_int();
+    }
+
+    MCOutPoint after;
+    const MCOutPoint* pStart = nullptr;
+    if (!request.params[3].isNull()) {
+        RPCTypeCheckArgument(request.params[3], UniValue::VOBJ);
+        after = MCOutPoint(ParseHashO(request.params[3], "txhash"), find_value(request.params[3].get_obj(), "outn").get_int());
+        pStart = &after;
+    }
 
 	UniValue uvalCoins(UniValue::VARR);
 	MCAmount nValue = 0;
-	if (plist != nullptr) {
-		BOOST_FOREACH(const MCOutPoint& outpoint, plist->coins) {
+    // 分页读取，跳过的币不计入count
+    const size_t nPageSize = 1000;
+    std::vector<MCOutPoint> page;
+    bool fDone = false;
+	while (!fDone) {
+        pcoinListDb->GetCoins((const uint160&)kFromKeyId, pStart, nPageSize, page);
+        fDone = page.size() < nPageSize;
+		for (const MCOutPoint& outpoint : page) {
 			const Coin& coin = pcoinsTip->AccessCoin(outpoint);
 			if (coin.IsSpent()) {
 				continue;
@@ -3793,7 +3819,15 @@ UniValue getaddresscoins(const JSONRPCRequest& request)
             }
             uvalCoin.push_back(Pair("confirmations", int(chainActive.Height() - coin.nHeight)));
 			uvalCoins.push_back(uvalCoin);
+            if (nCount > 0 && uvalCoins.size() >= nCount) {
+                fDone = true;
+                break;
+            }
 		}
+        if (!page.empty()) {
+            after = page.back();
+            pStart = &after;
+        }
 	}
 
 	return uvalCoins;
@@ -4235,7 +4269,7 @@ static const CRPCCommand commands[] =
     { "wallet",             "walletpassphrase",         &walletpassphrase,         true,   {"passphrase","timeout"} },
     { "wallet",             "removeprunedfunds",        &removeprunedfunds,        true,   {"txid"} },
 
-    { "wallet",             "getaddresscoins",          &getaddresscoins,          true,  { "address", "withscript",} },
+    { "wallet",             "getaddresscoins",          &getaddresscoins,          true,  { "address", "withscript", "count", "after"} },
     { "wallet",             "premaketransaction",       &premaketransaction,       false,  { "fromaddress","toaddress","changeaddress", "amount" } },
 	{ "wallet",             "prepublishcode",           &prepublishcode,           false,  {}},
 	{ "wallet",             "precallcontract",          &precallcontract,          false,  {}},
@@ -698,4 +698,81 @@ BOOST_FIXTURE_TEST_CASE(ListCoins, ListCoinsTestingSetup)
     BOOST_CHECK_EQUAL(list.begin()->second.size(), 260 * 2);
 }
 
+BOOST_FIXTURE_TEST_CASE(AvailableCoinsIndex, ListCoinsTestingSetup)
+{
+    LOCK2(cs_main, wallet->cs_wallet);
+
+    std::vector<MCOutput> available;
+    wallet->AvailableCoins(available);
+    const size_t nCoins = available.size();
+    auto contains = [&](const MCOutPoint& outpoint) {
+        for (const MCOutput& out : available) {
+            if (out.tx->GetHash() == outpoint.hash && (unsigned int)out.i == outpoint.n)
+                return true;
+        }
+        return false;
+    };
+
+    // 花费交易进入区块后，所花费的输出从索引中去掉，找零加入
+    SetMockTime(GetTime() + Params().GetConsensus().nPowTargetSpacing + 10000);
+    MCWalletTx& wtx = AddTx(MCRecipient{GetScriptForRawPubKey({}), 1 * COIN, false /* subtract fee */});
+    std::shared_ptr<MCBlock> pblock = std::make_shared<MCBlock>();
+    BOOST_CHECK(ReadBlockFromDisk(*pblock, chainActive.Tip(), Params().GetConsensus()));
+    wallet->BlockConnected(pblock, chainActive.Tip(), {});
+
+    size_t nChange = 0;
+    for (const MCTxOut& txout : wtx.tx->vout)
+        nChange += wallet->IsMine(txout) != ISMINE_NO;
+    wallet->AvailableCoins(available);
+    BOOST_CHECK_EQUAL(available.size(), nCoins - wtx.tx->vin.size() + nChange);
+    for (const MCTxIn& txin : wtx.tx->vin)
+        BOOST_CHECK(!contains(txin.prevout));
+
+    // 区块断开且交易被放弃后，所花费的输出重新可用
+    MCValidationState state;
+    BOOST_CHECK(InvalidateBlock(state, Params(), chainActive.Tip()));
+    wallet->BlockDisconnected(pblock);
+    mempool.RemoveRecursive(*wtx.tx);
+    BOOST_CHECK(wallet->AbandonTransaction(wtx.GetHash()));
+    wallet->AvailableCoins(available);
+    BOOST_CHECK_EQUAL(available.size(), nCoins);
+    for (const MCTxIn& txin : wtx.tx->vin)
+        BOOST_CHECK(contains(txin.prevout));
+}
+
+BOOST_FIXTURE_TEST_CASE(AvailableCoinsIndexImport, ListCoinsTestingSetup)
+{
+    LOCK2(cs_main, wallet->cs_wallet);
+
+    // 付给钱包外密钥的输出不在索引中，导入该密钥后才可用
+    MCKey key;
+    key.MakeNewKey(true);
+    SetMockTime(GetTime() + Params().GetConsensus().nPowTargetSpacing + 10000);
+    MCWalletTx& wtx = AddTx(MCRecipient{GetScriptForRawPubKey(key.GetPubKey()), 1 * COIN, false /* subtract fee */});
+    int nOut = -1;
+    for (unsigned int i = 0; i < wtx.tx->vout.size(); i++) {
+        if (wtx.tx->vout[i].scriptPubKey == GetScriptForRawPubKey(key.GetPubKey()))
+            nOut = i;
+    }
+    BOOST_CHECK(nOut >= 0);
+
+    std::vector<MCOutput> available;
+    auto contains = [&]() {
+        for (const MCOutput& out : available) {
+            if (out.tx->GetHash() == wtx.GetHash() && out.i == nOut)
+                return true;
+        }
+        return false;
+    };
+    wallet->AvailableCoins(available);
+    const size_t nCoins = available.size();
+    BOOST_CHECK(!contains());
+
+    AddKey(*wallet, key);
+    wallet->AvailableCoins(available);
+    BOOST_CHECK_EQUAL(available.size(), nCoins + 1);
+    BOOST_CHECK(contains());
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
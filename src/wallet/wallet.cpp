@@ -229,6 +229,8 @@ bool MCWallet::AddKeyPubKeyWithDB(CWalletDB &walletdb, const MCKey& secret, cons
         return false;
     }
     if (needsDB) pwalletdbEncryption = nullptr;
+    // 新的密钥可能拥有已有交易的输出
+    fUnspentOutputsBuilt = false;
 
     // check if we need to remove from watch-only
     MCScript script;
@@ -260,6 +262,7 @@ bool MCWallet::AddCryptedKey(const MCPubKey &vchPubKey,
         return false;
     {
         LOCK(cs_wallet);
+        fUnspentOutputsBuilt = false;
         if (pwalletdbEncryption)
             return pwalletdbEncryption->WriteCryptedKey(vchPubKey,
                                                         vchCryptedSecret,
@@ -304,6 +307,10 @@ bool MCWallet::AddCScript(const MCScript& redeemScript)
 {
     if (!MCCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    {
+        LOCK(cs_wallet);
+        fUnspentOutputsBuilt = false;
+    }
     return CWalletDB(*dbw).WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
@@ -327,6 +334,10 @@ bool MCWallet::AddWatchOnly(const MCScript& dest)
 {
     if (!MCCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    {
+        LOCK(cs_wallet);
+        fUnspentOutputsBuilt = false;
+    }
     const CKeyMetadata& meta = mapKeyMetadata[MCScriptID(dest)];
     UpdateTimeFirstKey(meta.nCreateTime);
     NotifyWatchonlyChanged(true);
@@ -952,6 +963,8 @@ bool MCWallet::AddToWallet(const MCWalletTx& wtxIn, bool fFlushOnClose)
         wtxOrdered.insert(std::make_pair(wtx.nOrderPos, TxPair(&wtx, (MCAccountingEntry*)0)));
         wtx.nTimeSmart = ComputeTimeSmart(wtx);
         AddToSpends(hash);
+        if (fUnspentOutputsBuilt)
+            AddUnspentOutputs(wtx);
     }
 
     bool fUpdated = false;
@@ -1026,6 +1039,8 @@ bool MCWallet::LoadToWallet(const MCWalletTx& wtxIn)
     wtx.BindWallet(this);
     wtxOrdered.insert(std::make_pair(wtx.nOrderPos, TxPair(&wtx, (MCAccountingEntry*)0)));
     AddToSpends(hash);
+    if (fUnspentOutputsBuilt)
+        AddUnspentOutputs(wtx);
     for (const MCTxIn& txin : wtx.tx->vin) {
         if (mapWallet.count(txin.prevout.hash)) {
             MCWalletTx& prevtx = mapWallet[txin.prevout.hash];
@@ -1251,6 +1266,8 @@ void MCWallet::SyncTransaction(const MCTransactionRef& ptx, const MCBlockIndex *
     if (!AddToWalletIfInvolvingMe(ptx, pindex, posInBlock, true))
         return; // Not one of ours
 
+    UpdateUnspentOutputs(tx, pindex != nullptr);
+
     // If a transaction changes 'conflicted' state, that changes the balance
     // available of the outputs it spends. So force those to be
     // recomputed, also:
@@ -1646,6 +1663,7 @@ MCBlockIndex* MCWallet::ScanForWalletTransactions(MCBlockIndex* pindexStart, boo
         LOCK2(cs_main, cs_wallet);
         fAbortRescan = false;
         fScanningWallet = true;
+        fUnspentOutputsBuilt = false;
 
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
         double dProgressStart = GuessVerificationProgress(chainParams.TxData(), pindex);
@@ -2170,129 +2188,228 @@ MCAmount MCWallet::GetAvailableBalance(const MCCoinControl* coinControl) const
     return balance;
 }
 
+bool MCWallet::IsSpentInMainChain(const MCOutPoint& outpoint) const
+{
+    std::pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(outpoint);
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it) {
+        std::map<uint256, MCWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0)
+            return true;
+    }
+    return false;
+}
+
+void MCWallet::AddUnspentOutputs(const MCWalletTx& wtx) const
+{
+    const uint256& hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.tx->vout.size(); i++) {
+        if (IsMine(wtx.tx->vout[i]) == ISMINE_NO)
+            continue;
+        MCOutPoint outpoint(hash, i);
+        branch_script_type bsptype = QuickGetBranchScriptType(wtx.tx->vout[i].scriptPubKey);
+        if (bsptype == BST_INVALID)
+            setUnspentOutputs.insert(outpoint);
+        else
+            mapUnspentBranchOutputs[outpoint] = bsptype;
+    }
+}
+
+void MCWallet::BuildUnspentOutputs() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (fUnspentOutputsBuilt)
+        return;
+
+    setUnspentOutputs.clear();
+    mapUnspentBranchOutputs.clear();
+    for (const std::pair<const uint256, MCWalletTx>& item : mapWallet)
+        AddUnspentOutputs(item.second);
+
+    // 已被主链上的钱包交易花费的输出再也不会被选中，除非该交易离开主链
+    for (auto it = setUnspentOutputs.begin(); it != setUnspentOutputs.end();) {
+        if (IsSpentInMainChain(*it))
+            it = setUnspentOutputs.erase(it);
+        else
+            ++it;
+    }
+    for (auto it = mapUnspentBranchOutputs.begin(); it != mapUnspentBranchOutputs.end();) {
+        if (IsSpentInMainChain(it->first))
+            it = mapUnspentBranchOutputs.erase(it);
+        else
+            ++it;
+    }
+    fUnspentOutputsBuilt = true;
+}
+
+void MCWallet::UpdateUnspentOutputs(const MCTransaction& tx, bool fInMainChain)
+{
+    AssertLockHeld(cs_wallet);
+    if (!fUnspentOutputsBuilt || tx.IsCoinBase())
+        return;
+    // 与AddToSpends一致，这类交易的输入不是真正花费的输出
+    if (tx.IsBranchChainTransStep2() && tx.fromBranchId == MCBaseChainParams::MAIN)
+        return;
+
+    for (const MCTxIn& txin : tx.vin) {
+        if (fInMainChain) {
+            setUnspentOutputs.erase(txin.prevout);
+            mapUnspentBranchOutputs.erase(txin.prevout);
+            continue;
+        }
+
+        // 花费交易离开主链(断开区块、冲突)后，所花费的输出重新成为候选
+        std::map<uint256, MCWalletTx>::const_iterator mit = mapWallet.find(txin.prevout.hash);
+        if (mit == mapWallet.end() || txin.prevout.n >= mit->second.tx->vout.size() || IsSpentInMainChain(txin.prevout))
+            continue;
+        if (IsMine(mit->second.tx->vout[txin.prevout.n]) == ISMINE_NO)
+            continue;
+        branch_script_type bsptype = QuickGetBranchScriptType(mit->second.tx->vout[txin.prevout.n].scriptPubKey);
+        if (bsptype == BST_INVALID)
+            setUnspentOutputs.insert(txin.prevout);
+        else
+            mapUnspentBranchOutputs[txin.prevout] = bsptype;
+    }
+}
+
+bool MCWallet::IsAvailableTx(const MCWalletTx* pcoin, bool fOnlySafe, int nMinDepth, int nMaxDepth, int& nDepth, bool& safeTx) const
+{
+    if (!CheckFinalTx(*pcoin))
+        return false;
+
+    if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+        return false;
+
+    nDepth = pcoin->GetDepthInMainChain();
+    if (nDepth < 0)
+        return false;
+
+    // We should not consider coins which aren't at least in our mempool
+    // It's possible for these to be conflicted via ancestors which we may never be able to detect
+    if (nDepth == 0 && !pcoin->InMempool())
+        return false;
+
+    safeTx = pcoin->IsTrusted();
+
+    // We should not consider coins from transactions that are replacing
+    // other transactions.
+    //
+    // Example: There is a transaction A which is replaced by bumpfee
+    // transaction B. In this case, we want to prevent creation of
+    // a transaction B' which spends an output of B.
+    //
+    // Reason: If transaction A were initially confirmed, transactions B
+    // and B' would no longer be valid, so the user would have to create
+    // a new transaction C to replace B'. However, in the case of a
+    // one-block reorg, transactions B' and C might BOTH be accepted,
+    // when the user only wanted one of them. Specifically, there could
+    // be a 1-block reorg away from the chain where transactions A and C
+    // were accepted to another chain where B, B', and C were all
+    // accepted.
+    if (nDepth == 0 && pcoin->mapValue.count("replaces_txid")) {
+        safeTx = false;
+    }
+
+    // Similarly, we should not consider coins from transactions that
+    // have been replaced. In the example above, we would want to prevent
+    // creation of a transaction A' spending an output of A, because if
+    // transaction B were initially confirmed, conflicting with A and
+    // A', we wouldn't want to the user to create a transaction D
+    // intending to replace A', but potentially resulting in a scenario
+    // where A, A', and D could all be accepted (instead of just B and
+    // D, or just A and A' like the user would want).
+    if (nDepth == 0 && pcoin->mapValue.count("replaced_by_txid")) {
+        safeTx = false;
+    }
+
+    if (fOnlySafe && !safeTx) {
+        return false;
+    }
+
+    if (nDepth < nMinDepth || nDepth > nMaxDepth)
+        return false;
+
+    return true;
+}
+
 void MCWallet::AvailableCoins(std::vector<MCOutput> &vCoins, const MCTxDestination* dest, bool fOnlySafe, const MCCoinControl *coinControl, const MCAmount &nMinimumAmount, const MCAmount &nMaximumAmount, const MCAmount &nMinimumSumAmount, const uint64_t &nMaximumCount, const int &nMinDepth, const int &nMaxDepth) const
 {
     vCoins.clear();
 
     {
         LOCK2(cs_main, cs_wallet);
+        BuildUnspentOutputs();
 
         MCAmount nTotal = 0;
 
-        for (std::map<uint256, MCWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        // 同一交易的输出相邻，交易层面的检查只做一次
+        const MCWalletTx* pcoin = nullptr;
+        bool fAvailableTx = false;
+        int nDepth = 0;
+        bool safeTx = false;
+        for (const MCOutPoint& outpoint : setUnspentOutputs)
         {
-            const uint256& wtxid = it->first;
-            const MCWalletTx* pcoin = &(*it).second;
-
-            if (!CheckFinalTx(*pcoin))
+            const uint256& wtxid = outpoint.hash;
+            const unsigned int i = outpoint.n;
+            if (pcoin == nullptr || pcoin->GetHash() != wtxid) {
+                std::map<uint256, MCWalletTx>::const_iterator it = mapWallet.find(wtxid);
+                if (it == mapWallet.end())
+                    continue;
+                pcoin = &it->second;
+                fAvailableTx = IsAvailableTx(pcoin, fOnlySafe, nMinDepth, nMaxDepth, nDepth, safeTx);
+            }
+            if (!fAvailableTx)
                 continue;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+            if (pcoin->tx->vout[i].nValue < nMinimumAmount || pcoin->tx->vout[i].nValue > nMaximumAmount)
                 continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
+            if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(outpoint))
                 continue;
 
-            // We should not consider coins which aren't at least in our mempool
-            // It's possible for these to be conflicted via ancestors which we may never be able to detect
-            if (nDepth == 0 && !pcoin->InMempool())
+            if (IsLockedCoin(wtxid, i))
                 continue;
 
-            bool safeTx = pcoin->IsTrusted();
-
-            // We should not consider coins from transactions that are replacing
-            // other transactions.
-            //
-            // Example: There is a transaction A which is replaced by bumpfee
-            // transaction B. In this case, we want to prevent creation of
-            // a transaction B' which spends an output of B.
-            //
-            // Reason: If transaction A were initially confirmed, transactions B
-            // and B' would no longer be valid, so the user would have to create
-            // a new transaction C to replace B'. However, in the case of a
-            // one-block reorg, transactions B' and C might BOTH be accepted,
-            // when the user only wanted one of them. Specifically, there could
-            // be a 1-block reorg away from the chain where transactions A and C
-            // were accepted to another chain where B, B', and C were all
-            // accepted.
-            if (nDepth == 0 && pcoin->mapValue.count("replaces_txid")) {
-                safeTx = false;
-            }
+            if (IsSpent(wtxid, i))
+                continue;
 
-            // Similarly, we should not consider coins from transactions that
-            // have been replaced. In the example above, we would want to prevent
-            // creation of a transaction A' spending an output of A, because if
-            // transaction B were initially confirmed, conflicting with A and
-            // A', we wouldn't want to the user to create a transaction D
-            // intending to replace A', but potentially resulting in a scenario
-            // where A, A', and D could all be accepted (instead of just B and
-            // D, or just A and A' like the user would want).
-            if (nDepth == 0 && pcoin->mapValue.count("replaced_by_txid")) {
-                safeTx = false;
+            if (dest != nullptr) {
+                MCTxDestination dest_test;
+                ExtractDestination(pcoin->tx->vout[i].scriptPubKey, dest_test);
+                if (!(dest_test == *dest))
+                    continue;
             }
 
-            if (fOnlySafe && !safeTx) {
+            isminetype mine = IsMine(pcoin->tx->vout[i]);
+            if (mine == ISMINE_NO) {
                 continue;
             }
 
-            if (nDepth < nMinDepth || nDepth > nMaxDepth)
+            // 抵押币、挖矿币不能普通使用，不在setUnspentOutputs中
+            if (pcoin->tx->IsBranchCreate() && IsCoinCreateBranchScript(pcoin->tx->vout[i].scriptPubKey) 
+                && pcoin->GetBlocksToMaturityForCoinCreateBranch() > 0)// 支链创建抵押币需要满足一定高度才能使用
+            {
                 continue;
+            }
 
-            for (unsigned int i = 0; i < pcoin->tx->vout.size(); i++) {
-                if (pcoin->tx->vout[i].nValue < nMinimumAmount || pcoin->tx->vout[i].nValue > nMaximumAmount)
-                    continue;
-
-                if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(MCOutPoint((*it).first, i)))
-                    continue;
-
-                if (IsLockedCoin((*it).first, i))
-                    continue;
-
-                if (IsSpent(wtxid, i))
-                    continue;
-
-                if (dest != nullptr) {
-                    MCTxDestination dest_test;
-                    ExtractDestination(pcoin->tx->vout[i].scriptPubKey, dest_test);
-                    if (!(dest_test == *dest))
-                        continue;
-                }
-
-                isminetype mine = IsMine(pcoin->tx->vout[i]);
-                if (mine == ISMINE_NO) {
-                    continue;
-                }
-
-                if (QuickGetBranchScriptType(pcoin->tx->vout[i].scriptPubKey) != BST_INVALID)//抵押币、挖矿币不能普通使用
-                {
-                    continue;
-                }
-                if (pcoin->tx->IsBranchCreate() && IsCoinCreateBranchScript(pcoin->tx->vout[i].scriptPubKey) 
-                    && pcoin->GetBlocksToMaturityForCoinCreateBranch() > 0)// 支链创建抵押币需要满足一定高度才能使用
-                {
-                    continue;
-                }
-
-                bool fSpendableIn = ((mine & ISMINE_SPENDABLE) != ISMINE_NO) || (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO);
-                bool fSolvableIn = (mine & (ISMINE_SPENDABLE | ISMINE_WATCH_SOLVABLE)) != ISMINE_NO;
-
-                vCoins.push_back(MCOutput(pcoin, i, nDepth, fSpendableIn, fSolvableIn, safeTx));
+            bool fSpendableIn = ((mine & ISMINE_SPENDABLE) != ISMINE_NO) || (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO);
+            bool fSolvableIn = (mine & (ISMINE_SPENDABLE | ISMINE_WATCH_SOLVABLE)) != ISMINE_NO;
 
-                // Checks the sum amount of all UTXO's.
-                if (nMinimumSumAmount != MAX_MONEY) {
-                    nTotal += pcoin->tx->vout[i].nValue;
+            vCoins.push_back(MCOutput(pcoin, i, nDepth, fSpendableIn, fSolvableIn, safeTx));
 
-                    if (nTotal >= nMinimumSumAmount) {
-                        return;
-                    }
-                }
+            // Checks the sum amount of all UTXO's.
+            if (nMinimumSumAmount != MAX_MONEY) {
+                nTotal += pcoin->tx->vout[i].nValue;
 
-                // Checks the maximum number of UTXO's.
-                if (nMaximumCount > 0 && vCoins.size() >= nMaximumCount) {
+                if (nTotal >= nMinimumSumAmount) {
                     return;
                 }
             }
+
+            // Checks the maximum number of UTXO's.
+            if (nMaximumCount > 0 && vCoins.size() >= nMaximumCount) {
+                return;
+            }
         }
     }
 }
@@ -2303,110 +2420,68 @@ void MCWallet::AvailableMortgageCoins(std::vector<MCOutput>& vCoins, bool fOnlyS
 
     {
         LOCK2(cs_main, cs_wallet);
+        BuildUnspentOutputs();
 
         MCAmount nTotal = 0;
 
-        for (std::map<uint256, MCWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const MCWalletTx* pcoin = nullptr;
+        bool fAvailableTx = false;
+        int nDepth = 0;
+        bool safeTx = false;
+        for (const std::pair<const MCOutPoint, branch_script_type>& item : mapUnspentBranchOutputs)
         {
-            const uint256& wtxid = it->first;
-            const MCWalletTx* pcoin = &(*it).second;
-
-            if (!CheckFinalTx(*pcoin))
+            if (!(item.second & bsptype))
                 continue;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+            const MCOutPoint& outpoint = item.first;
+            const uint256& wtxid = outpoint.hash;
+            const unsigned int i = outpoint.n;
+            if (pcoin == nullptr || pcoin->GetHash() != wtxid) {
+                std::map<uint256, MCWalletTx>::const_iterator it = mapWallet.find(wtxid);
+                if (it == mapWallet.end())
+                    continue;
+                pcoin = &it->second;
+                fAvailableTx = IsAvailableTx(pcoin, fOnlySafe, nMinDepth, nMaxDepth, nDepth, safeTx);
+            }
+            if (!fAvailableTx)
                 continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
+            if (pcoin->tx->vout[i].nValue < nMinimumAmount || pcoin->tx->vout[i].nValue > nMaximumAmount)
                 continue;
 
-            // We should not consider coins which aren't at least in our mempool
-            // It's possible for these to be conflicted via ancestors which we may never be able to detect
-            if (nDepth == 0 && !pcoin->InMempool())
+            if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(outpoint))
                 continue;
 
-            bool safeTx = pcoin->IsTrusted();
-
-            // We should not consider coins from transactions that are replacing
-            // other transactions.
-            //
-            // Example: There is a transaction A which is replaced by bumpfee
-            // transaction B. In this case, we want to prevent creation of
-            // a transaction B' which spends an output of B.
-            //
-            // Reason: If transaction A were initially confirmed, transactions B
-            // and B' would no longer be valid, so the user would have to create
-            // a new transaction C to replace B'. However, in the case of a
-            // one-block reorg, transactions B' and C might BOTH be accepted,
-            // when the user only wanted one of them. Specifically, there could
-            // be a 1-block reorg away from the chain where transactions A and C
-            // were accepted to another chain where B, B', and C were all
-            // accepted.
-            if (nDepth == 0 && pcoin->mapValue.count("replaces_txid")) {
-                safeTx = false;
-            }
-
-            // Similarly, we should not consider coins from transactions that
-            // have been replaced. In the example above, we would want to prevent
-            // creation of a transaction A' spending an output of A, because if
-            // transaction B were initially confirmed, conflicting with A and
-            // A', we wouldn't want to the user to create a transaction D
-            // intending to replace A', but potentially resulting in a scenario
-            // where A, A', and D could all be accepted (instead of just B and
-            // D, or just A and A' like the user would want).
-            if (nDepth == 0 && pcoin->mapValue.count("replaced_by_txid")) {
-                safeTx = false;
-            }
-
-            if (fOnlySafe && !safeTx) {
+            if (IsLockedCoin(wtxid, i))
                 continue;
-            }
 
-            if (nDepth < nMinDepth || nDepth > nMaxDepth)
+            if (IsSpent(wtxid, i))
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->tx->vout.size(); i++) {
-                if (pcoin->tx->vout[i].nValue < nMinimumAmount || pcoin->tx->vout[i].nValue > nMaximumAmount)
-                    continue;
-
-                if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(MCOutPoint((*it).first, i)))
-                    continue;
-
-                if (IsLockedCoin((*it).first, i))
-                    continue;
+            isminetype mine = IsMine(pcoin->tx->vout[i]);
 
-                if (IsSpent(wtxid, i))
-                    continue;
-
-                isminetype mine = IsMine(pcoin->tx->vout[i]);
-
-                if (mine == ISMINE_NO) {
-                    continue;
-                }
-
-                if (!(QuickGetBranchScriptType(pcoin->tx->vout[i].scriptPubKey) & bsptype))// == BST_INVALID ? 
-                    continue;
-
-                bool fSpendableIn = ((mine & ISMINE_SPENDABLE) != ISMINE_NO) || (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO);
-                bool fSolvableIn = (mine & (ISMINE_SPENDABLE | ISMINE_WATCH_SOLVABLE)) != ISMINE_NO;
+            if (mine == ISMINE_NO) {
+                continue;
+            }
 
-                vCoins.push_back(MCOutput(pcoin, i, nDepth, fSpendableIn, fSolvableIn, safeTx));
+            bool fSpendableIn = ((mine & ISMINE_SPENDABLE) != ISMINE_NO) || (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO);
+            bool fSolvableIn = (mine & (ISMINE_SPENDABLE | ISMINE_WATCH_SOLVABLE)) != ISMINE_NO;
 
-                // Checks the sum amount of all UTXO's.
-                if (nMinimumSumAmount != MAX_MONEY) {
-                    nTotal += pcoin->tx->vout[i].nValue;
+            vCoins.push_back(MCOutput(pcoin, i, nDepth, fSpendableIn, fSolvableIn, safeTx));
 
-                    if (nTotal >= nMinimumSumAmount) {
-                        return;
-                    }
-                }
+            // Checks the sum amount of all UTXO's.
+            if (nMinimumSumAmount != MAX_MONEY) {
+                nTotal += pcoin->tx->vout[i].nValue;
 
-                // Checks the maximum number of UTXO's.
-                if (nMaximumCount > 0 && vCoins.size() >= nMaximumCount) {
+                if (nTotal >= nMinimumSumAmount) {
                     return;
                 }
             }
+
+            // Checks the maximum number of UTXO's.
+            if (nMaximumCount > 0 && vCoins.size() >= nMaximumCount) {
+                return;
+            }
         }
     }
 }
@@ -3462,6 +3537,7 @@ DBErrors MCWallet::ZapSelectTx(std::vector<uint256>& vHashIn, std::vector<uint25
     DBErrors nZapSelectTxRet = CWalletDB(*dbw,"cr+").ZapSelectTx(vHashIn, vHashOut);
     for (uint256 hash : vHashOut)
         mapWallet.erase(hash);
+    fUnspentOutputsBuilt = false;
 
     if (nZapSelectTxRet == DB_NEED_REWRITE)
     {
@@ -3489,6 +3565,10 @@ DBErrors MCWallet::ZapWalletTx(std::vector<MCWalletTx>& vWtx)
 {
     vchDefaultKey = MCPubKey();
     DBErrors nZapWalletTxRet = CWalletDB(*dbw,"cr+").ZapWalletTx(vWtx);
+    {
+        LOCK(cs_wallet);
+        fUnspentOutputsBuilt = false;
+    }
     if (nZapWalletTxRet == DB_NEED_REWRITE)
     {
         if (dbw->Rewrite("\x04pool"))
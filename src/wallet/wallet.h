@@ -726,6 +726,26 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Outputs of wallet transactions that are IsMine and that no wallet
+     * transaction in the main chain spends, split by QuickGetBranchScriptType
+     * into regular outputs and mortgage outputs. AvailableCoins and
+     * AvailableMortgageCoins only look at these, in the same (txid, n) order as
+     * mapWallet, and still apply all their checks to each of them. Built on
+     * first use, then updated when transactions are added and when spending
+     * transactions enter or leave the main chain. Rebuilt after keys, scripts
+     * or watch-only scripts are added and after a rescan.
+     */
+    mutable std::set<MCOutPoint> setUnspentOutputs;
+    mutable std::map<MCOutPoint, branch_script_type> mapUnspentBranchOutputs;
+    mutable bool fUnspentOutputsBuilt;
+    void AddUnspentOutputs(const MCWalletTx& wtx) const;
+    void BuildUnspentOutputs() const;
+    void UpdateUnspentOutputs(const MCTransaction& tx, bool fInMainChain);
+    bool IsSpentInMainChain(const MCOutPoint& outpoint) const;
+    // 交易层面的检查，nDepth和safeTx为AvailableCoins需要的结果
+    bool IsAvailableTx(const MCWalletTx* pcoin, bool fOnlySafe, int nMinDepth, int nMaxDepth, int& nDepth, bool& safeTx) const;
+
     /* Used by TransactionAddedToMemorypool/BlockConnected/Disconnected.
      * Should be called with pindexBlock and posInBlock if this is for a transaction that is included in a block. */
     void SyncTransaction(const MCTransactionRef& tx, const MCBlockIndex *pindex = nullptr, int posInBlock = 0);
@@ -833,6 +853,7 @@ public:
         fScanningWallet = false;
 		fFastMode = false;
 		fFakeWallet = false;
+        fUnspentOutputsBuilt = false;
     }
 
     std::map<uint256, MCWalletTx> mapWallet;